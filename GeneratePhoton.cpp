@@ -23,15 +23,81 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #include "GLApp/MathTools.h"
 #include "GeneratePhoton.h"
 #include "SynradDistributions.h"
+#include "PhotonRandom.h"
 #include <vector>
 #include <tuple>
 
 extern Distribution2D integral_N_photons, integral_SR_power/*,polarization_distribution,g1h2_distribution*/; 
+extern SpectrumTable SR_spectrum_table;
 //extern DistributionND SR_spectrum_CDF;
 
+inline double Uniform(gsl_rng* gen) {
+	//Simulation threads pass their own generator, the interface (trajectory details) uses the global one
+	return gen ? gsl_rng_uniform_pos(gen) : rnd();
+}
+
+static void ApplyBeamOffset(GenPhoton& result, const size_t& pointId, Region_mathonly* current_region) {
+	//Sets start position, direction, magnetic field and critical energy from the offsets already in 'result'
+
+	Trajectory_Point *source = &(current_region->Points[pointId]);
+
+	Vector3d offset = source->X_local * result.offset_x; //apply dX offset
+	offset = offset + source->Y_local * result.offset_y; //apply dY offset
+	result.start_pos = source->position + offset;
+
+	result.start_dir = source->Z_local; //choose orbit direction as original dir, then apply offset
+	result.start_dir = Rotate(result.start_dir,Vector3d(0,0,0),source->Y_local, result.offset_divx);
+	result.start_dir = Rotate(result.start_dir,Vector3d(0,0,0),source->X_local, - result.offset_divy);
+
+	result.B = current_region->B(pointId, offset); //recalculate B at offset position
+	result.B_par = Dot(result.start_dir, result.B);
+	result.B_ort = sqrt(Sqr(result.B.Norme()) - Sqr(result.B_par));
+
+	if (result.B_ort > VERY_SMALL)
+		result.radius = current_region->params.E_GeV / 0.00299792458 / result.B_ort; //Energy in GeV divided by speed of light/1E9 converted to centimeters
+	else { //Magnetic field very low, generate a 0-flux virtual photon tangent to the beam
+		result.radius = 1.0E30;
+	}
+
+	result.critical_energy = 2.959905E-5*pow(current_region->params.gamma, 3) / result.radius; //becomes ~1E-30 if radius is 1E30
+}
+
+SpectrumFactors CalculateSpectrumFactors(const RegionParams& params, const double& critical_energy) {
+	//What part of the spectrum falls between the region energy limits, for a given critical energy
+	SpectrumFactors factors;
+	factors.critical_energy = critical_energy;
+
+	double loEnergyRatio = params.energy_low_eV / critical_energy;
+	double hiEnergyRatio = params.energy_hi_eV / critical_energy;
+	factors.log10LoEnergyRatio = log10(loEnergyRatio);
+	factors.log10HiEnergyRatio = log10(hiEnergyRatio);
+
+	SR_spectrum_table.InterpolateIntegrals(factors.log10LoEnergyRatio, factors.interpFluxLo, factors.interpPowerLo);
+	SR_spectrum_table.InterpolateIntegrals(factors.log10HiEnergyRatio, factors.interpFluxHi, factors.interpPowerHi);
+
+	factors.B_factor = (factors.interpFluxHi - factors.interpFluxLo) / integral_N_photons.GetY(NUMBER_OF_INTEGR_VALUES - 1); //what part of all photons we cover in our region [Emin,Emax]
+	factors.B_factor_power = (factors.interpPowerHi - factors.interpPowerLo) / integral_SR_power.GetY(NUMBER_OF_INTEGR_VALUES - 1); //what part of all power we cover in [Emin,Emax]
+	//Same as Interval_Mean(loEnergyRatio, hiEnergyRatio), from the integrals already looked up
+	double fluxInRange = factors.interpFluxHi - factors.interpFluxLo;
+	factors.average_photon_energy = (fluxInRange > VERY_SMALL) ? (factors.interpPowerHi - factors.interpPowerLo) / fluxInRange : 0.5*(loEnergyRatio + hiEnergyRatio);
+	return factors;
+}
+
+void PrecalculateSpectrumFactors(Region_mathonly* region) {
+	//Nominal orbit (zero offset) of every point, which is also what an ideal beam generates from
+	//GeneratePhoton() looks up these values, so it doesn't have to interpolate the integrated spectrum
+	region->spectrumFactors.resize(region->Points.size());
+	for (size_t pointId = 0; pointId < region->Points.size(); pointId++) {
+		GenPhoton nominal;
+		nominal.offset_x = nominal.offset_y = nominal.offset_divx = nominal.offset_divy = 0.0;
+		ApplyBeamOffset(nominal, pointId, region);
+		region->spectrumFactors[pointId] = CalculateSpectrumFactors(region->params, nominal.critical_energy);
+	}
+}
+
 GenPhoton GeneratePhoton(size_t pointId, Region_mathonly *current_region, int generation_mode,
-	std::vector<std::vector<double>> &psi_distro, std::vector<std::vector<double>> &chi_distro,
-	std::vector<std::vector<double>> &parallel_polarization, bool recalc) { //Generates a photon from point number 'pointId'
+	const AngularTable& psiTable, const AngularTable& chiTable,
+	const AngularTable& polarizationTable, gsl_rng* gen) { //Generates a photon from point number 'pointId'
 
 	/* interpolation between source points removed, wasn't useful and slowed things down
 	//Interpolate source point
@@ -48,12 +114,6 @@ GenPhoton GeneratePhoton(size_t pointId, Region_mathonly *current_region, int ge
 	Trajectory_Point *source = &(current_region->Points[pointId]);
 	GenPhoton result;
 
-	static double last_critical_energy, last_Bfactor, last_Bfactor_power; //to speed up calculation if critical energy didn't change
-	static double last_average_ans;
-	double average_photon_energy_for_region;
-
-	if (recalc) last_critical_energy = 0.0; //force recalculation of B-factors (if, for example, region properties have changed)
-
 	if (source->emittance_X == 0.0) { //Ideal beam
 		result.offset_x = 0.0;
 		result.offset_divx = 0.0;
@@ -63,9 +123,9 @@ GenPhoton GeneratePhoton(size_t pointId, Region_mathonly *current_region, int ge
 		double factorX, phaseX, x_unrotated, xprime_unrotated;
 
 		//Generate point on ellipse whose axes are a,b precalculated previously
-		factorX = sqrt(-2.0 * log(rnd())); //Rayleigh distribution, will be the size of the ellipse
+		factorX = sqrt(-2.0 * log(Uniform(gen))); //Rayleigh distribution, will be the size of the ellipse
 
-		 phaseX = 2.0 * PI*rnd(); //We choose a point uniformly on the parametrized phase ellipse
+		 phaseX = 2.0 * PI*Uniform(gen); //We choose a point uniformly on the parametrized phase ellipse
 		 x_unrotated = factorX * source->a_x * cos(phaseX); //Offset in [cm] if alpha=0
 		 xprime_unrotated = factorX * source->b_x * sin(phaseX); //Divergence in [cm] if alpha=0
 
@@ -80,10 +140,10 @@ GenPhoton GeneratePhoton(size_t pointId, Region_mathonly *current_region, int ge
 	}
 	else {
 		//Generate particle emittance, around RMS emittance of the point
-		double factorY = sqrt(-2.0 * log(rnd()));
+		double factorY = sqrt(-2.0 * log(Uniform(gen)));
 
 		//Generate point on ellipse whose axes are a,b precalculated previously
-		double phaseY = 2 * PI*rnd(); //We choose a point uniformly on the parametrized phase ellipse
+		double phaseY = 2 * PI*Uniform(gen); //We choose a point uniformly on the parametrized phase ellipse
 		double y_unrotated = factorY * source->a_y * cos(phaseY); //Offset in [cm] if alpha=0
 		double yprime_unrotated = factorY * source->b_y * sin(phaseY); //Divergence in [cm] if alpha=0
 
@@ -92,53 +152,30 @@ GenPhoton GeneratePhoton(size_t pointId, Region_mathonly *current_region, int ge
 		result.offset_divy = y_unrotated * sin(source->theta_Y) + yprime_unrotated * cos(source->theta_Y); //vertical divergence in [rad]
 	}
 
-	Vector3d offset = source->X_local * result.offset_x; //apply dX offset
-	offset = offset + source->Y_local * result.offset_y; //apply dY offset
-	result.start_pos = source->position + offset;
-
-	result.start_dir = source->Z_local; //choose orbit direction as original dir, then apply offset
-	result.start_dir = Rotate(result.start_dir,Vector3d(0,0,0),source->Y_local, result.offset_divx);
-	result.start_dir = Rotate(result.start_dir,Vector3d(0,0,0),source->X_local, - result.offset_divy);
-
-	result.B = current_region->B(pointId, offset); //recalculate B at offset position
-	result.B_par = Dot(result.start_dir, result.B);
-	result.B_ort = sqrt(Sqr(result.B.Norme()) - Sqr(result.B_par));
+	return GeneratePhotonAtOffset(result, pointId, current_region, generation_mode, psiTable, chiTable, polarizationTable, gen);
+}
 
-	if (result.B_ort > VERY_SMALL)
-		result.radius = current_region->params.E_GeV / 0.00299792458 / result.B_ort; //Energy in GeV divided by speed of light/1E9 converted to centimeters
-	else { //Magnetic field very low, generate a 0-flux virtual photon tangent to the beam
-		result.radius = 1.0E30;
-	}
+GenPhoton GeneratePhotonAtOffset(GenPhoton result, size_t pointId, Region_mathonly *current_region, int generation_mode,
+	const AngularTable& psiTable, const AngularTable& chiTable,
+	const AngularTable& polarizationTable, gsl_rng* gen) { //Completes a photon whose beam offsets are already set
 
-	result.critical_energy = 2.959905E-5*pow(current_region->params.gamma, 3) / result.radius; //becomes ~1E-30 if radius is 1E30
+	Trajectory_Point *source = &(current_region->Points[pointId]);
+	ApplyBeamOffset(result, pointId, current_region);
 
-	//Precalc reused values
-	double loEnergyRatio = current_region->params.energy_low_eV / result.critical_energy;
-	double hiEnergyRatio = current_region->params.energy_hi_eV / result.critical_energy;
-	double log10LoEnergyRatio = log10(loEnergyRatio);
-	double log10HiEnergyRatio = log10(hiEnergyRatio);
-	double interpFluxLo, interpFluxHi, interpPowerLo, interpPowerHi;
-	bool calcInterpolates; //Should SYNGEN1 interpolate?
-
-	if (result.critical_energy == last_critical_energy) { //check if we've calculated the results already
-		result.B_factor = last_Bfactor;
-		result.B_factor_power = last_Bfactor_power;
-		average_photon_energy_for_region = last_average_ans;
-		calcInterpolates = true;
+	//Energy-range constants: precalculated on the nominal orbit, only an offset beam with a different critical energy needs them calculated
+	SpectrumFactors calculatedFactors;
+	const SpectrumFactors* factors;
+	if (pointId < current_region->spectrumFactors.size() && current_region->spectrumFactors[pointId].critical_energy == result.critical_energy) {
+		factors = &(current_region->spectrumFactors[pointId]);
 	}
 	else {
-
-		interpFluxLo = integral_N_photons.InterpolateY(log10LoEnergyRatio, false);
-		interpFluxHi = integral_N_photons.InterpolateY(log10HiEnergyRatio, false);
-		interpPowerLo = integral_SR_power.InterpolateY(log10LoEnergyRatio, false);
-		interpPowerHi = integral_SR_power.InterpolateY(log10HiEnergyRatio, false);
-		
-		result.B_factor = (interpFluxHi - interpFluxLo)	/ integral_N_photons.GetY(NUMBER_OF_INTEGR_VALUES - 1); //what part of all photons we cover in our region [Emin,Emax]
-		result.B_factor_power = (interpPowerHi - interpPowerLo)	/ integral_SR_power.GetY(NUMBER_OF_INTEGR_VALUES - 1); //what part of all power we cover in [Emin,Emax]
-		average_photon_energy_for_region = Interval_Mean(loEnergyRatio,	hiEnergyRatio);
-		calcInterpolates = false;
+		calculatedFactors = CalculateSpectrumFactors(current_region->params, result.critical_energy);
+		factors = &calculatedFactors;
 	}
-	
+	result.B_factor = factors->B_factor;
+	result.B_factor_power = factors->B_factor_power;
+	double average_photon_energy_for_region = factors->average_photon_energy;
+
 	if (result.B_factor < 1E-10) { //negligible photons inside region energy limits
 		result.critical_energy = 1.0E-30;
 		result.B_factor = result.B_factor_power = 0.0;
@@ -150,24 +187,20 @@ GenPhoton GeneratePhoton(size_t pointId, Region_mathonly *current_region, int ge
 
 	double average_photon_energy_whole_range = integral_SR_power.GetY(NUMBER_OF_INTEGR_VALUES - 1) / integral_N_photons.GetY(NUMBER_OF_INTEGR_VALUES - 1);
 
-	double generated_energy = SYNGEN1(log10LoEnergyRatio, log10HiEnergyRatio,
-		interpFluxLo, interpFluxHi, interpPowerLo, interpPowerHi,calcInterpolates,
-		generation_mode);
-
-	int retries = 0;
-	do {
-		std::tie(result.natural_divy, result.polarization) = find_psi_and_polarization(generated_energy, psi_distro, parallel_polarization, current_region->params.polarizationCompIndex);
-		result.natural_divy /= current_region->params.gamma;
-	} while (result.natural_divy > current_region->params.psimaxY_rad || (++retries) > 1000);
-	
-	retries = 0;
-	do {
-		result.natural_divx = find_chi(result.natural_divy, current_region->params.gamma, chi_distro);
-	} while (result.natural_divx > current_region->params.psimaxX_rad || (++retries) > 1000);
+	double interpFluxLo = factors->interpFluxLo, interpFluxHi = factors->interpFluxHi, interpPowerLo = factors->interpPowerLo, interpPowerHi = factors->interpPowerHi;
+	double generated_energy = SYNGEN1(factors->log10LoEnergyRatio, factors->log10HiEnergyRatio,
+		interpFluxLo, interpFluxHi, interpPowerLo, interpPowerHi, false,
+		generation_mode, Uniform(gen));
+
+	//Both angles are drawn from their CDF truncated at the region's limits, no rejection
+	std::tie(result.natural_divy, result.polarization) = find_psi_and_polarization(generated_energy, Uniform(gen), psiTable, polarizationTable,
+		current_region->params.polarizationCompIndex, current_region->params.psimaxY_rad * current_region->params.gamma);
+	result.natural_divy /= current_region->params.gamma;
+	result.natural_divx = find_chi(result.natural_divy, current_region->params.gamma, chiTable, Uniform(gen), Uniform(gen), current_region->params.psimaxX_rad);
 
 	//Symmetrize distribution
-	if (rnd() < 0.5) result.natural_divx *= -1;
-	if (rnd() < 0.5) result.natural_divy *= -1;
+	if (Uniform(gen) < 0.5) result.natural_divx *= -1;
+	if (Uniform(gen) < 0.5) result.natural_divy *= -1;
 
 	//Flux and power
 	double ratio_of_full_revolution = current_region->params.dL_cm / (result.radius * 2 * PI);
@@ -185,12 +218,6 @@ GenPhoton GeneratePhoton(size_t pointId, Region_mathonly *current_region, int ge
 	}
 	else result.SR_power = 0.0;
 
-	//Store these calc results to speed up calculation for the same critical energy
-	last_critical_energy = result.critical_energy;
-	last_Bfactor = result.B_factor;
-	last_Bfactor_power = result.B_factor_power;
-	last_average_ans = average_photon_energy_for_region;
-
 	//return values
 	result.start_dir = Rotate(result.start_dir,Vector3d(0,0,0),source->Y_local, result.natural_divx);
 	result.start_dir = Rotate(result.start_dir,Vector3d(0,0,0),source->X_local, - result.natural_divy);
@@ -199,6 +226,67 @@ GenPhoton GeneratePhoton(size_t pointId, Region_mathonly *current_region, int ge
 	return result;
 }
 
+void PhotonBatch::Resize(const size_t& capacity) {
+	photonIndex.resize(capacity);
+	regionId.resize(capacity);
+	pointId.resize(capacity);
+	fluxCorrection.resize(capacity);
+	offset_x.resize(capacity);
+	offset_divx.resize(capacity);
+	offset_y.resize(capacity);
+	offset_divy.resize(capacity);
+	photons.resize(capacity);
+	for (auto vec : { &rndX1, &rndX2, &rndY1, &rndY2, &a_x, &b_x, &theta_X, &a_y, &b_y, &theta_Y })
+		vec->resize(capacity);
+	Clear();
+}
+
+void PhotonBatch::Clear() {
+	size = next = 0;
+}
+
+void SampleBeamOffsets(PhotonBatch& batch, const std::vector<Region_mathonly>& regions, const uint64_t& randomSeed) {
+	//Same distribution as GeneratePhoton(), for the whole batch
+	//Random numbers and point properties are gathered first, so that the arithmetic loops have no branches and can be vectorized
+	size_t n = batch.size;
+	double* rndX1 = batch.rndX1.data(); double* rndX2 = batch.rndX2.data();
+	double* rndY1 = batch.rndY1.data(); double* rndY2 = batch.rndY2.data();
+	double* a_x = batch.a_x.data(); double* b_x = batch.b_x.data(); double* theta_X = batch.theta_X.data();
+	double* a_y = batch.a_y.data(); double* b_y = batch.b_y.data(); double* theta_Y = batch.theta_Y.data();
+	for (size_t i = 0; i < n; i++) {
+		const Trajectory_Point& source = regions[batch.regionId[i]].Points[batch.pointId[i]];
+		//Zero axes give zero offsets for an ideal beam
+		a_x[i] = (source.emittance_X == 0.0) ? 0.0 : source.a_x;
+		b_x[i] = (source.emittance_X == 0.0) ? 0.0 : source.b_x;
+		theta_X[i] = source.theta_X;
+		a_y[i] = (source.emittance_Y == 0.0) ? 0.0 : source.a_y;
+		b_y[i] = (source.emittance_Y == 0.0) ? 0.0 : source.b_y;
+		theta_Y[i] = source.theta_Y;
+	}
+	PhiloxUniformBatch(randomSeed, batch.photonIndex.data(), n, PHOTON_STREAM_BEAM, 0, rndX1, rndX2, rndY1, rndY2);
+
+	double* offset_x = batch.offset_x.data();
+	double* offset_divx = batch.offset_divx.data();
+	double* offset_y = batch.offset_y.data();
+	double* offset_divy = batch.offset_divy.data();
+	for (size_t i = 0; i < n; i++) {
+		double factorX = sqrt(-2.0 * log(rndX1[i])); //Rayleigh distribution, will be the size of the ellipse
+		double phaseX = 2.0 * PI * rndX2[i]; //We choose a point uniformly on the parametrized phase ellipse
+		double x_unrotated = factorX * a_x[i] * cos(phaseX);
+		double xprime_unrotated = factorX * b_x[i] * sin(phaseX);
+		offset_x[i] = x_unrotated * cos(theta_X[i]) - xprime_unrotated * sin(theta_X[i]);
+		offset_divx[i] = x_unrotated * sin(theta_X[i]) + xprime_unrotated * cos(theta_X[i]);
+	}
+	for (size_t i = 0; i < n; i++) {
+		double factorY = sqrt(-2.0 * log(rndY1[i]));
+		double phaseY = 2.0 * PI * rndY2[i];
+		double y_unrotated = factorY * a_y[i] * cos(phaseY);
+		double yprime_unrotated = factorY * b_y[i] * sin(phaseY);
+		offset_y[i] = y_unrotated * cos(theta_Y[i]) - yprime_unrotated * sin(theta_Y[i]);
+		offset_divy[i] = y_unrotated * sin(theta_Y[i]) + yprime_unrotated * cos(theta_Y[i]);
+	}
+}
+
 double Interval_Mean(const double &min, const double &max) {
 	//average of a cumulative distribution (differentiation included)
 
@@ -20,7 +20,37 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #pragma once
 
 #include "Region_mathonly.h"
+#include "SynradDistributions.h"
+#include <gsl/gsl_rng.h>
+#include <cstdint>
 GenPhoton GeneratePhoton(size_t pointId, Region_mathonly *current_region, int generation_mode,
-	std::vector<std::vector<double>> &psi_distro, std::vector<std::vector<double>> &chi_distro,
-	std::vector<std::vector<double>> &parallel_polarization, bool recalc = 0); //Generates a photon from point number 'pointId'
-double Interval_Mean(const double &min, const double &max);
\ No newline at end of file
+	const AngularTable& psiTable, const AngularTable& chiTable,
+	const AngularTable& polarizationTable, gsl_rng* gen); //Generates a photon from point number 'pointId'. gen: thread's generator, NULL to use the global rnd()
+GenPhoton GeneratePhotonAtOffset(GenPhoton result, size_t pointId, Region_mathonly *current_region, int generation_mode,
+	const AngularTable& psiTable, const AngularTable& chiTable,
+	const AngularTable& polarizationTable, gsl_rng* gen); //Second half of GeneratePhoton(): 'result' has its offset_ members set
+SpectrumFactors CalculateSpectrumFactors(const RegionParams& params, const double& critical_energy);
+void PrecalculateSpectrumFactors(Region_mathonly* region); //Fills region->spectrumFactors for the nominal orbit of every trajectory point
+double Interval_Mean(const double &min, const double &max);
+
+#define PHOTON_BATCH_SIZE 1024 //Photons generated at once by a simulation thread
+
+//Photons generated ahead of tracing, in structure-of-arrays layout for the sampling stages
+class PhotonBatch {
+public:
+	std::vector<uint64_t> photonIndex; //Global photon index, keys the photon's random streams (PhotonRandom.h)
+	std::vector<size_t> regionId, pointId; //Source point, from the source sampler
+	std::vector<double> fluxCorrection; //Source sampler weight correction
+	std::vector<double> offset_x, offset_divx, offset_y, offset_divy; //Beam offsets, see SampleBeamOffsets()
+	std::vector<GenPhoton> photons; //Completed photons
+	std::vector<double> rndX1, rndX2, rndY1, rndY2; //SampleBeamOffsets() scratch: random numbers
+	std::vector<double> a_x, b_x, theta_X, a_y, b_y, theta_Y; //SampleBeamOffsets() scratch: gathered point properties
+	size_t size; //Number of photons in the batch
+	size_t next; //Next photon to hand out
+
+	void Resize(const size_t& capacity);
+	void Clear(); //Drops the remaining photons (for example when the generation mode changes)
+	bool Empty() const { return next >= size; }
+};
+
+void SampleBeamOffsets(PhotonBatch& batch, const std::vector<Region_mathonly>& regions, const uint64_t& randomSeed); //Emittance offsets of the first batch.size photons, from their PHOTON_STREAM_BEAM streams
\ No newline at end of file
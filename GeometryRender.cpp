@@ -48,6 +48,9 @@ void SynradGeometry::BuildFacetTextures(BYTE *hits, bool renderRegularTexture, b
 		textureMax_auto.power /= worker->no_scans;
 	}
 
+	TexturePoolLayout texturePool = GetTexturePoolLayout();
+	std::vector<TextureCell> facetTexture; //Cells of one facet for BuildTexture(), which makes the GL texture of all of them anyway
+
 	for (int i = 0; i < sh.nbFacet; i++) {
 		int time = SDL_GetTicks();
 		if (!prg->IsVisible() && ((time - startTime) > 500)) {
@@ -56,9 +59,7 @@ void SynradGeometry::BuildFacetTextures(BYTE *hits, bool renderRegularTexture, b
 		prg->SetProgress((double)i / (double)sh.nbFacet);
 		Facet *f = facets[i];
 
-		int profSize = (f->sh.isProfile) ? PROFILE_SIZE*sizeof(ProfileSlice) : 0;
 		size_t nbElem = f->sh.texWidth*f->sh.texHeight;
-		size_t tSize = nbElem * sizeof(double);
 
 		if (renderRegularTexture && f->sh.isTextured) {
 
@@ -81,22 +82,22 @@ void SynradGeometry::BuildFacetTextures(BYTE *hits, bool renderRegularTexture, b
 				f->textureError = false;
 			}
 
-		   // Retrieve texture from shared memory (every seconds)
-			TextureCell *texture = (TextureCell *)((BYTE *)shGHit + (f->sh.hitOffset + sizeof(FacetHitBuffer) + profSize));
-			f->BuildTexture(texture, textureMode, texAutoScale ? textureMin_auto : textureMin_manual, texAutoScale ? textureMax_auto : textureMax_manual, worker->no_scans, texColormap, texLogScale);
+		   // Retrieve texture from shared memory (every seconds), tiles never hit are empty cells
+			facetTexture.resize(nbElem);
+			GetTextureView(hits, f->sh, texturePool).CopyTo(facetTexture.data());
+			f->BuildTexture(facetTexture.data(), textureMode, texAutoScale ? textureMin_auto : textureMin_manual, texAutoScale ? textureMax_auto : textureMax_manual, worker->no_scans, texColormap, texLogScale);
 		}
 		if (renderDirectionTexture && f->sh.countDirection && f->dirCache) {
-			
-			size_t dSize = nbElem * sizeof(DirectionCell);
-			
+
 			double iDesorbed = 0.0;
 			if (shGHit->globalHits.hit.nbDesorbed)
 				iDesorbed = 1.0 / (double)shGHit->globalHits.hit.nbDesorbed;
 
-			DirectionCell *dirs = (DirectionCell *)((BYTE *)shGHit + (f->sh.hitOffset + sizeof(FacetHitBuffer) + profSize + tSize));
-			for (int j = 0; j < nbElem; j++) {
-				f->dirCache[j].dir = dirs[j].dir * iDesorbed;
-				f->dirCache[j].count = dirs[j].count;
+			TileView<DirectionCell> dirs = GetDirectionView(hits, f->sh, texturePool);
+			for (size_t j = 0; j < nbElem; j++) {
+				const DirectionCell& cell = dirs[j];
+				f->dirCache[j].dir = cell.dir * iDesorbed;
+				f->dirCache[j].count = cell.count;
 			}
 		}
 
@@ -25,19 +25,55 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #include "GLApp/MathTools.h"
 #include "Synrad.h"
 #include "AppUpdater.h"
+#include "PhaseProfile.h"
+#include "File.h" //FileUtils::GetExtension
+#include <iomanip> //std::setprecision
+#include <NativeFileDialog/molflow_wrapper/nfd_wrapper.h>
 
 extern SynRad *mApp;
 
-static const int   plWidth[] = { 60,40,70,70,335 };
-static const char *plName[] = { "#","PID","Mem Usage","Mem Peak",/*"CPU",*/"Status" };
-static const int   plAligns[] = { ALIGN_LEFT,ALIGN_LEFT,ALIGN_LEFT,ALIGN_LEFT,ALIGN_LEFT };
+static const int   plWidth[] = { 60,40,70,70,260,200 };
+static const char *plName[] = { "#","PID","Mem Usage","Mem Peak",/*"CPU",*/"Status","Profile" };
+static const int   plAligns[] = { ALIGN_LEFT,ALIGN_LEFT,ALIGN_LEFT,ALIGN_LEFT,ALIGN_LEFT,ALIGN_LEFT };
+
+//Reads the phase profile published by subprocess 'procIdx' (see SynradSub.cpp), false if it has none yet
+static bool ReadProcessProfile(const size_t& procIdx, PhaseProfile& profile) {
+	char dpName[32];
+	sprintf(dpName, "SNRDPROF%d_%zd", GetCurrentProcessId(), procIdx);
+	Dataport* dpProfile = OpenDataport(dpName, sizeof(PhaseProfile));
+	if (!dpProfile) return false;
+	bool ok = AccessDataportTimed(dpProfile, 100);
+	if (ok) {
+		memcpy(&profile, dpProfile->buff, sizeof(PhaseProfile));
+		ReleaseDataport(dpProfile);
+	}
+	CLOSEDP(dpProfile);
+	return ok;
+}
+
+//Share of the simulation thread time of the main phases, and the mean hit update time
+static std::string GetProfileSummary(const PhaseProfile& profile) {
+	std::stringstream summary;
+	summary << std::fixed << std::setprecision(0);
+	if (profile.threadSeconds > 0.0) {
+		for (size_t phase = 0; phase < PHASE_HITUPDATE; phase++) {
+			double percent = 100.0 * GetPhaseSeconds(profile, phase) / profile.threadSeconds;
+			if (percent >= 0.5) summary << GetPhaseShortName(phase) << " " << percent << "% ";
+		}
+	}
+	if (profile.hitWeightSquareSum > 0.0)
+		summary << std::scientific << std::setprecision(1) << "ess " << GetEffectiveSamplesPerSecond(profile) << "/s " << std::fixed;
+	if (profile.nbCalls[PHASE_HITUPDATE] > 0)
+		summary << std::setprecision(1) << GetPhaseShortName(PHASE_HITUPDATE) << " " << 1E3 * GetPhaseSeconds(profile, PHASE_HITUPDATE) / (double)profile.nbCalls[PHASE_HITUPDATE] << "ms";
+	return summary.str();
+}
 
 //HANDLE synradHandle;
 
 GlobalSettings::GlobalSettings():GLWindow() {
 
 	int wD = 610;
-	int hD = 525;
+	int hD = 700;
 
 	SetTitle("Global Settings");
 	SetIconfiable(true);
@@ -80,7 +116,7 @@ GlobalSettings::GlobalSettings():GLWindow() {
 	panel2->Add(cutoffText);
 
 	GLTitledPanel *panel4 = new GLTitledPanel("Program settings");
-	panel4->SetBounds(5,85,600,90);
+	panel4->SetBounds(5,85,600,115);
 	Add(panel4);
 
 	GLLabel *asLabel = new GLLabel("Autosave frequency (minutes):");
@@ -116,22 +152,118 @@ GlobalSettings::GlobalSettings():GLWindow() {
 	chkCompressSavedFiles->SetBounds(10,150,100,19);
 	Add(chkCompressSavedFiles);
 
+	chkTextResults = new GLToggle(0,"Save results as text (larger, readable by older versions)");
+	chkTextResults->SetBounds(10,175,100,19);
+	Add(chkTextResults);
+
 	/*chkNonIsothermal = new GLToggle(0,"Non-isothermal system (textures only, experimental)");
 	chkNonIsothermal->SetBounds(315,125,100,19);
 	Add(chkNonIsothermal);*/
 
+	GLTitledPanel *panel5 = new GLTitledPanel("Simulation run (applied on reload)");
+	panel5->SetBounds(5,205,600,145);
+	Add(panel5);
+
+	GLLabel *threadsLabel = new GLLabel("Threads per subprocess (0: auto):");
+	threadsLabel->SetBounds(15,220,170,19);
+	panel5->Add(threadsLabel);
+
+	nbThreadsText = new GLTextField(0,"");
+	nbThreadsText->SetBounds(190,220,30,19);
+	panel5->Add(nbThreadsText);
+
+	GLLabel *wavefrontLabel = new GLLabel("Particles traced together:");
+	wavefrontLabel->SetBounds(235,220,140,19);
+	panel5->Add(wavefrontLabel);
+
+	wavefrontText = new GLTextField(0,"");
+	wavefrontText->SetBounds(375,220,30,19);
+	panel5->Add(wavefrontText);
+
+	chkFluxWeightedSources = new GLToggle(0,"Sample source points by flux");
+	chkFluxWeightedSources->SetBounds(425,220,160,19);
+	panel5->Add(chkFluxWeightedSources);
+
+	GLLabel *rouletteLabel = new GLLabel("Roulette survival weight (0: 10x cutoff):");
+	rouletteLabel->SetBounds(15,245,210,19);
+	panel5->Add(rouletteLabel);
+
+	rouletteText = new GLTextField(0,"");
+	rouletteText->SetBounds(225,245,60,19);
+	panel5->Add(rouletteText);
+
+	GLLabel *splitLabel = new GLLabel("Low flux, split in:");
+	splitLabel->SetBounds(315,245,90,19);
+	panel5->Add(splitLabel);
+
+	splitFactorText = new GLTextField(0,"");
+	splitFactorText->SetBounds(405,245,30,19);
+	panel5->Add(splitFactorText);
+
+	GLLabel *texturePoolLabel = new GLLabel("Texture tiles (MB):");
+	texturePoolLabel->SetBounds(450,245,95,19);
+	panel5->Add(texturePoolLabel);
+
+	texturePoolText = new GLTextField(0,"");
+	texturePoolText->SetBounds(545,245,40,19);
+	panel5->Add(texturePoolText);
+
+	GLLabel *splitFacetsLabel = new GLLabel("Splitting facets:");
+	splitFacetsLabel->SetBounds(15,270,90,19);
+	panel5->Add(splitFacetsLabel);
+
+	splitFacetsText = new GLTextField(0,"");
+	splitFacetsText->SetBounds(105,270,180,19);
+	panel5->Add(splitFacetsText);
+
+	GLLabel *splitStructuresLabel = new GLLabel("Splitting structures:");
+	splitStructuresLabel->SetBounds(315,270,110,19);
+	panel5->Add(splitStructuresLabel);
+
+	splitStructuresText = new GLTextField(0,"");
+	splitStructuresText->SetBounds(425,270,160,19);
+	panel5->Add(splitStructuresText);
+
+	GLLabel *precisionLabel = new GLLabel("Precision targets:");
+	precisionLabel->SetBounds(15,295,90,19);
+	panel5->Add(precisionLabel);
+
+	precisionText = new GLTextField(0,"");
+	precisionText->SetBounds(105,295,430,19);
+	panel5->Add(precisionText);
+
+	precisionInfo = new GLButton(0, "Info");
+	precisionInfo->SetBounds(545,295,40,19);
+	panel5->Add(precisionInfo);
+
+	GLLabel *tallyFacetsLabel = new GLLabel("Tallied facets:");
+	tallyFacetsLabel->SetBounds(15,320,90,19);
+	panel5->Add(tallyFacetsLabel);
+
+	tallyFacetsText = new GLTextField(0,"");
+	tallyFacetsText->SetBounds(105,320,180,19);
+	panel5->Add(tallyFacetsText);
+
+	GLLabel *energyBandsLabel = new GLLabel("Energy bands:");
+	energyBandsLabel->SetBounds(315,320,80,19);
+	panel5->Add(energyBandsLabel);
+
+	energyBandsText = new GLTextField(0,"");
+	energyBandsText->SetBounds(395,320,190,19);
+	panel5->Add(energyBandsText);
+
 	GLTitledPanel *panel3 = new GLTitledPanel("Subprocess control");
-	panel3->SetBounds(5,180,wD-10,hD-225);
+	panel3->SetBounds(5,355,wD-10,hD-400);
 	Add(panel3);
 
 	processList = new GLList(0);
 	processList->SetHScrollVisible(true);
-	processList->SetSize(5, MAX_PROCESS + 1);
+	processList->SetSize(6, MAX_PROCESS + 1);
 	processList->SetColumnWidths((int*)plWidth);
 	processList->SetColumnLabels(plName);
 	processList->SetColumnAligns((int *)plAligns);
 	processList->SetColumnLabelVisible(true);
-	processList->SetBounds(10, 195, wD - 20, hD - 305);
+	processList->SetBounds(10, 370, wD - 20, hD - 480);
 	panel3->Add(processList);
 
 	char tmp[128];
@@ -153,6 +285,10 @@ GlobalSettings::GlobalSettings():GLWindow() {
 	restartButton->SetBounds(170,hD-76,90,19);
 	panel3->Add(restartButton);
 
+	dumpProfileButton = new GLButton(0,"Dump profile...");
+	dumpProfileButton->SetBounds(265,hD-76,90,19);
+	panel3->Add(dumpProfileButton);
+
 	maxButton = new GLButton(0,"Change MAX generated photons");
 	maxButton->SetBounds(wD-195,hD-76,180,19);
 	panel3->Add(maxButton);
@@ -204,6 +340,22 @@ void GlobalSettings::Display(Worker *w) {
 		chkCheckForUpdates->SetEnabled(false);
 	}
 	chkCompressSavedFiles->SetState(mApp->compressSavedFiles);
+	chkTextResults->SetState(mApp->saveTextResults);
+	sprintf(tmp,"%zd",mApp->runSettings.nbThreads);
+	nbThreadsText->SetText(tmp);
+	chkFluxWeightedSources->SetState(mApp->runSettings.fluxWeightedSources);
+	sprintf(tmp,"%zd",mApp->runSettings.wavefrontSize);
+	wavefrontText->SetText(tmp);
+	rouletteText->SetText(mApp->runSettings.rouletteSurvivalWeight);
+	sprintf(tmp,"%zd",mApp->runSettings.splitFactor);
+	splitFactorText->SetText(tmp);
+	sprintf(tmp,"%zd",mApp->runSettings.texturePoolMB);
+	texturePoolText->SetText(tmp);
+	splitFacetsText->SetText(FormatIdList(mApp->runSettings.splitFacets).c_str());
+	splitStructuresText->SetText(FormatIdList(mApp->runSettings.splitStructures).c_str());
+	precisionText->SetText(FormatPrecisionTargets(mApp->runSettings.precisionTargets).c_str());
+	tallyFacetsText->SetText(FormatIdList(mApp->runSettings.tallyFacets).c_str());
+	energyBandsText->SetText(FormatEnergyBands(mApp->runSettings.energyBands).c_str());
 	
 	size_t nb = worker->GetProcNumber();
 	sprintf(tmp,"%zd",nb);
@@ -220,7 +372,7 @@ void GlobalSettings::SMPUpdate() {
 
 	if (!IsVisible() || IsIconic()) return;
 	size_t nb = worker->GetProcNumber();
-	if (processList->GetNbRow() != (nb + 1)) processList->SetSize(5, nb + 1, true);
+	if (processList->GetNbRow() != (nb + 1)) processList->SetSize(6, nb + 1, true);
 
 	if (time - lastUpdate>333) {
 
@@ -287,6 +439,9 @@ void GlobalSettings::SMPUpdate() {
 			std::stringstream tmp; tmp << prStates[states[i]] << " " << statusStrings[i];
 			processList->SetValueAt(4, i + 1, tmp.str().c_str());
 
+			PhaseProfile profile;
+			if (ReadProcessProfile(i, profile)) processList->SetValueAt(5, i + 1, GetProfileSummary(profile).c_str());
+
 		}
 	}
 
@@ -322,6 +477,39 @@ void GlobalSettings::RestartProc() {
 
 }
 
+void GlobalSettings::DumpProfile() {
+
+	std::string fileName = NFD_SaveFile_Cpp("txt", "");
+	if (fileName.empty()) return;
+	if (FileUtils::GetExtension(fileName).empty()) fileName += ".txt";
+
+	FILE *f = fopen(fileName.c_str(), "w");
+	if (!f) {
+		GLMessageBox::Display("Cannot open file for writing", "Error", GLDLG_OK, GLDLG_ICONERROR);
+		return;
+	}
+	fprintf(f, "Phase profile, sampled time scaled to all calls. %% is of the simulation thread time\n");
+	for (size_t i = 0; i < worker->GetProcNumber(); i++) {
+		PhaseProfile profile;
+		if (!ReadProcessProfile(i, profile)) {
+			fprintf(f, "\nSubproc.%zd: no profile\n", i + 1);
+			continue;
+		}
+		fprintf(f, "\nSubproc.%zd: %I64d thread(s), %.3f s in simulation steps\n", i + 1, profile.nbThreads, profile.threadSeconds);
+		fprintf(f, "%-22s %14s %14s %12s %12s %8s\n", "Phase", "Calls", "Timed calls", "Est. s", "ns/call", "%");
+		for (size_t phase = 0; phase < NB_PROFILE_PHASES; phase++) {
+			double seconds = GetPhaseSeconds(profile, phase);
+			double percent = (profile.threadSeconds > 0.0) ? 100.0 * seconds / profile.threadSeconds : 0.0;
+			fprintf(f, "%-22s %14I64d %14I64d %12.4f %12.1f %8.2f\n", GetPhaseName(phase), profile.nbCalls[phase], profile.nbTimedCalls[phase],
+				seconds, GetPhaseNanosecondsPerCall(profile, phase), percent);
+		}
+		fprintf(f, "Effective samples per thread second: %g (MC hits weighed by their ratio of the generated photon)\n", GetEffectiveSamplesPerSecond(profile));
+		fprintf(f, "Russian roulette: %I64d killed, %I64d survived. Split copies: %I64d\n",
+			profile.nbRouletteKills, profile.nbRouletteSurvivals, profile.nbSplitCopies);
+	}
+	fclose(f);
+}
+
 void GlobalSettings::ProcessMessage(GLComponent *src,int message) {
 
 	switch(message) {
@@ -333,6 +521,8 @@ void GlobalSettings::ProcessMessage(GLComponent *src,int message) {
 
 		} else if (src==restartButton) {
 			RestartProc();
+		} else if (src==dumpProfileButton) {
+			DumpProfile();
 		} else if (src==maxButton) {
 			if( worker->GetGeometry()->IsLoaded() ) {
 				char tmp[128];
@@ -367,6 +557,7 @@ void GlobalSettings::ProcessMessage(GLComponent *src,int message) {
 				}
 			}
 			mApp->compressSavedFiles = chkCompressSavedFiles->GetState();
+			mApp->saveTextResults = chkTextResults->GetState();
 			mApp->autoUpdateFormulas = chkAutoUpdateFormulas->GetState();
 			mApp->autoSaveSimuOnly=chkSimuOnly->GetState();
 			double autosavefreq;
@@ -375,6 +566,54 @@ void GlobalSettings::ProcessMessage(GLComponent *src,int message) {
 				return;
 			}
 			mApp->autoSaveFrequency = autosavefreq;
+
+			int nbThreads;
+			if (!nbThreadsText->GetNumberInt(&nbThreads) || nbThreads < 0) {
+				GLMessageBox::Display("Invalid number of threads, must be 0 (auto) or more","Error",GLDLG_OK,GLDLG_ICONERROR);
+				return;
+			}
+			int wavefrontSize;
+			if (!wavefrontText->GetNumberInt(&wavefrontSize) || wavefrontSize < 1) {
+				GLMessageBox::Display("Invalid number of particles traced together, must be 1 or more","Error",GLDLG_OK,GLDLG_ICONERROR);
+				return;
+			}
+			double rouletteSurvivalWeight;
+			if (!rouletteText->GetNumber(&rouletteSurvivalWeight) || !(rouletteSurvivalWeight >= 0.0)) {
+				GLMessageBox::Display("Invalid roulette survival weight, must be 0 (10x the cutoff) or more","Error",GLDLG_OK,GLDLG_ICONERROR);
+				return;
+			}
+			int splitFactor;
+			if (!splitFactorText->GetNumberInt(&splitFactor) || splitFactor < 1) {
+				GLMessageBox::Display("Invalid number of split copies, must be 1 (no splitting) or more","Error",GLDLG_OK,GLDLG_ICONERROR);
+				return;
+			}
+			int texturePoolMB;
+			if (!texturePoolText->GetNumberInt(&texturePoolMB) || texturePoolMB < 1) {
+				GLMessageBox::Display("Invalid texture tile space, must be 1 MB or more","Error",GLDLG_OK,GLDLG_ICONERROR);
+				return;
+			}
+			std::vector<bool> splitFacets, splitStructures;
+			if (!ParseIdList(splitFacetsText->GetText().c_str(), splitFacets) || !ParseIdList(splitStructuresText->GetText().c_str(), splitStructures)) {
+				GLMessageBox::Display("Invalid splitting facets or structures, must be numbers separated by commas","Error",GLDLG_OK,GLDLG_ICONERROR);
+				return;
+			}
+			std::vector<bool> tallyFacets;
+			if (!ParseIdList(tallyFacetsText->GetText().c_str(), tallyFacets)) {
+				GLMessageBox::Display("Invalid tallied facets, must be numbers separated by commas","Error",GLDLG_OK,GLDLG_ICONERROR);
+				return;
+			}
+			std::vector<EnergyBandEdges> energyBands;
+			if (!ParseEnergyBands(energyBandsText->GetText().c_str(), energyBands)) {
+				char errMsg[256];
+				sprintf(errMsg,"Invalid energy bands, expected FACET:E1,E2,...[:texture] separated by semicolons,\nwith up to %d increasing edges in eV",MAX_BAND_EDGES);
+				GLMessageBox::Display(errMsg,"Error",GLDLG_OK,GLDLG_ICONERROR);
+				return;
+			}
+			std::vector<PrecisionTarget> precisionTargets;
+			if (!ParsePrecisionTargets(precisionText->GetText().c_str(), precisionTargets)) {
+				GLMessageBox::Display("Invalid precision targets, see Info","Error",GLDLG_OK,GLDLG_ICONERROR);
+				return;
+			}
 			
 			double cutoffnumber;
 			if (!cutoffText->GetNumber(&cutoffnumber) || !(cutoffnumber>0.0 && cutoffnumber<1.0)) {
@@ -397,6 +636,31 @@ void GlobalSettings::ProcessMessage(GLComponent *src,int message) {
 				}
 			}
 
+			bool fluxWeightedSources = (chkFluxWeightedSources->GetState() == 1);
+			if (mApp->runSettings.nbThreads != (size_t)nbThreads || mApp->runSettings.fluxWeightedSources != fluxWeightedSources
+				|| mApp->runSettings.wavefrontSize != (size_t)wavefrontSize || mApp->runSettings.rouletteSurvivalWeight != rouletteSurvivalWeight
+				|| mApp->runSettings.splitFactor != (size_t)splitFactor || mApp->runSettings.splitFacets != splitFacets
+				|| mApp->runSettings.texturePoolMB != (size_t)texturePoolMB
+				|| mApp->runSettings.splitStructures != splitStructures
+				|| mApp->runSettings.tallyFacets != tallyFacets
+				|| FormatEnergyBands(mApp->runSettings.energyBands) != FormatEnergyBands(energyBands)
+				|| FormatPrecisionTargets(mApp->runSettings.precisionTargets) != FormatPrecisionTargets(precisionTargets)) {
+				if (mApp->AskToReset()) {
+					mApp->runSettings.nbThreads = (size_t)nbThreads;
+					mApp->runSettings.fluxWeightedSources = fluxWeightedSources;
+					mApp->runSettings.wavefrontSize = (size_t)wavefrontSize;
+					mApp->runSettings.rouletteSurvivalWeight = rouletteSurvivalWeight;
+					mApp->runSettings.splitFactor = (size_t)splitFactor;
+					mApp->runSettings.texturePoolMB = (size_t)texturePoolMB;
+					mApp->runSettings.splitFacets = splitFacets;
+					mApp->runSettings.splitStructures = splitStructures;
+					mApp->runSettings.tallyFacets = tallyFacets;
+					mApp->runSettings.energyBands = energyBands;
+					mApp->runSettings.precisionTargets = precisionTargets;
+					worker->Reload();
+				}
+			}
+
 			GLWindow::ProcessMessage(NULL,MSG_CLOSE); 
 			return;
 		}
@@ -409,6 +673,13 @@ void GlobalSettings::ProcessMessage(GLComponent *src,int message) {
 				"of the original flux, it will be eliminated. A good advice is that if you'd like to see flux across N orders of magnitude, set it to 1E-N"
 				, "Low flux mode", GLDLG_OK, GLDLG_ICONINFO);
 			return;
+		} else if (src == precisionInfo) {
+			GLMessageBox::Display("The simulation stops once every target is reached. Targets are separated by semicolons,\n"
+				"each written FACET:QUANTITY:ERROR with ERROR the relative error of the result (for example 0.01 for 1%).\n"
+				"QUANTITY is power, flux or hits (absorbed by the facet), peak (power density of the hottest texture cell)\n"
+				"or cells=U0,V0,U1,V1 (power absorbed by a rectangle of texture cells, numbered from 1).\n"
+				"Example: 12:power:0.01; 15:cells=1,1,10,4:0.05", "Precision targets", GLDLG_OK, GLDLG_ICONINFO);
+			return;
 		} else if (src == newReflectmodeInfo) {
 			GLMessageBox::Display("In the old reflection model, both the material reflection probability and the new, reflected photon direction\n"
 				"depend on the ""roughness ratio"" parameter, which is generally the ratio of the RMS roughness and the autocorrelation length\n"
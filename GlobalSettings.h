@@ -47,13 +47,25 @@ public:
 private:
 
 	void RestartProc();
+	void DumpProfile(); //Phase profile of each subprocess to a text file
 	  Worker      *worker;
   GLList      *processList;
   GLButton    *restartButton;
+  GLButton    *dumpProfileButton;
   GLButton    *maxButton;
   GLTextField *nbProcText;
   GLTextField *autoSaveText;
   GLTextField *cutoffText;
+  GLTextField *nbThreadsText;
+  GLTextField *wavefrontText;
+  GLTextField *rouletteText;
+  GLTextField *splitFactorText;
+  GLTextField *texturePoolText;
+  GLTextField *splitFacetsText; //Not saved in synrad.cfg: facet and structure numbers belong to the loaded geometry
+  GLTextField *splitStructuresText;
+  GLTextField *tallyFacetsText;
+  GLTextField *energyBandsText;
+  GLTextField *precisionText; //Not saved either
  
   int lastUpdate;
   //float lastCPUTime[MAX_PROCESS];
@@ -68,11 +80,14 @@ private:
   GLToggle      *chkAutoUpdateFormulas;
   GLToggle      *chkNewReflectionModel;
   GLToggle      *chkCompressSavedFiles;
+  GLToggle      *chkTextResults;
+  GLToggle      *chkFluxWeightedSources;
   GLToggle      *lowFluxToggle;
   GLButton    *applyButton;
   GLButton    *cancelButton;
   GLButton    *lowFluxInfo;
   GLButton    *newReflectmodeInfo;
+  GLButton    *precisionInfo;
 
   /*GLTextField *outgassingText;
   GLTextField *gasmassText;*/
@@ -0,0 +1,451 @@
+/*
+Program:     MolFlow+ / Synrad+
+Description: Monte Carlo simulator for ultra-high vacuum and synchrotron radiation
+Authors:     Jean-Luc PONS / Roberto KERSEVAN / Marton ADY
+Copyright:   E.S.R.F / CERN
+Website:     https://cern.ch/molflow
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
+*/
+
+//Synrad-side ray tracing of a simulation thread
+//Unlike the shared Intersect(), collision coordinates and transparent passes are written to the calling thread,
+//so that several threads can trace the same (read-only) structures and BVHs
+
+#include <math.h>
+#include <vector>
+#include <tuple>
+#include <algorithm> //std::swap, std::nth_element
+#include <cfloat> //FLT_MAX
+#include "Simulation.h"
+#include "GLApp/MathTools.h"
+
+#define BVH_MAX_LEAF_SIZE 4 //A node with more facets is split if the surface area heuristic doesn't prefer a leaf
+#define BVH_SAH_BINS 12
+#define BVH_SAH_DEPTH 40 //Deeper nodes are split at the median, which bounds the depth
+
+// BVH construction
+
+//Facet bounds used only while building
+class BVHBuildItem {
+public:
+	Vector3d bbMin, bbMax, centroid;
+	size_t facetId; //in the structure's facet vector
+};
+
+static double HalfArea(const Vector3d& bbMin, const Vector3d& bbMax) {
+	Vector3d e = bbMax - bbMin;
+	return e.x*e.y + e.y*e.z + e.z*e.x;
+}
+
+static double Component(const Vector3d& v, const size_t& axis) {
+	return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+static void GrowBox(Vector3d& bbMin, Vector3d& bbMax, const Vector3d& pMin, const Vector3d& pMax) {
+	bbMin.x = Min(bbMin.x, pMin.x); bbMin.y = Min(bbMin.y, pMin.y); bbMin.z = Min(bbMin.z, pMin.z);
+	bbMax.x = Max(bbMax.x, pMax.x); bbMax.y = Max(bbMax.y, pMax.y); bbMax.z = Max(bbMax.z, pMax.z);
+}
+
+static size_t BuildNode(FacetBVH& bvh, std::vector<BVHBuildItem>& items, const size_t& begin, const size_t& end, const size_t& depth) {
+	//Emits the node of items[begin,end) and its subtree in depth-first order, returns its index
+	bvh.depth = Max(bvh.depth, depth);
+
+	Vector3d bbMin(1e100, 1e100, 1e100), bbMax(-1e100, -1e100, -1e100);
+	Vector3d cMin(1e100, 1e100, 1e100), cMax(-1e100, -1e100, -1e100);
+	for (size_t i = begin; i < end; i++) {
+		GrowBox(bbMin, bbMax, items[i].bbMin, items[i].bbMax);
+		GrowBox(cMin, cMax, items[i].centroid, items[i].centroid);
+	}
+
+	size_t nodeId = bvh.nodes.size();
+	bvh.nodes.emplace_back();
+	//Float bounds rounded outwards, so that the box never shrinks
+	double dMin[3] = { bbMin.x, bbMin.y, bbMin.z };
+	double dMax[3] = { bbMax.x, bbMax.y, bbMax.z };
+	for (size_t a = 0; a < 3; a++) {
+		bvh.nodes[nodeId].bbMin[a] = nextafterf((float)dMin[a], -FLT_MAX);
+		bvh.nodes[nodeId].bbMax[a] = nextafterf((float)dMax[a], FLT_MAX);
+	}
+
+	size_t count = end - begin;
+	size_t axis = 0; //largest centroid extent
+	Vector3d cExtent = cMax - cMin;
+	if (cExtent.y > cExtent.x) axis = 1;
+	if (cExtent.z > Component(cExtent, axis)) axis = 2;
+
+	size_t mid = begin;
+	bool makeLeaf = (count <= 1);
+	bool splitAtMedian = false;
+
+	if (!makeLeaf && Component(cExtent, axis) <= 0.0) {
+		//Coincident centroids: no plane separates them
+		if (count <= BVH_MAX_LEAF_SIZE) makeLeaf = true;
+		else splitAtMedian = true;
+	}
+	else if (!makeLeaf && depth >= BVH_SAH_DEPTH) {
+		splitAtMedian = true;
+	}
+	else if (!makeLeaf) {
+		//Binned surface area heuristic along the largest axis
+		size_t binCount[BVH_SAH_BINS] = { 0 };
+		Vector3d binMin[BVH_SAH_BINS], binMax[BVH_SAH_BINS];
+		for (size_t b = 0; b < BVH_SAH_BINS; b++) {
+			binMin[b] = Vector3d(1e100, 1e100, 1e100);
+			binMax[b] = Vector3d(-1e100, -1e100, -1e100);
+		}
+		double cLow = Component(cMin, axis);
+		double binScale = (double)BVH_SAH_BINS / Component(cExtent, axis);
+		auto binOf = [&](const BVHBuildItem& item) {
+			return Min((size_t)((Component(item.centroid, axis) - cLow) * binScale), (size_t)(BVH_SAH_BINS - 1));
+		};
+		for (size_t i = begin; i < end; i++) {
+			size_t b = binOf(items[i]);
+			binCount[b]++;
+			GrowBox(binMin[b], binMax[b], items[i].bbMin, items[i].bbMax);
+		}
+
+		//Sweep from the right to get the cost of every split plane
+		double rightArea[BVH_SAH_BINS];
+		size_t rightCount[BVH_SAH_BINS];
+		Vector3d accMin(1e100, 1e100, 1e100), accMax(-1e100, -1e100, -1e100);
+		size_t acc = 0;
+		for (size_t b = BVH_SAH_BINS - 1; b > 0; b--) {
+			GrowBox(accMin, accMax, binMin[b], binMax[b]);
+			acc += binCount[b];
+			rightArea[b] = acc ? HalfArea(accMin, accMax) : 0.0;
+			rightCount[b] = acc;
+		}
+		double bestCost = 1e100;
+		size_t bestSplit = 0; //0: no plane with facets on both sides
+		accMin = Vector3d(1e100, 1e100, 1e100); accMax = Vector3d(-1e100, -1e100, -1e100);
+		acc = 0;
+		for (size_t b = 1; b < BVH_SAH_BINS; b++) {
+			GrowBox(accMin, accMax, binMin[b - 1], binMax[b - 1]);
+			acc += binCount[b - 1];
+			if (acc == 0 || rightCount[b] == 0) continue;
+			double cost = HalfArea(accMin, accMax) * (double)acc + rightArea[b] * (double)rightCount[b];
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestSplit = b;
+			}
+		}
+
+		//Leaf cost: every facet tested. Split cost: one more box test, then the children weighed by their area relative to the parent
+		double parentArea = HalfArea(bbMin, bbMax);
+		double splitCost = (parentArea > 0.0) ? 1.0 + bestCost / parentArea : 1e100;
+		if (count <= BVH_MAX_LEAF_SIZE && (bestSplit == 0 || (double)count <= splitCost)) {
+			makeLeaf = true;
+		}
+		else if (bestSplit != 0 && parentArea > 0.0) {
+			mid = std::partition(items.begin() + begin, items.begin() + end, [&](const BVHBuildItem& item) {
+				return binOf(item) < bestSplit;
+			}) - items.begin();
+		}
+		else {
+			splitAtMedian = true;
+		}
+	}
+
+	if (splitAtMedian) {
+		mid = begin + count / 2;
+		std::nth_element(items.begin() + begin, items.begin() + mid, items.begin() + end, [axis](const BVHBuildItem& a, const BVHBuildItem& b) {
+			return Component(a.centroid, axis) < Component(b.centroid, axis);
+		});
+	}
+
+	if (makeLeaf) {
+		bvh.nodes[nodeId].offset = (uint32_t)begin; //items are in leaf order, so are BVH::facets
+		bvh.nodes[nodeId].nbFacets = (uint16_t)count;
+		bvh.nodes[nodeId].splitAxis = 0;
+		return nodeId;
+	}
+
+	bvh.nodes[nodeId].nbFacets = 0;
+	bvh.nodes[nodeId].splitAxis = (uint16_t)axis;
+	BuildNode(bvh, items, begin, mid, depth + 1); //first child follows its parent
+	bvh.nodes[nodeId].offset = (uint32_t)BuildNode(bvh, items, mid, end, depth + 1);
+	return nodeId;
+}
+
+void FacetBVH::Build(const std::vector<SubprocessFacet*>& structureFacets, const std::vector<Vector3d>& vertices3) {
+	Clear();
+	if (structureFacets.empty()) return;
+
+	std::vector<BVHBuildItem> items(structureFacets.size());
+	for (size_t i = 0; i < structureFacets.size(); i++) {
+		const SubprocessFacet& f = *structureFacets[i];
+		items[i].facetId = i;
+		items[i].bbMin = Vector3d(1e100, 1e100, 1e100);
+		items[i].bbMax = Vector3d(-1e100, -1e100, -1e100);
+		for (auto& index : f.indices) GrowBox(items[i].bbMin, items[i].bbMax, vertices3[index], vertices3[index]);
+		items[i].centroid = 0.5 * (items[i].bbMin + items[i].bbMax);
+	}
+
+	nodes.reserve(2 * items.size());
+	BuildNode(*this, items, 0, items.size(), 0);
+
+	//Intersection data, in leaf order
+	facets.resize(items.size());
+	for (size_t i = 0; i < items.size(); i++) {
+		SubprocessFacet& f = *structureFacets[items[i].facetId];
+		IntersectionFacet& data = facets[i];
+		data.O = f.sh.O;
+		data.U = f.sh.U;
+		data.V = f.sh.V;
+		data.N = f.sh.N;
+		data.Nuv = f.sh.Nuv;
+		data.opacity = f.sh.opacity;
+		data.reflectType = f.sh.reflectType;
+		data.is2sided = f.sh.is2sided;
+		data.firstVertex = (uint32_t)vertices2.size();
+		data.nbVertex = (uint32_t)f.vertices2.size();
+		vertices2.insert(vertices2.end(), f.vertices2.begin(), f.vertices2.end());
+		data.facet = &f;
+		if ((f.sh.opacity > 0.0 && f.sh.opacity < 1.0) || f.sh.reflectType >= 10) hasRandomPasses = true;
+	}
+}
+
+void FacetBVH::Clear() {
+	depth = 0;
+	hasRandomPasses = false;
+	nodes.clear();
+	facets.clear();
+	vertices2.clear();
+}
+
+// Traversal
+
+//Everything the traversal needs about one ray, precomputed once per Intersect() call
+class TracedRay {
+public:
+	Vector3d pos, dir, dirOpposite, inverseDir;
+	bool nullRx, nullRy, nullRz;
+	const SubprocessFacet* lastHitBefore; //excluded from the search
+	CurrentParticleStatus* particle; //energy (for material transparency) and transparent pass buffer
+	uint64_t passKey; //Keys the pass draws of this ray, from the particle's stream
+	FacetCollision hardHit;
+	bool found;
+
+	void Set(CurrentParticleStatus& p, const bool& drawPassKey) {
+		particle = &p;
+		passKey = 0;
+		if (drawPassKey) passKey = (uint64_t)p.rng.Next() | ((uint64_t)p.rng.Next() << 32);
+		pos = p.position;
+		dir = p.direction;
+		dirOpposite = Vector3d(-1.0*dir.x, -1.0*dir.y, -1.0*dir.z);
+		nullRx = (dir.x == 0.0);
+		nullRy = (dir.y == 0.0);
+		nullRz = (dir.z == 0.0);
+		inverseDir = Vector3d(0.0, 0.0, 0.0);
+		if (!nullRx) inverseDir.x = 1.0 / dir.x;
+		if (!nullRy) inverseDir.y = 1.0 / dir.y;
+		if (!nullRz) inverseDir.z = 1.0 / dir.z;
+		lastHitBefore = p.lastHitFacet;
+		hardHit.facet = NULL;
+		hardHit.colDist = 1e100;
+		hardHit.colU = hardHit.colV = 0.0;
+		found = false;
+		p.transparentHitBuffer.clear();
+	}
+};
+
+static inline bool RayHitsSlab(const double& pos, const double& inverseDir, const bool& nullR, const float& bbMin, const float& bbMax, double& tNear, double& tFar) {
+	if (nullR) return pos >= bbMin && pos <= bbMax;
+	double t1 = (bbMin - pos) * inverseDir;
+	double t2 = (bbMax - pos) * inverseDir;
+	if (t1 > t2) std::swap(t1, t2);
+	tNear = Max(tNear, t1);
+	tFar = Min(tFar, t2);
+	return true;
+}
+
+static inline bool RayHitsBox(const BVHNode& node, const TracedRay& ray) {
+	//Slab test against the node's bounding box. Returns false if the box is further than the closest hit found so far
+	double tNear = -1e100;
+	double tFar = 1e100;
+	if (!RayHitsSlab(ray.pos.x, ray.inverseDir.x, ray.nullRx, node.bbMin[0], node.bbMax[0], tNear, tFar)) return false;
+	if (!RayHitsSlab(ray.pos.y, ray.inverseDir.y, ray.nullRy, node.bbMin[1], node.bbMax[1], tNear, tFar)) return false;
+	if (!RayHitsSlab(ray.pos.z, ray.inverseDir.z, ray.nullRz, node.bbMin[2], node.bbMax[2], tNear, tFar)) return false;
+	return tNear <= tFar && tFar >= 0.0 && tNear <= ray.hardHit.colDist;
+}
+
+static bool IsInPolygon(const Vector2d* polygon, const size_t& nbVertex, const double& u, const double& v) {
+	//Even-odd rule: count polygon edges crossed by a ray from (u,v) towards +v
+	bool inside = false;
+	for (size_t i = 0, j = nbVertex - 1; i < nbVertex; j = i++) {
+		const Vector2d& p1 = polygon[i];
+		const Vector2d& p2 = polygon[j];
+		if ((p1.u > u) != (p2.u > u)) {
+			double vCross = p1.v + (u - p1.u) * (p2.v - p1.v) / (p2.u - p1.u);
+			if (v < vCross) inside = !inside;
+		}
+	}
+	return inside;
+}
+
+static void IntersectFacet(SimulationThread* thread, const FacetBVH& bvh, const IntersectionFacet& f, TracedRay& ray) {
+
+	// Do not check last collided facet
+	if (f.facet == ray.lastHitBefore) return;
+
+	double det = Dot(f.Nuv, ray.dirOpposite);
+	// Eliminate "back facet"
+	if (!(f.is2sided || det > 0.0) || det == 0.0) return;
+
+	// Solve O + u*U + v*V = rayPos + d*rayDir (Cramer's rule)
+	double iDet = 1.0 / det;
+	Vector3d intZ = ray.pos - f.O;
+	double u = iDet * Dot(intZ, CrossProduct(f.V, ray.dirOpposite));
+	if (u < 0.0 || u > 1.0) return;
+	double v = iDet * Dot(f.U, CrossProduct(intZ, ray.dirOpposite));
+	if (v < 0.0 || v > 1.0) return;
+	double d = iDet * Dot(f.Nuv, intZ);
+	if (d <= 0.0 || d >= ray.hardHit.colDist) return;
+
+	// Now check intersection with the facet polygon (in the u,v space)
+	if (!IsInPolygon(&bvh.vertices2[f.firstVertex], f.nbVertex, u, v)) return;
+
+	bool isHardHit;
+	if (f.opacity == 1.0) isHardHit = true;
+	else if (f.opacity == 0.0) isHardHit = false;
+	else isHardHit = PassUniform(thread->model->randomSeed, ray.passKey, (uint32_t)f.facet->globalId, 0) < f.opacity;
+
+	if (isHardHit && f.reflectType >= 10 && (f.reflectType - 10) < (int)thread->model->materials.size()) {
+		//Material with transparent pass probability
+		Material& mat = thread->model->materials[f.reflectType - 10];
+		if (mat.hasBackscattering) {
+			double cosTheta = Dot(ray.dir, f.N);
+			Saturate(cosTheta, -1.0, 1.0);
+			ReflectionProbabilities materialReflProbabilities = mat.Lookup(ray.particle->energy, abs(acos(cosTheta) - PI / 2));
+			isHardHit = PassUniform(thread->model->randomSeed, ray.passKey, (uint32_t)f.facet->globalId, 1) >= materialReflProbabilities[3];
+		}
+	}
+
+	if (isHardHit) {
+		ray.hardHit.facet = f.facet;
+		ray.hardHit.colDist = d;
+		ray.hardHit.colU = u;
+		ray.hardHit.colV = v;
+		ray.found = true;
+	}
+	else {
+		FacetCollision pass;
+		pass.facet = f.facet;
+		pass.colDist = d;
+		pass.colU = u;
+		pass.colV = v;
+		ray.particle->transparentHitBuffer.push_back(pass);
+	}
+}
+
+static void IntersectBVH(SimulationThread* thread, const FacetBVH& bvh, TracedRay& ray) {
+	//Front-to-back traversal with an explicit stack: the child on the ray's side of the split is visited first
+	if (bvh.nodes.empty()) return;
+	uint32_t stack[BVH_STACK_SIZE];
+	size_t stackSize = 0;
+	stack[stackSize++] = 0;
+	while (stackSize > 0) {
+		uint32_t nodeId = stack[--stackSize];
+		const BVHNode& node = bvh.nodes[nodeId];
+		if (!RayHitsBox(node, ray)) continue;
+		if (node.nbFacets > 0) {
+			for (size_t i = 0; i < node.nbFacets; i++) IntersectFacet(thread, bvh, bvh.facets[node.offset + i], ray);
+		}
+		else {
+			uint32_t nearChild = nodeId + 1;
+			uint32_t farChild = node.offset;
+			if (Component(ray.dir, node.splitAxis) < 0.0) std::swap(nearChild, farChild);
+			stack[stackSize++] = farChild;
+			stack[stackSize++] = nearChild;
+		}
+	}
+}
+
+static void IntersectBVHPacket(SimulationThread* thread, const FacetBVH& bvh, const uint32_t& nodeId, TracedRay* rays, const size_t& nbRays, const unsigned int& activeMask) {
+	//Same as IntersectBVH(), for up to RAY_PACKET_SIZE rays: a node is visited once if any ray of the packet hits its box
+	//Facets of a leaf are loaded once and tested against every active ray, instead of once per ray
+
+	const BVHNode& node = bvh.nodes[nodeId];
+	unsigned int mask = 0;
+	for (size_t r = 0; r < nbRays; r++) {
+		if ((activeMask & (1u << r)) && RayHitsBox(node, rays[r])) mask |= (1u << r);
+	}
+	if (!mask) return;
+
+	if (node.nbFacets > 0) {
+		for (size_t i = 0; i < node.nbFacets; i++) {
+			const IntersectionFacet& f = bvh.facets[node.offset + i];
+			for (size_t r = 0; r < nbRays; r++) {
+				if (mask & (1u << r)) IntersectFacet(thread, bvh, f, rays[r]);
+			}
+		}
+	}
+	else {
+		//Packets are sorted by direction octant: the first ray's direction decides the order
+		uint32_t nearChild = nodeId + 1;
+		uint32_t farChild = node.offset;
+		size_t firstRay = 0;
+		while (!(mask & (1u << firstRay))) firstRay++;
+		if (Component(rays[firstRay].dir, node.splitAxis) < 0.0) std::swap(nearChild, farChild);
+		IntersectBVHPacket(thread, bvh, nearChild, rays, nbRays, mask);
+		IntersectBVHPacket(thread, bvh, farChild, rays, nbRays, mask); //boxes tested again: rays may have found a closer hit
+	}
+}
+
+void SimulationThread::ApplyCollision(const bool& found, const FacetCollision& hardHit) {
+	//Records what the traversal found for the current particle
+	if (found) {
+
+		// Transparent passes in front of the hard hit (their counters use the pass coordinates)
+		for (const auto& pass : currentParticle.transparentHitBuffer) {
+			if (pass.colDist < hardHit.colDist) {
+				currentParticle.colU = pass.colU;
+				currentParticle.colV = pass.colV;
+				RegisterTransparentPass(*pass.facet);
+			}
+		}
+
+		currentParticle.colU = hardHit.colU;
+		currentParticle.colV = hardHit.colV;
+		facetStates[hardHit.facet->globalId].hitted = true;
+	}
+}
+
+std::tuple<bool, SubprocessFacet*, double> SimulationThread::Intersect() {
+	// Traces the current particle (direction must be normalized)
+	// lastHitFacet is the facet the ray starts from, it's excluded from the search
+
+	const FacetBVH& bvh = model->structures[currentParticle.structureId].bvh;
+	TracedRay ray;
+	ray.Set(currentParticle, bvh.hasRandomPasses);
+	IntersectBVH(this, bvh, ray);
+
+	ApplyCollision(ray.found, ray.hardHit);
+	return std::make_tuple(ray.found, ray.hardHit.facet, ray.hardHit.colDist);
+}
+
+void SimulationThread::IntersectPacket(const size_t* slots, const size_t& nbRays) {
+	//Traces wavefront particles 'slots' (same structure) together. Results go to wavefrontHits, ApplyCollision() is left to the shading pass
+	const FacetBVH& bvh = model->structures[wavefront[slots[0]].structureId].bvh;
+	TracedRay rays[RAY_PACKET_SIZE];
+	for (size_t r = 0; r < nbRays; r++) {
+		rays[r].Set(wavefront[slots[r]], bvh.hasRandomPasses); //Same draw as Intersect(): the particle's stream stays in step
+	}
+
+	if (!bvh.nodes.empty()) IntersectBVHPacket(this, bvh, 0, rays, nbRays, (1u << nbRays) - 1);
+
+	for (size_t r = 0; r < nbRays; r++) {
+		wavefrontHits[slots[r]] = rays[r].hardHit; //facet is NULL if nothing was hit
+	}
+}
@@ -0,0 +1,184 @@
+/*
+Program:     MolFlow+ / Synrad+
+Description: Monte Carlo simulator for ultra-high vacuum and synchrotron radiation
+Authors:     Jean-Luc PONS / Roberto KERSEVAN / Marton ADY
+Copyright:   E.S.R.F / CERN
+Website:     https://cern.ch/molflow
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
+*/
+#pragma once
+
+//Flat geometry format sent to the subprocesses in the 'loader' dataport (or read from a mapped file)
+//A LoaderHeader followed by arrays of plain data, each aligned and located by its offset from the start of the buffer,
+//so that a reader can use every array where it lies instead of deserializing it
+
+#include <cstdint>
+#include <cstddef>
+#include <type_traits>
+
+#define LOADER_MAGIC     0x4C445953 //"SYDL" in memory
+#define LOADER_VERSION   9 //Increase on any layout change, readers refuse other versions
+#define LOADER_ALIGNMENT 64 //Start of every section
+
+enum LoaderSectionId {
+	LOADER_WORKER_PARAMS,      //WorkerParams, 1
+	LOADER_ONTHEFLY_PARAMS,    //OntheflySimulationParams, 1
+	LOADER_GEOM_COUNTS,        //LoaderGeomCounts, 1
+	LOADER_GEOM_NAME,          //char, geometry name without terminating zero
+	LOADER_VERTICES,           //Vector3d, one per vertex
+	LOADER_FACETS,             //FacetProperties, one per facet
+	LOADER_FACET_RANGES,       //LoaderFacetRanges, one per facet
+	LOADER_INDICES,            //size_t, vertex indices of all facets
+	LOADER_VERTICES2,          //Vector2d, same ranges as LOADER_INDICES
+	LOADER_TEXTURE_INCREMENTS, //double, reciprocal cell areas of all textured facets
+	LOADER_REGIONS,            //RegionParams, one per region
+	LOADER_REGION_RANGES,      //LoaderRegionRanges, one per region
+	LOADER_TRAJECTORY_POINTS,  //Trajectory_Point, points of all regions
+	LOADER_DISTRIBUTION_PAIRS, //LoaderPair, magnetic field distributions of all regions
+	LOADER_MATERIALS,          //LoaderMaterial, one per material
+	LOADER_MATERIAL_VALUES,    //double, angles, energies and cells of all materials
+	LOADER_TABLES,             //LoaderRange of rows: psi_distro, chi_distros (LoaderGeomCounts::nbChiDistros), parallel_polarization
+	LOADER_TABLE_ROWS,         //LoaderRange of values, one per row
+	LOADER_TABLE_VALUES,       //double
+	LOADER_RUN_SETTINGS,       //LoaderRunSettings, 1 (see RunSettings.h)
+	LOADER_SPLIT_FACETS,       //uint64_t facet index, splitting facets
+	LOADER_SPLIT_STRUCTURES,   //uint64_t structure index, splitting structures
+	LOADER_PRECISION_TARGETS,  //LoaderPrecisionTarget
+	LOADER_TALLY_FACETS,       //uint64_t facet index, tallied facets
+	LOADER_ENERGY_BANDS,       //LoaderEnergyBands, one per facet having energy bands
+	LOADER_BAND_EDGES,         //double, edges of all energy bands, in eV
+	LOADER_NB_SECTIONS
+};
+
+struct LoaderRange { //Elements [first, first+count) of a section
+	uint64_t first;
+	uint64_t count;
+};
+
+struct LoaderPair {
+	double x, y;
+};
+
+struct LoaderSection {
+	uint64_t offset; //From the start of the buffer
+	uint64_t count;
+	uint64_t elementSize; //Checked against the reader's types
+};
+
+struct LoaderHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t totalSize;
+	LoaderSection sections[LOADER_NB_SECTIONS];
+};
+
+struct LoaderGeomCounts {
+	uint64_t nbFacet, nbVertex, nbSuper;
+	uint64_t nbChiDistros;
+};
+
+struct LoaderFacetRanges {
+	LoaderRange indices; //In LOADER_INDICES and LOADER_VERTICES2
+	LoaderRange textureIncrements; //Empty if not textured
+};
+
+struct LoaderRegionRanges {
+	LoaderRange points;
+	LoaderRange Bx_distr, By_distr, Bz_distr;
+};
+
+struct LoaderMaterial {
+	uint64_t hasBackscattering;
+	uint64_t nbAngles, nbEnergies, nbComponents; //nbComponents: 4 with backscattering, 1 otherwise
+	uint64_t firstValue; //nbAngles angles, nbEnergies energies, then cells energy by energy, angle by angle, component by component
+};
+
+struct LoaderRunSettings {
+	uint64_t nbThreads; //Simulation threads per subprocess, 0: the cores shared between the subprocesses
+	uint64_t fluxWeightedSources; //0 or 1
+	uint64_t wavefrontSize; //Particles traced together per thread, 1: one at a time
+	double rouletteSurvivalWeight; //0: 10x the low flux cutoff
+	uint64_t splitFactor; //1: no splitting
+	uint64_t texturePoolMB; //Texture tile pool of the hits dataport, at least 1
+};
+
+struct LoaderPrecisionTarget { //PrecisionTarget without its statistics
+	uint64_t facetId;
+	uint64_t quantity; //PrecisionQuantity
+	uint64_t u0, v0, u1, v1;
+	double relativeError;
+};
+
+struct LoaderEnergyBands { //EnergyBandEdges of one facet
+	uint64_t facetId;
+	uint64_t recordTexture; //0 or 1
+	LoaderRange edges; //In LOADER_BAND_EDGES, increasing
+};
+
+//Writer side: declare every section, then LayoutLoader() gives the buffer size
+
+inline void SetLoaderSection(LoaderHeader& header, const LoaderSectionId& id, const size_t& count, const size_t& elementSize) {
+	header.sections[id].count = count;
+	header.sections[id].elementSize = elementSize;
+}
+
+inline size_t AlignLoaderOffset(const size_t& offset) {
+	return (offset + LOADER_ALIGNMENT - 1) / LOADER_ALIGNMENT * LOADER_ALIGNMENT;
+}
+
+inline size_t LayoutLoader(LoaderHeader& header) {
+	header.magic = LOADER_MAGIC;
+	header.version = LOADER_VERSION;
+	size_t offset = AlignLoaderOffset(sizeof(LoaderHeader));
+	for (size_t i = 0; i < LOADER_NB_SECTIONS; i++) {
+		header.sections[i].offset = offset;
+		offset = AlignLoaderOffset(offset + header.sections[i].count * header.sections[i].elementSize);
+	}
+	header.totalSize = offset;
+	return offset;
+}
+
+template <class T> T* LoaderSectionData(void* buffer, const LoaderHeader& header, const LoaderSectionId& id) {
+	static_assert(std::is_trivially_copyable<T>::value, "Loader sections hold plain data only");
+	return (T*)((char*)buffer + header.sections[id].offset);
+}
+
+//Reader side: the buffer isn't trusted, every section is checked before use
+
+inline const char* CheckLoaderBuffer(const void* buffer, const size_t& size) { //Returns NULL if valid, or the reason
+	if (size < sizeof(LoaderHeader) || (uintptr_t)buffer % alignof(LoaderHeader) != 0) return "Loader buffer too small";
+	const LoaderHeader* header = (const LoaderHeader*)buffer;
+	if (header->magic != LOADER_MAGIC) return "Not a Synrad loader buffer";
+	if (header->version != LOADER_VERSION) return "Loader buffer version mismatch (interface and subprocess from different builds?)";
+	if (header->totalSize > size) return "Loader buffer truncated";
+	for (size_t i = 0; i < LOADER_NB_SECTIONS; i++) {
+		const LoaderSection& s = header->sections[i];
+		if (s.offset % LOADER_ALIGNMENT != 0 || s.offset > header->totalSize) return "Loader section misplaced";
+		if (s.elementSize != 0 && s.count > (header->totalSize - s.offset) / s.elementSize) return "Loader section out of buffer";
+	}
+	return NULL;
+}
+
+template <class T> const T* GetLoaderSection(const void* buffer, const LoaderSectionId& id, size_t& count) { //NULL if the element type doesn't match, call CheckLoaderBuffer() first
+	static_assert(std::is_trivially_copyable<T>::value, "Loader sections hold plain data only");
+	const LoaderHeader* header = (const LoaderHeader*)buffer;
+	const LoaderSection& s = header->sections[id];
+	count = (size_t)s.count;
+	if (s.count > 0 && s.elementSize != sizeof(T)) return NULL;
+	return (const T*)((const char*)buffer + s.offset);
+}
+
+inline bool InLoaderSection(const LoaderRange& range, const size_t& sectionCount) { //Range lies within a section of sectionCount elements
+	return range.first <= sectionCount && range.count <= sectionCount - range.first;
+}
@@ -0,0 +1,75 @@
+/*
+Program:     MolFlow+ / Synrad+
+Description: Monte Carlo simulator for ultra-high vacuum and synchrotron radiation
+Authors:     Jean-Luc PONS / Roberto KERSEVAN / Marton ADY
+Copyright:   E.S.R.F / CERN
+Website:     https://cern.ch/molflow
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
+*/
+#pragma once
+
+//Where a simulation process spends its time, published by each synradSub in its 'profile' dataport (SNRDPROF<interface pid>_<index>)
+//and read by Global Settings. Plain data, the same layout on both sides
+
+#include <cstdint>
+#include <cstddef>
+
+enum ProfilePhase {
+	PHASE_SOURCE,     //Source point selection
+	PHASE_GENERATION, //Beam offsets, energy, natural divergence and polarization of generated photons
+	PHASE_INTERSECT,  //Ray tracing (transparent passes recorded inside it)
+	PHASE_MATERIAL,   //Material reflectivity lookup
+	PHASE_SCATTERING, //Outgoing direction and surface roughness
+	PHASE_RECORDING,  //Hit cache, texture, direction, profile and spectrum recording
+	PHASE_HITUPDATE,  //Reduction of the thread counters and copy to the 'hits' dataport (main thread)
+	PHASE_HITWAIT,    //Waiting for the 'hits' dataport (main thread)
+	NB_PROFILE_PHASES
+};
+
+struct PhaseProfile {
+	uint64_t nbCalls[NB_PROFILE_PHASES]; //Calls since the last reset: rays for intersection, photons for source and generation
+	uint64_t nbTimedCalls[NB_PROFILE_PHASES]; //Sampled part of them
+	double timedSeconds[NB_PROFILE_PHASES]; //Time of the sampled calls
+	double threadSeconds; //Time spent in simulation steps, summed over the threads
+	uint64_t nbThreads;
+	double hitWeightSum, hitWeightSquareSum; //oriRatio of the MC hits: effective sample size (sum)^2/(sum of squares)
+	uint64_t nbRouletteKills, nbRouletteSurvivals; //Low flux mode photons that played the Russian roulette
+	uint64_t nbSplitCopies; //Copies traced in addition to the generated photons
+};
+
+inline const char* GetPhaseName(const size_t& phase) {
+	static const char* names[NB_PROFILE_PHASES] = { "Source selection", "Photon generation", "Intersection", "Material lookup",
+		"Scattering/roughness", "Recording", "Hit update", "Hit dataport wait" };
+	return names[phase];
+}
+
+inline const char* GetPhaseShortName(const size_t& phase) {
+	static const char* names[NB_PROFILE_PHASES] = { "src", "gen", "int", "mat", "sct", "rec", "upd", "wait" };
+	return names[phase];
+}
+
+inline double GetPhaseSeconds(const PhaseProfile& profile, const size_t& phase) { //Sampled time scaled to all calls
+	if (profile.nbTimedCalls[phase] == 0) return 0.0;
+	return profile.timedSeconds[phase] * (double)profile.nbCalls[phase] / (double)profile.nbTimedCalls[phase];
+}
+
+inline double GetEffectiveSamplesPerSecond(const PhaseProfile& profile) { //Per simulation thread second: the figure of merit of variance reduction
+	if (profile.hitWeightSquareSum <= 0.0 || profile.threadSeconds <= 0.0) return 0.0;
+	return profile.hitWeightSum * profile.hitWeightSum / profile.hitWeightSquareSum / profile.threadSeconds;
+}
+
+inline double GetPhaseNanosecondsPerCall(const PhaseProfile& profile, const size_t& phase) {
+	if (profile.nbTimedCalls[phase] == 0) return 0.0;
+	return profile.timedSeconds[phase] * 1E9 / (double)profile.nbTimedCalls[phase];
+}
@@ -0,0 +1,118 @@
+/*
+Program:     MolFlow+ / Synrad+
+Description: Monte Carlo simulator for ultra-high vacuum and synchrotron radiation
+Authors:     Jean-Luc PONS / Roberto KERSEVAN / Marton ADY
+Copyright:   E.S.R.F / CERN
+Website:     https://cern.ch/molflow
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
+*/
+#pragma once
+
+//Counter-based random numbers (Philox4x32-10, Salmon et al., SC'11): each output block is a pure function of (key, counter)
+//The key is the run seed and the counter holds the photon index, so any photon's random numbers can be regenerated
+//from its index alone, whatever the number of processes and threads that ran and the order they ran in
+
+#include <cstdint>
+#include <cstddef>
+
+//Independent streams of one photon (third counter word), so that drawing more in one stage doesn't shift the others
+#define PHOTON_STREAM_SOURCE 0 //Source point, drawn when the photon batch is generated
+#define PHOTON_STREAM_BEAM   1 //Beam offsets, one block per photon, see PhiloxUniformBatch()
+#define PHOTON_STREAM_PHOTON 2 //Energy, natural divergence and polarization
+#define PHOTON_STREAM_TRACE  3 //Everything drawn from the start of tracing until the photon is absorbed or lost
+#define PHOTON_STREAM_SPLIT  0x80000000 //Tracing streams of split copies: this bit, and a hash of their ancestry (see SplitStreamId())
+
+inline void Philox4x32(const uint32_t counter[4], const uint32_t key[2], uint32_t out[4]) {
+	uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+	uint32_t k0 = key[0], k1 = key[1];
+	for (int round = 0; round < 10; round++) {
+		uint64_t p0 = (uint64_t)0xD2511F53 * c0;
+		uint64_t p1 = (uint64_t)0xCD9E8D57 * c2;
+		c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+		c1 = (uint32_t)p1;
+		c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+		c3 = (uint32_t)p0;
+		k0 += 0x9E3779B9; //Weyl sequence key schedule
+		k1 += 0xBB67AE85;
+	}
+	out[0] = c0; out[1] = c1; out[2] = c2; out[3] = c3;
+}
+
+inline double PhiloxToUniform(const uint32_t& x) { //In (0,1), never 0 or 1 like gsl_rng_uniform_pos()
+	return ((double)x + 0.5) * (1.0 / 4294967296.0);
+}
+
+//Sequential reader of one stream of one photon, 4 numbers per Philox block
+class PhotonStream {
+public:
+	void Set(const uint64_t& seed, const uint64_t& photonIndex, const uint32_t& streamId) {
+		key[0] = (uint32_t)seed; key[1] = (uint32_t)(seed >> 32);
+		counter[0] = (uint32_t)photonIndex; counter[1] = (uint32_t)(photonIndex >> 32);
+		counter[2] = streamId;
+		counter[3] = 0; //Block number in the stream
+		nbBuffered = 0;
+	}
+	uint32_t Next() {
+		if (nbBuffered == 0) {
+			Philox4x32(counter, key, buffer);
+			counter[3]++;
+			nbBuffered = 4;
+		}
+		return buffer[4 - (nbBuffered--)];
+	}
+	double Uniform() { return PhiloxToUniform(Next()); }
+	uint32_t GetStreamId() const { return counter[2]; }
+private:
+	uint32_t key[2] = { 0, 0 };
+	uint32_t counter[4] = { 0, 0, 0, 0 };
+	uint32_t buffer[4];
+	size_t nbBuffered = 0;
+};
+
+//Stream of copy 'copyIndex' made at the 'splitIndex'-th split of a particle tracing 'parentStream'
+//Depends on the ancestry only, so split photons are reproducible whatever order the copies are traced in
+inline uint32_t SplitStreamId(const uint32_t& parentStream, const uint32_t& splitIndex, const uint32_t& copyIndex) {
+	uint32_t h = (parentStream * 0x9E3779B1) ^ (splitIndex * 0x85EBCA77) ^ (copyIndex * 0xC2B2AE3D);
+	h ^= h >> 16; h *= 0x7FEB352D; //Integer finalizer, spreads neighbouring inputs over the whole range
+	h ^= h >> 15; h *= 0x846CA68B;
+	h ^= h >> 16;
+	return h | PHOTON_STREAM_SPLIT;
+}
+
+//Decision of a ray on a facet (transparent pass draws): a pure function of the ray's key and the facet,
+//so a ray takes the same decisions whatever order the traversal tests the facets in (scalar or packet)
+//The key differs from the photon streams' so that the two never share a block
+inline double PassUniform(const uint64_t& seed, const uint64_t& rayKey, const uint32_t& facetId, const uint32_t& drawIndex) {
+	const uint32_t key[2] = { (uint32_t)seed ^ 0xA511E9B3, (uint32_t)(seed >> 32) ^ 0x63D83595 };
+	const uint32_t counter[4] = { (uint32_t)rayKey, (uint32_t)(rayKey >> 32), facetId, drawIndex };
+	uint32_t block[4];
+	Philox4x32(counter, key, block);
+	return PhiloxToUniform(block[0]);
+}
+
+//Batch API for the generation stage: block 'blockId' of stream 'streamId' of nbPhotons photons, 4 uniforms per photon
+//The photons are independent, the loop has no branch and vectorizes
+inline void PhiloxUniformBatch(const uint64_t& seed, const uint64_t* photonIndex, const size_t& nbPhotons, const uint32_t& streamId, const uint32_t& blockId,
+	double* out0, double* out1, double* out2, double* out3) {
+	const uint32_t key[2] = { (uint32_t)seed, (uint32_t)(seed >> 32) };
+	for (size_t i = 0; i < nbPhotons; i++) {
+		const uint32_t counter[4] = { (uint32_t)photonIndex[i], (uint32_t)(photonIndex[i] >> 32), streamId, blockId };
+		uint32_t block[4];
+		Philox4x32(counter, key, block);
+		out0[i] = PhiloxToUniform(block[0]);
+		out1[i] = PhiloxToUniform(block[1]);
+		out2[i] = PhiloxToUniform(block[2]);
+		out3[i] = PhiloxToUniform(block[3]);
+	}
+}
@@ -0,0 +1,231 @@
+/*
+Program:     MolFlow+ / Synrad+
+Description: Monte Carlo simulator for ultra-high vacuum and synchrotron radiation
+Authors:     Jean-Luc PONS / Roberto KERSEVAN / Marton ADY
+Copyright:   E.S.R.F / CERN
+Website:     https://cern.ch/molflow
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
+*/
+#include "PrecisionMonitor.h"
+#include "Simulation.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <sstream>
+
+std::string PrecisionTarget::GetDescription() const {
+	std::ostringstream desc;
+	desc << "Facet " << facetId + 1 << " ";
+	switch (quantity) {
+	case PRECISION_ABS_POWER: desc << "absorbed power"; break;
+	case PRECISION_ABS_FLUX: desc << "absorbed flux"; break;
+	case PRECISION_MC_HITS: desc << "MC hits"; break;
+	case PRECISION_TEXTURE_REGION: desc << "power on cells " << u0 + 1 << "," << v0 + 1 << ".." << u1 + 1 << "," << v1 + 1; break;
+	case PRECISION_PEAK_DENSITY: desc << "peak power density"; break;
+	}
+	return desc.str();
+}
+
+bool PrecisionTarget::Parse(const char* spec) {
+	//FACET:QUANTITY:RELERROR, QUANTITY one of power, flux, hits, peak or cells=U0,V0,U1,V1 (cells from 1, inclusive)
+	char quantityName[64];
+	int facet;
+	double error;
+	if (sscanf(spec, "%d:%63[^:]:%lf", &facet, quantityName, &error) != 3 || facet < 1 || !(error > 0.0)) return false;
+	int cells[4] = { 1, 1, 1, 1 };
+	if (strcmp(quantityName, "power") == 0) quantity = PRECISION_ABS_POWER;
+	else if (strcmp(quantityName, "flux") == 0) quantity = PRECISION_ABS_FLUX;
+	else if (strcmp(quantityName, "hits") == 0) quantity = PRECISION_MC_HITS;
+	else if (strcmp(quantityName, "peak") == 0) quantity = PRECISION_PEAK_DENSITY;
+	else if (sscanf(quantityName, "cells=%d,%d,%d,%d", &cells[0], &cells[1], &cells[2], &cells[3]) == 4
+		&& cells[0] >= 1 && cells[1] >= 1 && cells[2] >= 1 && cells[3] >= 1) {
+		quantity = PRECISION_TEXTURE_REGION;
+	}
+	else return false;
+	facetId = (size_t)(facet - 1);
+	relativeError = error;
+	u0 = (size_t)(cells[0] - 1);
+	v0 = (size_t)(cells[1] - 1);
+	u1 = (size_t)(cells[2] - 1);
+	v1 = (size_t)(cells[3] - 1);
+	return true;
+}
+
+std::string PrecisionTarget::GetSpec() const {
+	std::ostringstream spec;
+	spec << facetId + 1 << ":";
+	switch (quantity) {
+	case PRECISION_ABS_POWER: spec << "power"; break;
+	case PRECISION_ABS_FLUX: spec << "flux"; break;
+	case PRECISION_MC_HITS: spec << "hits"; break;
+	case PRECISION_TEXTURE_REGION: spec << "cells=" << u0 + 1 << "," << v0 + 1 << "," << u1 + 1 << "," << v1 + 1; break;
+	case PRECISION_PEAK_DENSITY: spec << "peak"; break;
+	}
+	spec << ":" << relativeError;
+	return spec.str();
+}
+
+bool PrecisionMonitor::Initialize(const Simulation& sim) {
+	cellStats.clear();
+	errorMsg.clear();
+	for (auto& target : targets) {
+		if (target.facetId >= sim.facets.size()) {
+			errorMsg = "Precision target on facet " + std::to_string(target.facetId + 1) + ", which doesn't exist";
+			return false;
+		}
+		const SubprocessFacet& f = sim.facets[target.facetId];
+		bool textureTarget = (target.quantity == PRECISION_TEXTURE_REGION || target.quantity == PRECISION_PEAK_DENSITY);
+		if (textureTarget && !(f.sh.isTextured && f.sh.countAbs)) {
+			errorMsg = target.GetDescription() + ": the facet has no texture counting absorption";
+			return false;
+		}
+		if (target.quantity == PRECISION_TEXTURE_REGION && (target.u0 > target.u1 || target.v0 > target.v1
+			|| target.u1 >= f.sh.texWidth || target.v1 >= f.sh.texHeight)) {
+			errorMsg = target.GetDescription() + ": outside the texture";
+			return false;
+		}
+	}
+
+	//Cell statistics: peak targets, or every textured facet for the uncertainty textures
+	try {
+		for (auto& f : sim.facets) {
+			if (!f.sh.isTextured) continue;
+			bool needed = uncertaintyTextures;
+			for (auto& target : targets) {
+				needed = needed || (target.facetId == f.globalId && target.quantity == PRECISION_PEAK_DENSITY);
+			}
+			if (!needed) continue;
+			CellBatchStats stats;
+			stats.facetId = f.globalId;
+			stats.width = f.sh.texWidth;
+			stats.height = f.sh.texHeight;
+			stats.cells.resize(stats.width * stats.height);
+			cellStats.push_back(std::move(stats));
+		}
+	}
+	catch (...) {
+		errorMsg = "Not enough memory for the uncertainty textures";
+		cellStats.clear();
+		return false;
+	}
+	Reset();
+	return true;
+}
+
+void PrecisionMonitor::Reset() {
+	nbBatches = 0;
+	sumN = sumN2 = 0.0;
+	worstRatio = -1.0;
+	for (auto& target : targets) {
+		target.sums = BatchSums();
+		target.lastError = -1.0;
+	}
+	for (auto& stats : cellStats) {
+		std::fill(stats.cells.begin(), stats.cells.end(), BatchSums());
+	}
+}
+
+void PrecisionMonitor::AddBatch(const Simulation& sim) {
+	if (targets.empty() && cellStats.empty()) return;
+
+	double n = 0.0;
+	for (auto& t : sim.threads) n += (double)t->tmpGlobalResult.globalHits.hit.nbDesorbed;
+	if (n == 0.0) return; //Nothing generated since the last batch (paused or limit reached)
+	nbBatches++;
+	sumN += n;
+	sumN2 += n * n;
+
+	const SimulationThread* merged = sim.threads[0];
+	for (auto& target : targets) {
+		const FacetHitState& state = merged->facetStates[target.facetId];
+		const SubprocessFacet& f = sim.facets[target.facetId];
+		double y = 0.0;
+		switch (target.quantity) {
+		case PRECISION_ABS_POWER: y = state.tmpCounter.hit.powerAbs; break;
+		case PRECISION_ABS_FLUX: y = state.tmpCounter.hit.fluxAbs; break;
+		case PRECISION_MC_HITS: y = (double)state.tmpCounter.hit.nbMCHit; break;
+		case PRECISION_TEXTURE_REGION:
+			state.ForEachAllocatedCell([&](const size_t& u, const size_t& v, const size_t& cellSlot) {
+				if (u < target.u0 || u > target.u1 || v < target.v0 || v > target.v1) return;
+				double increment = f.GetCellIncrement(u, v);
+				if (increment > 0.0) y += state.textureTiles[cellSlot].power / increment; //Density back to power
+			});
+			break;
+		case PRECISION_PEAK_DENSITY: continue; //From the cell statistics
+		}
+		target.sums.Add(y, n);
+	}
+
+	for (auto& stats : cellStats) {
+		const FacetHitState& state = merged->facetStates[stats.facetId];
+		if (!state.hitted || state.textureTiles.empty()) continue;
+		state.ForEachAllocatedCell([&](const size_t& u, const size_t& v, const size_t& cellSlot) {
+			double y = state.textureTiles[cellSlot].power;
+			if (y != 0.0) stats.cells[u + v * stats.width].Add(y, n); //Zero batch values add nothing to the sums
+		});
+	}
+}
+
+double PrecisionMonitor::GetRelativeError(const BatchSums& sums) const {
+	//Ratio estimator R = sumY/sumN over B batches: var(R) = sum((y_b - R*n_b)^2) / (B*(B-1)*mean(n)^2)
+	if (nbBatches < PRECISION_MIN_BATCHES || sums.sumY == 0.0) return -1.0;
+	double B = (double)nbBatches;
+	double R = sums.sumY / sumN;
+	double spread = sums.sumY2 - 2.0 * R * sums.sumYN + R * R * sumN2;
+	if (spread < 0.0) spread = 0.0; //Rounding
+	double meanN = sumN / B;
+	double variance = spread / (B * (B - 1.0) * meanN * meanN);
+	return sqrt(variance) / fabs(R);
+}
+
+double PrecisionMonitor::GetPeakError(const PrecisionTarget& target) const {
+	const CellBatchStats* stats = GetCellStats(target.facetId);
+	if (!stats) return -1.0;
+	const BatchSums* peak = NULL;
+	for (auto& cell : stats->cells) {
+		if (!peak || cell.sumY > peak->sumY) peak = &cell;
+	}
+	return peak ? GetRelativeError(*peak) : -1.0;
+}
+
+bool PrecisionMonitor::TargetsReached(const size_t& nbProcess) {
+	//Processes run independently: averaging nbProcess of them divides the error by sqrt(nbProcess)
+	if (targets.empty()) return false;
+	double processScale = sqrt((double)(nbProcess > 0 ? nbProcess : 1));
+	bool reached = true;
+	worstRatio = 0.0;
+	for (auto& target : targets) {
+		target.lastError = (target.quantity == PRECISION_PEAK_DENSITY) ? GetPeakError(target) : GetRelativeError(target.sums);
+		if (target.lastError < 0.0) {
+			reached = false;
+			worstRatio = -1.0;
+			continue;
+		}
+		double runError = target.lastError / processScale;
+		if (worstRatio >= 0.0 && runError / target.relativeError > worstRatio) worstRatio = runError / target.relativeError;
+		if (runError > target.relativeError) reached = false;
+	}
+	return reached;
+}
+
+double PrecisionMonitor::GetWorstRatio() const {
+	return worstRatio;
+}
+
+const CellBatchStats* PrecisionMonitor::GetCellStats(const size_t& facetId) const {
+	for (auto& stats : cellStats) {
+		if (stats.facetId == facetId) return &stats;
+	}
+	return NULL;
+}
@@ -0,0 +1,95 @@
+/*
+Program:     MolFlow+ / Synrad+
+Description: Monte Carlo simulator for ultra-high vacuum and synchrotron radiation
+Authors:     Jean-Luc PONS / Roberto KERSEVAN / Marton ADY
+Copyright:   E.S.R.F / CERN
+Website:     https://cern.ch/molflow
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
+*/
+#pragma once
+
+//Live statistical error of selected results, by batch means: every hit update of a process is a batch
+//Batches have different photon counts, so each quantity is estimated as a ratio (sum of batch values)/(sum of batch photons)
+//and its variance from the spread of the batches around that ratio
+
+#include <vector>
+#include <string>
+#include <cstddef>
+
+class Simulation;
+
+#define PRECISION_MIN_BATCHES 10 //Below this, the estimate isn't trusted and the targets aren't reached
+
+enum PrecisionQuantity {
+	PRECISION_ABS_POWER,      //Absorbed power of a facet
+	PRECISION_ABS_FLUX,       //Absorbed flux of a facet
+	PRECISION_MC_HITS,        //MC hits of a facet
+	PRECISION_TEXTURE_REGION, //Power absorbed by a rectangle of texture cells
+	PRECISION_PEAK_DENSITY    //Power density of the hottest texture cell of a facet
+};
+
+class BatchSums { //Sums over the batches of one quantity, the photon sums are shared (PrecisionMonitor)
+public:
+	double sumY = 0.0, sumY2 = 0.0, sumYN = 0.0;
+	void Add(const double& y, const double& n) {
+		sumY += y;
+		sumY2 += y * y;
+		sumYN += y * n;
+	}
+};
+
+class PrecisionTarget {
+public:
+	size_t facetId; //globalId
+	int quantity; //PrecisionQuantity
+	size_t u0, v0, u1, v1; //PRECISION_TEXTURE_REGION: cells u0..u1, v0..v1 (inclusive, from 0)
+	double relativeError; //Requested, for the whole run (all processes)
+
+	BatchSums sums; //Unused for PRECISION_PEAK_DENSITY: the cell's own sums are used
+	double lastError = -1.0; //Last estimate, -1 if there isn't any yet
+
+	std::string GetDescription() const;
+	bool Parse(const char* spec); //FACET:QUANTITY:RELERROR as typed in Global Settings and synradCLI, false if invalid
+	std::string GetSpec() const; //As parsed by Parse()
+};
+
+class CellBatchStats { //Per-cell batch sums of the power density of one textured facet, for peak targets and uncertainty textures
+public:
+	size_t facetId;
+	size_t width, height;
+	std::vector<BatchSums> cells; //u + v*width
+};
+
+class PrecisionMonitor {
+public:
+	std::vector<PrecisionTarget> targets; //From the run settings at each load (RunSettings::precisionTargets), kept across resets
+	bool uncertaintyTextures = false; //Per-cell statistics on every textured facet, not only the ones of peak targets
+
+	bool Initialize(const Simulation& sim); //After loading: checks the targets and sizes the cell statistics. false and error set if invalid
+	void Reset(); //New run
+	void AddBatch(const Simulation& sim); //Increments of the thread counters (already reduced to the first thread) since the last batch
+	bool TargetsReached(const size_t& nbProcess); //Every target within its error, each process running for 1/nbProcess of the statistics
+	double GetWorstRatio() const; //Largest achieved/requested error of the last check, -1 if unknown
+	double GetRelativeError(const BatchSums& sums) const; //-1 if not enough batches or a zero result
+	const CellBatchStats* GetCellStats(const size_t& facetId) const; //NULL if not recorded
+	std::string errorMsg;
+
+	size_t nbBatches = 0;
+	double sumN = 0.0, sumN2 = 0.0; //Photons of the batches
+
+private:
+	std::vector<CellBatchStats> cellStats;
+	double worstRatio = -1.0;
+	double GetPeakError(const PrecisionTarget& target) const;
+};
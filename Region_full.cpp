@@ -25,45 +25,115 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #include <ctime>
 #include <vector>
 #include "GLApp\GLToolkit.h"
-#include "GLApp\GLProgress.h"
 #include "SynRad.h"
 #include "GeometryViewer.h"
 #include <string>
+#ifdef WIN
 #include <direct.h> //for CWD
+#else
+#include <unistd.h>
+#include <limits.h>
+#define _getcwd getcwd
+#define MAX_PATH PATH_MAX
+#endif
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <algorithm> //std::upper_bound
+#include "WorkerPool.h"
 using namespace std;
 //extern int antiAliasing;
 
 extern SynRad *mApp;
 
+static thread_local bool insideParallelFor = false;
+
+//Runs task(0..nbTasks-1) on all cores, each task on one thread. Nested calls (a trajectory of a region loaded by LoadRegionFiles()) run serially
+static void ParallelFor(const size_t& nbTasks, const std::function<void(const size_t&)>& task) {
+	//Threads started at the first call and kept until the process exits, shared by all regions
+	static WorkerPool* pool = new WorkerPool((size_t)Max(std::thread::hardware_concurrency(), 1u));
+	if (nbTasks <= 1 || pool->GetNbThreads() <= 1 || insideParallelFor) {
+		for (size_t i = 0; i < nbTasks; i++) task(i);
+		return;
+	}
+	std::atomic<size_t> nextTask(0);
+	pool->Run([&](const size_t& worker) { //The calling thread takes part
+		insideParallelFor = true;
+		for (size_t i = nextTask++; i < nbTasks; i = nextTask++) task(i);
+		insideParallelFor = false;
+	});
+}
+
 void Region_full::CalculateTrajectory(int max_steps){
-	//global variables. All distances in cm!
-	Trajectory_Point current_point;
-	//extern Distribution2D polarization_distribution,integral_N_photons,integral_SR_power,g1h2_distribution;
+	//All distances in cm!
+	//The orbit is integrated step by step, each step needing the field of the previous point (CalcPointField)
+	//The beam properties of the points are independent of each other, evaluated afterwards on all cores (CalcPointBeam)
+
+	//Points sized once for the straight path to the boundary corner, grown only for strongly bent orbits
+	size_t maxPoints = (size_t)max_steps + 1;
+	size_t estimate = (params.dL_cm > 0.0) ? (size_t)((params.limits - params.startPoint).Norme() / params.dL_cm) + 2 : maxPoints;
+	Points.clear();
+	Points.resize(Min(estimate, maxPoints));
 
 	//initial position and speed
-	current_point.position=this->params.startPoint;
-	current_point.direction=this->params.startDir;
-	//current_point.rho=Vector3d(0.0,0.0,1e30); //big enough so no rotation
+	Points[0].position=this->params.startPoint;
+	Points[0].direction=this->params.startDir;
 	AABBmin=AABBmax=this->params.startPoint;
+	CalcPointField(0); //calculate magnetic field, etc. of first point
+	size_t nbPoints = 1;
+
+	for (int i=0;i<max_steps&&!isOutsideBoundaries(Points[i].position);i++) {
+		if (nbPoints == Points.size()) Points.resize(Min(Points.size() * 3 / 2 + 1, maxPoints));
+		Points[i + 1] = OneStep(i); //step forward, store point on i+1st place
+		nbPoints++;
+		CalcPointField(i + 1);
+		//extend trajectory limits if needed
+		const Vector3d& position = Points[i + 1].position;
+		if (position.x<AABBmin.x) AABBmin.x = position.x;
+		if (position.y<AABBmin.y) AABBmin.y = position.y;
+		if (position.z<AABBmin.z) AABBmin.z = position.z;
+		if (position.x>AABBmax.x) AABBmax.x = position.x;
+		if (position.y>AABBmax.y) AABBmax.y = position.y;
+		if (position.z>AABBmax.z) AABBmax.z = position.z;
+	}
+	Points.resize(nbPoints);
+	if (Points.capacity() > 2 * nbPoints) Points.shrink_to_fit(); //Boundary reached well before the estimate
 
-	//Calculate trajectory
-	Points.push_back(current_point); //beam starting position
-	CalcPointProperties(0); //calculate magnetic field, etc. of first point
+	if (params.emittance_cm > 0.0 && params.betax_const_cm < 0.0) BuildLatticeTable();
+	ParallelFor(nbPoints, [&](const size_t& pointId) { CalcPointBeam((int)pointId); });
+}
 
-	for (int i=0;i<max_steps&&!isOutsideBoundaries(current_point.position,i==0);i++) {
-		current_point=OneStep(i); //step forward
-		Points.push_back(current_point); //store point on i+1st place
-		CalcPointProperties(i + 1);
-		//extend trajectory limits if needed
-		if (current_point.position.x<AABBmin.x) AABBmin.x = current_point.position.x;
-		if (current_point.position.y<AABBmin.y) AABBmin.y = current_point.position.y;
-		if (current_point.position.z<AABBmin.z) AABBmin.z = current_point.position.z;
-		if (current_point.position.x>AABBmax.x) AABBmax.x = current_point.position.x;
-		if (current_point.position.y>AABBmax.y) AABBmax.y = current_point.position.y;
-		if (current_point.position.z>AABBmax.z) AABBmax.z = current_point.position.z;
+void Region_full::BuildLatticeTable() {
+	size_t nbLines = latticeFunctions.GetSize();
+	latticeCoordinates.resize(nbLines);
+	latticeTable.resize(nbLines * 6);
+	for (size_t i = 0; i < nbLines; i++) {
+		latticeCoordinates[i] = latticeFunctions.GetX(i);
+		std::vector<double> lineValues = latticeFunctions.GetY(i);
+		for (size_t j = 0; j < 6; j++) latticeTable[i * 6 + j] = j < lineValues.size() ? lineValues[j] : 0.0;
 	}
 }
 
+void Region_full::InterpolateLattice(const double& coordinate, double* values) const {
+	//Linear interpolation between the two lines around coordinate, no extrapolation outside the table
+	size_t nbLines = latticeCoordinates.size();
+	if (nbLines == 0) {
+		for (size_t j = 0; j < 6; j++) values[j] = 0.0;
+		return;
+	}
+	size_t upper = std::upper_bound(latticeCoordinates.begin(), latticeCoordinates.end(), coordinate) - latticeCoordinates.begin();
+	if (upper == 0 || upper == nbLines) { //Before the first or after the last line
+		const double* line = &latticeTable[(upper == 0 ? 0 : nbLines - 1) * 6];
+		for (size_t j = 0; j < 6; j++) values[j] = line[j];
+		return;
+	}
+	const double* lower = &latticeTable[(upper - 1) * 6];
+	const double* higher = &latticeTable[upper * 6];
+	double span = latticeCoordinates[upper] - latticeCoordinates[upper - 1];
+	double ratio = span > 0.0 ? (coordinate - latticeCoordinates[upper - 1]) / span : 0.0;
+	for (size_t j = 0; j < 6; j++) values[j] = lower[j] + ratio * (higher[j] - lower[j]);
+}
+
 Trajectory_Point Region_full::OneStep(int pointId) {
 	Trajectory_Point* p0 = &(Points[pointId]);
 
@@ -86,7 +156,7 @@ Trajectory_Point Region_full::OneStep(int pointId) {
 	return p;
 }
 
-void Region_full::CalcPointProperties(int pointId) {
+void Region_full::CalcPointField(int pointId) {
 	Trajectory_Point* p = &(Points[pointId]);
 
 	p->B = B(pointId, Vector3d(0, 0, 0)); //local magnetic field
@@ -112,6 +182,10 @@ void Region_full::CalcPointProperties(int pointId) {
 	p->Z_local = p->direction.Normalized(); //Z' base vector
 	p->Y_local = Vector3d(0.0, 1.0, 0.0); //same as absolute Y - assuming that machine's orbit is in the XZ plane
 	p->X_local = CrossProduct(p->Y_local, p->Z_local); //Left-hand coord system
+}
+
+void Region_full::CalcPointBeam(int pointId) {
+	Trajectory_Point* p = &(Points[pointId]);
 
 	if (params.emittance_cm > 0.0) { //if beam is not ideal
 		//calculate non-ideal beam's offset (the four sigmas)
@@ -122,7 +196,8 @@ void Region_full::CalcPointProperties(int pointId) {
 			else if (params.beta_kind == 2) coordinate = p->position.y;
 			else if (params.beta_kind == 3) coordinate = p->position.z;
 
-			std::vector<double> latticeValues = latticeFunctions.InterpolateY(coordinate,false); //interpolation, don't extrapolate beta functions
+			double latticeValues[6];
+			InterpolateLattice(coordinate, latticeValues); //interpolation, don't extrapolate beta functions
 
 			p->beta_X = latticeValues[0];    // [cm]
 			p->beta_Y = latticeValues[1];    // [cm]
@@ -201,15 +276,11 @@ void Region_full::CalcPointProperties(int pointId) {
 	}
 }
 
-bool Region_full::isOutsideBoundaries(Vector3d a,bool recalcDirs){
-	static double xDir=(params.limits.x>params.startPoint.x)?1.0:-1.0;
-	static double yDir=(params.limits.y>params.startPoint.y)?1.0:-1.0;
-	static double zDir=(params.limits.z>params.startPoint.z)?1.0:-1.0;
-	if (recalcDirs) {
-		xDir=(params.limits.x>params.startPoint.x)?1.0:-1.0;
-		yDir=(params.limits.y>params.startPoint.y)?1.0:-1.0;
-		zDir=(params.limits.z>params.startPoint.z)?1.0:-1.0;
-	}
+bool Region_full::isOutsideBoundaries(const Vector3d& a){
+	//Directions recomputed on each call (no static state), regions are loaded on several threads
+	double xDir=(params.limits.x>params.startPoint.x)?1.0:-1.0;
+	double yDir=(params.limits.y>params.startPoint.y)?1.0:-1.0;
+	double zDir=(params.limits.z>params.startPoint.z)?1.0:-1.0;
 	return ((a.x- params.limits.x)*xDir>0.0)||((a.y- params.limits.y)*yDir>0.0)||((a.z- params.limits.z)*zDir>0.0);
 }
 
@@ -349,7 +420,6 @@ void Region_full::LoadPAR(FileReader *file){
 	//prg->SetMessage("Calculating trajectory...");
 	CalculateTrajectory(1000000); //max 1 million points
 	isLoaded=true;
-	if (mApp->regionInfo) mApp->regionInfo->Update();
 }
 
 Distribution2D Region_full::LoadMAGFile(FileReader *file,Vector3d *dir,double *period,double *phase,int mode){
@@ -1057,8 +1127,7 @@ void Region_full::LoadParam(FileReader *file){
 						MagFileNamePtr[i]->assign(tmp);
 					else {//not in tmp, nor in current, error.
 						sprintf(tmp2,"Referenced MAG file not found: %s",tmp);
-						SAFE_DELETE(file);
-						throw Error(tmp2);
+						throw Error(tmp2); //file is deleted by the caller (LoadFile())
 					}
 				}
 				FileReader MAGfile((char*)MagFileNamePtr[i]->c_str());
@@ -1070,6 +1139,33 @@ void Region_full::LoadParam(FileReader *file){
 	//prg->SetMessage("Calculating trajectory...");
 	CalculateTrajectory(1000000); //max 1 million points
 	isLoaded=true;
-	
-	if (mApp->regionInfo) mApp->regionInfo->Update();
+}
+
+void Region_full::LoadFile(const std::string& fileName) {
+	std::string ext = FileUtils::GetExtension(fileName);
+	if (ext != "par" && ext != "PAR" && ext != "param") throw Error("LoadParam(): Invalid file extension [Only par or param]");
+	FileReader* fr = new FileReader(fileName);
+	try {
+		if (ext == "par" || ext == "PAR") LoadPAR(fr);
+		else LoadParam(fr);
+	}
+	catch (Error &e) {
+		SAFE_DELETE(fr);
+		throw e;
+	}
+	SAFE_DELETE(fr);
+	this->fileName = fileName;
+}
+
+void LoadRegionFiles(const std::vector<std::string>& fileNames, std::vector<Region_full>& regions, std::vector<std::string>& errors) {
+	regions = std::vector<Region_full>(fileNames.size());
+	errors = std::vector<std::string>(fileNames.size());
+	ParallelFor(fileNames.size(), [&](const size_t& i) {
+		try {
+			regions[i].LoadFile(fileNames[i]);
+		}
+		catch (Error &e) {
+			errors[i] = e.GetMsg();
+		}
+	});
 }
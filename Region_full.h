@@ -23,12 +23,13 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #include <stdio.h>
 #include <fstream>
 #include "Region_mathonly.h"
+#ifdef WIN
 #include <Process.h> //for getpid
+#endif
 
 #include "File.h"
 
 #include "GLApp\GLToolkit.h"
-#include "GLApp\GLProgress.h"
 //#include "GLApp\GLTypes.h"
 #include <cereal/types/string.hpp>
 #include <cereal/types/vector.hpp>
@@ -42,6 +43,8 @@ public:
 	bool isLoaded;
 	Vector3d AABBmin,AABBmax;
 	int selectedPointId; //can be -1 if nothing's selected
+	std::vector<double> latticeCoordinates; //X values of latticeFunctions, increasing
+	std::vector<double> latticeTable; //Y values of latticeFunctions, 6 per coordinate: read by all threads of the point pass without allocating
 
 	//Methods
 	Region_full();
@@ -52,10 +55,14 @@ public:
 	
 	void CalculateTrajectory(int max_steps);
 	Trajectory_Point OneStep(int pointId); //moves the beam by dL length from the i-th calculated point
-	void CalcPointProperties(int pointId); //calculates magnetic field, sigma values, etc. for a trajectory point
-	bool isOutsideBoundaries(Vector3d a,bool recalcDirs);
+	void CalcPointField(int pointId); //magnetic field, bending radius and local base of a trajectory point, needed by the next step
+	void CalcPointBeam(int pointId); //lattice functions, emittance and sigma values of a trajectory point, independent of the other points
+	void BuildLatticeTable(); //Copies latticeFunctions into the flat table below, once per trajectory
+	void InterpolateLattice(const double& coordinate, double* values) const; //The 6 lattice values at coordinate, clamped to the first and last line of the table
+	bool isOutsideBoundaries(const Vector3d& a);
 	void LoadPAR(FileReader *file);
 	void LoadParam(FileReader *f);
+	void LoadFile(const std::string& fileName); //.par or .param by extension, throws Error. Doesn't touch the interface, can run on any thread
 	Distribution2D LoadMAGFile(FileReader *file,Vector3d *dir,double *period,double *phase,int mode);
 	int LoadBXY(const std::string& fileName); //Throws error
 	void Render(const size_t& regionId, const size_t& dispNumTraj, GLMATERIAL *B_material, const double& vectorLength);
@@ -83,4 +90,7 @@ public:
     }*/
 };
 
+//Loads region files on all cores, regions[i] and errors[i] (empty if loaded) for fileNames[i]
+void LoadRegionFiles(const std::vector<std::string>& fileNames, std::vector<Region_full>& regions, std::vector<std::string>& errors);
+
 #endif
\ No newline at end of file
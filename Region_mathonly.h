@@ -99,6 +99,15 @@ struct RegionParams {
     }
 };
 
+class SpectrumFactors { //Energy-range constants of photon generation for a given critical energy, see CalculateSpectrumFactors()
+public:
+	double critical_energy; //[eV], on the nominal orbit when precalculated
+	double log10LoEnergyRatio, log10HiEnergyRatio; //log10 of the region energy limits in critical energy units
+	double interpFluxLo, interpFluxHi, interpPowerLo, interpPowerHi; //integral_N_photons and integral_SR_power at the energy limits
+	double B_factor, B_factor_power; //part of all photons (power) emitted between the energy limits
+	double average_photon_energy; //average photon energy between the energy limits, in critical energy units
+};
+
 class Region_mathonly { //Beam trajectory
 public:
 	RegionParams params; //everything except distributions (Plain Old Data)
@@ -111,6 +120,7 @@ public:
 
 	//Calculated data
 	std::vector<Trajectory_Point> Points;
+	std::vector<SpectrumFactors> spectrumFactors; //One per trajectory point, filled on load by PrecalculateSpectrumFactors(). Not serialized
 
 	//Methods
 	Region_mathonly();
@@ -0,0 +1,109 @@
+/*
+Program:     MolFlow+ / Synrad+
+Description: Monte Carlo simulator for ultra-high vacuum and synchrotron radiation
+Authors:     Jean-Luc PONS / Roberto KERSEVAN / Marton ADY
+Copyright:   E.S.R.F / CERN
+Website:     https://cern.ch/molflow
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
+*/
+#pragma once
+
+//Binary result section of .syn files (version 11+, resultFormat 1), appended after the text part:
+//one chunk per facet and result type, then an index of the chunks and a fixed-size footer at the very end of the file,
+//so that a reader finds every chunk without parsing the text part and can decode them independently
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring> //memcpy
+#include <vector>
+
+#define RESULT_CHUNK_MAGIC   0x52535953 //"SYSR" in memory
+#define RESULT_CHUNK_VERSION 1 //Increase on any layout change, readers refuse other versions
+
+#define RESULT_FORMAT_TEXT   0 //Profiles, spectrums and textures as text after the facets (versions up to 10, interchange)
+#define RESULT_FORMAT_CHUNKS 1 //Binary chunks after the text part
+
+enum ResultChunkType {
+	RESULT_CHUNK_TEXTURE_LIMITS, //ResultTextureLimits, 1, not bound to a facet
+	RESULT_CHUNK_PROFILE,        //ProfileSlice, PROFILE_SIZE
+	RESULT_CHUNK_TEXTURE,        //TextureCell, width*height, per area as in the hits buffer
+	RESULT_CHUNK_SPECTRUM        //ProfileSlice, SPECTRUM_SIZE
+};
+
+enum ResultChunkEncoding {
+	RESULT_ENCODING_RAW,    //Bytes of the hits buffer
+	RESULT_ENCODING_ZERORUN //64-bit words, runs of zero words collapsed, see EncodeZeroRuns()
+};
+
+struct ResultChunkEntry {
+	uint32_t type, encoding;
+	uint64_t facetId; //0-based
+	uint64_t offset; //From the start of the file
+	uint64_t storedSize, rawSize; //Bytes in the file, bytes once decoded
+	uint64_t elementSize; //Checked against the reader's types
+	uint64_t width, height; //Elements per row and rows when saved: texture dimensions, or count*1 for the other types
+};
+
+struct ResultChunkFooter { //Last bytes of the file
+	uint64_t indexOffset; //From the start of the file, nbChunks ResultChunkEntry
+	uint64_t nbChunks;
+	uint32_t version;
+	uint32_t magic;
+};
+
+struct ResultTextureLimits {
+	uint64_t minCount, maxCount;
+	double minFlux, maxFlux, minPower, maxPower;
+};
+
+//Zero-run coding: tokens of (count << 1 | isZeroRun), a literal token is followed by its count words
+//Textures of long runs are mostly empty cells, other chunks are left raw when coding doesn't pay off
+
+inline void EncodeZeroRuns(const uint64_t* words, const size_t& nbWords, std::vector<uint64_t>& out) {
+	out.clear();
+	size_t i = 0;
+	while (i < nbWords) {
+		size_t runEnd = i;
+		while (runEnd < nbWords && words[runEnd] == 0) runEnd++;
+		if (runEnd - i >= 2) {
+			out.push_back(((uint64_t)(runEnd - i) << 1) | 1);
+			i = runEnd;
+			continue;
+		}
+		size_t literalEnd = i; //Up to the next pair of zero words
+		while (literalEnd < nbWords && !(words[literalEnd] == 0 && literalEnd + 1 < nbWords && words[literalEnd + 1] == 0)) literalEnd++;
+		out.push_back((uint64_t)(literalEnd - i) << 1);
+		out.insert(out.end(), words + i, words + literalEnd);
+		i = literalEnd;
+	}
+}
+
+inline bool DecodeZeroRuns(const uint64_t* in, const size_t& nbIn, uint64_t* words, const size_t& nbWords) { //False if the input doesn't decode to exactly nbWords
+	size_t i = 0, w = 0;
+	while (i < nbIn) {
+		uint64_t token = in[i++];
+		uint64_t count = token >> 1;
+		if (count > nbWords - w) return false;
+		if (token & 1) {
+			memset(words + w, 0, count * sizeof(uint64_t));
+		}
+		else {
+			if (count > nbIn - i) return false;
+			memcpy(words + w, in + i, count * sizeof(uint64_t));
+			i += count;
+		}
+		w += count;
+	}
+	return w == nbWords;
+}
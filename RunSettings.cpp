@@ -0,0 +1,377 @@
+/*
+Program:     MolFlow+ / Synrad+
+Description: Monte Carlo simulator for ultra-high vacuum and synchrotron radiation
+Authors:     Jean-Luc PONS / Roberto KERSEVAN / Marton ADY
+Copyright:   E.S.R.F / CERN
+Website:     https://cern.ch/molflow
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
+*/
+#include "RunSettings.h"
+#include "LoaderFormat.h"
+#include "Buffer_shared.h" //PROFILE_SIZE
+#include <thread>
+#include <algorithm> //std::max
+#include <cstdlib> //strtol
+#include <cstring> //strcmp
+#include <cmath> //HUGE_VAL
+
+#define MAX_LISTED_ID 0xFFFFFFFF //Facet and structure lists: larger ids are refused, they would only allocate flags
+
+bool EnergyBandEdges::Set(const std::vector<double>& bandEdges) {
+	if (bandEdges.empty() || bandEdges.size() > MAX_BAND_EDGES) return false;
+	for (size_t i = 1; i < bandEdges.size(); i++) {
+		if (!(bandEdges[i] > bandEdges[i - 1])) return false;
+	}
+	for (size_t i = 0; i < MAX_BAND_EDGES; i++) {
+		edges[i] = (i < bandEdges.size()) ? bandEdges[i] : HUGE_VAL; //Never reached: GetBand() stops counting at the last edge
+	}
+	nbBands = bandEdges.size() + 1;
+	return true;
+}
+
+size_t RunSettings::GetThreadCount(const size_t& nbProcess) const {
+	if (nbThreads > 0) return nbThreads;
+	size_t nbCores = (size_t)std::thread::hardware_concurrency();
+	return std::max(nbCores / std::max(nbProcess, (size_t)1), (size_t)1);
+}
+
+static size_t CountFlags(const std::vector<bool>& flags) {
+	return (size_t)std::count(flags.begin(), flags.end(), true);
+}
+
+static void CopyIdSection(void* buffer, const LoaderHeader& header, const LoaderSectionId& id, const std::vector<bool>& flags) {
+	uint64_t* ids = LoaderSectionData<uint64_t>(buffer, header, id);
+	for (size_t i = 0; i < flags.size(); i++) {
+		if (flags[i]) *ids++ = i;
+	}
+}
+
+static bool ReadIdSection(const void* buffer, const LoaderSectionId& id, std::vector<bool>& flags) {
+	size_t count;
+	const uint64_t* ids = GetLoaderSection<uint64_t>(buffer, id, count);
+	if (!ids) return false;
+	flags.clear();
+	for (size_t i = 0; i < count; i++) {
+		if (ids[i] >= MAX_LISTED_ID) return false;
+		if (ids[i] >= flags.size()) flags.resize((size_t)ids[i] + 1, false);
+		flags[(size_t)ids[i]] = true;
+	}
+	return true;
+}
+
+void RunSettings::SetLoaderSections(LoaderHeader& header) const {
+	SetLoaderSection(header, LOADER_RUN_SETTINGS, 1, sizeof(LoaderRunSettings));
+	SetLoaderSection(header, LOADER_SPLIT_FACETS, CountFlags(splitFacets), sizeof(uint64_t));
+	SetLoaderSection(header, LOADER_SPLIT_STRUCTURES, CountFlags(splitStructures), sizeof(uint64_t));
+	SetLoaderSection(header, LOADER_PRECISION_TARGETS, precisionTargets.size(), sizeof(LoaderPrecisionTarget));
+	SetLoaderSection(header, LOADER_TALLY_FACETS, CountFlags(tallyFacets), sizeof(uint64_t));
+	size_t nbBandFacets = 0, nbEdges = 0;
+	for (auto& bands : energyBands) {
+		if (bands.nbBands == 0) continue;
+		nbBandFacets++;
+		nbEdges += bands.nbBands - 1;
+	}
+	SetLoaderSection(header, LOADER_ENERGY_BANDS, nbBandFacets, sizeof(LoaderEnergyBands));
+	SetLoaderSection(header, LOADER_BAND_EDGES, nbEdges, sizeof(double));
+}
+
+void RunSettings::CopyToLoader(void* buffer, const LoaderHeader& header) const {
+	LoaderRunSettings* settings = LoaderSectionData<LoaderRunSettings>(buffer, header, LOADER_RUN_SETTINGS);
+	settings->nbThreads = nbThreads;
+	settings->fluxWeightedSources = fluxWeightedSources ? 1 : 0;
+	settings->wavefrontSize = wavefrontSize;
+	settings->rouletteSurvivalWeight = rouletteSurvivalWeight;
+	settings->splitFactor = splitFactor;
+	settings->texturePoolMB = texturePoolMB;
+	CopyIdSection(buffer, header, LOADER_SPLIT_FACETS, splitFacets);
+	CopyIdSection(buffer, header, LOADER_SPLIT_STRUCTURES, splitStructures);
+	LoaderPrecisionTarget* targets = LoaderSectionData<LoaderPrecisionTarget>(buffer, header, LOADER_PRECISION_TARGETS);
+	for (size_t i = 0; i < precisionTargets.size(); i++) {
+		const PrecisionTarget& target = precisionTargets[i];
+		targets[i].facetId = target.facetId;
+		targets[i].quantity = (uint64_t)target.quantity;
+		targets[i].u0 = target.u0;
+		targets[i].v0 = target.v0;
+		targets[i].u1 = target.u1;
+		targets[i].v1 = target.v1;
+		targets[i].relativeError = target.relativeError;
+	}
+	CopyIdSection(buffer, header, LOADER_TALLY_FACETS, tallyFacets);
+	LoaderEnergyBands* bandFacets = LoaderSectionData<LoaderEnergyBands>(buffer, header, LOADER_ENERGY_BANDS);
+	double* edges = LoaderSectionData<double>(buffer, header, LOADER_BAND_EDGES);
+	size_t nbEdges = 0;
+	for (size_t i = 0; i < energyBands.size(); i++) {
+		const EnergyBandEdges& bands = energyBands[i];
+		if (bands.nbBands == 0) continue;
+		bandFacets->facetId = i;
+		bandFacets->recordTexture = bands.recordTexture ? 1 : 0;
+		bandFacets->edges.first = nbEdges;
+		bandFacets->edges.count = bands.nbBands - 1;
+		for (size_t e = 0; e < bands.nbBands - 1; e++) edges[nbEdges++] = bands.edges[e];
+		bandFacets++;
+	}
+}
+
+bool RunSettings::ReadFromLoader(const void* buffer) {
+	size_t count;
+	const LoaderRunSettings* settings = GetLoaderSection<LoaderRunSettings>(buffer, LOADER_RUN_SETTINGS, count);
+	if (!settings || count != 1) return false;
+	nbThreads = (size_t)settings->nbThreads;
+	fluxWeightedSources = (settings->fluxWeightedSources != 0);
+	wavefrontSize = std::max((size_t)settings->wavefrontSize, (size_t)1);
+	if (!(settings->rouletteSurvivalWeight >= 0.0)) return false;
+	rouletteSurvivalWeight = settings->rouletteSurvivalWeight;
+	splitFactor = std::max((size_t)settings->splitFactor, (size_t)1);
+	texturePoolMB = std::max((size_t)settings->texturePoolMB, (size_t)1);
+	if (!ReadIdSection(buffer, LOADER_SPLIT_FACETS, splitFacets) || !ReadIdSection(buffer, LOADER_SPLIT_STRUCTURES, splitStructures)) return false;
+
+	//Facets and texture cells are checked against the geometry by PrecisionMonitor::Initialize()
+	const LoaderPrecisionTarget* targets = GetLoaderSection<LoaderPrecisionTarget>(buffer, LOADER_PRECISION_TARGETS, count);
+	if (!targets) return false;
+	precisionTargets.resize(count);
+	for (size_t i = 0; i < count; i++) {
+		if (targets[i].quantity > PRECISION_PEAK_DENSITY || !(targets[i].relativeError > 0.0)) return false;
+		PrecisionTarget& target = precisionTargets[i];
+		target = PrecisionTarget();
+		target.facetId = (size_t)targets[i].facetId;
+		target.quantity = (int)targets[i].quantity;
+		target.u0 = (size_t)targets[i].u0;
+		target.v0 = (size_t)targets[i].v0;
+		target.u1 = (size_t)targets[i].u1;
+		target.v1 = (size_t)targets[i].v1;
+		target.relativeError = targets[i].relativeError;
+	}
+	if (!ReadIdSection(buffer, LOADER_TALLY_FACETS, tallyFacets)) return false;
+
+	//Edges checked again by EnergyBandEdges::Set(), bands of facets past the geometry are ignored
+	const LoaderEnergyBands* bandFacets = GetLoaderSection<LoaderEnergyBands>(buffer, LOADER_ENERGY_BANDS, count);
+	size_t nbEdges;
+	const double* edges = GetLoaderSection<double>(buffer, LOADER_BAND_EDGES, nbEdges);
+	if (!bandFacets || !edges) return false;
+	energyBands.clear();
+	for (size_t i = 0; i < count; i++) {
+		const LoaderEnergyBands& bands = bandFacets[i];
+		if (bands.facetId >= MAX_LISTED_ID || !InLoaderSection(bands.edges, nbEdges)) return false;
+		EnergyBandEdges bandEdges;
+		if (!bandEdges.Set(std::vector<double>(edges + bands.edges.first, edges + bands.edges.first + bands.edges.count))) return false;
+		bandEdges.recordTexture = (bands.recordTexture != 0);
+		if (bands.facetId >= energyBands.size()) energyBands.resize((size_t)bands.facetId + 1);
+		energyBands[(size_t)bands.facetId] = bandEdges;
+	}
+	return true;
+}
+
+size_t TallyLayout::Set(const size_t& startOffset, const size_t& tags, const bool& isProfile, const size_t& width, const size_t& height,
+	const size_t& bands, const bool& withBandTexture) {
+	offset = startOffset;
+	nbTags = tags;
+	profileSize = isProfile ? PROFILE_SIZE : 0;
+	texWidth = width;
+	texHeight = height;
+	nbBands = bands;
+	bandTexture = withBandTexture && texWidth > 0;
+	return GetEndOffset();
+}
+
+size_t TallyLayout::GetBlockSize() const {
+	return (1 + profileSize) * sizeof(ProfileSlice) + texWidth * texHeight * sizeof(TextureCell);
+}
+
+size_t TallyLayout::GetBandBlockSize() const {
+	return sizeof(ProfileSlice) + (bandTexture ? texWidth * texHeight * sizeof(TextureCell) : 0);
+}
+
+static const char* bounceNames[NB_BOUNCE_BUCKETS] = { "0", "1", "2+" };
+
+static bool IsTagHit(const TallyLayout& layout, const BYTE* buffer, const size_t& tag) {
+	const ProfileSlice& total = *layout.GetTotal(buffer, tag);
+	return total.count_incident > 0 || total.count_absorbed > 0;
+}
+
+static void WritePowerDensity(FILE* f, const TextureCell* texture, const size_t& width, const size_t& height) {
+	//Rows along u like the interface's texture export
+	for (size_t u = 0; u < width; u++) {
+		for (size_t v = 0; v < height; v++) {
+			fprintf(f, "%g", texture[u + v * width].power * 0.01);
+			if (v < height - 1) fprintf(f, "\t");
+		}
+		fprintf(f, "\n");
+	}
+	fprintf(f, "\n");
+}
+
+void WriteTallyTable(FILE* f, const BYTE* buffer, const std::vector<TallyLayout>& layouts) {
+	fprintf(f, "Tallied_facet\tRegion\tBounces\tMC_hits\tFlux_inc(ph/s)\tFlux_abs(ph/s)\tPower_inc(W)\tPower_abs(W)\n");
+	for (size_t i = 0; i < layouts.size(); i++) {
+		for (size_t tag = 0; tag < layouts[i].nbTags; tag++) {
+			if (!IsTagHit(layouts[i], buffer, tag)) continue;
+			const ProfileSlice& total = *layouts[i].GetTotal(buffer, tag);
+			fprintf(f, "%zd\t%zd\t%s\t%zd\t%g\t%g\t%g\t%g\n", i + 1, tag / NB_BOUNCE_BUCKETS + 1, bounceNames[tag % NB_BOUNCE_BUCKETS],
+				total.count_incident, total.flux_incident, total.flux_absorbed, total.power_incident, total.power_absorbed);
+		}
+	}
+}
+
+void WriteTallyTextures(FILE* f, const BYTE* buffer, const std::vector<TallyLayout>& layouts) {
+	for (size_t i = 0; i < layouts.size(); i++) {
+		const TallyLayout& layout = layouts[i];
+		if (layout.texWidth == 0) continue;
+		for (size_t tag = 0; tag < layout.nbTags; tag++) {
+			if (!IsTagHit(layout, buffer, tag)) continue;
+			fprintf(f, "FACET%zd REGION%zd BOUNCES%s\n", i + 1, tag / NB_BOUNCE_BUCKETS + 1, bounceNames[tag % NB_BOUNCE_BUCKETS]);
+			WritePowerDensity(f, layout.GetTexture(buffer, tag), layout.texWidth, layout.texHeight);
+		}
+	}
+}
+
+void WriteBandTable(FILE* f, const BYTE* buffer, const std::vector<TallyLayout>& layouts, const std::vector<EnergyBandEdges>& energyBands) {
+	fprintf(f, "Band_facet\tEnergy_from(eV)\tEnergy_to(eV)\tMC_hits\tFlux_inc(ph/s)\tFlux_abs(ph/s)\tPower_inc(W)\tPower_abs(W)\n");
+	for (size_t i = 0; i < layouts.size() && i < energyBands.size(); i++) {
+		const EnergyBandEdges& edges = energyBands[i];
+		for (size_t b = 0; b < layouts[i].nbBands; b++) {
+			double from = (b > 0) ? edges.edges[b - 1] : 0.0;
+			double to = (b < layouts[i].nbBands - 1) ? edges.edges[b] : HUGE_VAL;
+			const ProfileSlice& total = *layouts[i].GetBandTotal(buffer, b);
+			fprintf(f, "%zd\t%g\t%g\t%zd\t%g\t%g\t%g\t%g\n", i + 1, from, to,
+				total.count_incident, total.flux_incident, total.flux_absorbed, total.power_incident, total.power_absorbed);
+		}
+	}
+}
+
+void WriteBandTextures(FILE* f, const BYTE* buffer, const std::vector<TallyLayout>& layouts) {
+	for (size_t i = 0; i < layouts.size(); i++) {
+		const TallyLayout& layout = layouts[i];
+		if (!layout.bandTexture) continue;
+		for (size_t b = 0; b < layout.nbBands; b++) {
+			fprintf(f, "FACET%zd BAND%zd\n", i + 1, b + 1);
+			WritePowerDensity(f, layout.GetBandTexture(buffer, b), layout.texWidth, layout.texHeight);
+		}
+	}
+}
+
+bool ParseIdList(const char* list, std::vector<bool>& flags) {
+	//"3,7,12": flags[2], flags[6] and flags[11] set. Spaces allowed, an empty list sets nothing
+	flags.clear();
+	const char* p = list;
+	while (*p == ' ') p++;
+	while (*p) {
+		char* end;
+		long id = strtol(p, &end, 10);
+		if (end == p || id < 1 || (unsigned long)id > MAX_LISTED_ID) return false;
+		if ((size_t)id > flags.size()) flags.resize((size_t)id, false);
+		flags[id - 1] = true;
+		for (p = end; *p == ' '; p++);
+		if (*p == ',') p++;
+		else if (*p) return false;
+		while (*p == ' ') p++;
+	}
+	return true;
+}
+
+std::string FormatIdList(const std::vector<bool>& flags) {
+	std::string list;
+	for (size_t i = 0; i < flags.size(); i++) {
+		if (!flags[i]) continue;
+		if (!list.empty()) list += ",";
+		list += std::to_string(i + 1);
+	}
+	return list;
+}
+
+bool ParsePrecisionTargets(const char* list, std::vector<PrecisionTarget>& targets) {
+	targets.clear();
+	std::string specs(list);
+	size_t start = 0;
+	while (start <= specs.size()) {
+		size_t end = specs.find(';', start);
+		if (end == std::string::npos) end = specs.size();
+		std::string spec = specs.substr(start, end - start);
+		size_t first = spec.find_first_not_of(' ');
+		if (first != std::string::npos) {
+			PrecisionTarget target;
+			if (!target.Parse(spec.c_str() + first)) return false;
+			targets.push_back(target);
+		}
+		start = end + 1;
+	}
+	return true;
+}
+
+std::string FormatPrecisionTargets(const std::vector<PrecisionTarget>& targets) {
+	std::string list;
+	for (auto& target : targets) {
+		if (!list.empty()) list += "; ";
+		list += target.GetSpec();
+	}
+	return list;
+}
+
+bool AddEnergyBands(const char* spec, std::vector<EnergyBandEdges>& energyBands) {
+	//FACET:E1,E2,...[:texture], edges in eV, increasing: bands below E1, E1..E2, ..., above the last edge
+	long facet = strtol(spec, NULL, 10);
+	const char* p = strchr(spec, ':');
+	if (facet < 1 || (unsigned long)facet > MAX_LISTED_ID || !p) return false;
+	std::vector<double> edges;
+	char* end;
+	for (p++; *p && *p != ':';) {
+		edges.push_back(strtod(p, &end));
+		if (end == p) return false;
+		p = end;
+		if (*p == ',') p++;
+	}
+	EnergyBandEdges bandEdges;
+	if (!bandEdges.Set(edges)) return false;
+	if (*p == ':') {
+		if (strcmp(p + 1, "texture") != 0) return false;
+		bandEdges.recordTexture = true;
+	}
+	if ((size_t)facet > energyBands.size()) energyBands.resize((size_t)facet);
+	energyBands[facet - 1] = bandEdges;
+	return true;
+}
+
+bool ParseEnergyBands(const char* list, std::vector<EnergyBandEdges>& energyBands) {
+	energyBands.clear();
+	std::string specs(list);
+	size_t start = 0;
+	while (start <= specs.size()) {
+		size_t end = specs.find(';', start);
+		if (end == std::string::npos) end = specs.size();
+		std::string spec = specs.substr(start, end - start);
+		size_t first = spec.find_first_not_of(' ');
+		if (first != std::string::npos) {
+			size_t last = spec.find_last_not_of(' ');
+			if (!AddEnergyBands(spec.substr(first, last + 1 - first).c_str(), energyBands)) return false;
+		}
+		start = end + 1;
+	}
+	return true;
+}
+
+std::string FormatEnergyBands(const std::vector<EnergyBandEdges>& energyBands) {
+	std::string list;
+	char tmp[32];
+	for (size_t i = 0; i < energyBands.size(); i++) {
+		const EnergyBandEdges& bands = energyBands[i];
+		if (bands.nbBands == 0) continue;
+		if (!list.empty()) list += "; ";
+		list += std::to_string(i + 1) + ":";
+		for (size_t e = 0; e < bands.nbBands - 1; e++) {
+			sprintf(tmp, (e > 0) ? ",%.10g" : "%.10g", bands.edges[e]);
+			list += tmp;
+		}
+		if (bands.recordTexture) list += ":texture";
+	}
+	return list;
+}
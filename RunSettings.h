@@ -0,0 +1,126 @@
+/*
+Program:     MolFlow+ / Synrad+
+Description: Monte Carlo simulator for ultra-high vacuum and synchrotron radiation
+Authors:     Jean-Luc PONS / Roberto KERSEVAN / Marton ADY
+Copyright:   E.S.R.F / CERN
+Website:     https://cern.ch/molflow
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
+*/
+#pragma once
+
+//Simulation run settings: chosen in Global Settings and sent to the subprocesses with the geometry, in the loader buffer
+//(LOADER_RUN_SETTINGS and the sections after it). synradCLI reads them from an exported input, its options override them
+
+#include <cstddef>
+#include <cstdio>
+#include <vector>
+#include <string>
+#include "SynradTypes.h" //ProfileSlice, TextureCell
+#include "PrecisionMonitor.h" //PrecisionTarget
+#include "TextureTiles.h" //DEFAULT_TEXTURE_POOL_MB
+
+#define NB_BOUNCE_BUCKETS 3 //Tagged tallies: photons not reflected yet, reflected once, reflected twice or more
+#define MAX_BAND_EDGES 15 //Energy band tallies: up to 16 bands per facet
+
+struct LoaderHeader;
+
+//Energy band edges of one facet: band b is edges[b-1] <= energy < edges[b], the bands below the first and above the last edge included
+class EnergyBandEdges {
+public:
+	double edges[MAX_BAND_EDGES]; //Increasing, the unused ones +infinity
+	size_t nbBands = 0; //0: no energy bands on this facet
+	bool recordTexture = false; //Power, flux and hits texture per band (textured facets only)
+
+	bool Set(const std::vector<double>& bandEdges); //false if not increasing or too many
+	size_t GetBand(const double& energy) const {
+		//Edges at or below the energy, counted over the fixed size array: no search, no branch, the loop vectorizes
+		size_t band = 0;
+		for (size_t i = 0; i < MAX_BAND_EDGES; i++) band += (energy >= edges[i]);
+		return band;
+	}
+};
+
+class RunSettings {
+public:
+	size_t nbThreads = 0; //Simulation threads per subprocess, 0: the cores shared between the subprocesses
+	bool fluxWeightedSources = false; //Sample source points by their flux instead of uniformly
+	size_t wavefrontSize = 1; //Particles traced together per thread, 1: one at a time
+	size_t texturePoolMB = DEFAULT_TEXTURE_POOL_MB; //Hits dataport space for the texture and direction tiles hit so far (TexturePoolLayout::Set())
+
+	//Variance reduction
+	double rouletteSurvivalWeight = 0.0; //Low flux mode: weight of the photons surviving the Russian roulette, 0: 10x the cutoff
+	size_t splitFactor = 1; //Low flux mode: copies a photon becomes when it leaves a splitting facet or enters a splitting structure, 1: no splitting
+	std::vector<bool> splitFacets; //By facet index, may be shorter than the facet list
+	std::vector<bool> splitStructures; //By structure index, may be shorter than the structure list
+
+	std::vector<PrecisionTarget> precisionTargets; //The run stops once all are reached
+
+	std::vector<bool> tallyFacets; //By facet index: hits split by source region and bounce bucket (GetTallyTag()), may be shorter than the facet list
+	bool IsTallied(const size_t& facetId) const { return facetId < tallyFacets.size() && tallyFacets[facetId]; }
+	std::vector<EnergyBandEdges> energyBands; //By facet index, may be shorter than the facet list: power and flux split by photon energy
+	size_t GetNbEnergyBands(const size_t& facetId) const { return facetId < energyBands.size() ? energyBands[facetId].nbBands : 0; }
+
+	size_t GetThreadCount(const size_t& nbProcess) const; //nbThreads, or the share of the cores of each of nbProcess processes
+
+	//Loader buffer (LoaderFormat.h)
+	void SetLoaderSections(LoaderHeader& header) const; //Declares the sections, before LayoutLoader()
+	void CopyToLoader(void* buffer, const LoaderHeader& header) const;
+	bool ReadFromLoader(const void* buffer); //false if a section is malformed. Call CheckLoaderBuffer() first
+};
+
+//Tally results in the 'hits' dataport, after the last facet: facet after facet, one block per tag of every tallied facet
+//(all tags, hit or not, in GetTallyTag() order). A block is the ProfileSlice total, then the facet's profile and texture if it has them
+//The facet's energy bands follow its tags, one block per band: the total, then the texture if the bands record one
+class TallyLayout {
+public:
+	size_t offset = 0; //First block
+	size_t nbTags = 0; //0: the facet isn't tallied
+	size_t profileSize = 0; //ProfileSlice after the total
+	size_t texWidth = 0, texHeight = 0; //TextureCell after the profile, u + v*texWidth. 0 if the facet isn't textured
+	size_t nbBands = 0; //0: no energy bands on the facet
+	bool bandTexture = false; //Band blocks have a texture (textured facets only)
+
+	size_t Set(const size_t& startOffset, const size_t& tags, const bool& isProfile, const size_t& width, const size_t& height,
+		const size_t& bands, const bool& withBandTexture); //Returns the end offset
+	size_t GetBlockSize() const;
+	size_t GetBandBlockSize() const;
+	size_t GetEndOffset() const { return offset + nbTags * GetBlockSize() + nbBands * GetBandBlockSize(); }
+	ProfileSlice* GetTotal(BYTE* buffer, const size_t& tag) const { return (ProfileSlice*)(buffer + offset + tag * GetBlockSize()); }
+	ProfileSlice* GetProfile(BYTE* buffer, const size_t& tag) const { return GetTotal(buffer, tag) + 1; }
+	TextureCell* GetTexture(BYTE* buffer, const size_t& tag) const { return (TextureCell*)(GetProfile(buffer, tag) + profileSize); }
+	ProfileSlice* GetBandTotal(BYTE* buffer, const size_t& band) const { return (ProfileSlice*)(buffer + offset + nbTags * GetBlockSize() + band * GetBandBlockSize()); }
+	TextureCell* GetBandTexture(BYTE* buffer, const size_t& band) const { return (TextureCell*)(GetBandTotal(buffer, band) + 1); }
+	const ProfileSlice* GetTotal(const BYTE* buffer, const size_t& tag) const { return GetTotal((BYTE*)buffer, tag); }
+	const TextureCell* GetTexture(const BYTE* buffer, const size_t& tag) const { return GetTexture((BYTE*)buffer, tag); }
+	const ProfileSlice* GetBandTotal(const BYTE* buffer, const size_t& band) const { return GetBandTotal((BYTE*)buffer, band); }
+	const TextureCell* GetBandTexture(const BYTE* buffer, const size_t& band) const { return GetBandTexture((BYTE*)buffer, band); }
+};
+
+//Exports of the interface and synradCLI, layouts by facet index. Only the tags that hit the facet are written, all the bands are
+void WriteTallyTable(FILE* f, const BYTE* buffer, const std::vector<TallyLayout>& layouts); //Tab separated totals
+void WriteTallyTextures(FILE* f, const BYTE* buffer, const std::vector<TallyLayout>& layouts); //Power density (W/mm2) per tag of the textured facets
+void WriteBandTable(FILE* f, const BYTE* buffer, const std::vector<TallyLayout>& layouts, const std::vector<EnergyBandEdges>& energyBands);
+void WriteBandTextures(FILE* f, const BYTE* buffer, const std::vector<TallyLayout>& layouts); //Power density (W/mm2) per band
+
+//Facet or structure lists as typed in Global Settings and synradCLI: "3,7,12", numbered from 1
+bool ParseIdList(const char* list, std::vector<bool>& flags); //false if not numbers separated by commas
+std::string FormatIdList(const std::vector<bool>& flags);
+//Precision targets separated by semicolons, each as in PrecisionTarget::Parse()
+bool ParsePrecisionTargets(const char* list, std::vector<PrecisionTarget>& targets);
+std::string FormatPrecisionTargets(const std::vector<PrecisionTarget>& targets);
+//Energy bands of one facet, "FACET:E1,E2,...[:texture]" with up to MAX_BAND_EDGES increasing edges in eV, added to energyBands
+bool AddEnergyBands(const char* spec, std::vector<EnergyBandEdges>& energyBands);
+//Energy bands of several facets separated by semicolons, each as in AddEnergyBands()
+bool ParseEnergyBands(const char* list, std::vector<EnergyBandEdges>& energyBands);
+std::string FormatEnergyBands(const std::vector<EnergyBandEdges>& energyBands);
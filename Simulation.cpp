@@ -1,38 +1,19 @@
 #include "Simulation.h"
-#include "IntersectAABB_shared.h"
 #include "GLApp/MathTools.h"
-
-SuperStructure::SuperStructure()
-{
-	aabbTree = NULL;
-}
-
-SuperStructure::~SuperStructure(){
-	SAFE_DELETE(aabbTree);
-}
+#include <algorithm> //std::upper_bound
+#include <chrono>
+#include <thread>
 
 Simulation::Simulation(){
 
-	memset(&tmpGlobalResult, 0, sizeof(GlobalHitBuffer));
-	
-
-    nbLeakSinceUpdate = 0;
-
-    totalDesorbed = 0;
-
-    currentParticle.lastHitFacet = NULL;
-    currentParticle.structureId = 0;
-    currentParticle.teleportedFrom = 0;
-
     sh.nbSuper = 0;
 
     // Geometry
     nbMaterials = 0;
     sourceArea = 0;
+    fluxWeightedSources = false;
     nbDistrPoints_BXY = 0;
-    sourceRegionId = 0;
 
-    stepPerSec = 0.0;
     textTotalSize = 0;
     profTotalSize = 0;
     dirTotalSize = 0;
@@ -45,4 +26,235 @@ Simulation::Simulation(){
     wp.nbRegion = 0;
     wp.nbTrajPoints = 0;
     wp.newReflectionModel = false;
-}
\ No newline at end of file
+
+    nbThreads = 1;
+    workerPool = NULL;
+    wavefrontSize = 1;
+
+    rouletteSurvivalWeight = 0.0;
+    splitFactor = 1;
+    tallyTotalSize = 0;
+    texturePoolMB = DEFAULT_TEXTURE_POOL_MB;
+    texturePoolSize = 0;
+
+    randomSeed = 0;
+    processIndex = 0;
+    nbPhotonIndices = 0;
+}
+
+Simulation::~Simulation(){
+	SAFE_DELETE(workerPool);
+	for (auto& t : threads) SAFE_DELETE(t);
+}
+
+size_t Simulation::GetTotalDesorbed() {
+	size_t sum = 0;
+	for (auto& t : threads) sum += t->totalDesorbed;
+	return sum;
+}
+
+void Simulation::GetPhaseProfile(PhaseProfile& profile) {
+	memset(&profile, 0, sizeof(PhaseProfile));
+	double secondsPerTick = 1.0 / GetTscFrequency();
+	auto addTimer = [&](const SampledTimer& timer, const size_t& phase) {
+		profile.nbCalls[phase] += timer.nbCalls;
+		profile.nbTimedCalls[phase] += timer.nbTimedCalls;
+		profile.timedSeconds[phase] += (double)timer.timedTicks * secondsPerTick;
+	};
+	for (auto& t : threads) {
+		for (size_t phase = 0; phase < NB_PROFILE_PHASES; phase++) addTimer(t->phaseTimers[phase], phase);
+		profile.threadSeconds += t->runSeconds;
+		profile.hitWeightSum += t->hitWeightSum;
+		profile.hitWeightSquareSum += t->hitWeightSquareSum;
+		profile.nbRouletteKills += t->nbRouletteKills;
+		profile.nbRouletteSurvivals += t->nbRouletteSurvivals;
+		profile.nbSplitCopies += t->nbSplitCopies;
+	}
+	for (size_t phase = 0; phase < NB_PROFILE_PHASES; phase++) addTimer(phaseTimers[phase], phase);
+	profile.nbThreads = threads.size();
+}
+
+uint64_t Simulation::ReservePhotonIndices(const size_t& nbPhotons) {
+	return nbPhotonIndices.fetch_add(nbPhotons); //Once per photon batch
+}
+
+uint64_t Simulation::GetPhotonIndex(const uint64_t& localIndex) const {
+	uint64_t nbProcess = (uint64_t)Max((size_t)ontheflyParams.nbProcess, (size_t)1);
+	return localIndex * nbProcess + processIndex;
+}
+
+// gsl_rng type reading a PhotonStream: the existing samplers keep taking a gsl_rng*
+
+typedef struct {
+	PhotonStream* stream; //Stream read by the generator
+	PhotonStream ownStream; //Until SetPhotonStream() is called
+} PhotonStreamRngState;
+
+static void PhotonStreamRngSet(void* vstate, unsigned long int seed) {
+	PhotonStreamRngState* state = (PhotonStreamRngState*)vstate;
+	state->ownStream.Set((uint64_t)seed, 0, PHOTON_STREAM_TRACE);
+	state->stream = &state->ownStream;
+}
+
+static unsigned long int PhotonStreamRngGet(void* vstate) {
+	return ((PhotonStreamRngState*)vstate)->stream->Next();
+}
+
+static double PhotonStreamRngGetDouble(void* vstate) {
+	return ((double)((PhotonStreamRngState*)vstate)->stream->Next()) / 4294967296.0; //[0,1) as gsl_rng_uniform() expects
+}
+
+static const gsl_rng_type photonStreamRngType = {
+	"philox4x32", 0xFFFFFFFFUL, 0, sizeof(PhotonStreamRngState),
+	&PhotonStreamRngSet, &PhotonStreamRngGet, &PhotonStreamRngGetDouble
+};
+
+gsl_rng* AllocPhotonStreamRng() {
+	return gsl_rng_alloc(&photonStreamRngType);
+}
+
+void SetPhotonStream(gsl_rng* gen, PhotonStream* stream) {
+	((PhotonStreamRngState*)gen->state)->stream = stream;
+}
+
+double GetTscFrequency() {
+	static const double ticksPerSecond = [] {
+		auto t0 = std::chrono::steady_clock::now();
+		uint64_t tsc0 = ReadTsc();
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		uint64_t tsc1 = ReadTsc();
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+		return (double)(tsc1 - tsc0) / seconds;
+	}();
+	return ticksPerSecond;
+}
+
+SimulationThread::SimulationThread(Simulation* model, const size_t& threadId) {
+
+	this->model = model;
+	this->threadId = threadId;
+
+	memset(&tmpGlobalResult, 0, sizeof(GlobalHitBuffer));
+
+    nbLeakSinceUpdate = 0;
+
+    totalDesorbed = 0;
+    desorptionLimit = 0;
+    finished = false;
+
+    currentParticle.lastHitFacet = NULL;
+    currentParticle.structureId = 0;
+    currentParticle.sourceRegionId = 0;
+    currentParticle.teleportedFrom = 0;
+    currentParticle.photonIndex = 0;
+    currentParticle.splitGeneration = 0;
+    currentParticle.splitWeight = 1.0;
+    currentParticle.nbSplits = 0;
+    distTraveledSinceUpdate = 0.0;
+    currentSlot = 0;
+
+    stepPerSec = 0.0;
+    allocationsLastStep = 0;
+    runSeconds = 0.0;
+    hitWeightSum = hitWeightSquareSum = 0.0;
+    nbRouletteKills = nbRouletteSurvivals = nbSplitCopies = 0;
+    particleRestarted = false;
+    //Sampling periods: per photon batch for generation, one call in 16 or 64 for the per-bounce phases
+    phaseTimers[PHASE_INTERSECT] = SampledTimer(64);
+    phaseTimers[PHASE_MATERIAL] = SampledTimer(16);
+    phaseTimers[PHASE_SCATTERING] = SampledTimer(16);
+    phaseTimers[PHASE_RECORDING] = SampledTimer(64);
+    gen = NULL;
+
+    photonBatch.Resize(PHOTON_BATCH_SIZE);
+}
+
+SimulationThread::~SimulationThread(){
+	if (gen) gsl_rng_free(gen);
+}
+
+void SourceSampler::Build(const std::vector<Region_mathonly>& regions, const bool& fluxWeighted) {
+	Clear();
+	size_t nbPoints = 0;
+	for (auto& reg : regions) {
+		regionFirstPoint.push_back(nbPoints);
+		nbPoints += reg.Points.size();
+	}
+	if (nbPoints == 0) return;
+
+	//Probability of each point
+	std::vector<double> probability(nbPoints, 1.0 / (double)nbPoints);
+	if (fluxWeighted) {
+		std::vector<double> flux(nbPoints, 0.0);
+		double totalFlux = 0.0;
+		for (size_t r = 0; r < regions.size(); r++) {
+			const Region_mathonly& reg = regions[r];
+			for (size_t p = 0; p < reg.spectrumFactors.size(); p++) {
+				//Nominal flux up to a constant: dL/radius*gamma*B_factor*current, with radius = 2.959905E-5*gamma^3/critical_energy
+				const SpectrumFactors& factors = reg.spectrumFactors[p];
+				double pointFlux = reg.params.dL_cm * factors.critical_energy / Sqr(reg.params.gamma) * factors.B_factor * reg.params.current_mA;
+				if (pointFlux > 0.0) { //NaN or negative would break the table
+					flux[regionFirstPoint[r] + p] = pointFlux;
+					totalFlux += pointFlux;
+				}
+			}
+		}
+		if (totalFlux > 0.0) {
+			//Keep 10% uniform: points that are dark on the nominal orbit can still emit with emittance
+			for (size_t i = 0; i < nbPoints; i++)
+				probability[i] = 0.9 * flux[i] / totalFlux + 0.1 / (double)nbPoints;
+		}
+	}
+
+	fluxCorrection.resize(nbPoints);
+	for (size_t i = 0; i < nbPoints; i++)
+		fluxCorrection[i] = 1.0 / ((double)nbPoints * probability[i]);
+
+	//Vose's construction of the alias table
+	keepProbability.resize(nbPoints);
+	alias.resize(nbPoints);
+	std::vector<size_t> small, large;
+	for (size_t i = 0; i < nbPoints; i++) {
+		keepProbability[i] = probability[i] * (double)nbPoints;
+		if (keepProbability[i] < 1.0) small.push_back(i);
+		else large.push_back(i);
+	}
+	while (!small.empty() && !large.empty()) {
+		size_t s = small.back(); small.pop_back();
+		size_t l = large.back();
+		alias[s] = l;
+		keepProbability[l] -= 1.0 - keepProbability[s];
+		if (keepProbability[l] < 1.0) {
+			large.pop_back();
+			small.push_back(l);
+		}
+	}
+	//Leftovers are 1.0 up to rounding
+	for (auto& i : large) {
+		keepProbability[i] = 1.0;
+		alias[i] = i;
+	}
+	for (auto& i : small) {
+		keepProbability[i] = 1.0;
+		alias[i] = i;
+	}
+}
+
+bool SourceSampler::Sample(gsl_rng* gen, size_t& regionId, size_t& pointId, double& correction) const {
+	if (keepProbability.empty()) return false;
+	size_t nbPoints = keepProbability.size();
+	size_t slot = Min((size_t)(gsl_rng_uniform_pos(gen) * (double)nbPoints), nbPoints - 1);
+	size_t pointIdGlobal = (gsl_rng_uniform_pos(gen) < keepProbability[slot]) ? slot : alias[slot];
+
+	regionId = std::upper_bound(regionFirstPoint.begin(), regionFirstPoint.end(), pointIdGlobal) - regionFirstPoint.begin() - 1;
+	pointId = pointIdGlobal - regionFirstPoint[regionId];
+	correction = fluxCorrection[pointIdGlobal];
+	return true;
+}
+
+void SourceSampler::Clear() {
+	keepProbability.clear();
+	alias.clear();
+	fluxCorrection.clear();
+	regionFirstPoint.clear();
+}
@@ -27,75 +27,235 @@
 #include "Region_mathonly.h"
 #include "TruncatedGaussian\rtnorm.hpp"
 #include "SynradDistributions.h"
+#include "GeneratePhoton.h"
+#include "PhotonRandom.h"
+#include "PhaseProfile.h"
+#include "PrecisionMonitor.h"
+#include "RunSettings.h" //NB_BOUNCE_BUCKETS, TallyLayout
+#include "TextureTiles.h" //TEXTURE_TILE_SIZE, TexturePoolLayout
+#include "WorkerPool.h"
 #include <tuple>
+#include <atomic>
+#ifdef WIN
+#include <intrin.h> //__rdtsc()
+#else
+#include <chrono>
+#endif
+#include <string>
+#include <cstdint>
+#include <algorithm> //std::min
+
+class Simulation;
+
+//The thread counters use the tiles of the 'hits' dataport (TextureTiles.h): same cell order, their own slots
+#define FULL_SIZE_TILE UINT32_MAX //Tile of full size cells only, no stored increments
+#define NO_TAG UINT32_MAX //Tagged tally never hit, not allocated
+
+class TaggedTally;
 
 // Local facet structure
 
 class SubprocessFacet {
 public:
 	FacetProperties sh;
-	FacetHitBuffer tmpCounter;
 
     std::vector<size_t> indices;   // Indices (Reference to geometry vertex)
     std::vector<Vector2d> vertices2; // Vertices (2D plane space, UV coordinates)
-    std::vector<TextureCell> texture;
 
     double	 fullSizeInc; // 1/Texture FULL element area
-    std::vector<double> textureCellIncrements;        // reciprocial of element area
-    std::vector<bool> largeEnough; //cells that are NOT too small for autoscaling
-    std::vector<DirectionCell>direction; // Direction field recording (average)
-	//char     *fullElem;  // Direction field recording (only on full element) (WHY???)
-    std::vector<ProfileSlice> profile;
-    Histogram spectrum;
-
-	// Temporary var (used in Intersect for collision)
-	double colDist;
-	double colU;
-	double colV;
+    //Reciprocal of element area, stored by tiles of TEXTURE_TILE_CELLS: inside a meshed facet nearly every cell is full size,
+    //so only the tiles along its border keep their own values (see GetCellIncrement())
+    std::vector<uint32_t> incrementTiles; //Per tile: slot in partialIncrements, or FULL_SIZE_TILE
+    std::vector<double> partialIncrements;
+    size_t nbIncrementTilesX; //Tiles per texture row
+
+	// Texture cell size, used by the hit recording
 	double rw;
 	double rh;
 	double iw;
 	double ih;
 
-	// Temporary var (used in FillHit for hit recording)
-	bool   hitted;
-	bool   ready;         // Volatile state
-	size_t    textureSize;   // Texture size (in bytes)
+	size_t    textureSize;   // Texture tile index size in the hits dataport (in bytes)
 	size_t    profileSize;   // profile size (in bytes)
-	size_t    directionSize; // direction field size (in bytes)
+	size_t    directionSize; // direction field tile index size (in bytes)
 	size_t    spectrumSize;  // spectrum size in bytes
 
 	size_t globalId; //Global index (to identify when superstructures are present)
 
-	void RegisterTransparentPass(); //Allows one shared Intersect routine between MolFlow and Synrad
+    bool  InitializeOnLoad(Simulation* sim, const size_t& globalId);
+
+    bool InitializeDirectionTexture(Simulation* sim);
+
+    bool InitializeProfile(Simulation* sim);
+
+    bool InitializeTexture(Simulation* sim);
+
+    bool InitializeTextureIncrements(const double* increments, const size_t& nbIncrements); //From the dense loader section, before InitializeOnLoad()
+
+    double GetCellIncrement(const size_t& u, const size_t& v) const {
+        uint32_t slot = incrementTiles[(v / TEXTURE_TILE_SIZE) * nbIncrementTilesX + u / TEXTURE_TILE_SIZE];
+        if (slot == FULL_SIZE_TILE) return fullSizeInc;
+        return partialIncrements[(size_t)slot * TEXTURE_TILE_CELLS + (v % TEXTURE_TILE_SIZE) * TEXTURE_TILE_SIZE + u % TEXTURE_TILE_SIZE];
+    }
+
+    bool IsLargeEnough(const double& cellIncrement) const { //Cell NOT too small for autoscaling
+        return cellIncrement < 5.0 * fullSizeInc;
+    }
+
+    bool InitializeSpectrum(Simulation* sim);
+
+    bool InitializeLinkAndVolatile(Simulation* sim, const size_t & id);
+};
+
+//Hit accumulators of one facet, owned by one simulation thread
+//Kept apart from SubprocessFacet so that the geometry can be shared read-only between threads
+//Texture and direction cells live in tiles of TEXTURE_TILE_CELLS, allocated on the first hit of the tile and released by Reset():
+//a finely meshed facet costs memory only where photons actually landed since the last hit update
+class FacetHitState {
+public:
+	FacetHitBuffer tmpCounter;
+	std::vector<ProfileSlice> profile;
+	Histogram spectrum;
+	bool hitted;
+
+	size_t texWidth, texHeight; //Cells of the texture and direction field (0 if the facet has neither)
+	size_t nbTilesX; //Tiles per texture row
+	bool hasTexture, hasDirection;
+	std::vector<uint32_t> tileSlots; //Per tile: slot in the pools below, or NO_TILE
+	std::vector<uint32_t> usedTiles; //Tile of each allocated slot, in slot order
+	std::vector<TextureCell> textureTiles; //TEXTURE_TILE_CELLS per slot, cell (u%8)+(v%8)*8 of the tile
+	std::vector<DirectionCell> directionTiles; // Direction field recording (average), same slots
+
+	//Tagged tallies (facets of Simulation::tallyFacets): the same hits split by source region and bounce bucket, see GetTallyTag()
+	//A tag is allocated on its first hit on the facet, then Reset() zeroes it but keeps it
+	std::vector<uint32_t> tagSlots; //Per tag: position in 'tagged', or NO_TAG. Empty if the facet isn't tallied
+	std::vector<TaggedTally> tagged;
+
+	//Energy band tallies (facets with Simulation::energyBands): one per band, tag = band index, allocated with the facet
+	std::vector<TaggedTally> bands;
+
+	bool Initialize(const SubprocessFacet& f, const std::vector<Region_mathonly>& regions);
+	void InitializeTagging(const size_t& nbTags);
+	void InitializeBands(const size_t& nbBands, const bool& withTexture);
+	void InitializeTagCells(const FacetHitState& facetState, const bool& withProfile, const bool& withTexture); //Layout of the facet, no direction field nor spectrum
+	void Add(const FacetHitState& src); //Same facet, another thread
+	void AddTagged(const FacetHitState& src); //Tagged and energy band tallies only
+	TaggedTally& GetTaggedTally(const size_t& tag); //Allocates the tag on first use
 	void ResetCounter();
-    void	ResizeCounter(size_t nbMoments);
-    bool  InitializeOnLoad(const size_t& globalId);
+	void Reset();
+
+	size_t GetTileSlot(const size_t& tile) { //Allocates the tile on first use
+		uint32_t slot = tileSlots[tile];
+		if (slot == NO_TILE) {
+			slot = (uint32_t)usedTiles.size();
+			usedTiles.push_back((uint32_t)tile);
+			if (hasTexture) textureTiles.resize(textureTiles.size() + TEXTURE_TILE_CELLS);
+			if (hasDirection) directionTiles.resize(directionTiles.size() + TEXTURE_TILE_CELLS);
+			tileSlots[tile] = slot;
+		}
+		return slot;
+	}
+
+	size_t GetCellSlot(const size_t& u, const size_t& v) { //Position of cell (u,v) in the pools, tile allocated if needed
+		size_t slot = GetTileSlot((v / TEXTURE_TILE_SIZE) * nbTilesX + u / TEXTURE_TILE_SIZE);
+		return slot * TEXTURE_TILE_CELLS + (v % TEXTURE_TILE_SIZE) * TEXTURE_TILE_SIZE + u % TEXTURE_TILE_SIZE;
+	}
+
+	template <typename CellFunction> void ForEachAllocatedCell(CellFunction cellFunction) const {
+		//Calls cellFunction(u, v, cellSlot) for every texture cell of the allocated tiles, cellSlot indexing the pools
+		for (size_t slot = 0; slot < usedTiles.size(); slot++) {
+			size_t tile = usedTiles[slot];
+			size_t u0 = (tile % nbTilesX) * TEXTURE_TILE_SIZE;
+			size_t v0 = (tile / nbTilesX) * TEXTURE_TILE_SIZE;
+			size_t u1 = std::min(u0 + TEXTURE_TILE_SIZE, texWidth);
+			size_t v1 = std::min(v0 + TEXTURE_TILE_SIZE, texHeight);
+			for (size_t v = v0; v < v1; v++) {
+				for (size_t u = u0; u < u1; u++) {
+					cellFunction(u, v, slot * TEXTURE_TILE_CELLS + (v - v0) * TEXTURE_TILE_SIZE + (u - u0));
+				}
+			}
+		}
+	}
+};
 
-    void InitializeHistogram();
+//Hits on one facet of the photons of one tag
+class TaggedTally {
+public:
+	size_t tag;
+	ProfileSlice total; //Incident and absorbed count, flux and power. Passes through transparent or link facets are incident only
+	FacetHitState cells; //Profile and texture of these photons, its counter and spectrum aren't used
+};
 
-    bool InitializeDirectionTexture();
+inline size_t GetTallyTag(const size_t& sourceRegionId, const size_t& nbBounces) {
+	return sourceRegionId * NB_BOUNCE_BUCKETS + std::min(nbBounces, (size_t)NB_BOUNCE_BUCKETS - 1);
+}
 
-    bool InitializeProfile();
+//Candidate collision found during ray tracing. Stored per thread, not in the facet, to keep Intersect() reentrant
+class FacetCollision {
+public:
+	SubprocessFacet* facet;
+	double colDist;
+	double colU;
+	double colV;
+};
 
-    bool InitializeTexture();
+//Picks the (region, point) a photon is generated from, in constant time (Walker's alias method)
+//Uniform over all trajectory points, or proportional to the nominal flux of each point
+class SourceSampler {
+public:
+	std::vector<double> keepProbability; //Probability of keeping the drawn slot instead of its alias
+	std::vector<size_t> alias;
+	std::vector<double> fluxCorrection; //(1/nbPoints)/probability of the point, multiplies the photon flux so that the result is unbiased
+	std::vector<size_t> regionFirstPoint; //Global index of the first point of each region
+
+	void Build(const std::vector<Region_mathonly>& regions, const bool& fluxWeighted);
+	bool Sample(gsl_rng* gen, size_t& regionId, size_t& pointId, double& correction) const;
+	void Clear();
+};
 
-    bool InitializeSpectrum();
+//Facet data needed to find a collision, copied out of SubprocessFacet so that tracing doesn't touch the hit recording members
+class IntersectionFacet {
+public:
+	Vector3d O, U, V, N, Nuv;
+	double opacity;
+	int reflectType;
+	bool is2sided;
+	uint32_t firstVertex, nbVertex; //Polygon in FacetBVH::vertices2 (u,v space)
+	SubprocessFacet* facet; //Returned as the collided facet
+};
 
-    bool InitializeLinkAndVolatile(const size_t & id);
+//Bounding volume hierarchy node, 32 bytes. An inner node's first child follows it, 'offset' is its second child
+struct alignas(32) BVHNode {
+	float bbMin[3], bbMax[3]; //Rounded outwards from the double precision bounds
+	uint32_t offset; //Leaf: first facet in FacetBVH::facets, inner node: index of the second child
+	uint16_t nbFacets; //0 for an inner node
+	uint16_t splitAxis; //Inner node: 0,1,2 for x,y,z, decides which child is visited first
 };
 
+#define BVH_STACK_SIZE 64 //Traversal stack entries, holds a hierarchy of depth BVH_STACK_SIZE-1
+
+//Flattened bounding volume hierarchy of a structure, built with the surface area heuristic
+class FacetBVH {
+public:
+	std::vector<BVHNode> nodes; //Depth-first order, root first
+	std::vector<IntersectionFacet> facets; //Leaf order
+	std::vector<Vector2d> vertices2; //Polygons of all facets, contiguous
+	size_t depth = 0; //Of the deepest node, the root being 0. Checked against BVH_STACK_SIZE on load
+	bool hasRandomPasses = false; //Some facet is semi-transparent or has a material: rays draw a pass key (see PassUniform())
+
+	void Build(const std::vector<SubprocessFacet*>& structureFacets, const std::vector<Vector3d>& vertices3); //Facets must not move afterwards
+	void Clear();
+};
 
-class AABBNODE;
 // Local simulation structure
 class SuperStructure {
 public:
-    SuperStructure();
-    ~SuperStructure();
-    std::vector<SubprocessFacet> facets;   // Facet handles
-	AABBNODE *aabbTree; // Structure AABB tree
+    std::vector<SubprocessFacet*> facets;   // Facet handles, universal facets are referenced from every structure
+	FacetBVH bvh; // Structure ray tracing hierarchy
 } ;
 
+#define MAX_SPLIT_GENERATIONS 3 //Successive splits of one photon's descendants, at most splitFactor^3 copies
+
 class CurrentParticleStatus {
 public:
 
@@ -106,28 +266,171 @@ public:
     double oriRatio; //Represented ratio of desorbed, used for low flux mode
 
     //Recordings for histogram
-    size_t   nbBounces; // Number of hit (current particle) since desorption
+    size_t   nbBounces; // Reflections of the current particle since generation (split copies inherit them)
     double   distanceTraveled;
-    double   distTraveledSinceUpdate;
 
     double   dF;  //Flux carried by photon
     double   dP;  //Power carried by photon
     double   energy; //energy of the generated photon
 
     size_t   structureId;        // Current structure
+    size_t   sourceRegionId;     // Region that generated the current photon
     int      teleportedFrom;   // We memorize where the particle came from: we can teleport back
     SubprocessFacet *lastHitFacet;     // Last hitted facet
-    std::vector<SubprocessFacet*> transparentHitBuffer; //Storing this buffer simulation-wide is cheaper than recreating it at every Intersect() call
+    double   colU, colV; // Local (u,v) coordinates of the collision being processed
+    uint64_t photonIndex; //Global index of the photon, with the run seed it replays the whole history
+    PhotonStream rng; //Its PHOTON_STREAM_TRACE stream, read by the thread's 'gen' (swapped along with the particle in wavefront mode)
+    size_t   splitGeneration; //Splits between the generated photon and this particle
+    double   splitWeight; //Share of the generated photon this copy stands for, (1/splitFactor)^splitGeneration. Weighs its absorptions
+    size_t   nbSplits; //Splits made by this particle, numbers the streams of its copies
+    std::vector<FacetCollision> transparentHitBuffer; //Storing this buffer thread-wide is cheaper than recreating it at every Intersect() call
 };
 
-class Simulation {
+//Fixed-size 3x3 matrix for the bounce path, rows first
+class Matrix3x3 {
 public:
-    Simulation();
-    GlobalHitBuffer tmpGlobalResult;            // Temporary number of hits (between 2 calls of UpdateMC)
+	double m[3][3];
+	Vector3d operator*(const Vector3d& v) const {
+		return Vector3d(m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+			m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+			m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+	}
+};
+
+//Phase timing with the time stamp counter: calls are counted, one start in 'period' is timed
+#ifdef WIN
+inline uint64_t ReadTsc() { return __rdtsc(); }
+#else
+inline uint64_t ReadTsc() { return (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count(); } //Ticks of the steady clock, calibrated the same way
+#endif
+double GetTscFrequency(); //Ticks per second, measured on the first call (InitSimulation())
+
+class SampledTimer {
+public:
+	SampledTimer(const size_t& period = 1) : period(period), countdown(period) {}
+	bool Start(const size_t& nbCallsNow = 1) { //nbCallsNow: calls covered by this start (rays of a packet, photons of a batch)
+		nbCalls += nbCallsNow;
+		if (--countdown != 0) return false; //No division on the hot path
+		countdown = period;
+		nbTimedCalls += nbCallsNow;
+		start = ReadTsc();
+		return true;
+	}
+	void Stop() { timedTicks += ReadTsc() - start; } //Only after a Start() that returned true
+	void Add(const uint64_t& ticks) { nbCalls++; nbTimedCalls++; timedTicks += ticks; } //Section always timed by the caller
+	void Reset() { nbCalls = nbTimedCalls = timedTicks = 0; countdown = period; }
+	uint64_t nbCalls = 0, nbTimedCalls = 0, timedTicks = 0;
+private:
+	uint64_t period, countdown, start = 0; //countdown: starts left until the next timed one
+};
+
+class PhaseScope { //Times the enclosing block when its timer samples this call
+public:
+	PhaseScope(SampledTimer& timer) : timer(timer), timed(timer.Start()) {}
+	~PhaseScope() { if (timed) timer.Stop(); }
+private:
+	SampledTimer& timer;
+	bool timed;
+};
+
+gsl_rng* AllocPhotonStreamRng(); //gsl generator reading a PhotonStream, for the code that takes a gsl_rng* (TruncatedGaussian, samplers)
+void SetPhotonStream(gsl_rng* gen, PhotonStream* stream); //Subsequent draws of 'gen' come from 'stream'
+
+#ifdef SYNRAD_COUNT_ALLOCATIONS
+size_t GetThreadAllocationCount(); //Heap allocations made so far by the calling thread (operator new is replaced in SimulationControl.cpp)
+#endif
+
+//One Monte-Carlo thread: owns a particle, a random generator and its own hit accumulators
+//The geometry, regions, materials and distributions are read through 'model', which isn't modified while running
+#define RAY_PACKET_SIZE 8 //Rays traversing a BVH together in wavefront mode (bits of a mask)
 
+class SimulationThread {
+public:
+	SimulationThread(Simulation* model, const size_t& threadId);
+	~SimulationThread();
+
+	Simulation* model;
+	size_t threadId;
+
+	GlobalHitBuffer tmpGlobalResult;            // Temporary number of hits (between 2 calls of UpdateMC)
+	std::vector<FacetHitState> facetStates;     // Hit accumulators, indexed by facet globalId
 	size_t    nbLeakSinceUpdate;   // Leaks since last UpdateMC
+	double    distTraveledSinceUpdate;
+	size_t    totalDesorbed;       //total number of generated photons by this thread
+	size_t    desorptionLimit;     //this thread's share of the process desorption limit (only checked if the process has a limit)
+	bool      finished;            //desorption limit reached, or stopped on error
+	double    stepPerSec;  // Avg number of step per sec
+	size_t    allocationsLastStep; //Heap allocations during the last SimulationRun(), only counted with SYNRAD_COUNT_ALLOCATIONS
+	SampledTimer phaseTimers[NB_PROFILE_PHASES]; //Hot-path phases of this thread (the hit update ones are the model's)
+	double    runSeconds; //Time spent in SimulationRun() since the last reset
+	double    hitWeightSum, hitWeightSquareSum; //oriRatio of the MC hits since the last reset, for the effective sample size
+	size_t    nbRouletteKills, nbRouletteSurvivals, nbSplitCopies; //Variance reduction events since the last reset
+
+	gsl_rng *gen; //Reads currentParticle.rng, or the stream of the photon being generated
+
+	// Particle coordinates (MC)
+	CurrentParticleStatus currentParticle;
+	PhotonBatch photonBatch; //Photons generated ahead, handed out by StartFromSource()
+
+	//Wavefront mode (model->wavefrontSize > 1): particles waiting for their next bounce, swapped into currentParticle one at a time
+	std::vector<CurrentParticleStatus> wavefront;
+	std::vector<bool> wavefrontActive; //false once the desorption limit stopped the slot
+	std::vector<FacetCollision> wavefrontHits; //Result of the last intersection pass, facet is NULL for a leak
+	std::vector<size_t> wavefrontOrder; //Active slots in tracing order, kept to avoid reallocating at every step
+	size_t currentSlot; //Wavefront slot in currentParticle, 0 in scalar mode
+
+	//Particle splitting: copies waiting to be traced, handed out by StartFromSource() before any new photon
+	std::vector<CurrentParticleStatus> splitCopies;
+	bool particleRestarted; //StartFromSource() was called while processing the current collision
+
+	std::vector<ParticleLoggerItem> tmpParticleLog;
+
+	std::string errorMsg; //Set when the thread stops on an error, reported by the main thread
+
+	bool InitializeHitStates();
+	void ResetTmpCounters();
+	bool SimulationRun();
+	bool SimulationMCStep(const size_t& nbStep);
+	bool InitializeWavefront();
+	bool SimulationWavefrontStep(const size_t& nbStep);
+	bool ProcessCollision(const bool& found, SubprocessFacet* collidedFacetPtr, const double& d);
+	bool StartFromSource();
+	bool PlayRoulette(); //Low flux mode, photon below the cutoff: true if it survives (weight raised), false if it's terminated
+	bool IsSplittingEntry(const SubprocessFacet& collidedFacet, const size_t& previousStructure) const;
+	void SplitParticle();
+	bool GeneratePhotonBatch();
+
+	std::tuple<bool, SubprocessFacet*, double> Intersect();
+	void IntersectPacket(const size_t* slots, const size_t& nbRays);
+	void ApplyCollision(const bool& found, const FacetCollision& hardHit);
+	void GetStickingProbability(const SubprocessFacet& collidedFacet, const double& theta,
+		double& stickingProbability, ReflectionProbabilities& materialReflProbabilities, bool& complexScattering);
+	bool DoOldRegularReflection(SubprocessFacet& collidedFacet, const int& reflType, const double& inTheta, const double& inPhi,
+		const Vector3d& N_rotated, const Vector3d& nU_rotated, const Vector3d& nV_rotated);
+	bool DoLowFluxReflection(SubprocessFacet& collidedFacet, const double& stickingProbability, const bool& complexScattering, const ReflectionProbabilities& materialReflProbabilities,
+		const double& inTheta, const double& inPhi,
+		const Vector3d& N_rotated = Vector3d(0, 0, 0), const Vector3d& nU_rotated = Vector3d(0, 0, 0), const Vector3d& nV_rotated = Vector3d(0, 0, 0)); //old or new model
+	int GetHardHitType(const double& stickingProbability, const ReflectionProbabilities& materialReflProbabilities, const bool& complexScattering);
+	std::tuple<Vector3d, Vector3d, Vector3d> PerturbateSurface(const SubprocessFacet& collidedFacet, const double& sigmaRatio);
+	void PerformBounce_new(SubprocessFacet& collidedFacet, const int &reflType, const double &inTheta, const double &inPhi);
+	bool PerformBounce_old(SubprocessFacet& collidedFacet, const int& reflType, const double& inTheta, const double& inPhi, const Vector3d& N_rotated, const Vector3d& nU_rotated, const Vector3d& nV_rotated);
+	bool VerifiedSpecularReflection(const SubprocessFacet& collidedFacet, const int& reflType, const double& inTheta, const double& inPhi, const Vector3d& nU_rotated, const Vector3d& nV_rotated, const Vector3d& N_rotated);
+	void Stick(SubprocessFacet& collidedFacet);
+	void PerformTeleport(SubprocessFacet& collidedFacet);
+	void RegisterTransparentPass(SubprocessFacet& f);
+	void RecordHit(const int &type, const double &dF, const double &dP);
+	void RecordLeakPos();
+	void RecordHitOnTexture(const SubprocessFacet& f, double dF, double dP);
+	void RecordDirectionVector(const SubprocessFacet& f);
+	void ProfileFacet(const SubprocessFacet &f, const double& energy, const ProfileSlice &increment);
+	void LogHit(const SubprocessFacet& f);
+	void SetThreadError(const std::string& msg);
+};
 
-	size_t totalDesorbed;        //total number of generated photons, for process state reporting and simulation end check
+class Simulation {
+public:
+    Simulation();
+    ~Simulation();
 
 	// Geometry
 	/*char name[64];         // Global name
@@ -147,83 +450,90 @@ public:
     std::vector<Vector3d> vertices3;        // Vertices
 	size_t nbMaterials;
 	size_t sourceArea;       //number of trajectory points weighed by 1/dL
+	bool fluxWeightedSources; //Generate photons more often from points that emit more flux (weight of each photon corrected accordingly)
+	SourceSampler sourceSampler;
 	//size_t nbDistrPoints_MAG;
 	size_t nbDistrPoints_BXY;
-	size_t sourceRegionId;
-    std::vector<SuperStructure> structures; //They contain the facets
+    std::vector<SubprocessFacet> facets; //Every facet once, indexed by globalId
+    std::vector<SuperStructure> structures; //They reference the facets
 
 	std::vector<Region_mathonly> regions;// Regions
 	std::vector<Material> materials;//materials
 	std::vector<std::vector<double>> psi_distro;
 	std::vector<std::vector<std::vector<double>>> chi_distros;
 	std::vector<std::vector<double>> parallel_polarization;
+	AngularTable psiTable, polarizationTable; //psi_distro and parallel_polarization flattened for sampling, rows by lambda ratio
+	std::vector<AngularTable> chiTables; //chi_distros transposed: rows by psi, knots by chi
 
-	//SubprocessFacet* lastHitFacet;     // Last hitted facet. Pointer, not a reference, that way it can be NULL (example: desorption from the middle of the volume)
-	//int sourceArea;  // Number of trajectory points
-	double stepPerSec;  // Avg number of step per sec
-	size_t textTotalSize;  // Texture total size
+	size_t textTotalSize;  // Texture tile indices total size
 	size_t profTotalSize;  // Profile total size
-	size_t dirTotalSize;   // Direction field total size
+	size_t dirTotalSize;   // Direction field tile indices total size
 	size_t spectrumTotalSize; //Spectrums total size
 	bool loadOK;        // Load OK flag
 	bool lastHitUpdateOK;  // Last hit update timeout
 	bool lastLogUpdateOK;  // Last log update timeout
+	TextureCell lastHitMin; // Texture minimum this process last wrote to the dataport
+	size_t hitMinOffset[3]; // Dataport offset of the cell holding lastHitMin's count, flux and power, 0: none
 	bool hasVolatile;   // Contains volatile facet
 	//bool hasDirection;  // Contains direction field
 
-	gsl_rng *gen; //rnd gen stuff
-
-    // Particle coordinates (MC)
-    CurrentParticleStatus currentParticle;
-
-
-    std::vector<ParticleLoggerItem> tmpParticleLog;
-
+	size_t nbThreads; //Number of Monte-Carlo threads sharing this geometry, from the run settings (RunSettings::GetThreadCount())
+	size_t wavefrontSize; //Particles traced together by each thread, 1: one at a time
+
+	//Variance reduction
+	double rouletteSurvivalWeight; //Low flux mode: oriRatio given to photons surviving the Russian roulette played below lowFluxCutoff, 0: 10x lowFluxCutoff
+	size_t splitFactor; //Low flux mode: copies a photon becomes when it leaves a splitting facet or enters a splitting structure, 1: no splitting
+	std::vector<bool> splitFacets; //By facet globalId, may be shorter than the facet list
+	std::vector<bool> splitStructures; //By structure index, may be shorter than the structure list
+
+	PrecisionMonitor precision; //Stops the run once the selected results reach their statistical error
+
+	//Tagged tallies: flux and power of selected facets split by source region and bounce bucket
+	std::vector<bool> tallyFacets; //By facet globalId, may be shorter than the facet list
+	std::vector<TallyLayout> tallyLayouts; //By facet globalId: its tagged tallies in the hits dataport, after the facets
+	size_t tallyTotalSize; //Bytes of all tagged tallies in the hits dataport
+	size_t texturePoolMB; //From the run settings: space of the texture pool, see TexturePoolLayout::Set()
+	TexturePoolLayout texturePool; //After the tallies, same layout as the interface's (SynradGeometry::GetTexturePoolLayout())
+	size_t texturePoolSize; //Bytes of texturePool in the hits dataport
+	std::vector<EnergyBandEdges> energyBands; //By facet globalId, may be shorter than the facet list: power and flux split by photon energy
+	bool IsTallied(const size_t& globalId) const { return globalId < tallyFacets.size() && tallyFacets[globalId]; }
+	size_t GetNbTallyTags() const { return regions.size() * NB_BOUNCE_BUCKETS; }
+	size_t GetNbEnergyBands(const size_t& globalId) const { return globalId < energyBands.size() ? energyBands[globalId].nbBands : 0; }
+	std::vector<SimulationThread*> threads;
+	WorkerPool* workerPool; //nbThreads system threads kept from LoadSimulation() to ClearSimulation(), run the steps and the hit reduction
+
+	uint64_t randomSeed; //Key of all photon streams, the same in every process if GSL_RNG_SEED is set
+	size_t processIndex; //This process among ontheflyParams.nbProcess: photon indices processIndex, processIndex+nbProcess, ...
+	std::atomic<uint64_t> nbPhotonIndices; //Photon indices handed out to the threads of this process since the last reset
+	uint64_t ReservePhotonIndices(const size_t& nbPhotons); //First local index of nbPhotons consecutive ones
+	uint64_t GetPhotonIndex(const uint64_t& localIndex) const; //Global index, unique across processes
+
+	size_t GetTotalDesorbed();
+	SampledTimer phaseTimers[NB_PROFILE_PHASES]; //Main thread phases: PHASE_HITUPDATE and PHASE_HITWAIT
+	void GetPhaseProfile(PhaseProfile& profile); //All threads and the main thread since the last reset
 };
 
 // -- Macros ---------------------------------------------------
 
 // -- Methods ---------------------------------------------------
 
-void RecordHitOnTexture(SubprocessFacet& f, double dF, double dP);
-void RecordDirectionVector(SubprocessFacet& f);
-void LogHit(SubprocessFacet *f);
-void ProfileFacet(SubprocessFacet &f, const double& energy, const ProfileSlice &increment);
 void InitSimulation();
-void ClearSimulation();
+void ClearSimulation(Simulation* sim);
 void SetState(size_t state, const char *status, bool changeState = true, bool changeStatus = true);
 void SetErrorSub(const char *msg);
-bool LoadSimulation(Dataport *loader);
-bool UpdateOntheflySimuParams(Dataport *loader);
-bool StartSimulation();
-void ResetSimulation();
-bool SimulationRun();
-bool SimulationMCStep(const size_t& nbStep);
-std::tuple<double, std::vector<double>, bool> GetStickingProbability(const SubprocessFacet& collidedFacet, const double& theta);
-
-bool DoOldRegularReflection(SubprocessFacet& collidedFacet, const int& reflType, const double& inTheta, const double& inPhi,
-	const Vector3d& N_rotated, const Vector3d& nU_rotated, const Vector3d& nV_rotated);
-bool DoLowFluxReflection(SubprocessFacet& collidedFacet, const double& stickingProbability, const bool& complexScattering, const std::vector<double>& materialReflProbabilities,
-	const double& inTheta, const double& inPhi,
-	const Vector3d& N_rotated = Vector3d(0, 0, 0), const Vector3d& nU_rotated = Vector3d(0, 0, 0), const Vector3d& nV_rotated = Vector3d(0, 0, 0)); //old or new model
-int GetHardHitType(const double& stickingProbability, const std::vector<double>& materialReflProbabilities, const bool& complexScattering);
-std::tuple<Vector3d, Vector3d, Vector3d> PerturbateSurface(const SubprocessFacet& collidedFacet, const double& sigmaRatio);
-//std::tuple<double,double,double> GetDirComponents(const Vector3d & nU_rotated, const Vector3d & nV_rotated, const Vector3d & N_rotated);
-void RecordHit(const int &type, const double &dF, const double &dP);
-void RecordLeakPos();
-bool StartFromSource();
-void ComputeSourceArea();
-void PerformBounce_new(SubprocessFacet& collidedFacet, const int &reflType, const double &inTheta, const double &inPhi);
-bool PerformBounce_old(SubprocessFacet& collidedFacet, const int& reflType, const double& inTheta, const double& inPhi, const Vector3d& N_rotated, const Vector3d& nU_rotated, const Vector3d& nV_rotated);
-bool VerifiedSpecularReflection(const SubprocessFacet& collidedFacet, const int& reflType, const double& inTheta, const double& inPhi, const Vector3d& nU_rotated, const Vector3d& nV_rotated, const Vector3d& N_rotated);
-void Stick(SubprocessFacet& collidedFacet);
-void PerformTeleport(const SubprocessFacet& collidedFacet);
-void UpdateHits(Dataport *dpHit, Dataport *dpLog, int prIdx, DWORD timeout);
-void UpdateLog(Dataport *dpLog, DWORD timeout);
-void UpdateMCHits(Dataport *dpHit, int prIdx, DWORD timeout);
-void ResetTmpCounters();
+bool LoadSimulation(Simulation* sim, Dataport *loader);
+bool LoadSimulation(Simulation* sim, const void* loaderBuffer, const size_t& loaderSize, const RunSettings* runSettings = NULL); //Flat loader format (LoaderFormat.h), from a dataport or a mapped file. runSettings: instead of the buffer's
+bool UpdateOntheflySimuParams(Simulation* sim, Dataport *loader);
+bool StartSimulation(Simulation* sim);
+void ResetSimulation(Simulation* sim);
+bool SimulationRun(Simulation* sim);
+void ComputeSourceArea(Simulation* sim);
+void UpdateHits(Simulation* sim, Dataport *dpHit, Dataport *dpLog, int prIdx, DWORD timeout);
+void UpdateLog(Simulation* sim, Dataport *dpLog, DWORD timeout);
+void UpdateMCHits(Simulation* sim, Dataport *dpHit, int prIdx, DWORD timeout);
+void ResetTmpCounters(Simulation* sim);
 //bool RaySphereIntersect(Vector3d *center, double radius, Vector3d *rPos, Vector3d *rDir, double *dist);
 double GetTick();
-size_t   GetHitsSize();
+size_t   GetHitsSize(Simulation* sim);
 
 #endif /* _SIMULATIONH_ */
\ No newline at end of file
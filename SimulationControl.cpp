@@ -37,6 +37,9 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #include "IntersectAABB_shared.h"
 #include "Random.h"
 #include "SynradTypes.h" //Histogram
+#include "GeneratePhoton.h"
+#include "LoaderFormat.h"
+#include "RunSettings.h"
 //#include "Tools.h"
 #include <cereal/types/utility.hpp>
 #include <cereal/archives/binary.hpp>
@@ -46,10 +49,6 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 
 extern void SetErrorSub(const char *message);
 
-// Global handles
-
-extern Simulation *sHandle;
-
 // Timing stuff
 
 #ifdef WIN
@@ -59,10 +58,40 @@ double perfTicksPerSec;      // Performance counter (number of tick per second)
 #endif
 DWORD tickStart;
 
-void InitSimulation() {
+#ifdef SYNRAD_COUNT_ALLOCATIONS
+// Allocation counting, to check that the bounce loop doesn't touch the heap once warmed up
+#include <new>
+
+static thread_local size_t threadAllocationCount = 0;
+
+size_t GetThreadAllocationCount() {
+	return threadAllocationCount;
+}
+
+void* operator new(size_t size) {
+	threadAllocationCount++;
+	void* p = malloc(size ? size : 1);
+	if (!p) throw std::bad_alloc();
+	return p;
+}
 
-	// Global handle allocation
-	sHandle = new Simulation();
+void* operator new[](size_t size) {
+	threadAllocationCount++;
+	void* p = malloc(size ? size : 1);
+	if (!p) throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void* p) noexcept {
+	free(p);
+}
+
+void operator delete[](void* p) noexcept {
+	free(p);
+}
+#endif
+
+void InitSimulation() {
 
 #ifdef WIN
 	{
@@ -77,13 +106,50 @@ void InitSimulation() {
 #else
 	tickStart = (DWORD)time(NULL);
 #endif
+	GetTscFrequency(); //Calibrated now rather than in the first profile update
 
 }
 
-void ClearSimulation() {
-
-    delete sHandle;
-    sHandle = new Simulation;
+void ClearSimulation(Simulation* sim) {
+
+	//Release geometry and threads, the run settings come again with the next load
+	SAFE_DELETE(sim->workerPool);
+	for (auto& t : sim->threads) SAFE_DELETE(t);
+	sim->threads.clear();
+	sim->structures.clear();
+	sim->facets.clear();
+	sim->tallyLayouts.clear();
+	sim->vertices3.clear();
+	sim->regions.clear();
+	sim->materials.clear();
+	sim->psi_distro.clear();
+	sim->chi_distros.clear();
+	sim->parallel_polarization.clear();
+	sim->chiTables.clear();
+
+	sim->sh.nbSuper = 0;
+	sim->nbMaterials = 0;
+	sim->sourceArea = 0;
+	sim->sourceSampler.Clear();
+	sim->nbDistrPoints_BXY = 0;
+	sim->textTotalSize = 0;
+	sim->profTotalSize = 0;
+	sim->dirTotalSize = 0;
+	sim->spectrumTotalSize = 0;
+	sim->tallyTotalSize = 0;
+	sim->texturePool = TexturePoolLayout();
+	sim->texturePoolSize = 0;
+	sim->loadOK = false;
+	sim->lastHitUpdateOK = false;
+	sim->lastLogUpdateOK = false;
+	sim->lastHitMin.count = 0; //Differs from any dataport minimum: the first update searches all textures
+	sim->lastHitMin.flux = sim->lastHitMin.power = -1.0;
+	for (auto& offset : sim->hitMinOffset) offset = 0;
+	sim->hasVolatile = false;
+
+	sim->wp.nbRegion = 0;
+	sim->wp.nbTrajPoints = 0;
+	sim->wp.newReflectionModel = false;
 
 }
 
@@ -119,16 +185,218 @@ double Norme(Vector3d *v) {
 	return sqrt(v->x*v->x + v->y*v->y + v->z*v->z);
 }
 
-bool LoadSimulation(Dataport *loader) {
+void DistributeDesorptionLimit(Simulation* sim) {
+	//Split this process' share of the desorption limit between its threads, the first threads take the remainder
+	size_t processLimit = sim->ontheflyParams.desorptionLimit / sim->ontheflyParams.nbProcess;
+	for (auto& t : sim->threads) {
+		t->desorptionLimit = processLimit / sim->nbThreads + ((t->threadId < processLimit % sim->nbThreads) ? 1 : 0);
+	}
+}
+
+bool ReportThreadErrors(Simulation* sim) {
+	//Threads can't call SetErrorSub() concurrently, they store their error and the main thread reports the first one
+	for (auto& t : sim->threads) {
+		if (!t->errorMsg.empty()) {
+			SetErrorSub(t->errorMsg.c_str());
+			return true;
+		}
+	}
+	return false;
+}
+
+// Copy each section of the loader buffer (see LoaderFormat.h) to the simulation model, in one pass
+
+static bool LoadRegionsFromBuffer(Simulation* sim, const void* loaderBuffer) {
+	size_t nbRegions, nbRanges, nbPoints, nbPairs;
+	const RegionParams* params = GetLoaderSection<RegionParams>(loaderBuffer, LOADER_REGIONS, nbRegions);
+	const LoaderRegionRanges* ranges = GetLoaderSection<LoaderRegionRanges>(loaderBuffer, LOADER_REGION_RANGES, nbRanges);
+	const Trajectory_Point* points = GetLoaderSection<Trajectory_Point>(loaderBuffer, LOADER_TRAJECTORY_POINTS, nbPoints);
+	const LoaderPair* pairs = GetLoaderSection<LoaderPair>(loaderBuffer, LOADER_DISTRIBUTION_PAIRS, nbPairs);
+	if (!params || !ranges || !points || !pairs || nbRanges != nbRegions) {
+		SetErrorSub("Error loading regions");
+		return false;
+	}
+
+	sim->regions.resize(nbRegions);
+	for (size_t r = 0; r < nbRegions; r++) {
+		Region_mathonly& reg = sim->regions[r];
+		const LoaderRegionRanges& range = ranges[r];
+		if (!InLoaderSection(range.points, nbPoints) || !InLoaderSection(range.Bx_distr, nbPairs)
+			|| !InLoaderSection(range.By_distr, nbPairs) || !InLoaderSection(range.Bz_distr, nbPairs)
+			|| range.points.count != params[r].nbPointsToCopy) {
+			SetErrorSub("Error loading regions");
+			return false;
+		}
+		reg.params = params[r];
+		reg.Points.assign(points + range.points.first, points + range.points.first + range.points.count);
+		Distribution2D* distributions[3] = { &reg.Bx_distr, &reg.By_distr, &reg.Bz_distr };
+		const LoaderRange* distrRanges[3] = { &range.Bx_distr, &range.By_distr, &range.Bz_distr };
+		for (size_t d = 0; d < 3; d++) {
+			distributions[d]->Resize((size_t)distrRanges[d]->count);
+			for (size_t j = 0; j < distrRanges[d]->count; j++) {
+				const LoaderPair& pair = pairs[distrRanges[d]->first + j];
+				distributions[d]->SetPair(j, pair.x, pair.y);
+			}
+		}
+	}
+	return true;
+}
+
+static bool LoadMaterialsFromBuffer(Simulation* sim, const void* loaderBuffer) {
+	size_t nbMaterials, nbValues;
+	const LoaderMaterial* materials = GetLoaderSection<LoaderMaterial>(loaderBuffer, LOADER_MATERIALS, nbMaterials);
+	const double* values = GetLoaderSection<double>(loaderBuffer, LOADER_MATERIAL_VALUES, nbValues);
+	if (!materials || !values) {
+		SetErrorSub("Error loading materials");
+		return false;
+	}
+
+	sim->nbMaterials = nbMaterials;
+	sim->materials.resize(nbMaterials);
+	for (size_t i = 0; i < nbMaterials; i++) {
+		const LoaderMaterial& m = materials[i];
+		LoaderRange range = { m.firstValue, m.nbAngles + m.nbEnergies + m.nbAngles * m.nbEnergies * m.nbComponents };
+		if (m.nbComponents != (m.hasBackscattering ? 4 : 1) || !InLoaderSection(range, nbValues)) {
+			SetErrorSub("Error loading materials");
+			return false;
+		}
+		Material& mat = sim->materials[i];
+		mat.hasBackscattering = (int)m.hasBackscattering;
+		const double* value = values + m.firstValue;
+		mat.angleVals.assign(value, value + m.nbAngles); value += m.nbAngles;
+		mat.energyVals.assign(value, value + m.nbEnergies); value += m.nbEnergies;
+		mat.reflVals.resize((size_t)m.nbEnergies);
+		for (auto& row : mat.reflVals) {
+			row.resize((size_t)m.nbAngles);
+			for (auto& cell : row) {
+				cell.assign(value, value + m.nbComponents); value += m.nbComponents;
+			}
+		}
+	}
+	return true;
+}
+
+static bool LoadDistributionsFromBuffer(Simulation* sim, const void* loaderBuffer, const size_t& nbChiDistros) {
+	size_t nbTables, nbRows, nbValues;
+	const LoaderRange* tables = GetLoaderSection<LoaderRange>(loaderBuffer, LOADER_TABLES, nbTables);
+	const LoaderRange* rows = GetLoaderSection<LoaderRange>(loaderBuffer, LOADER_TABLE_ROWS, nbRows);
+	const double* values = GetLoaderSection<double>(loaderBuffer, LOADER_TABLE_VALUES, nbValues);
+	if (!tables || !rows || !values || nbTables != nbChiDistros + 2) {
+		SetErrorSub("Error loading distributions");
+		return false;
+	}
+
+	sim->chi_distros.resize(nbChiDistros);
+	for (size_t t = 0; t < nbTables; t++) {
+		std::vector<std::vector<double>>& table = (t == 0) ? sim->psi_distro
+			: (t == nbTables - 1) ? sim->parallel_polarization
+			: sim->chi_distros[t - 1];
+		if (!InLoaderSection(tables[t], nbRows)) {
+			SetErrorSub("Error loading distributions");
+			return false;
+		}
+		table.resize((size_t)tables[t].count);
+		for (size_t i = 0; i < table.size(); i++) {
+			const LoaderRange& row = rows[tables[t].first + i];
+			if (!InLoaderSection(row, nbValues)) {
+				SetErrorSub("Error loading distributions");
+				return false;
+			}
+			table[i].assign(values + row.first, values + row.first + row.count);
+		}
+	}
+	return true;
+}
+
+static bool LoadFacetsFromBuffer(Simulation* sim, const void* loaderBuffer) {
+	size_t nbFacets, nbRanges, nbIndices, nbVertices2, nbIncrements;
+	const FacetProperties* properties = GetLoaderSection<FacetProperties>(loaderBuffer, LOADER_FACETS, nbFacets);
+	const LoaderFacetRanges* ranges = GetLoaderSection<LoaderFacetRanges>(loaderBuffer, LOADER_FACET_RANGES, nbRanges);
+	const size_t* indices = GetLoaderSection<size_t>(loaderBuffer, LOADER_INDICES, nbIndices);
+	const Vector2d* vertices2 = GetLoaderSection<Vector2d>(loaderBuffer, LOADER_VERTICES2, nbVertices2);
+	const double* increments = GetLoaderSection<double>(loaderBuffer, LOADER_TEXTURE_INCREMENTS, nbIncrements);
+	if (!properties || !ranges || !indices || !vertices2 || !increments
+		|| nbFacets != sim->sh.nbFacet || nbRanges != nbFacets || nbVertices2 != nbIndices) {
+		SetErrorSub("Error loading facets");
+		return false;
+	}
+
+	if (sim->sh.nbSuper == 0) {
+		SetErrorSub("No structures");
+		return false;
+	}
+
+	//Every facet is stored once, universal facets (superIdx == -1) are referenced from all structures
+	std::vector<size_t> nbStructureFacets(sim->sh.nbSuper, 0);
+	for (size_t i = 0; i < nbFacets; i++) {
+		int superIdx = properties[i].superIdx;
+		if (superIdx == -1) {
+			for (auto& n : nbStructureFacets) n++;
+		}
+		else if (superIdx >= 0 && (size_t)superIdx < sim->sh.nbSuper) nbStructureFacets[superIdx]++;
+		else {
+			char tmp[128];
+			sprintf(tmp, "Facet %zd is in structure %d which doesn't exist", i + 1, superIdx + 1);
+			SetErrorSub(tmp);
+			return false;
+		}
+	}
+
+	sim->facets.resize(nbFacets); //Not resized afterwards: structures and BVHs point into it
+	for (size_t i = 0; i < nbFacets; i++) {
+		const LoaderFacetRanges& range = ranges[i];
+		if (!InLoaderSection(range.indices, nbIndices) || !InLoaderSection(range.textureIncrements, nbIncrements)) {
+			SetErrorSub("Error loading facets");
+			return false;
+		}
+		SubprocessFacet& f = sim->facets[i];
+		f.sh = properties[i];
+		f.indices.assign(indices + range.indices.first, indices + range.indices.first + range.indices.count);
+		f.vertices2.assign(vertices2 + range.indices.first, vertices2 + range.indices.first + range.indices.count);
+		if (!f.InitializeTextureIncrements(increments + range.textureIncrements.first, range.textureIncrements.count)) return false;
+
+		//Some initialization
+		if (!f.InitializeOnLoad(sim, i)) return false;
+	}
+
+	for (size_t s = 0; s < sim->sh.nbSuper; s++) sim->structures[s].facets.reserve(nbStructureFacets[s]);
+	for (auto& f : sim->facets) {
+		if (f.sh.superIdx == -1) { //Facet in all structures
+			for (auto& s : sim->structures) s.facets.push_back(&f);
+		}
+		else sim->structures[f.sh.superIdx].facets.push_back(&f);
+	}
+	return true;
+}
+
+bool LoadSimulation(Simulation* sim, Dataport *loader) {
+	return LoadSimulation(sim, loader->buff, loader->size);
+}
+
+static void ApplyRunSettings(Simulation* sim, const RunSettings& settings) {
+	sim->nbThreads = settings.GetThreadCount(sim->ontheflyParams.nbProcess);
+	sim->fluxWeightedSources = settings.fluxWeightedSources;
+	sim->wavefrontSize = settings.wavefrontSize;
+	sim->rouletteSurvivalWeight = settings.rouletteSurvivalWeight;
+	sim->splitFactor = settings.splitFactor;
+	sim->splitFacets = settings.splitFacets;
+	sim->splitStructures = settings.splitStructures;
+	sim->precision.targets = settings.precisionTargets;
+	sim->tallyFacets = settings.tallyFacets;
+	sim->energyBands = settings.energyBands;
+	sim->texturePoolMB = settings.texturePoolMB;
+}
+
+bool LoadSimulation(Simulation* sim, const void* loaderBuffer, const size_t& loaderSize, const RunSettings* runSettings) {
 
 	double t1, t0;
 	DWORD seed;
 	t0 = GetTick();
 
-	sHandle->loadOK = false;
+	sim->loadOK = false;
 	SetState(PROCESS_STARTING, "Clearing previous simulation");
 	try {
-		ClearSimulation();
+		ClearSimulation(sim);
 	}
 	catch (...) {
 		SetErrorSub("Error clearing geometry");
@@ -145,96 +413,91 @@ bool LoadSimulation(Dataport *loader) {
 	*/
 
     SetState(PROCESS_STARTING, "Loading simulation");
-    sHandle->textTotalSize =
-    sHandle->profTotalSize =
-    sHandle->dirTotalSize =
-            sHandle->spectrumTotalSize = 0;
-
-    {
+    sim->textTotalSize =
+    sim->profTotalSize =
+    sim->dirTotalSize =
+            sim->spectrumTotalSize = 0;
+
+    const char* loaderError = CheckLoaderBuffer(loaderBuffer, loaderSize);
+    if (loaderError) {
+        SetErrorSub(loaderError);
+        return false;
+    }
 
-        std::string inputString(loader->size,NULL);
-        BYTE* buffer = (BYTE*)loader->buff;
-        std::copy(buffer, buffer + loader->size, inputString.begin());
-        std::stringstream inputStream;
-        inputStream << inputString;
-        cereal::BinaryInputArchive inputarchive(inputStream);
+    try {
+        //Worker params
+        size_t count, nbWp, nbOntheflyParams, nbGeomCounts;
+        const WorkerParams* wp = GetLoaderSection<WorkerParams>(loaderBuffer, LOADER_WORKER_PARAMS, nbWp);
+        const OntheflySimulationParams* ontheflyParams = GetLoaderSection<OntheflySimulationParams>(loaderBuffer, LOADER_ONTHEFLY_PARAMS, nbOntheflyParams);
+        const LoaderGeomCounts* geomCounts = GetLoaderSection<LoaderGeomCounts>(loaderBuffer, LOADER_GEOM_COUNTS, nbGeomCounts);
+        if (!wp || !ontheflyParams || !geomCounts || nbWp != 1 || nbOntheflyParams != 1 || nbGeomCounts != 1) {
+            SetErrorSub("Error loading parameters");
+            return false;
+        }
+        sim->wp = *wp;
+        sim->ontheflyParams = *ontheflyParams;
 
-        //std::ifstream is("data.json");
-        //cereal::JSONInputArchive inputarchive(is);
+        //Run settings of the interface, or the caller's
+        RunSettings loadedSettings;
+        if (!runSettings && !loadedSettings.ReadFromLoader(loaderBuffer)) {
+            SetErrorSub("Error loading run settings");
+            return false;
+        }
+        ApplyRunSettings(sim, runSettings ? *runSettings : loadedSettings);
 
-        //Worker params
-        inputarchive(sHandle->wp);
-        //sHandle->regions.resize(sHandle->wp.nbRegion); //Create structures
-        inputarchive(sHandle->ontheflyParams);
-        inputarchive(sHandle->regions); // mathonly
-        inputarchive(sHandle->materials);
-        inputarchive(sHandle->psi_distro);
-        inputarchive(sHandle->chi_distros);
-        inputarchive(sHandle->parallel_polarization);
+        if (!LoadRegionsFromBuffer(sim, loaderBuffer)) return false;
+        if (!LoadMaterialsFromBuffer(sim, loaderBuffer)) return false;
+        if (!LoadDistributionsFromBuffer(sim, loaderBuffer, (size_t)geomCounts->nbChiDistros)) return false;
 
         //Geometry
-        inputarchive(sHandle->sh);
-        inputarchive(sHandle->vertices3);
+        sim->sh.nbFacet = (size_t)geomCounts->nbFacet;
+        sim->sh.nbVertex = (size_t)geomCounts->nbVertex;
+        sim->sh.nbSuper = (size_t)geomCounts->nbSuper;
+        const char* name = GetLoaderSection<char>(loaderBuffer, LOADER_GEOM_NAME, count);
+        sim->sh.name.assign(name, count);
+        const Vector3d* vertices3 = GetLoaderSection<Vector3d>(loaderBuffer, LOADER_VERTICES, count);
+        if (!vertices3 || count != sim->sh.nbVertex) {
+            SetErrorSub("Error loading vertices");
+            return false;
+        }
+        sim->vertices3.assign(vertices3, vertices3 + count);
 
         // Prepare super structure
-        sHandle->structures.resize(sHandle->sh.nbSuper); //Create structures
-        /*for (size_t i = 0; i < sHandle->sh.nbSuper; i++) {
-            int nbF = sHandle->structures[i].facets.size();
-            if (nbF == 0) {
-
-            }
-            else {
-                std::vector<SubprocessFacet>(nbF).swap(sHandle->structures[i].facets);
-            }
-        }*/
+        sim->structures.resize(sim->sh.nbSuper); //Create structures
 
         SetState(PROCESS_STARTING, ("Loading facets"));
+        if (!LoadFacetsFromBuffer(sim, loaderBuffer)) return false;
+    }
+    catch (...) {
+        SetErrorSub("Not enough memory to load geometry");
+        return false;
+    }
 
-        //Facets
-        for (size_t i = 0; i < sHandle->sh.nbFacet; i++) { //Necessary because facets is not (yet) a vector in the interface
-            SubprocessFacet f;
-            inputarchive(f.sh);
-            inputarchive(f.indices);
-            inputarchive(f.vertices2);
-            inputarchive(f.textureCellIncrements);
-
-            //Some initialization
-            if (!f.InitializeOnLoad(i)) return false;
-            if (f.sh.superIdx == -1) { //Facet in all structures
-                for (auto& s : sHandle->structures) {
-                    s.facets.push_back(f);
-                }
-            }
-            else {
-                sHandle->structures[f.sh.superIdx].facets.push_back(f); //Assign to structure
-            }
-        }
-    }//inputarchive goes out of scope, file released
-
-    sHandle->wp.nbTrajPoints = 0;
+    sim->wp.nbTrajPoints = 0;
 
-    if (sHandle->sh.nbSuper <= 0) {
+    if (sim->sh.nbSuper <= 0) {
         //ReleaseDataport(loader);
         SetErrorSub("No structures");
         return false;
     }
 
     try {
-        //copy trajectory points
-        for (auto& reg : sHandle->regions) {
-            reg.Points.resize(reg.params.nbPointsToCopy);
-            sHandle->wp.nbTrajPoints += reg.params.nbPointsToCopy;
+        //trajectory points already copied by LoadRegionsFromBuffer(), nbPointsToCopy of them
+        for (auto& reg : sim->regions) {
+            sim->wp.nbTrajPoints += reg.params.nbPointsToCopy;
         }
 
-        //copy distribution points
-        sHandle->nbDistrPoints_BXY = 0;
-        for (auto& reg : sHandle->regions) {
-            reg.Bx_distr.Resize((size_t)reg.params.nbDistr_MAG.x);
-            reg.By_distr.Resize((size_t)reg.params.nbDistr_MAG.y);
-            reg.Bz_distr.Resize((size_t)reg.params.nbDistr_MAG.z);
+        //distribution points already copied by LoadRegionsFromBuffer()
+        sim->nbDistrPoints_BXY = 0;
+        for (auto& reg : sim->regions) {
             reg.latticeFunctions.Resize(0);
 
-            sHandle->nbDistrPoints_BXY += reg.params.nbDistr_BXY;
+            sim->nbDistrPoints_BXY += reg.params.nbDistr_BXY;
+        }
+
+        //B-factors of the nominal orbit, once per point instead of once per photon
+        for (auto& reg : sim->regions) {
+            PrecalculateSpectrumFactors(&reg);
         }
     }
     catch (...) {
@@ -244,11 +507,6 @@ bool LoadSimulation(Dataport *loader) {
 
 
 
-    //Reserve particle log
-    if (sHandle->ontheflyParams.enableLogging)
-        sHandle->tmpParticleLog.reserve(sHandle->ontheflyParams.logLimit / sHandle->ontheflyParams.nbProcess);
-
-
     /*BYTE *bufferStart = (BYTE *)loader->buff;
     BYTE *buffer = bufferStart;
     BYTE *areaBuff;
@@ -564,49 +822,109 @@ bool LoadSimulation(Dataport *loader) {
 */
     //ReleaseDataport(loader); //Commented out as AccessDataport removed
 
-	// Build all AABBTrees
-	size_t maxDepth = 0;
+	// Compile the reflectivity tables
+    for (auto& mat : sim->materials) {
+        mat.BuildLookupTable();
+    }
 
-    for (auto& s : sHandle->structures) {
-        std::vector<SubprocessFacet*> facetPointers; facetPointers.reserve(s.facets.size());
-        for (auto& f : s.facets) {
-            facetPointers.push_back(&f);
+	// Flatten the angular distributions
+	sim->psiTable.Build(sim->psi_distro, false, true);
+	sim->polarizationTable.Build(sim->parallel_polarization, false, false);
+	sim->chiTables.resize(sim->chi_distros.size());
+	for (size_t i = 0; i < sim->chi_distros.size(); i++) {
+		sim->chiTables[i].Build(sim->chi_distros[i], true, true); //Stored [chi][psi], sampled along chi
+	}
+
+	// Build the ray tracing hierarchies
+    for (size_t i = 0; i < sim->structures.size(); i++) {
+        sim->structures[i].bvh.Build(sim->structures[i].facets, sim->vertices3);
+        if (sim->structures[i].bvh.depth >= BVH_STACK_SIZE) { //IntersectBVH() pushes at most one node per level plus the root
+            char tmp[256];
+            sprintf(tmp, "Structure %zd: ray tracing hierarchy depth %zd exceeds the traversal stack (%d)", i + 1, sim->structures[i].bvh.depth, BVH_STACK_SIZE);
+            SetErrorSub(tmp);
+            return false;
         }
-        s.aabbTree = BuildAABBTree(facetPointers, 0, maxDepth);
     }
 
 	// Initialise simulation
-	ComputeSourceArea();
+	ComputeSourceArea(sim);
 	seed = GetSeed();
 	rseed(seed);
 
-	//--- GSL random init ---
+	//--- Photon streams ---
+	//Counter-based: photon i of a run is the same whatever the number of processes and threads
+	//Set GSL_RNG_SEED to share the run seed between the processes and to replay a run
     gsl_rng_env_setup();                          // Read variable environnement
-    const gsl_rng_type* type = gsl_rng_default;   // Default algorithm 'twister'
-    sHandle->gen = gsl_rng_alloc(type);          // Rand generator allocation
+    sim->randomSeed = getenv("GSL_RNG_SEED") ? (uint64_t)gsl_rng_default_seed : (uint64_t)seed;
+    sim->nbPhotonIndices = 0;
+
+	//Monte-Carlo threads: they share the geometry above, each has its own generator and hit counters
+	SetState(PROCESS_STARTING, "Allocating thread counters");
+	for (size_t t = 0; t < sim->nbThreads; t++) {
+		SimulationThread* thread = new SimulationThread(sim, t);
+		sim->threads.push_back(thread);
+		thread->gen = AllocPhotonStreamRng();
+		SetPhotonStream(thread->gen, &thread->currentParticle.rng); //Photon being traced, set by StartFromSource()
+		if (!thread->InitializeHitStates()) return false;
+		//Reserve particle log
+		if (sim->ontheflyParams.enableLogging)
+			thread->tmpParticleLog.reserve(sim->ontheflyParams.logLimit / sim->ontheflyParams.nbProcess / sim->nbThreads);
+	}
+	sim->workerPool = new WorkerPool(sim->nbThreads);
+	DistributeDesorptionLimit(sim);
+
+	//Tagged and energy band tallies: in the hits dataport after the facets, same layout as the interface's (SynradGeometry::GetTallyLayouts())
+	sim->tallyTotalSize = 0;
+	size_t tallyOffset = GetHitsSize(sim);
+	sim->tallyLayouts.resize(sim->sh.nbFacet);
+	for (auto& f : sim->facets) {
+		size_t nbBands = sim->GetNbEnergyBands(f.globalId);
+		tallyOffset = sim->tallyLayouts[f.globalId].Set(tallyOffset, sim->IsTallied(f.globalId) ? sim->GetNbTallyTags() : 0,
+			f.sh.isProfile, f.sh.isTextured ? f.sh.texWidth : 0, f.sh.isTextured ? f.sh.texHeight : 0,
+			nbBands, nbBands > 0 && sim->energyBands[f.globalId].recordTexture);
+	}
+	sim->tallyTotalSize = tallyOffset - GetHitsSize(sim);
 
-	sHandle->loadOK = true;
+	//Texture and direction tiles: at the end of the hits dataport, taken as photons hit them
+	size_t nbTextureTiles = 0, nbDirectionTiles = 0;
+	for (auto& f : sim->facets) {
+		if (f.sh.isTextured) nbTextureTiles += GetNbTiles(f.sh.texWidth, f.sh.texHeight);
+		if (f.sh.countDirection) nbDirectionTiles += GetNbTiles(f.sh.texWidth, f.sh.texHeight);
+	}
+	size_t poolOffset = GetHitsSize(sim);
+	sim->texturePoolSize = sim->texturePool.Set(poolOffset, nbTextureTiles, nbDirectionTiles, sim->texturePoolMB) - poolOffset;
+
+	//Statistical error targets, checked at every hit update
+	if (!sim->precision.Initialize(*sim)) {
+		SetErrorSub(sim->precision.errorMsg.c_str());
+		return false;
+	}
+
+	sim->loadOK = true;
 	t1 = GetTick();
-	printf("  Load %s successful\n", sHandle->sh.name.c_str());
-	printf("  Geometry: %zd vertex %zd facets\n", sHandle->sh.nbVertex, sHandle->sh.nbFacet);
-	printf("  Region: %zd regions\n", sHandle->wp.nbRegion);
-	printf("  Trajectory points: %zd points\n", sHandle->wp.nbTrajPoints);
+	printf("  Load %s successful\n", sim->sh.name.c_str());
+	printf("  Geometry: %zd vertex %zd facets\n", sim->sh.nbVertex, sim->sh.nbFacet);
+	printf("  Region: %zd regions\n", sim->wp.nbRegion);
+	printf("  Trajectory points: %zd points\n", sim->wp.nbTrajPoints);
 	printf("  Geom size: %d bytes\n", /*(size_t)(buffer - bufferStart)*/0);
-	printf("  Number of stucture: %zd\n", sHandle->sh.nbSuper);
+	printf("  Number of stucture: %zd\n", sim->sh.nbSuper);
 	printf("  Global Hit: %zd bytes\n", sizeof(GlobalHitBuffer));
-	printf("  Facet Hit : %zd bytes\n", sHandle->sh.nbFacet*(int)sizeof(FacetHitBuffer));
-	printf("  Texture   : %zd bytes\n", sHandle->textTotalSize);
-	printf("  Profile   : %zd bytes\n", sHandle->profTotalSize);
-	printf("  Direction : %zd bytes\n", sHandle->dirTotalSize);
-	printf("  Spectrum  : %zd bytes\n", sHandle->spectrumTotalSize);
-	printf("  Total     : %zd bytes\n", GetHitsSize());
-	printf("  Seed: %u\n", seed);
+	printf("  Facet Hit : %zd bytes\n", sim->sh.nbFacet*(int)sizeof(FacetHitBuffer));
+	printf("  Texture   : %zd bytes\n", sim->textTotalSize);
+	printf("  Profile   : %zd bytes\n", sim->profTotalSize);
+	printf("  Direction : %zd bytes\n", sim->dirTotalSize);
+	printf("  Spectrum  : %zd bytes\n", sim->spectrumTotalSize);
+	printf("  Tallies   : %zd bytes\n", sim->tallyTotalSize);
+	printf("  Tile pool : %zd bytes (%zd texture, %zd direction tiles)\n", sim->texturePoolSize, sim->texturePool.textureCapacity, sim->texturePool.directionCapacity);
+	printf("  Total     : %zd bytes\n", GetHitsSize(sim));
+	printf("  Threads   : %zd\n", sim->nbThreads);
+	printf("  Seed: %llu\n", (unsigned long long)sim->randomSeed);
 	printf("  Loading time: %.3f ms\n", (t1 - t0)*1000.0);
 	return true;
 
 }
 
-bool UpdateOntheflySimuParams(Dataport *loader) {
+bool UpdateOntheflySimuParams(Simulation* sim, Dataport *loader) {
 	// Connect the dataport
 	if (!AccessDataportTimed(loader, 2000)) {
 		SetErrorSub("Failed to connect to loader DP");
@@ -614,147 +932,192 @@ bool UpdateOntheflySimuParams(Dataport *loader) {
 	}
 	BYTE* buffer = (BYTE *)loader->buff;
 
-	sHandle->ontheflyParams = READBUFFER(OntheflySimulationParams);
+	sim->ontheflyParams = READBUFFER(OntheflySimulationParams);
 
-	for (size_t i = 0; i < sHandle->wp.nbRegion; i++) {
-		sHandle->regions[i].params.showPhotons = READBUFFER(bool);
+	for (size_t i = 0; i < sim->wp.nbRegion; i++) {
+		sim->regions[i].params.showPhotons = READBUFFER(bool);
 	}
 
 	ReleaseDataport(loader);
 
-	//Reset hit cache
-    sHandle->tmpGlobalResult.hitCacheSize = 0;
-	//memset(sHandle->hitCache, 0, sizeof(HIT)*HITCACHESIZE);
-    sHandle->tmpGlobalResult.leakCacheSize = 0;
-	//memset(sHandle->leakCache, 0, sizeof(LEAK)*LEAKCACHESIZE); //No need to reset, will gradually overwrite
+	for (auto& t : sim->threads) {
+		//Reset hit cache
+		t->tmpGlobalResult.hitCacheSize = 0;
+		//memset(sHandle->hitCache, 0, sizeof(HIT)*HITCACHESIZE);
+		t->tmpGlobalResult.leakCacheSize = 0;
+		//memset(sHandle->leakCache, 0, sizeof(LEAK)*LEAKCACHESIZE); //No need to reset, will gradually overwrite
+		t->photonBatch.Clear(); //Generated with the previous generation mode
+	}
+	DistributeDesorptionLimit(sim);
 
 	return true;
 }
 
-void UpdateHits(Dataport *dpHit, Dataport* dpLog, int prIdx, DWORD timeout) {
+void UpdateHits(Simulation* sim, Dataport *dpHit, Dataport* dpLog, int prIdx, DWORD timeout) {
 
-	UpdateMCHits(dpHit, prIdx, timeout);
-	if (dpLog) UpdateLog(dpLog, timeout);
+	UpdateMCHits(sim, dpHit, prIdx, timeout);
+	if (dpLog) UpdateLog(sim, dpLog, timeout);
 }
 
-size_t GetHitsSize() {
-	return sHandle->textTotalSize + sHandle->profTotalSize + sHandle->dirTotalSize +
-		sHandle->spectrumTotalSize + sHandle->sh.nbFacet * sizeof(FacetHitBuffer) + sizeof(GlobalHitBuffer);
+size_t GetHitsSize(Simulation* sim) {
+	return sim->textTotalSize + sim->profTotalSize + sim->dirTotalSize +
+		sim->spectrumTotalSize + sim->sh.nbFacet * sizeof(FacetHitBuffer) + sizeof(GlobalHitBuffer) + sim->tallyTotalSize + sim->texturePoolSize;
 }
 
-void ResetTmpCounters() {
+void ResetTmpCounters(Simulation* sim) {
 	SetState(NULL, "Resetting local cache...", false, true);
 
-	memset(&sHandle->tmpGlobalResult, 0, sizeof(GlobalHitBuffer));
-
-	sHandle->currentParticle.distTraveledSinceUpdate = 0.0;
-	sHandle->nbLeakSinceUpdate = 0;
-	sHandle->tmpGlobalResult.hitCacheSize = 0;
-	sHandle->tmpGlobalResult.leakCacheSize = 0;
-
-    for (int j = 0; j < sHandle->sh.nbSuper; j++) {
-        for (auto& f : sHandle->structures[j].facets) {
-
-            f.ResetCounter();
-            f.hitted = false;
-
-            std::vector<TextureCell>(f.texture.size()).swap(f.texture);
-            std::vector<ProfileSlice>(f.profile.size()).swap(f.profile);
-            //if (f.sh.recordSpectrum)
-                f.spectrum.ResetCounts();
-            std::vector<DirectionCell>(f.direction.size()).swap(f.direction);
+	for (auto& t : sim->threads) {
+		t->ResetTmpCounters();
+	}
+}
 
+void SimulationThread::ResetTmpCounters() {
+	memset(&tmpGlobalResult, 0, sizeof(GlobalHitBuffer));
 
+	distTraveledSinceUpdate = 0.0;
+	nbLeakSinceUpdate = 0;
+	tmpGlobalResult.hitCacheSize = 0;
+	tmpGlobalResult.leakCacheSize = 0;
 
-        }
-    }
+	for (auto& state : facetStates) {
+		state.Reset();
+	}
 }
 
-void ResetSimulation() {
-    sHandle->currentParticle.lastHitFacet = NULL;
-	sHandle->totalDesorbed = 0;
-	ResetTmpCounters();
-	sHandle->tmpParticleLog.clear();
+void ResetSimulation(Simulation* sim) {
+	for (auto& t : sim->threads) {
+		t->currentParticle.lastHitFacet = NULL;
+		t->totalDesorbed = 0;
+		t->finished = false;
+		t->tmpParticleLog.clear();
+		t->photonBatch.Clear();
+		t->wavefront.clear();
+		t->splitCopies.clear();
+		t->runSeconds = 0.0;
+		t->hitWeightSum = t->hitWeightSquareSum = 0.0;
+		t->nbRouletteKills = t->nbRouletteSurvivals = t->nbSplitCopies = 0;
+		for (auto& timer : t->phaseTimers) timer.Reset();
+	}
+	for (auto& timer : sim->phaseTimers) timer.Reset();
+	sim->nbPhotonIndices = 0; //Photons of the next run are numbered from 0 again
+	sim->precision.Reset();
+	ResetTmpCounters(sim);
 }
 
-bool StartSimulation() {
-	if (sHandle->regions.size() == 0) {
+bool StartSimulation(Simulation* sim) {
+	if (sim->regions.size() == 0) {
 		SetErrorSub("No regions");
 		return false;
 	}
 
 	//Check for invalid material (ID==9) passed from the interface
 	//It is valid to load invalid materials (to extract textures, etc.) but not to launch the simulation
-    for(auto& s : sHandle->structures) {
-		for (auto& f : s.facets) {
-			if (f.sh.reflectType == 9) {
-				char tmp[32];
-				sprintf(tmp, "Invalid material on Facet %zd.", f.globalId + 1);
-				SetErrorSub(tmp);
-				return false;
-			}
+	for (auto& f : sim->facets) {
+		if (f.sh.reflectType == 9) {
+			char tmp[32];
+			sprintf(tmp, "Invalid material on Facet %zd.", f.globalId + 1);
+			SetErrorSub(tmp);
+			return false;
 		}
 	}
 
-	//if (!sHandle->lastHitFacet) StartFromSource();
-    if (!sHandle->currentParticle.lastHitFacet) StartFromSource();
-    //return (sHandle->currentParticle.lastHitFacet != NULL);
-	return true;
+	for (auto& t : sim->threads) {
+		t->finished = false;
+		if (sim->wavefrontSize > 1) t->finished = !t->InitializeWavefront();
+		else if (!t->currentParticle.lastHitFacet) t->finished = !t->StartFromSource();
+	}
+	return !ReportThreadErrors(sim);
 }
 
-void RecordHit(const int &type, const double &dF, const double &dP) {
-	if (sHandle->regions[sHandle->sourceRegionId].params.showPhotons) {
-        if (sHandle->tmpGlobalResult.hitCacheSize < HITCACHESIZE) {
-            sHandle->tmpGlobalResult.hitCache[sHandle->tmpGlobalResult.hitCacheSize].pos = sHandle->currentParticle.position;
-            sHandle->tmpGlobalResult.hitCache[sHandle->tmpGlobalResult.hitCacheSize].type = type;
-            sHandle->tmpGlobalResult.hitCache[sHandle->tmpGlobalResult.hitCacheSize].dF = sHandle->currentParticle.dF;
-            sHandle->tmpGlobalResult.hitCache[sHandle->tmpGlobalResult.hitCacheSize].dP = sHandle->currentParticle.dP;
-
-            sHandle->tmpGlobalResult.hitCacheSize++;
+void SimulationThread::RecordHit(const int &type, const double &dF, const double &dP) {
+	PhaseScope scope(phaseTimers[PHASE_RECORDING]);
+	//In wavefront mode only the first slot is recorded, the interface draws consecutive cache entries as one path
+	if (currentSlot == 0 && model->regions[currentParticle.sourceRegionId].params.showPhotons) {
+        if (tmpGlobalResult.hitCacheSize < HITCACHESIZE) {
+            tmpGlobalResult.hitCache[tmpGlobalResult.hitCacheSize].pos = currentParticle.position;
+            tmpGlobalResult.hitCache[tmpGlobalResult.hitCacheSize].type = type;
+            tmpGlobalResult.hitCache[tmpGlobalResult.hitCacheSize].dF = currentParticle.dF;
+            tmpGlobalResult.hitCache[tmpGlobalResult.hitCacheSize].dP = currentParticle.dP;
+
+            tmpGlobalResult.hitCacheSize++;
         }
 	}
 }
 
-void RecordLeakPos() {
+void SimulationThread::RecordLeakPos() {
 	// Source region check performed when calling this routine 
 	// Record leak for debugging
-	RecordHit(HIT_REF, sHandle->currentParticle.dF, sHandle->currentParticle.dP);
-	RecordHit(HIT_LAST, sHandle->currentParticle.dF, sHandle->currentParticle.dP);
-    if (sHandle->tmpGlobalResult.leakCacheSize < LEAKCACHESIZE) {
-        sHandle->tmpGlobalResult.leakCache[sHandle->tmpGlobalResult.leakCacheSize].pos = sHandle->currentParticle.position;
-        sHandle->tmpGlobalResult.leakCache[sHandle->tmpGlobalResult.leakCacheSize].dir = sHandle->currentParticle.direction;
-        sHandle->tmpGlobalResult.leakCacheSize++;
+	RecordHit(HIT_REF, currentParticle.dF, currentParticle.dP);
+	RecordHit(HIT_LAST, currentParticle.dF, currentParticle.dP);
+    if (tmpGlobalResult.leakCacheSize < LEAKCACHESIZE) {
+        tmpGlobalResult.leakCache[tmpGlobalResult.leakCacheSize].pos = currentParticle.position;
+        tmpGlobalResult.leakCache[tmpGlobalResult.leakCacheSize].dir = currentParticle.direction;
+        tmpGlobalResult.leakCacheSize++;
     }
 }
 
-bool SimulationRun() {
+bool SimulationRun(Simulation* sim) {
+
+	// 1s step on every thread of the pool, the first one runs on the calling (main) thread
+	std::vector<char> endOfRun(sim->nbThreads, false); //not vector<bool>: written concurrently
+	sim->workerPool->Run([sim, &endOfRun](const size_t& t) {
+		endOfRun[t] = sim->threads[t]->SimulationRun();
+	});
+
+	ReportThreadErrors(sim);
+
+	for (const auto& e : endOfRun) {
+		if (!e) return false;
+	}
+	return true; //All threads reached their desorption limit
+
+}
+
+bool SimulationThread::SimulationRun() {
 
 	// 1s step
 	double t0, t1;
 	size_t    nbStep = 1;
 	bool   goOn;
 
-	if (sHandle->stepPerSec == 0.0) {
+	if (finished) return true;
+
+	if (stepPerSec == 0.0) {
 
 		nbStep = 250;
 
 	}
 
-	if (sHandle->stepPerSec != 0.0)
-		nbStep = (size_t)(sHandle->stepPerSec + 0.5);
+	if (stepPerSec != 0.0)
+		nbStep = (size_t)(stepPerSec + 0.5);
 	if (nbStep < 1) nbStep = 1;
 	t0 = GetTick();
+#ifdef SYNRAD_COUNT_ALLOCATIONS
+	size_t allocationsBefore = GetThreadAllocationCount();
+#endif
 
 	goOn = SimulationMCStep(nbStep);
 
+#ifdef SYNRAD_COUNT_ALLOCATIONS
+	allocationsLastStep = GetThreadAllocationCount() - allocationsBefore;
+	if (stepPerSec != 0.0 && allocationsLastStep > 0) //first run is the warm-up (batches, hit buffers, transparent pass buffer)
+		printf("Thread %zd: %zd heap allocations in %zd steps\n", threadId, allocationsLastStep, nbStep);
+#endif
 	t1 = GetTick();
-	sHandle->stepPerSec = (double)(nbStep) / (t1 - t0);
+	runSeconds += t1 - t0;
+	stepPerSec = (double)(nbStep) / (t1 - t0);
 #ifdef _DEBUG
-	printf("Running: stepPerSec = %f\n", sHandle->stepPerSec);
+	printf("Running thread %zd: stepPerSec = %f\n", threadId, stepPerSec);
 #endif
 
-	return !goOn;
+	finished = !goOn;
+	return finished;
+
+}
 
+void SimulationThread::SetThreadError(const std::string& msg) {
+	if (errorMsg.empty()) errorMsg = msg; //Keep the first one
 }
 
 double GetTick() {
@@ -790,59 +1153,32 @@ double GetTick() {
 
 }
 
-bool SubprocessFacet::InitializeOnLoad(const size_t& id) {
+bool SubprocessFacet::InitializeOnLoad(Simulation* sim, const size_t& id) {
     globalId = id;
-    if (!InitializeLinkAndVolatile(id)) return false;
-    if (!InitializeTexture()) return false;
-    if (!InitializeProfile()) return false;
-    if (!InitializeDirectionTexture()) return false;
-    if (!InitializeSpectrum()) return false;
+    if (!InitializeLinkAndVolatile(sim, id)) return false;
+    if (!InitializeTexture(sim)) return false;
+    if (!InitializeProfile(sim)) return false;
+    if (!InitializeDirectionTexture(sim)) return false;
+    if (!InitializeSpectrum(sim)) return false;
 
     return true;
 }
 
-bool SubprocessFacet::InitializeProfile() {
+bool SubprocessFacet::InitializeProfile(Simulation* sim) {
     //Profiles
     if (sh.isProfile) {
         profileSize = PROFILE_SIZE * sizeof(ProfileSlice);
-        try {
-            profile = std::vector<ProfileSlice>(PROFILE_SIZE);
-        }
-        catch (...) {
-            SetErrorSub("Not enough memory to load profiles");
-            return false;
-        }
-        sHandle->profTotalSize += profileSize * (1);
+        sim->profTotalSize += profileSize * (1);
     }
     else profileSize = 0;
     return true;
 }
 
-bool SubprocessFacet::InitializeTexture(){
+bool SubprocessFacet::InitializeTexture(Simulation* sim){
     //Textures
     if (sh.isTextured) {
-        size_t nbE = sh.texWidth*sh.texHeight;
-        textureSize = nbE*sizeof(TextureCell);
-        try {
-            texture.resize(nbE);
-            textureCellIncrements.resize(nbE);
-            largeEnough.resize(nbE);
-        }
-        catch (...) {
-            SetErrorSub("Not enough memory to load textures");
-            return false;
-        }
-
-
-        fullSizeInc = 1E30;
-
-        for (size_t j = 0; j < nbE; j++) {
-            if ((textureCellIncrements[j] > 0.0) && (textureCellIncrements[j] < fullSizeInc)) fullSizeInc = textureCellIncrements[j];
-        }
-        for (size_t j = 0; j < nbE; j++) { //second pass, filter out very small cells
-            largeEnough[j] = (textureCellIncrements[j] < ((5.0f)*fullSizeInc));
-        }
-        sHandle->textTotalSize += textureSize;
+        textureSize = GetTileIndexSize(sh.texWidth, sh.texHeight); //Cells in the texture pool
+        sim->textTotalSize += textureSize;
         iw = 1.0 / (double)sh.texWidthD;
         ih = 1.0 / (double)sh.texHeightD;
         rw = sh.U.Norme() * iw;
@@ -852,54 +1188,82 @@ bool SubprocessFacet::InitializeTexture(){
     return true;
 }
 
-bool SubprocessFacet::InitializeDirectionTexture(){
+bool SubprocessFacet::InitializeTextureIncrements(const double* increments, const size_t& nbIncrements) {
+    //Tiles whose cells are all full size (the inside of the facet) keep no values, only the border tiles do
+    incrementTiles.clear();
+    partialIncrements.clear();
+    nbIncrementTilesX = 0;
+    fullSizeInc = 1E30;
+    if (!sh.isTextured) return true;
+
+    size_t w = sh.texWidth;
+    size_t h = sh.texHeight;
+    size_t nbE = w*h;
+    auto increment = [&](const size_t& u, const size_t& v) { //Missing values are zero-area cells, as the dense vector padded them
+        size_t index = u + v*w;
+        return (index < nbIncrements) ? increments[index] : 0.0;
+    };
+
+    for (size_t j = 0; j < std::min(nbE, nbIncrements); j++) {
+        if ((increments[j] > 0.0) && (increments[j] < fullSizeInc)) fullSizeInc = increments[j];
+    }
+
+    nbIncrementTilesX = (w + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+    size_t nbTilesY = (h + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+    try {
+        incrementTiles.assign(nbIncrementTilesX*nbTilesY, FULL_SIZE_TILE);
+        for (size_t ty = 0; ty < nbTilesY; ty++) {
+            for (size_t tx = 0; tx < nbIncrementTilesX; tx++) {
+                size_t u0 = tx * TEXTURE_TILE_SIZE, v0 = ty * TEXTURE_TILE_SIZE;
+                size_t u1 = std::min(u0 + TEXTURE_TILE_SIZE, w), v1 = std::min(v0 + TEXTURE_TILE_SIZE, h);
+                bool fullSize = true;
+                for (size_t v = v0; v < v1 && fullSize; v++) {
+                    for (size_t u = u0; u < u1 && fullSize; u++) {
+                        fullSize = (increment(u, v) == fullSizeInc);
+                    }
+                }
+                if (fullSize) continue;
+                size_t slot = partialIncrements.size() / TEXTURE_TILE_CELLS;
+                incrementTiles[tx + ty*nbIncrementTilesX] = (uint32_t)slot;
+                partialIncrements.resize(partialIncrements.size() + TEXTURE_TILE_CELLS, 0.0);
+                for (size_t v = v0; v < v1; v++) {
+                    for (size_t u = u0; u < u1; u++) {
+                        partialIncrements[slot * TEXTURE_TILE_CELLS + (v - v0) * TEXTURE_TILE_SIZE + (u - u0)] = increment(u, v);
+                    }
+                }
+            }
+        }
+    }
+    catch (...) {
+        SetErrorSub("Not enough memory to load textures");
+        return false;
+    }
+    return true;
+}
+
+bool SubprocessFacet::InitializeDirectionTexture(Simulation* sim){
     //Direction
     if (sh.countDirection) {
-        directionSize = sh.texWidth*sh.texHeight * sizeof(DirectionCell);
-        try {
-            direction = std::vector<DirectionCell>(directionSize);
-        }
-        catch (...) {
-            SetErrorSub("Not enough memory to load direction textures");
-            return false;
-        }
-        sHandle->dirTotalSize += directionSize;
+        directionSize = GetTileIndexSize(sh.texWidth, sh.texHeight); //Cells in the texture pool
+        sim->dirTotalSize += directionSize;
     }
     else directionSize = 0;
     return true;
 }
 
-bool SubprocessFacet::InitializeSpectrum(){
+bool SubprocessFacet::InitializeSpectrum(Simulation* sim){
     //Spectrum
     if (sh.recordSpectrum) {
         spectrumSize = sizeof(ProfileSlice)*SPECTRUM_SIZE;
-        double min_energy, max_energy;
-        if (sHandle->wp.nbRegion > 0) {
-            min_energy = sHandle->regions[0].params.energy_low_eV;
-            max_energy = sHandle->regions[0].params.energy_hi_eV;
-        }
-        else {
-            min_energy = 10.0;
-            max_energy = 1000000.0;
-        }
-
-        try {
-            spectrum = Histogram(min_energy, max_energy, SPECTRUM_SIZE, true);
-            //spectrum = std::vector<ProfileSlice>(SPECTRUM_SIZE);
-        }
-        catch (...) {
-            SetErrorSub("Not enough memory to load spectrum");
-            return false;
-        }
-        sHandle->spectrumTotalSize += spectrumSize;
+        sim->spectrumTotalSize += spectrumSize;
     }
     else spectrumSize = 0;
 
     return true;
 }
 
-bool SubprocessFacet::InitializeLinkAndVolatile(const size_t & id){
-    sHandle->hasVolatile |= sh.isVolatile;
+bool SubprocessFacet::InitializeLinkAndVolatile(Simulation* sim, const size_t & id){
+    sim->hasVolatile |= sh.isVolatile;
 
     if (sh.superDest || sh.isVolatile) {
         // Link or volatile facet, overides facet settings
@@ -908,9 +1272,8 @@ bool SubprocessFacet::InitializeLinkAndVolatile(const size_t & id){
         //sh.isOpaque = true;
         sh.opacity = 1.0;
         sh.sticking = 0.0;
-        if (((sh.superDest - 1) >= sHandle->sh.nbSuper || sh.superDest < 0)) {
+        if (((sh.superDest - 1) >= sim->sh.nbSuper || sh.superDest < 0)) {
             // Geometry error
-            ClearSimulation();
             //ReleaseDataport(loader);
             std::ostringstream err;
             err << "Invalid structure (wrong link on F#" << id + 1 << ")";
@@ -919,4 +1282,111 @@ bool SubprocessFacet::InitializeLinkAndVolatile(const size_t & id){
         }
     }
     return true;
-}
\ No newline at end of file
+}
+
+bool SimulationThread::InitializeHitStates() {
+	//One set of counters per facet, universal facets included (they are stored once)
+	try {
+		facetStates.resize(model->sh.nbFacet);
+		for (auto& f : model->facets) {
+			if (!facetStates[f.globalId].Initialize(f, model->regions)) return false;
+			if (model->IsTallied(f.globalId)) facetStates[f.globalId].InitializeTagging(model->GetNbTallyTags());
+			size_t nbBands = model->GetNbEnergyBands(f.globalId);
+			if (nbBands > 0) facetStates[f.globalId].InitializeBands(nbBands, model->energyBands[f.globalId].recordTexture);
+		}
+	}
+	catch (...) {
+		SetErrorSub("Not enough memory to allocate thread counters");
+		return false;
+	}
+	return true;
+}
+
+bool FacetHitState::Initialize(const SubprocessFacet& f, const std::vector<Region_mathonly>& regions) {
+	ResetCounter();
+	hitted = false;
+
+	try {
+		if (f.sh.isProfile) profile = std::vector<ProfileSlice>(PROFILE_SIZE);
+	}
+	catch (...) {
+		SetErrorSub("Not enough memory to load profiles");
+		return false;
+	}
+
+	//Tile table shared by texture and direction field, tiles allocated on first hit
+	hasTexture = f.sh.isTextured;
+	hasDirection = f.sh.countDirection;
+	if (hasTexture || hasDirection) {
+		texWidth = f.sh.texWidth;
+		texHeight = f.sh.texHeight;
+	}
+	else texWidth = texHeight = 0;
+	nbTilesX = (texWidth + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+	size_t nbTiles = nbTilesX * ((texHeight + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE);
+	try {
+		tileSlots.assign(nbTiles, NO_TILE);
+	}
+	catch (...) {
+		SetErrorSub("Not enough memory to load textures");
+		return false;
+	}
+	usedTiles.clear();
+	textureTiles.clear();
+	directionTiles.clear();
+	tagSlots.clear(); //Not tallied unless InitializeTagging() or InitializeBands() follows
+	tagged.clear();
+	bands.clear();
+
+	if (f.sh.recordSpectrum) {
+		double min_energy, max_energy;
+		if (regions.size() > 0) {
+			min_energy = regions[0].params.energy_low_eV;
+			max_energy = regions[0].params.energy_hi_eV;
+		}
+		else {
+			min_energy = 10.0;
+			max_energy = 1000000.0;
+		}
+
+		try {
+			spectrum = Histogram(min_energy, max_energy, SPECTRUM_SIZE, true);
+			//spectrum = std::vector<ProfileSlice>(SPECTRUM_SIZE);
+		}
+		catch (...) {
+			SetErrorSub("Not enough memory to load spectrum");
+			return false;
+		}
+	}
+	return true;
+}
+
+void FacetHitState::InitializeTagging(const size_t& nbTags) {
+	tagSlots.assign(nbTags, NO_TAG); //Tags allocated on their first hit, see GetTaggedTally()
+	tagged.clear();
+}
+
+void FacetHitState::InitializeBands(const size_t& nbBands, const bool& withTexture) {
+	//Few bands, all allocated now: the band of a hit is an index, see EnergyBandEdges::GetBand()
+	bands.resize(nbBands);
+	for (size_t b = 0; b < nbBands; b++) {
+		bands[b].tag = b;
+		bands[b].total = ProfileSlice();
+		bands[b].cells.InitializeTagCells(*this, false, withTexture);
+	}
+}
+
+void FacetHitState::InitializeTagCells(const FacetHitState& facetState, const bool& withProfile, const bool& withTexture) {
+	ResetCounter();
+	hitted = false;
+	profile.assign(withProfile ? facetState.profile.size() : 0, ProfileSlice());
+	hasTexture = withTexture && facetState.hasTexture;
+	hasDirection = false;
+	texWidth = facetState.texWidth;
+	texHeight = facetState.texHeight;
+	nbTilesX = facetState.nbTilesX;
+	tileSlots.assign(hasTexture ? facetState.tileSlots.size() : 0, NO_TILE);
+	usedTiles.clear();
+	textureTiles.clear();
+	directionTiles.clear();
+}
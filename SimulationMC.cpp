@@ -30,8 +30,10 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #include "GLApp/MathTools.h"
 #include "SynradTypes.h" //Histogram
 #include <tuple>
+#include <algorithm> //std::sort
+#include <string>
+#include <gsl/gsl_randist.h> //gsl_ran_gaussian
 
-extern Simulation *sHandle;
 extern void SetErrorSub(const char *message);
 
 //extern Distribution2D K_1_3_distribution;
@@ -42,142 +44,268 @@ extern Distribution2D integral_SR_power;
 //extern Distribution2D polarization_distribution;
 //extern Distribution2D g1h2_distribution;
 
-void ComputeSourceArea() {
-	sHandle->sourceArea = sHandle->wp.nbTrajPoints;
+void ComputeSourceArea(Simulation* sim) {
+	sim->sourceArea = sim->wp.nbTrajPoints;
+	sim->sourceSampler.Build(sim->regions, sim->fluxWeightedSources);
 }
 
-void UpdateMCHits(Dataport *dpHit, int prIdx, DWORD timeout) {
+static void ReduceThreadHits(Simulation* sim) {
+	//Adds the facet counters of every thread to the first one, without holding any dataport
+	//Facets are split between workers, so that each destination is written by one worker only
+	if (sim->threads.size() <= 1) return;
+
+	size_t nbWorkers = sim->threads.size();
+	sim->workerPool->Run([sim, nbWorkers](const size_t& worker) {
+		for (size_t i = worker; i < sim->facets.size(); i += nbWorkers) {
+			FacetHitState& destination = sim->threads[0]->facetStates[i];
+			for (size_t t = 1; t < sim->threads.size(); t++) {
+				FacetHitState& source = sim->threads[t]->facetStates[i];
+				if (source.hitted) {
+					destination.Add(source);
+					source.Reset(); //Now counted in the first thread, even if the dataport access fails
+				}
+			}
+		}
+	});
+}
+
+static void AddTallyTexture(const FacetHitState& cells, TextureCell* texture) {
+	cells.ForEachAllocatedCell([&](const size_t& u, const size_t& v, const size_t& cellSlot) {
+		texture[u + v * cells.texWidth] += cells.textureTiles[cellSlot];
+	});
+}
+
+static void AddTaggedTallies(const TallyLayout& layout, const FacetHitState& state, BYTE* buffer) {
+	//Tags hit and energy bands since the last update into their dense blocks of the dataport
+	for (const auto& tally : state.tagged) {
+		*layout.GetTotal(buffer, tally.tag) += tally.total;
+		ProfileSlice* profile = layout.GetProfile(buffer, tally.tag);
+		for (size_t j = 0; j < layout.profileSize && j < tally.cells.profile.size(); j++) profile[j] += tally.cells.profile[j];
+		if (layout.texWidth > 0) AddTallyTexture(tally.cells, layout.GetTexture(buffer, tally.tag));
+	}
+	for (size_t b = 0; b < state.bands.size() && b < layout.nbBands; b++) {
+		*layout.GetBandTotal(buffer, b) += state.bands[b].total;
+		if (layout.bandTexture && state.bands[b].cells.hasTexture) AddTallyTexture(state.bands[b].cells, layout.GetBandTexture(buffer, b));
+	}
+}
+
+static void FindTextureMinimum(Simulation* sim, BYTE* buffer, TextureCell& hitMin) {
+	//Smallest nonzero cell of all textures as the dataport holds them, remembers where each field was found
+	hitMin.count = HITMAX_INT64;
+	hitMin.flux = HITMAX_DOUBLE;
+	hitMin.power = HITMAX_DOUBLE;
+	for (auto& offset : sim->hitMinOffset) offset = 0;
+	for (auto& f : sim->facets) {
+		if (!f.sh.isTextured) continue;
+		GetTextureView(buffer, f.sh, sim->texturePool).ForEachAllocatedCell([&](const size_t& u, const size_t& v, const TextureCell& cell) {
+			size_t cellOffset = (const BYTE*)&cell - buffer;
+			if (cell.count > 0 && cell.count < hitMin.count) {
+				hitMin.count = cell.count;
+				sim->hitMinOffset[0] = cellOffset;
+			}
+			if (!f.IsLargeEnough(f.GetCellIncrement(u, v))) return;
+			if (cell.flux > 0.0 && cell.flux < hitMin.flux) {
+				hitMin.flux = cell.flux;
+				sim->hitMinOffset[1] = cellOffset;
+			}
+			if (cell.power > 0.0 && cell.power < hitMin.power) {
+				hitMin.power = cell.power;
+				sim->hitMinOffset[2] = cellOffset;
+			}
+		});
+	}
+}
+
+void UpdateMCHits(Simulation* sim, Dataport *dpHit, int prIdx, DWORD timeout) {
 
 	BYTE *buffer;
 	GlobalHitBuffer *gHits;
-	TextureCell oldMin, oldMax;
-	size_t i, j, s, x, y;
+	TextureCell oldMin, touchedMin;
+	size_t touchedMinOffset[3] = { 0, 0, 0 };
+	size_t j;
 #ifdef _DEBUG
 	double t0, t1;
 	t0 = GetTick();
 #endif
+	//Heavy part first, so that other processes can use the dataport meanwhile
+	uint64_t reduceStart = ReadTsc();
+	ReduceThreadHits(sim);
+
 	SetState(NULL, "Waiting for 'hits' dataport access...", false, true);
-	sHandle->lastHitUpdateOK = AccessDataportTimed(dpHit, timeout);
+	uint64_t waitStart = ReadTsc();
+	sim->lastHitUpdateOK = AccessDataportTimed(dpHit, timeout);
+	uint64_t copyStart = ReadTsc();
+	sim->phaseTimers[PHASE_HITWAIT].Add(copyStart - waitStart);
 	SetState(NULL, "Updating MC hits...", false, true);
-	if (!sHandle->lastHitUpdateOK) return;
+	if (!sim->lastHitUpdateOK) {
+		sim->phaseTimers[PHASE_HITUPDATE].Add(waitStart - reduceStart);
+		return;
+	}
 
 	buffer = (BYTE*)dpHit->buff;
 	gHits = (GlobalHitBuffer *)buffer;
 
 	// Global hits and leaks
-	gHits->globalHits.hit.nbMCHit += sHandle->tmpGlobalResult.globalHits.hit.nbMCHit;
-	gHits->globalHits.hit.nbHitEquiv += sHandle->tmpGlobalResult.globalHits.hit.nbHitEquiv;
-	gHits->globalHits.hit.nbAbsEquiv += sHandle->tmpGlobalResult.globalHits.hit.nbAbsEquiv;
-	gHits->globalHits.hit.nbDesorbed += sHandle->tmpGlobalResult.globalHits.hit.nbDesorbed;
-	gHits->globalHits.hit.fluxAbs += sHandle->tmpGlobalResult.globalHits.hit.fluxAbs;
-	gHits->globalHits.hit.powerAbs += sHandle->tmpGlobalResult.globalHits.hit.powerAbs;
-    gHits->distTraveledTotal += sHandle->currentParticle.distTraveledSinceUpdate;
+	for (auto& t : sim->threads) {
+		gHits->globalHits.hit.nbMCHit += t->tmpGlobalResult.globalHits.hit.nbMCHit;
+		gHits->globalHits.hit.nbHitEquiv += t->tmpGlobalResult.globalHits.hit.nbHitEquiv;
+		gHits->globalHits.hit.nbAbsEquiv += t->tmpGlobalResult.globalHits.hit.nbAbsEquiv;
+		gHits->globalHits.hit.nbDesorbed += t->tmpGlobalResult.globalHits.hit.nbDesorbed;
+		gHits->globalHits.hit.fluxAbs += t->tmpGlobalResult.globalHits.hit.fluxAbs;
+		gHits->globalHits.hit.powerAbs += t->tmpGlobalResult.globalHits.hit.powerAbs;
+		gHits->distTraveledTotal += t->distTraveledSinceUpdate;
+	}
 
 	oldMin = gHits->hitMin;
-	oldMax = gHits->hitMax;
-
-	gHits->hitMin.count = HITMAX_INT64;
-	gHits->hitMax.count = 0;
-	gHits->hitMin.flux = HITMAX_DOUBLE;
-	gHits->hitMax.flux = 0;
-	gHits->hitMin.power = HITMAX_DOUBLE;
-	gHits->hitMax.power = 0;
+
+	//Maximum: cells only grow, so it's the old maximum or a cell touched now
+	//Minimum of the nonzero cells: the old minimum or a cell touched now, unless the old minimum's cell grew.
+	//Then, or if another process or a reset changed the minimum (its cell is unknown here), all textures are searched
+	touchedMin.count = HITMAX_INT64;
+	touchedMin.flux = HITMAX_DOUBLE;
+	touchedMin.power = HITMAX_DOUBLE;
 	//for(i=0;i<BOUNCEMAX;i++) gHits->wallHits[i] += sHandle->wallHits[i];
 
 	// Leak
-	for (size_t leakIndex = 0; leakIndex < sHandle->tmpGlobalResult.leakCacheSize; leakIndex++)
-		gHits->leakCache[(leakIndex + gHits->lastLeakIndex) % LEAKCACHESIZE] = sHandle->tmpGlobalResult.leakCache[leakIndex];
-	gHits->nbLeakTotal += sHandle->nbLeakSinceUpdate;
-	gHits->lastLeakIndex = (gHits->lastLeakIndex + sHandle->tmpGlobalResult.leakCacheSize) % LEAKCACHESIZE;
-	gHits->leakCacheSize = Min(LEAKCACHESIZE, gHits->leakCacheSize + sHandle->tmpGlobalResult.leakCacheSize);
+	for (auto& t : sim->threads) {
+		for (size_t leakIndex = 0; leakIndex < t->tmpGlobalResult.leakCacheSize; leakIndex++)
+			gHits->leakCache[(leakIndex + gHits->lastLeakIndex) % LEAKCACHESIZE] = t->tmpGlobalResult.leakCache[leakIndex];
+		gHits->nbLeakTotal += t->nbLeakSinceUpdate;
+		gHits->lastLeakIndex = (gHits->lastLeakIndex + t->tmpGlobalResult.leakCacheSize) % LEAKCACHESIZE;
+		gHits->leakCacheSize = Min(LEAKCACHESIZE, gHits->leakCacheSize + t->tmpGlobalResult.leakCacheSize);
+	}
 
-	// Hit cache (Only prIdx 0)
+	// Hit cache (Only prIdx 0, first thread: consecutive hits of one particle make the trajectory lines)
 	if (prIdx == 0) {
-		for (size_t hitIndex = 0; hitIndex < sHandle->tmpGlobalResult.hitCacheSize; hitIndex++)
-			gHits->hitCache[(hitIndex + gHits->lastHitIndex) % HITCACHESIZE] = sHandle->tmpGlobalResult.hitCache[hitIndex];
+		const GlobalHitBuffer& threadResult = sim->threads[0]->tmpGlobalResult;
+		for (size_t hitIndex = 0; hitIndex < threadResult.hitCacheSize; hitIndex++)
+			gHits->hitCache[(hitIndex + gHits->lastHitIndex) % HITCACHESIZE] = threadResult.hitCache[hitIndex];
 
-		if (sHandle->tmpGlobalResult.hitCacheSize > 0) {
-			gHits->lastHitIndex = (gHits->lastHitIndex + sHandle->tmpGlobalResult.hitCacheSize) % HITCACHESIZE;
+		if (threadResult.hitCacheSize > 0) {
+			gHits->lastHitIndex = (gHits->lastHitIndex + threadResult.hitCacheSize) % HITCACHESIZE;
 
 			//if (gHits->lastHitIndex < (HITCACHESIZE - 1)) {
 			//	gHits->lastHitIndex++;
 				gHits->hitCache[gHits->lastHitIndex].type = HIT_LAST; //Penup (border between blocks of consecutive hits in the hit cache)
 			//}
 
-			gHits->hitCacheSize = Min(HITCACHESIZE, gHits->hitCacheSize + sHandle->tmpGlobalResult.hitCacheSize);
+			gHits->hitCacheSize = Min(HITCACHESIZE, gHits->hitCacheSize + threadResult.hitCacheSize);
 		}
 	}
 
-	// Facets
-	for (s = 0; s < sHandle->sh.nbSuper; s++) {
-        for (auto& f : sHandle->structures[s].facets) {
+	// Facets (counters of all threads already reduced to the first one)
+	SimulationThread* merged = sim->threads[0];
+	TexturePoolHeader* poolHeader = sim->texturePool.GetHeader(buffer);
+	for (auto& f : sim->facets) { //Universal facets are stored once: merged once
 
-			if (f.hitted) {
+		FacetHitState& state = merged->facetStates[f.globalId];
 
-				FacetHitBuffer *fFit = (FacetHitBuffer *)(buffer + f.sh.hitOffset);
-				*fFit += f.tmpCounter;
+		if (state.hitted) {
 
-				if (f.sh.isProfile) {
-					ProfileSlice *shProfile = (ProfileSlice *)(buffer + (f.sh.hitOffset + sizeof(FacetHitBuffer)));
-					for (j = 0; j < PROFILE_SIZE; j++) {
-						shProfile[j] += f.profile[j];
-					}
+			FacetHitBuffer *fFit = (FacetHitBuffer *)(buffer + f.sh.hitOffset);
+			*fFit += state.tmpCounter;
+			if (!state.tagged.empty() || !state.bands.empty()) AddTaggedTallies(sim->tallyLayouts[f.globalId], state, buffer);
+
+			if (f.sh.isProfile) {
+				ProfileSlice *shProfile = (ProfileSlice *)(buffer + (f.sh.hitOffset + sizeof(FacetHitBuffer)));
+				for (j = 0; j < PROFILE_SIZE; j++) {
+					shProfile[j] += state.profile[j];
 				}
+			}
 
-				size_t profileSize = (f.sh.isProfile) ? PROFILE_SIZE*sizeof(ProfileSlice) : 0;
-
-				if (f.sh.isTextured) {
-					size_t nbTextureCells = f.sh.texHeight*f.sh.texWidth;
-					TextureCell *shTexture = (TextureCell *)(buffer + (f.sh.hitOffset + sizeof(FacetHitBuffer) + profileSize));
-					for (y = 0; y < f.sh.texHeight; y++) {
-						for (x = 0; x < f.sh.texWidth; x++) {
-							size_t index = x + y*f.sh.texWidth;
-							//Increase value
-							shTexture[index] += f.texture[index];
-							//Adjust min/max
-							if (shTexture[index].count > gHits->hitMax.count)	gHits->hitMax.count = shTexture[index].count;
-							if (shTexture[index].count > 0 && shTexture[index].count < gHits->hitMin.count) gHits->hitMin.count = shTexture[index].count;
-							if (shTexture[index].flux > gHits->hitMax.flux && f.largeEnough[index]) gHits->hitMax.flux = shTexture[index].flux;
-							if (shTexture[index].flux > 0.0 && shTexture[index].flux < gHits->hitMin.flux && f.largeEnough[index]) gHits->hitMin.flux = shTexture[index].flux;
-							if (shTexture[index].power > gHits->hitMax.power && f.largeEnough[index]) gHits->hitMax.power = shTexture[index].power;
-							if (shTexture[index].power > 0.0 && shTexture[index].power < gHits->hitMin.power && f.largeEnough[index]) gHits->hitMin.power = shTexture[index].power;
+			size_t profileSize = (f.sh.isProfile) ? PROFILE_SIZE*sizeof(ProfileSlice) : 0;
+
+			if (f.sh.isTextured) { //Tile by tile, into the dataport tiles of the same position, taken from the pool if needed
+				uint32_t *shIndex = (uint32_t *)(buffer + (f.sh.hitOffset + sizeof(FacetHitBuffer) + profileSize));
+				for (size_t slot = 0; slot < state.usedTiles.size(); slot++) {
+					size_t tile = state.usedTiles[slot];
+					const TextureCell *cells = &state.textureTiles[slot * TEXTURE_TILE_CELLS];
+					TextureCell *shTile = sim->texturePool.AllocateTextureTile(buffer, shIndex, tile);
+					if (!shTile) { //Pool full: the facet counters have these hits, the texture doesn't
+						for (size_t c = 0; c < TEXTURE_TILE_CELLS; c++) poolHeader->nbLostHits += cells[c].count;
+						continue;
+					}
+					size_t u0 = (tile % state.nbTilesX) * TEXTURE_TILE_SIZE, v0 = (tile / state.nbTilesX) * TEXTURE_TILE_SIZE;
+					for (size_t c = 0; c < TEXTURE_TILE_CELLS; c++) {
+						if (cells[c].count == 0) continue; //Untouched or outside the texture, doesn't change min/max
+						TextureCell& shCell = shTile[c];
+						//Increase value
+						shCell += cells[c];
+						//Adjust min/max
+						size_t cellOffset = (BYTE*)&shCell - buffer;
+						if (shCell.count > gHits->hitMax.count)	gHits->hitMax.count = shCell.count;
+						if (shCell.count < touchedMin.count) {
+							touchedMin.count = shCell.count;
+							touchedMinOffset[0] = cellOffset;
+						}
+						if (f.IsLargeEnough(f.GetCellIncrement(u0 + c % TEXTURE_TILE_SIZE, v0 + c / TEXTURE_TILE_SIZE))) {
+							if (shCell.flux > gHits->hitMax.flux) gHits->hitMax.flux = shCell.flux;
+							if (shCell.flux > 0.0 && shCell.flux < touchedMin.flux) {
+								touchedMin.flux = shCell.flux;
+								touchedMinOffset[1] = cellOffset;
+							}
+							if (shCell.power > gHits->hitMax.power) gHits->hitMax.power = shCell.power;
+							if (shCell.power > 0.0 && shCell.power < touchedMin.power) {
+								touchedMin.power = shCell.power;
+								touchedMinOffset[2] = cellOffset;
+							}
 						}
 					}
 				}
+			}
 
-				if (f.sh.countDirection) {
-					DirectionCell *shDir = (DirectionCell *)(buffer + (f.sh.hitOffset + sizeof(FacetHitBuffer) + profileSize + f.textureSize));
-					for (y = 0; y < f.sh.texHeight; y++) {
-						for (x = 0; x < f.sh.texWidth; x++) {
-							size_t add = x + y*f.sh.texWidth;
-							shDir[add].dir += f.direction[add].dir;
-							shDir[add].count += f.direction[add].count;
-						}
+			if (f.sh.countDirection) {
+				uint32_t *shIndex = (uint32_t *)(buffer + (f.sh.hitOffset + sizeof(FacetHitBuffer) + profileSize + f.textureSize));
+				for (size_t slot = 0; slot < state.usedTiles.size(); slot++) {
+					DirectionCell *shTile = sim->texturePool.AllocateDirectionTile(buffer, shIndex, state.usedTiles[slot]);
+					if (!shTile) continue; //Pool full
+					const DirectionCell *cells = &state.directionTiles[slot * TEXTURE_TILE_CELLS];
+					for (size_t c = 0; c < TEXTURE_TILE_CELLS; c++) {
+						shTile[c].dir += cells[c].dir;
+						shTile[c].count += cells[c].count;
 					}
 				}
+			}
 
-				if (f.sh.recordSpectrum) {
-					ProfileSlice *shSpectrum = (ProfileSlice *)(buffer + (f.sh.hitOffset + sizeof(FacetHitBuffer) + profileSize
-						+ f.textureSize + f.directionSize));
-					for (j = 0; j < SPECTRUM_SIZE; j++) {
-						shSpectrum[j] += f.spectrum.GetCounts(j);
-					}
+			if (f.sh.recordSpectrum) {
+				ProfileSlice *shSpectrum = (ProfileSlice *)(buffer + (f.sh.hitOffset + sizeof(FacetHitBuffer) + profileSize
+					+ f.textureSize + f.directionSize));
+				for (j = 0; j < SPECTRUM_SIZE; j++) {
+					shSpectrum[j] += state.spectrum.GetCounts(j);
 				}
+			}
 
-			} // End if(hitted)
-		} // End nbFacet
-	} // End nbSuper
+		} // End if(hitted)
+	} // End nbFacet
 
-	//if there were no textures:
-	if (gHits->hitMin.count == HITMAX_INT64) gHits->hitMin.count = oldMin.count;
-	if (gHits->hitMax.count == 0) gHits->hitMax.count = oldMax.count;
-	if (gHits->hitMin.flux == HITMAX_DOUBLE) gHits->hitMin.flux = oldMin.flux;
-	if (gHits->hitMax.flux == 0.0) gHits->hitMax.flux = oldMax.flux;
-	if (gHits->hitMin.power == HITMAX_DOUBLE) gHits->hitMin.power = oldMin.power;
-	if (gHits->hitMax.power == 0.0) gHits->hitMax.power = oldMax.power;
+	//Minimum: still valid if it is the one this process wrote and its cells didn't grow since (in any process)
+	bool searchAll = oldMin.count != sim->lastHitMin.count || oldMin.flux != sim->lastHitMin.flux || oldMin.power != sim->lastHitMin.power;
+	if (sim->hitMinOffset[0] && ((TextureCell *)(buffer + sim->hitMinOffset[0]))->count != oldMin.count) searchAll = true;
+	if (sim->hitMinOffset[1] && ((TextureCell *)(buffer + sim->hitMinOffset[1]))->flux != oldMin.flux) searchAll = true;
+	if (sim->hitMinOffset[2] && ((TextureCell *)(buffer + sim->hitMinOffset[2]))->power != oldMin.power) searchAll = true;
+	if (searchAll) {
+		FindTextureMinimum(sim, buffer, gHits->hitMin);
+	}
+	else {
+		if (touchedMin.count < oldMin.count) {
+			gHits->hitMin.count = touchedMin.count;
+			sim->hitMinOffset[0] = touchedMinOffset[0];
+		}
+		if (touchedMin.flux < oldMin.flux) {
+			gHits->hitMin.flux = touchedMin.flux;
+			sim->hitMinOffset[1] = touchedMinOffset[1];
+		}
+		if (touchedMin.power < oldMin.power) {
+			gHits->hitMin.power = touchedMin.power;
+			sim->hitMinOffset[2] = touchedMinOffset[2];
+		}
+	}
+	sim->lastHitMin = gHits->hitMin;
 
 	ReleaseDataport(dpHit);
-	ResetTmpCounters();
+	sim->precision.AddBatch(*sim); //This update is one batch of the error estimates
+	ResetTmpCounters(sim);
+	sim->phaseTimers[PHASE_HITUPDATE].Add(waitStart - reduceStart + ReadTsc() - copyStart);
 	extern char* GetSimuStatus();
 	SetState(NULL, GetSimuStatus(), false, true);
 
@@ -190,7 +318,7 @@ void UpdateMCHits(Dataport *dpHit, int prIdx, DWORD timeout) {
 
 // Compute particle teleport
 
-void PerformTeleport(SubprocessFacet& collidedFacet) {
+void SimulationThread::PerformTeleport(SubprocessFacet& collidedFacet) {
 
 	//Search destination
 	bool found = false;
@@ -198,53 +326,49 @@ void PerformTeleport(SubprocessFacet& collidedFacet) {
     SubprocessFacet* destination;
 
 	if (collidedFacet.sh.teleportDest == -1) {
-		destIndex = sHandle->currentParticle.teleportedFrom;
+		destIndex = currentParticle.teleportedFrom;
 		if (destIndex == -1) {
 			/*char err[128];
 			sprintf(err, "Facet %d tried to teleport to the facet where the particle came from, but there is no such facet.", collidedFacet.globalId + 1);
 			SetErrorSub(err);*/
-			RecordHit(HIT_REF, sHandle->currentParticle.dF, sHandle->currentParticle.dP);
-			sHandle->currentParticle.lastHitFacet = &collidedFacet;
+			RecordHit(HIT_REF, currentParticle.dF, currentParticle.dP);
+			currentParticle.lastHitFacet = &collidedFacet;
 			return; //LEAK
 		}
 	}
 	else destIndex = collidedFacet.sh.teleportDest - 1;
 
-	//Look in which superstructure is the destination facet:
-	for (size_t i = 0; i < sHandle->sh.nbSuper && (!found); i++) {
-		for (size_t j = 0; j < sHandle->structures[i].facets.size() && (!found); j++) {
-			if (destIndex == sHandle->structures[i].facets[j].globalId) {
-                destination = &(sHandle->structures[i].facets[j]);
-				if (destination->sh.superIdx != -1) {
-                    sHandle->currentParticle.structureId = destination->sh.superIdx; //change current superstructure, unless universal facet
-				}
-                sHandle->currentParticle.teleportedFrom = (int)collidedFacet.globalId; //memorize where the particle came from
-				found = true;
-			}
+	//Facets are stored by global index, the destination tells its superstructure:
+	if (destIndex >= 0 && (size_t)destIndex < model->facets.size()) {
+		destination = &(model->facets[destIndex]);
+		if (destination->sh.superIdx != -1) {
+			currentParticle.structureId = destination->sh.superIdx; //change current superstructure, unless universal facet
 		}
+		currentParticle.teleportedFrom = (int)collidedFacet.globalId; //memorize where the particle came from
+		found = true;
 	}
 	if (!found) {
 		/*char err[128];
 		sprintf(err, "Teleport destination of facet %d not found (facet %d does not exist)", collidedFacet.globalId + 1, collidedFacet.sh.teleportDest);
 		SetErrorSub(err);*/
-		RecordHit(HIT_REF, sHandle->currentParticle.dF, sHandle->currentParticle.dP);
-		sHandle->currentParticle.lastHitFacet = &collidedFacet;
+		RecordHit(HIT_REF, currentParticle.dF, currentParticle.dP);
+		currentParticle.lastHitFacet = &collidedFacet;
 		return; //LEAK
 	}
 
 	// Count this hit as a transparent pass
-	RecordHit(HIT_TELEPORTSOURCE, sHandle->currentParticle.dF, sHandle->currentParticle.dP);
-	if (/*collidedFacet.texture &&*/ collidedFacet.sh.countTrans) RecordHitOnTexture(collidedFacet, sHandle->currentParticle.dF, sHandle->currentParticle.dP);
+	RecordHit(HIT_TELEPORTSOURCE, currentParticle.dF, currentParticle.dP);
+	if (/*collidedFacet.texture &&*/ collidedFacet.sh.countTrans) RecordHitOnTexture(collidedFacet, currentParticle.dF, currentParticle.dP);
 
 	// Relaunch particle from new facet
-    auto[inTheta, inPhi] = CartesianToPolar(sHandle->currentParticle.direction, collidedFacet.sh.nU,collidedFacet.sh.nV, collidedFacet.sh.N);
-    sHandle->currentParticle.direction = PolarToCartesian(destination, inTheta, inPhi, false);
+    auto[inTheta, inPhi] = CartesianToPolar(currentParticle.direction, collidedFacet.sh.nU,collidedFacet.sh.nV, collidedFacet.sh.N);
+    currentParticle.direction = PolarToCartesian(destination, inTheta, inPhi, false);
 
     // Move particle to teleport destination point
-	sHandle->currentParticle.position = destination->sh.O + collidedFacet.colU*destination->sh.U + collidedFacet.colV*destination->sh.V;
+	currentParticle.position = destination->sh.O + currentParticle.colU*destination->sh.U + currentParticle.colV*destination->sh.V;
 
-	RecordHit(HIT_TELEPORTDEST, sHandle->currentParticle.dF, sHandle->currentParticle.dP);
-	sHandle->currentParticle.lastHitFacet = destination;
+	RecordHit(HIT_TELEPORTDEST, currentParticle.dF, currentParticle.dP);
+	currentParticle.lastHitFacet = destination;
 
 	//Count hits on teleport facets (only TP source)
 	//collidedFacet.counter.nbAbsorbed++;
@@ -254,202 +378,298 @@ void PerformTeleport(SubprocessFacet& collidedFacet) {
 	increment.count_absorbed = 0;
 	increment.count_incident = 1;
 	increment.flux_absorbed = 0.0;
-	increment.flux_incident = sHandle->currentParticle.dF;
+	increment.flux_incident = currentParticle.dF;
 	increment.power_absorbed = 0.0;
-	increment.power_incident = sHandle->currentParticle.dP;
-	ProfileFacet(collidedFacet, sHandle->currentParticle.energy, increment); //Put here since removed from Intersect() routine
+	increment.power_incident = currentParticle.dP;
+	ProfileFacet(collidedFacet, currentParticle.energy, increment); //Put here since removed from Intersect() routine
 
-	collidedFacet.tmpCounter.hit.nbMCHit++;//destination->counter.nbMCHit++;
-	collidedFacet.tmpCounter.hit.nbHitEquiv += sHandle->currentParticle.oriRatio;
-	collidedFacet.tmpCounter.hit.fluxAbs += sHandle->currentParticle.dF;//destination->counter.fluxAbs+=sHandle->dF;
-	collidedFacet.tmpCounter.hit.powerAbs += sHandle->currentParticle.dP;//destination->counter.powerAbs+=sHandle->dP;
+	facetStates[collidedFacet.globalId].tmpCounter.hit.nbMCHit++;//destination->counter.nbMCHit++;
+	facetStates[collidedFacet.globalId].tmpCounter.hit.nbHitEquiv += currentParticle.oriRatio;
+	facetStates[collidedFacet.globalId].tmpCounter.hit.fluxAbs += currentParticle.dF;//destination->counter.fluxAbs+=sHandle->dF;
+	facetStates[collidedFacet.globalId].tmpCounter.hit.powerAbs += currentParticle.dP;//destination->counter.powerAbs+=sHandle->dP;
 }
 
 // Perform nbStep simulation steps (a step is a bounce)
 
-bool SimulationMCStep(const size_t& nbStep) {
+bool SimulationThread::SimulationMCStep(const size_t& nbStep) {
+
+	if (model->wavefrontSize > 1) return SimulationWavefrontStep(nbStep);
 
 	// Perform simulation steps
 	for (size_t i = 0; i < nbStep; i++) {
 
 		//std::tie(found,collidedFacetPtr,d) = Intersect(sHandle->pPos, sHandle->pDir); //May decide reflection type
-        auto[found, collidedFacetPtr, d] = Intersect(sHandle, sHandle->currentParticle.position, sHandle->currentParticle.direction);
+		bool timed = phaseTimers[PHASE_INTERSECT].Start();
+        auto[found, collidedFacetPtr, d] = Intersect();
+		if (timed) phaseTimers[PHASE_INTERSECT].Stop();
+		if (!ProcessCollision(found, collidedFacetPtr, d)) return false;
+	} //end step
+	return true;
+}
 
-		if (found) {
-			
-			SubprocessFacet& collidedFacet = *collidedFacetPtr; //better readability and passing as reference argument during this function
+// Wavefront mode: several particles per thread, traced together then bounced one by one
+
+bool SimulationThread::InitializeWavefront() {
+	//Starts a photon in every inactive slot (all of them the first time)
+	if (wavefront.size() != model->wavefrontSize) {
+		wavefront.assign(model->wavefrontSize, CurrentParticleStatus());
+		wavefrontActive.assign(model->wavefrontSize, false);
+		wavefrontHits.resize(model->wavefrontSize);
+	}
+	bool anyActive = false;
+	for (size_t slot = 0; slot < wavefront.size(); slot++) {
+		if (!wavefrontActive[slot]) {
+			currentSlot = slot;
+			std::swap(currentParticle, wavefront[slot]);
+			wavefrontActive[slot] = StartFromSource();
+			std::swap(currentParticle, wavefront[slot]);
+			currentSlot = 0;
+			if (!errorMsg.empty()) return false;
+		}
+		anyActive = anyActive || wavefrontActive[slot];
+	}
+	return anyActive;
+}
+
+bool SimulationThread::SimulationWavefrontStep(const size_t& nbStep) {
+
+	std::vector<size_t>& order = wavefrontOrder;
+	order.reserve(wavefront.size());
+	size_t nbDone = 0;
+	while (nbDone < nbStep) {
+
+		//Active particles, grouped by structure then direction octant so that packets are coherent
+		order.clear();
+		for (size_t slot = 0; slot < wavefront.size(); slot++) {
+			if (wavefrontActive[slot]) order.push_back(slot);
+		}
+		if (order.empty()) return false; //desorption limit reached on every slot
+		std::sort(order.begin(), order.end(), [this](const size_t& a, const size_t& b) {
+			const CurrentParticleStatus& pa = wavefront[a];
+			const CurrentParticleStatus& pb = wavefront[b];
+			size_t keyA = pa.structureId * 8 + (pa.direction.x < 0.0) + 2 * (pa.direction.y < 0.0) + 4 * (pa.direction.z < 0.0);
+			size_t keyB = pb.structureId * 8 + (pb.direction.x < 0.0) + 2 * (pb.direction.y < 0.0) + 4 * (pb.direction.z < 0.0);
+			return keyA < keyB;
+		});
+
+		//Intersection pass
+		for (size_t first = 0; first < order.size();) {
+			size_t nbRays = 1;
+			while (nbRays < RAY_PACKET_SIZE && first + nbRays < order.size()
+				&& wavefront[order[first + nbRays]].structureId == wavefront[order[first]].structureId) nbRays++;
+			bool timed = phaseTimers[PHASE_INTERSECT].Start(nbRays);
+			IntersectPacket(&order[first], nbRays);
+			if (timed) phaseTimers[PHASE_INTERSECT].Stop();
+			first += nbRays;
+		}
+
+		//Bounce pass, each particle takes the place of currentParticle
+		for (auto& slot : order) {
+			currentSlot = slot;
+			std::swap(currentParticle, wavefront[slot]);
+			const FacetCollision& hit = wavefrontHits[slot];
+			bool found = (hit.facet != NULL);
+			ApplyCollision(found, hit);
+			wavefrontActive[slot] = ProcessCollision(found, hit.facet, hit.colDist);
+			std::swap(currentParticle, wavefront[slot]);
+			if (!errorMsg.empty()) {
+				currentSlot = 0;
+				return false;
+			}
+		}
+		currentSlot = 0;
+		nbDone += order.size();
+	}
+	return true;
+}
 
-			// Move particle to intersection point
-			sHandle->currentParticle.position = sHandle->currentParticle.position + d*sHandle->currentParticle.direction;
-			sHandle->currentParticle.distTraveledSinceUpdate += d;
-			LogHit(&collidedFacet);
+// Handle what Intersect() found: a bounce, absorption, pass or leak. Returns false if no new particle could be started
 
-			if (collidedFacet.sh.teleportDest) {
-				PerformTeleport(collidedFacet); //increases hit, flux, power counters
+bool SimulationThread::ProcessCollision(const bool& found, SubprocessFacet* collidedFacetPtr, const double& d) {
+
+	if (found) {
+		
+		SubprocessFacet& collidedFacet = *collidedFacetPtr; //better readability and passing as reference argument during this function
+		size_t previousStructure = currentParticle.structureId;
+		particleRestarted = false;
+
+		// Move particle to intersection point
+		currentParticle.position = currentParticle.position + d*currentParticle.direction;
+		distTraveledSinceUpdate += d;
+		hitWeightSum += currentParticle.oriRatio;
+		hitWeightSquareSum += currentParticle.oriRatio * currentParticle.oriRatio;
+		LogHit(collidedFacet);
+
+		if (collidedFacet.sh.teleportDest) {
+			PerformTeleport(collidedFacet); //increases hit, flux, power counters
+		}
+		else {
+			// Record incident
+			tmpGlobalResult.globalHits.hit.nbMCHit++;
+			tmpGlobalResult.globalHits.hit.nbHitEquiv += currentParticle.oriRatio;
+			facetStates[collidedFacet.globalId].tmpCounter.hit.nbMCHit++;
+			facetStates[collidedFacet.globalId].tmpCounter.hit.nbHitEquiv += currentParticle.oriRatio;
+			if (collidedFacet.sh.superDest) {	// Handle super structure link facet
+                    currentParticle.structureId = collidedFacet.sh.superDest - 1;
+				// Count this hit as a transparent pass
+				RecordHit(HIT_TRANS, currentParticle.dF, currentParticle.dP);
+				ProfileSlice increment;
+				increment.count_absorbed = 0;
+				increment.count_incident = 1;
+				increment.flux_absorbed = 0.0;
+				increment.flux_incident = currentParticle.dF;
+				increment.power_absorbed = 0.0;
+				increment.power_incident = currentParticle.dP;
+				ProfileFacet(collidedFacet, currentParticle.energy, increment);
+				
+				if (/*collidedFacet.texture &&*/ collidedFacet.sh.countTrans) RecordHitOnTexture(collidedFacet, currentParticle.dF, currentParticle.dP);
 			}
-			else {
-				// Record incident
-				sHandle->tmpGlobalResult.globalHits.hit.nbMCHit++;
-				sHandle->tmpGlobalResult.globalHits.hit.nbHitEquiv += sHandle->currentParticle.oriRatio;
-				collidedFacet.tmpCounter.hit.nbMCHit++;
-				collidedFacet.tmpCounter.hit.nbHitEquiv += sHandle->currentParticle.oriRatio;
-				if (collidedFacet.sh.superDest) {	// Handle super structure link facet
-                    sHandle->currentParticle.structureId = collidedFacet.sh.superDest - 1;
-					// Count this hit as a transparent pass
-					RecordHit(HIT_TRANS, sHandle->currentParticle.dF, sHandle->currentParticle.dP);
-					ProfileSlice increment;
-					increment.count_absorbed = 0;
-					increment.count_incident = 1;
-					increment.flux_absorbed = 0.0;
-					increment.flux_incident = sHandle->currentParticle.dF;
-					increment.power_absorbed = 0.0;
-					increment.power_incident = sHandle->currentParticle.dP;
-					ProfileFacet(collidedFacet, sHandle->currentParticle.energy, increment);
+			else { //Not superDest or Teleport
+				if (model->wp.newReflectionModel) {
+					//New reflection model (Synrad 1.4)
+					double inTheta, inPhi;
+					std::tie(inTheta,inPhi) = CartesianToPolar(currentParticle.direction,collidedFacet.sh.nU,collidedFacet.sh.nV,collidedFacet.sh.N);
+
+					double stickingProbability;
+					bool complexScattering; //forward/diffuse/back/transparent/stick
+					ReflectionProbabilities materialReflProbabilities = {}; //0: forward reflection, 1: diffuse, 2: backscattering, 3: transparent, 100%-(0+1+2+3): absorption
+
+					if (currentParticle.dF == 0.0 || currentParticle.dP == 0.0 || currentParticle.energy < 1E-3) {
+						//stick non real photons (from beam beginning)
+						stickingProbability = 1.0; 
+						complexScattering = false;
+					}
+					else if (collidedFacet.sh.reflectType < 2) {
+						//Diffuse or Mirror
+						stickingProbability = collidedFacet.sh.sticking;
+						complexScattering = false;
+					}
+					else { //Material
+						GetStickingProbability(collidedFacet, inTheta, stickingProbability, materialReflProbabilities, complexScattering);
+						//In the new reflection model, reflection probabilities don't take into account surface roughness
+					}
 					
-					if (/*collidedFacet.texture &&*/ collidedFacet.sh.countTrans) RecordHitOnTexture(collidedFacet, sHandle->currentParticle.dF, sHandle->currentParticle.dP);
-				}
-				else { //Not superDest or Teleport
-					if (sHandle->wp.newReflectionModel) {
-						//New reflection model (Synrad 1.4)
-						double inTheta, inPhi;
-						std::tie(inTheta,inPhi) = CartesianToPolar(sHandle->currentParticle.direction,collidedFacet.sh.nU,collidedFacet.sh.nV,collidedFacet.sh.N);
-
-						double stickingProbability;
-						bool complexScattering; //forward/diffuse/back/transparent/stick
-						std::vector<double> materialReflProbabilities; //0: forward reflection, 1: diffuse, 2: backscattering, 3: transparent, 100%-(0+1+2+3): absorption
-
-						if (sHandle->currentParticle.dF == 0.0 || sHandle->currentParticle.dP == 0.0 || sHandle->currentParticle.energy < 1E-3) {
-							//stick non real photons (from beam beginning)
-							stickingProbability = 1.0; 
-							complexScattering = false;
-						}
-						else if (collidedFacet.sh.reflectType < 2) {
-							//Diffuse or Mirror
-							stickingProbability = collidedFacet.sh.sticking;
-							complexScattering = false;
-						}
-						else { //Material
-							std::tie(stickingProbability,materialReflProbabilities, complexScattering) = GetStickingProbability(collidedFacet, inTheta);
-							//In the new reflection model, reflection probabilities don't take into account surface roughness
-						}
-						
-						if (!sHandle->ontheflyParams.lowFluxMode) {
-							//Regular mode, stick or bounce
-							int reflType = GetHardHitType(stickingProbability, materialReflProbabilities, complexScattering);
-							if (reflType == REFL_ABSORB) {
-								Stick(collidedFacet);
-								if (!StartFromSource()) return false;
-							}
-							else PerformBounce_new(collidedFacet, reflType, inTheta, inPhi);
+					if (!model->ontheflyParams.lowFluxMode) {
+						//Regular mode, stick or bounce
+						int reflType = GetHardHitType(stickingProbability, materialReflProbabilities, complexScattering);
+						if (reflType == REFL_ABSORB) {
+							Stick(collidedFacet);
+							if (!StartFromSource()) return false;
 						}
-						else {
-							//Low flux mode and simple scattering:
-							Vector3d dummyNullVector(0.0, 0.0, 0.0); //DoLowFluxReflection will not use it since sHandle->wp.newReflectionModel == true
-							DoLowFluxReflection(collidedFacet, stickingProbability, complexScattering, materialReflProbabilities,
-								inTheta, inPhi, dummyNullVector, dummyNullVector, dummyNullVector);
-						} //end low flux mode
+						else PerformBounce_new(collidedFacet, reflType, inTheta, inPhi);
 					}
 					else {
-						//Old reflection model (Synrad <=1.3 or if user deselects new model in Global Settings)						
-						if (sHandle->currentParticle.dF == 0.0 || sHandle->currentParticle.dP == 0.0 || sHandle->currentParticle.energy < 1E-3) { //stick non real photons (from beam beginning)
-							Stick(collidedFacet);
-							if (!StartFromSource()) return false;
+						//Low flux mode and simple scattering:
+						Vector3d dummyNullVector(0.0, 0.0, 0.0); //DoLowFluxReflection will not use it since model->wp.newReflectionModel == true
+						DoLowFluxReflection(collidedFacet, stickingProbability, complexScattering, materialReflProbabilities,
+							inTheta, inPhi, dummyNullVector, dummyNullVector, dummyNullVector);
+					} //end low flux mode
+				}
+				else {
+					//Old reflection model (Synrad <=1.3 or if user deselects new model in Global Settings)						
+					if (currentParticle.dF == 0.0 || currentParticle.dP == 0.0 || currentParticle.energy < 1E-3) { //stick non real photons (from beam beginning)
+						Stick(collidedFacet);
+						if (!StartFromSource()) return false;
+					}
+					else {
+						//We first generate a perturbated surface, and from that point on we treat the whole reflection process as if it were locally flat
+						
+
+						if ((collidedFacet.sh.reflectType - 10) < (int)model->materials.size()) { //found material type
+																									//Generate incident angle
+							Vector3d nU_rotated, N_rotated, nV_rotated;
+							bool reflected = false;
+							do { //generate surfaces until reflected ray goes away from facet (and not through it)
+								
+								//First step: generate a random surface and determine incident angles
+								double inTheta, inPhi;
+								if (collidedFacet.sh.doScattering) {
+									double n_ori = Dot(currentParticle.direction, collidedFacet.sh.N); //incident angle with original facet surface (negative if front collision, positive if back collision);
+									double n_new;
+									do { //generate angles until incidence is from front
+										double sigmaRatio = collidedFacet.sh.rmsRoughness/collidedFacet.sh.autoCorrLength;
+										std::tie(nU_rotated, nV_rotated, N_rotated) = PerturbateSurface(collidedFacet, sigmaRatio);
+										n_new = Dot(currentParticle.direction, N_rotated);
+									} while (n_new*n_ori <= 0.0); //generate new random surface if grazing angle would be over 90deg (shadowing)
+									std::tie(inTheta, inPhi) = CartesianToPolar(currentParticle.direction, nU_rotated, nV_rotated, N_rotated); //Finally, get incident angles
+								}
+								else { //no scattering, use original surface
+									nU_rotated = collidedFacet.sh.nU;
+									nV_rotated = collidedFacet.sh.nV;
+									N_rotated = collidedFacet.sh.N;
+									std::tie(inTheta, inPhi) = CartesianToPolar(currentParticle.direction, collidedFacet.sh.nU, collidedFacet.sh.nV, collidedFacet.sh.N); //Incident angles with original facet surface
+								}
+									
+								//Second step: determine sticking/scattering probabilities
+								double stickingProbability; 
+								ReflectionProbabilities materialReflProbabilities = {}; //fwd/diffuse/back/transparent scattering probs
+								bool complexScattering; //does the material support multiple (diffuse, back, transparent) reflection modes?
+
+								if (collidedFacet.sh.reflectType < 2) {
+									//diffuse or mirror with fixed probability
+									stickingProbability = collidedFacet.sh.sticking;
+									complexScattering = false;
+								}
+								else {
+									//material reflection, depends on incident angle and energy
+									GetStickingProbability(collidedFacet, inTheta, stickingProbability, materialReflProbabilities, complexScattering);
+								}
+								if (!model->ontheflyParams.lowFluxMode) {
+									//Regular Monte-Carlo, stick or reflect fwd/diff/back/through
+									int reflType = GetHardHitType(stickingProbability, materialReflProbabilities, complexScattering);
+									reflected = DoOldRegularReflection(collidedFacet, reflType, inTheta, inPhi, N_rotated, nU_rotated, nV_rotated);
+								}
+								else {
+									//Low flux mode
+									reflected = DoLowFluxReflection(collidedFacet, stickingProbability, complexScattering, materialReflProbabilities,
+										inTheta, inPhi, 
+										N_rotated, nU_rotated, nV_rotated);
+								}
+							} while (!reflected); //do it again if reflection wasn't successful (reflected against the surface due to roughness)
 						}
 						else {
-							//We first generate a perturbated surface, and from that point on we treat the whole reflection process as if it were locally flat
-							
-
-							if ((collidedFacet.sh.reflectType - 10) < (int)sHandle->materials.size()) { //found material type
-																										//Generate incident angle
-								Vector3d nU_rotated, N_rotated, nV_rotated;
-								bool reflected = false;
-								do { //generate surfaces until reflected ray goes away from facet (and not through it)
-									
-									//First step: generate a random surface and determine incident angles
-									double inTheta, inPhi;
-									if (collidedFacet.sh.doScattering) {
-										double n_ori = Dot(sHandle->currentParticle.direction, collidedFacet.sh.N); //incident angle with original facet surface (negative if front collision, positive if back collision);
-										double n_new;
-										do { //generate angles until incidence is from front
-											double sigmaRatio = collidedFacet.sh.rmsRoughness/collidedFacet.sh.autoCorrLength;
-											std::tie(nU_rotated, nV_rotated, N_rotated) = PerturbateSurface(collidedFacet, sigmaRatio);
-											n_new = Dot(sHandle->currentParticle.direction, N_rotated);
-										} while (n_new*n_ori <= 0.0); //generate new random surface if grazing angle would be over 90deg (shadowing)
-										std::tie(inTheta, inPhi) = CartesianToPolar(sHandle->currentParticle.direction, nU_rotated, nV_rotated, N_rotated); //Finally, get incident angles
-									}
-									else { //no scattering, use original surface
-										nU_rotated = collidedFacet.sh.nU;
-										nV_rotated = collidedFacet.sh.nV;
-										N_rotated = collidedFacet.sh.N;
-										std::tie(inTheta, inPhi) = CartesianToPolar(sHandle->currentParticle.direction, collidedFacet.sh.nU, collidedFacet.sh.nV, collidedFacet.sh.N); //Incident angles with original facet surface
-									}
-										
-									//Second step: determine sticking/scattering probabilities
-									double stickingProbability; 
-									std::vector<double> materialReflProbabilities; //vector of fwd/diffuse/back/transparent scattering probs
-									bool complexScattering; //does the material support multiple (diffuse, back, transparent) reflection modes?
-
-									if (collidedFacet.sh.reflectType < 2) {
-										//diffuse or mirror with fixed probability
-										stickingProbability = collidedFacet.sh.sticking;
-										complexScattering = false;
-									}
-									else {
-										//material reflection, depends on incident angle and energy
-										std::tie(stickingProbability,materialReflProbabilities, complexScattering) = GetStickingProbability(collidedFacet, inTheta);
-									}
-									if (!sHandle->ontheflyParams.lowFluxMode) {
-										//Regular Monte-Carlo, stick or reflect fwd/diff/back/through
-										int reflType = GetHardHitType(stickingProbability, materialReflProbabilities, complexScattering);
-										reflected = DoOldRegularReflection(collidedFacet, reflType, inTheta, inPhi, N_rotated, nU_rotated, nV_rotated);
-									}
-									else {
-										//Low flux mode
-										reflected = DoLowFluxReflection(collidedFacet, stickingProbability, complexScattering, materialReflProbabilities,
-											inTheta, inPhi, 
-											N_rotated, nU_rotated, nV_rotated);
-									}
-								} while (!reflected); //do it again if reflection wasn't successful (reflected against the surface due to roughness)
-							}
-							else {
-								std::string err = "Facet " + (collidedFacet.globalId + 1);
-								err += "reflection material type not found";
-								SetErrorSub(err.c_str());
-							}
+							std::string err = "Facet " + std::to_string(collidedFacet.globalId + 1);
+							err += ": reflection material type not found";
+							SetThreadError(err);
+							return false;
 						}
-						
 					}
+					
 				}
 			}
 		}
-		else { // Leak (simulation error)
-			sHandle->nbLeakSinceUpdate++;
-			if (sHandle->regions[sHandle->sourceRegionId].params.showPhotons){
-				RecordLeakPos();
-			}
-			if (!StartFromSource())
-				// desorptionLimit reached
-				return false;
-		} //end intersect or leak
-	} //end step
+
+		//Still the same particle, leaving a splitting facet or entering a splitting structure
+		if (!particleRestarted && IsSplittingEntry(collidedFacet, previousStructure)) SplitParticle();
+	}
+	else { // Leak (simulation error)
+		nbLeakSinceUpdate++;
+		if (model->regions[currentParticle.sourceRegionId].params.showPhotons){
+			RecordLeakPos();
+		}
+		if (!StartFromSource())
+			// desorptionLimit reached
+			return false;
+	} //end intersect or leak
 	return true;
 }
 
-std::tuple<double,std::vector<double>,bool> GetStickingProbability(const SubprocessFacet& collidedFacet, const double& theta) {
-	//Returns sticking probability, materialReflProbabilities and complexScattering
-	Material *mat = &(sHandle->materials[collidedFacet.sh.reflectType - 10]);
-	bool complexScattering = mat->hasBackscattering;
-	std::vector<double> materialReflProbabilities = mat->BilinearInterpolate(sHandle->currentParticle.energy, abs(theta - PI / 2));
-	double stickingProbability = complexScattering
+void SimulationThread::GetStickingProbability(const SubprocessFacet& collidedFacet, const double& theta,
+	double& stickingProbability, ReflectionProbabilities& materialReflProbabilities, bool& complexScattering) {
+	//Sets sticking probability, materialReflProbabilities and complexScattering
+	PhaseScope scope(phaseTimers[PHASE_MATERIAL]);
+	const Material& mat = model->materials[collidedFacet.sh.reflectType - 10];
+	complexScattering = mat.hasBackscattering;
+	materialReflProbabilities = mat.Lookup(currentParticle.energy, abs(theta - PI / 2));
+	stickingProbability = complexScattering
 		? 1.0 - materialReflProbabilities[0] - materialReflProbabilities[1] - materialReflProbabilities[2] //100% - forward - diffuse - back (transparent already excluded in Intersect() routine)
 		: 1.0 - materialReflProbabilities[0]; //100% - forward (transparent already excluded in Intersect() routine)
-	return std::make_tuple(stickingProbability,materialReflProbabilities,complexScattering);
 }
 
-int GetHardHitType(const double& stickingProbability,const std::vector<double>& materialReflProbabilities, const bool& complexScattering) {
+int SimulationThread::GetHardHitType(const double& stickingProbability,const ReflectionProbabilities& materialReflProbabilities, const bool& complexScattering) {
 	//Similar to Material::GetReflectionType, but transparent pass is excluded and treats Mirror/Diffuse surfaces too with single sticking factor
 	double nonTransparentProbability = (complexScattering) ? 1.0 - materialReflProbabilities[3] : 1.0;
-	double random = rnd()*nonTransparentProbability;
+	double random = gsl_rng_uniform_pos(gen)*nonTransparentProbability;
 	if (random > (nonTransparentProbability - stickingProbability)) return REFL_ABSORB;
 	else if (!complexScattering) {
 		return REFL_FORWARD; //Not absorbed, so reflected
@@ -462,10 +682,11 @@ int GetHardHitType(const double& stickingProbability,const std::vector<double>&
 	}
 }
 
-std::tuple<Vector3d,Vector3d,Vector3d> PerturbateSurface(const SubprocessFacet& collidedFacet, const double& sigmaRatio) {
+std::tuple<Vector3d,Vector3d,Vector3d> SimulationThread::PerturbateSurface(const SubprocessFacet& collidedFacet, const double& sigmaRatio) {
 
-	double rnd1 = rnd();
-	double rnd2 = rnd(); //for debug
+	PhaseScope scope(phaseTimers[PHASE_SCATTERING]);
+	double rnd1 = gsl_rng_uniform_pos(gen);
+	double rnd2 = gsl_rng_uniform_pos(gen); //for debug
 	//Saturate(rnd1, 0.01, 0.99); //Otherwise thetaOffset would go to +/- infinity
 	//Saturate(rnd2, 0.01, 0.99); //Otherwise phiOffset would go to +/- infinity
 	double thetaOffset = atan(sigmaRatio*tan(PI*(rnd1 - 0.5)));
@@ -477,7 +698,7 @@ std::tuple<Vector3d,Vector3d,Vector3d> PerturbateSurface(const SubprocessFacet&
 	Vector3d N_facet = collidedFacet.sh.N;
 
 	//Random rotation around N (to discard U orientation thus make scattering isotropic)
-	double randomAngle = rnd() * 2 * PI;
+	double randomAngle = gsl_rng_uniform_pos(gen) * 2 * PI;
 	nU_facet = Rotate(nU_facet,Vector3d(0,0,0),N_facet, randomAngle);
 	nV_facet = Rotate(nV_facet,Vector3d(0,0,0),N_facet, randomAngle);
 
@@ -500,34 +721,34 @@ std::tuple<double,double,double> GetDirComponents(const Vector3d& nU_rotated, co
 	return std::make_tuple(u, v, n);
 }*/
 
-bool DoLowFluxReflection(SubprocessFacet& collidedFacet, const double& stickingProbability, const bool& complexScattering, const std::vector<double>& materialReflProbabilities,
+bool SimulationThread::DoLowFluxReflection(SubprocessFacet& collidedFacet, const double& stickingProbability, const bool& complexScattering, const ReflectionProbabilities& materialReflProbabilities,
 	const double& inTheta, const double& inPhi,
 	const Vector3d& N_rotated, const Vector3d& nU_rotated, const Vector3d& nV_rotated) {
 
 	//First register sticking part:
-	collidedFacet.tmpCounter.hit.fluxAbs += sHandle->currentParticle.dF * stickingProbability;
-	collidedFacet.tmpCounter.hit.powerAbs += sHandle->currentParticle.dP * stickingProbability;
-	collidedFacet.tmpCounter.hit.nbAbsEquiv += stickingProbability;
+	facetStates[collidedFacet.globalId].tmpCounter.hit.fluxAbs += currentParticle.dF * stickingProbability;
+	facetStates[collidedFacet.globalId].tmpCounter.hit.powerAbs += currentParticle.dP * stickingProbability;
+	facetStates[collidedFacet.globalId].tmpCounter.hit.nbAbsEquiv += stickingProbability * currentParticle.splitWeight;
 	if (/*collidedFacet.texture &&*/ collidedFacet.sh.countAbs) RecordHitOnTexture(collidedFacet,
-		sHandle->currentParticle.dF*stickingProbability, sHandle->currentParticle.dP*stickingProbability);
+		currentParticle.dF*stickingProbability, currentParticle.dP*stickingProbability);
 	ProfileSlice increment;
 	increment.count_absorbed = 0;
 	increment.count_incident = 1;
-	increment.flux_absorbed = sHandle->currentParticle.dF*stickingProbability;
-	increment.flux_incident = sHandle->currentParticle.dF;
-	increment.power_absorbed = sHandle->currentParticle.dP*stickingProbability;
-	increment.power_incident = sHandle->currentParticle.dP;
-	ProfileFacet(collidedFacet, sHandle->currentParticle.energy, increment);
+	increment.flux_absorbed = currentParticle.dF*stickingProbability;
+	increment.flux_incident = currentParticle.dF;
+	increment.power_absorbed = currentParticle.dP*stickingProbability;
+	increment.power_incident = currentParticle.dP;
+	ProfileFacet(collidedFacet, currentParticle.energy, increment);
 	//Absorbed part recorded, let's see how much is left
 	double survivalProbability = 1.0 - stickingProbability;
-	sHandle->currentParticle.oriRatio *= survivalProbability;
-	if (sHandle->currentParticle.oriRatio < sHandle->ontheflyParams.lowFluxCutoff) {//reflected part not important, throw it away
-		RecordHit(HIT_ABS, sHandle->currentParticle.dF, sHandle->currentParticle.dP); //for hits and lines display
+	currentParticle.oriRatio *= survivalProbability;
+	if (currentParticle.oriRatio < model->ontheflyParams.lowFluxCutoff && !PlayRoulette()) {//lost the Russian roulette below the cutoff: the survivors carry its weight
+		RecordHit(HIT_ABS, currentParticle.dF, currentParticle.dP); //for hits and lines display
 		return StartFromSource(); //false if maxdesorption reached
 	}
 	else { //reflect remainder
-		sHandle->currentParticle.dF *= survivalProbability;
-		sHandle->currentParticle.dP *= survivalProbability;
+		currentParticle.dF *= survivalProbability;
+		currentParticle.dP *= survivalProbability;
 
 		//Decide reflection type (fwd/diff/back, transparent excluded by intersect)
 		int reflType;
@@ -535,13 +756,13 @@ bool DoLowFluxReflection(SubprocessFacet& collidedFacet, const double& stickingP
 		else {
 			//Like GetHardHitType() but already excluding absorption
 			double anyReflectionProbability = survivalProbability - materialReflProbabilities[3]; //Not absorbed, not transparent
-			double random = rnd() * anyReflectionProbability;
+			double random = gsl_rng_uniform_pos(gen) * anyReflectionProbability;
 			if (random < materialReflProbabilities[0]) reflType = REFL_FORWARD;
 			else if (random < (materialReflProbabilities[0] + materialReflProbabilities[1])) reflType = REFL_DIFFUSE;
 			else reflType = REFL_BACK;
 		}
 
-		if (sHandle->wp.newReflectionModel) {
+		if (model->wp.newReflectionModel) {
 			PerformBounce_new(collidedFacet, reflType, inTheta, inPhi);
 			return true;
 		}
@@ -551,19 +772,66 @@ bool DoLowFluxReflection(SubprocessFacet& collidedFacet, const double& stickingP
 	}
 }
 
-bool DoOldRegularReflection(SubprocessFacet& collidedFacet, const int& reflType, const double& theta, const double& phi,
+bool SimulationThread::PlayRoulette() {
+	//Unbiased termination of low weight photons: survives with probability oriRatio/survivalWeight and then carries survivalWeight,
+	//so the expected weight is unchanged (instead of dropping everything below the cutoff)
+	double survivalWeight = (model->rouletteSurvivalWeight > 0.0) ? model->rouletteSurvivalWeight : 10.0 * model->ontheflyParams.lowFluxCutoff;
+	double survivalProbability = currentParticle.oriRatio / survivalWeight;
+	if (survivalProbability >= 1.0) return true; //Survival weight set below the cutoff: nothing to play for
+	if (gsl_rng_uniform_pos(gen) >= survivalProbability) {
+		nbRouletteKills++;
+		return false;
+	}
+	double scale = 1.0 / survivalProbability;
+	currentParticle.oriRatio *= scale;
+	currentParticle.dF *= scale;
+	currentParticle.dP *= scale;
+	nbRouletteSurvivals++;
+	return true;
+}
+
+bool SimulationThread::IsSplittingEntry(const SubprocessFacet& collidedFacet, const size_t& previousStructure) const {
+	//Low flux mode only, where photons already carry a weight
+	if (!model->ontheflyParams.lowFluxMode || model->splitFactor <= 1 || currentParticle.splitGeneration >= MAX_SPLIT_GENERATIONS) return false;
+	if (collidedFacet.globalId < model->splitFacets.size() && model->splitFacets[collidedFacet.globalId]) return true;
+	size_t structure = currentParticle.structureId;
+	return structure != previousStructure && structure < model->splitStructures.size() && model->splitStructures[structure];
+}
+
+void SimulationThread::SplitParticle() {
+	//The particle becomes splitFactor copies of 1/splitFactor weight. It goes on, the others wait in splitCopies
+	//Each copy traces its own stream from here, numbered by its ancestry
+	double share = 1.0 / (double)model->splitFactor;
+	currentParticle.oriRatio *= share;
+	currentParticle.dF *= share;
+	currentParticle.dP *= share;
+	currentParticle.splitWeight *= share;
+	currentParticle.splitGeneration++;
+	currentParticle.transparentHitBuffer.clear(); //Scratch buffer, not worth copying
+	uint32_t parentStream = currentParticle.rng.GetStreamId();
+	uint32_t splitIndex = (uint32_t)currentParticle.nbSplits++;
+	for (size_t copyIndex = 1; copyIndex < model->splitFactor; copyIndex++) {
+		splitCopies.push_back(currentParticle);
+		CurrentParticleStatus& copy = splitCopies.back();
+		copy.nbSplits = 0;
+		copy.rng.Set(model->randomSeed, copy.photonIndex, SplitStreamId(parentStream, splitIndex, (uint32_t)copyIndex));
+	}
+	nbSplitCopies += model->splitFactor - 1;
+}
+
+bool SimulationThread::DoOldRegularReflection(SubprocessFacet& collidedFacet, const int& reflType, const double& theta, const double& phi,
 	const Vector3d& N_rotated, const Vector3d& nU_rotated, const Vector3d& nV_rotated) {
 	
-	//sHandle->currentParticle.lastHitFacet = &collidedFacet; //If sticks, startfromsource will set to NULL, if reflects, PerformBounce_old will set it
+	//currentParticle.lastHitFacet = &collidedFacet; //If sticks, startfromsource will set to NULL, if reflects, PerformBounce_old will set it
 	ProfileSlice increment;
 	increment.count_absorbed = 0;
 	increment.count_incident = 1;
 	increment.flux_absorbed = 0.0;
-	increment.flux_incident = sHandle->currentParticle.dF;
+	increment.flux_incident = currentParticle.dF;
 	increment.power_absorbed = 0.0;
-	increment.power_incident = sHandle->currentParticle.dP;
-	ProfileFacet(collidedFacet, sHandle->currentParticle.energy, increment);
-	if (/*collidedFacet.texture &&*/ collidedFacet.sh.countRefl) RecordHitOnTexture(collidedFacet, sHandle->currentParticle.dF, sHandle->currentParticle.dP);
+	increment.power_incident = currentParticle.dP;
+	ProfileFacet(collidedFacet, currentParticle.energy, increment);
+	if (/*collidedFacet.texture &&*/ collidedFacet.sh.countRefl) RecordHitOnTexture(collidedFacet, currentParticle.dF, currentParticle.dP);
 	if (reflType == REFL_ABSORB) {
 				Stick(collidedFacet);
 				return StartFromSource(); //false if maxdesorption reached
@@ -572,104 +840,168 @@ bool DoOldRegularReflection(SubprocessFacet& collidedFacet, const int& reflType,
 
 // Launch photon from a trajectory point
 
-bool StartFromSource() {
+bool SimulationThread::StartFromSource() {
+
+	particleRestarted = true;
+
+	//Split copies first: they continue earlier photons, the desorption limit doesn't apply to them
+	if (!splitCopies.empty()) {
+		RecordHit(HIT_LAST, currentParticle.dF, currentParticle.dP); //Penup, the copy's path starts elsewhere
+		currentParticle = splitCopies.back();
+		splitCopies.pop_back();
+		RecordHit(HIT_REF, currentParticle.dF, currentParticle.dP);
+		return true;
+	}
 
 	// Check end of simulation
-	if (sHandle->ontheflyParams.desorptionLimit > 0) {
-		if (sHandle->totalDesorbed >= sHandle->ontheflyParams.desorptionLimit / sHandle->ontheflyParams.nbProcess) {
-            sHandle->currentParticle.lastHitFacet = NULL;
+	if (model->ontheflyParams.desorptionLimit > 0) {
+		if (totalDesorbed >= desorptionLimit) { //this thread's share of the limit
+            currentParticle.lastHitFacet = NULL;
 			return false;
 		}
 	}
 
-	//find source point
-	size_t pointIdGlobal = (size_t)(rnd()*(double)sHandle->sourceArea);
-	bool found = false;
-	size_t regionId;
-	size_t pointIdLocal;
-	size_t sum = 0;
-	for (regionId = 0; regionId<sHandle->wp.nbRegion&&!found; regionId++) {
-		if ((pointIdGlobal >= sum) && (pointIdGlobal < (sum + sHandle->regions[regionId].Points.size()))) {
-			pointIdLocal = pointIdGlobal - sum;
-			found = true;
+	//take the next pre-generated photon
+	if (photonBatch.Empty() && !GeneratePhotonBatch()) return false;
+	size_t batchIndex = photonBatch.next++;
+	size_t regionId = photonBatch.regionId[batchIndex];
+	size_t pointIdLocal = photonBatch.pointId[batchIndex];
+	double fluxCorrection = photonBatch.fluxCorrection[batchIndex]; //compensates flux-weighted source sampling, 1.0 otherwise
+	GenPhoton photon = photonBatch.photons[batchIndex];
+	Region_mathonly *sourceRegion = &(model->regions[regionId]);
+	currentParticle.photonIndex = photonBatch.photonIndex[batchIndex];
+	currentParticle.rng.Set(model->randomSeed, currentParticle.photonIndex, PHOTON_STREAM_TRACE); //'gen' reads it from here on
+
+	size_t retries = 0;
+	bool validEnergy = (photon.energy >= sourceRegion->params.energy_low_eV && photon.energy <= sourceRegion->params.energy_hi_eV);
+	while (!validEnergy && photon.energy>0.0 && retries < 5) {
+		retries++;
+		model->sourceSampler.Sample(gen, regionId, pointIdLocal, fluxCorrection); //redraw with the same weighting
+		sourceRegion = &(model->regions[regionId]);
+		if (!(sourceRegion->params.psimaxX_rad > 0.0 && sourceRegion->params.psimaxY_rad>0.0)) {
+			SetThreadError("psiMaxX or psiMaxY not positive. No photon can be generated");
+			return false;
 		}
-		else sum += sHandle->regions[regionId].Points.size();
-	}
-	if (!found) SetErrorSub("No start point found");
-	regionId--;
-	//Trajectory_Point *source=&(sHandle->regions[regionId].Points[pointIdLocal]);
-	Region_mathonly *sourceRegion = &(sHandle->regions[regionId]);
-	if (!(sourceRegion->params.psimaxX_rad > 0.0 && sourceRegion->params.psimaxY_rad>0.0)) SetErrorSub("psiMaxX or psiMaxY not positive. No photon can be generated");
-	
-	size_t retries = 0;bool validEnergy;GenPhoton photon;
-	do {
-		photon = GeneratePhoton(pointIdLocal, sourceRegion, sHandle->ontheflyParams.generation_mode,
-			sHandle->psi_distro, sHandle->chi_distros[sourceRegion->params.polarizationCompIndex],
-			sHandle->parallel_polarization, sHandle->tmpGlobalResult.globalHits.hit.nbDesorbed == 0);
+		photon = GeneratePhoton(pointIdLocal, sourceRegion, model->ontheflyParams.generation_mode,
+			model->psiTable, model->chiTables[sourceRegion->params.polarizationCompIndex],
+			model->polarizationTable, gen);
 		validEnergy = (photon.energy >= sourceRegion->params.energy_low_eV && photon.energy <= sourceRegion->params.energy_hi_eV);
-		if (!validEnergy && photon.energy>0.0) {
-			retries++;
-			pointIdLocal = (size_t)(rnd()*(double)sourceRegion->Points.size());
-		}
-	} while (!validEnergy && photon.energy>0.0 && retries < 5);
+	}
 
 	if (!validEnergy && photon.energy>0.0) {
 		char tmp[1024];
 		sprintf(tmp, "Region %zd point %zd: can't generate within energy limits (%geV .. %geV)", regionId + 1, pointIdLocal + 1,
 			sourceRegion->params.energy_low_eV , sourceRegion->params.energy_hi_eV);
-		SetErrorSub(tmp);
+		SetThreadError(tmp);
 		return false;
 	}
 
 	//sHandle->distTraveledCurrentParticle=0.0;
-	sHandle->currentParticle.dF = photon.SR_flux;
-	sHandle->currentParticle.dP = photon.SR_power;
-	sHandle->currentParticle.energy = photon.energy;
-	sHandle->currentParticle.oriRatio = 1.0;
+	currentParticle.dF = photon.SR_flux * fluxCorrection;
+	currentParticle.dP = photon.SR_power * fluxCorrection;
+	currentParticle.energy = photon.energy;
+	currentParticle.oriRatio = 1.0;
+	currentParticle.splitGeneration = 0;
+	currentParticle.splitWeight = 1.0;
+	currentParticle.nbSplits = 0;
+	currentParticle.nbBounces = 0;
 
 	//starting position
-	sHandle->currentParticle.position = photon.start_pos;
+	currentParticle.position = photon.start_pos;
 
-	sHandle->sourceRegionId = regionId;
+	currentParticle.sourceRegionId = regionId;
 
-	RecordHit(HIT_DES, sHandle->currentParticle.dF, sHandle->currentParticle.dP);
+	RecordHit(HIT_DES, currentParticle.dF, currentParticle.dP);
 
 	//angle
-	sHandle->currentParticle.direction = photon.start_dir;
+	currentParticle.direction = photon.start_dir;
 
-	if (sourceRegion->params.structureId > sHandle->sh.nbSuper) {
+	if (sourceRegion->params.structureId > model->sh.nbSuper) {
 		char tmp[1024];
 		sprintf(tmp, "Region %zd is in structure %zd which doesn't exist\n(This geometry has only %zd structures)",
-			regionId + 1, sourceRegion->params.structureId + 1, sHandle->sh.nbSuper);
-		SetErrorSub(tmp);
+			regionId + 1, sourceRegion->params.structureId + 1, model->sh.nbSuper);
+		SetThreadError(tmp);
 		return false;
 	}
 
-    sHandle->currentParticle.structureId = sourceRegion->params.structureId;
-    sHandle->currentParticle.teleportedFrom = -1;
+    currentParticle.structureId = sourceRegion->params.structureId;
+    currentParticle.teleportedFrom = -1;
 
 	// Count
-	sHandle->totalDesorbed++;
-	sHandle->tmpGlobalResult.globalHits.hit.fluxAbs += sHandle->currentParticle.dF;
-	sHandle->tmpGlobalResult.globalHits.hit.powerAbs += sHandle->currentParticle.dP;
-	sHandle->tmpGlobalResult.globalHits.hit.nbDesorbed++;
+	totalDesorbed++;
+	tmpGlobalResult.globalHits.hit.fluxAbs += currentParticle.dF;
+	tmpGlobalResult.globalHits.hit.powerAbs += currentParticle.dP;
+	tmpGlobalResult.globalHits.hit.nbDesorbed++;
 
-	sHandle->currentParticle.lastHitFacet = NULL; //Photon originates from the volume, not from a facet
+	currentParticle.lastHitFacet = NULL; //Photon originates from the volume, not from a facet
 
 	return true;
 
 }
 
+// Generate a batch of photons: source points, then beam offsets for the whole batch, then the rest of each photon
+
+bool SimulationThread::GeneratePhotonBatch() {
+	size_t nbPhotons = PHOTON_BATCH_SIZE;
+	if (model->ontheflyParams.desorptionLimit > 0 && desorptionLimit > totalDesorbed)
+		nbPhotons = Min(nbPhotons, desorptionLimit - totalDesorbed); //don't generate photons that won't be traced
+
+	bool timed = phaseTimers[PHASE_SOURCE].Start(nbPhotons);
+
+	//Each photon draws from its own streams, keyed by its global index
+	uint64_t firstLocalIndex = model->ReservePhotonIndices(nbPhotons);
+	PhotonStream photonStream;
+	SetPhotonStream(gen, &photonStream);
+	for (size_t i = 0; i < nbPhotons; i++) {
+		photonBatch.photonIndex[i] = model->GetPhotonIndex(firstLocalIndex + i);
+		photonStream.Set(model->randomSeed, photonBatch.photonIndex[i], PHOTON_STREAM_SOURCE);
+		if (!model->sourceSampler.Sample(gen, photonBatch.regionId[i], photonBatch.pointId[i], photonBatch.fluxCorrection[i])) {
+			SetPhotonStream(gen, &currentParticle.rng);
+			SetThreadError("No start point found");
+			return false;
+		}
+		const Region_mathonly& reg = model->regions[photonBatch.regionId[i]];
+		if (!(reg.params.psimaxX_rad > 0.0 && reg.params.psimaxY_rad > 0.0)) {
+			SetPhotonStream(gen, &currentParticle.rng);
+			SetThreadError("psiMaxX or psiMaxY not positive. No photon can be generated");
+			return false;
+		}
+	}
+	photonBatch.size = nbPhotons;
+	photonBatch.next = 0;
+	if (timed) phaseTimers[PHASE_SOURCE].Stop();
+
+	timed = phaseTimers[PHASE_GENERATION].Start(nbPhotons);
+	SampleBeamOffsets(photonBatch, model->regions, model->randomSeed);
+
+	for (size_t i = 0; i < nbPhotons; i++) {
+		Region_mathonly* sourceRegion = &(model->regions[photonBatch.regionId[i]]);
+		GenPhoton photon;
+		photon.offset_x = photonBatch.offset_x[i];
+		photon.offset_divx = photonBatch.offset_divx[i];
+		photon.offset_y = photonBatch.offset_y[i];
+		photon.offset_divy = photonBatch.offset_divy[i];
+		photonStream.Set(model->randomSeed, photonBatch.photonIndex[i], PHOTON_STREAM_PHOTON);
+		photonBatch.photons[i] = GeneratePhotonAtOffset(photon, photonBatch.pointId[i], sourceRegion, model->ontheflyParams.generation_mode,
+			model->psiTable, model->chiTables[sourceRegion->params.polarizationCompIndex],
+			model->polarizationTable, gen);
+	}
+	SetPhotonStream(gen, &currentParticle.rng);
+	if (timed) phaseTimers[PHASE_GENERATION].Stop();
+	return true;
+}
+
 // Compute bounce against a facet
 
 double TruncatedGaussian(gsl_rng *gen, const double &mean, const double &sigma, const double &lowerBound, const double &upperBound);
 
-void PerformBounce_new(SubprocessFacet& collidedFacet,  const int &reflType, const double &inTheta, const double &inPhi) {
+void SimulationThread::PerformBounce_new(SubprocessFacet& collidedFacet,  const int &reflType, const double &inTheta, const double &inPhi) {
 
+	bool timed = phaseTimers[PHASE_SCATTERING].Start(); //Outgoing direction, the recording below is counted apart
 	double outTheta, outPhi; //perform bounce without scattering, will perturbate these angles later if it's a rough surface
 	if (collidedFacet.sh.reflectType == REFLECTION_DIFFUSE) {
-		outTheta = acos(sqrt(rnd()));
-		outPhi = rnd()*2.0*PI;
+		outTheta = acos(sqrt(gsl_rng_uniform_pos(gen)));
+		outPhi = gsl_rng_uniform_pos(gen)*2.0*PI;
 	}
 	else if (collidedFacet.sh.reflectType == REFLECTION_SPECULAR) {
 		outTheta = PI - inTheta;
@@ -682,8 +1014,8 @@ void PerformBounce_new(SubprocessFacet& collidedFacet,  const int &reflType, con
 			outPhi = inPhi;
 			break;
 		case REFL_DIFFUSE: //diffuse scattering
-			outTheta = acos(sqrt(rnd()));
-			outPhi = rnd()*2.0*PI;
+			outTheta = acos(sqrt(gsl_rng_uniform_pos(gen)));
+			outPhi = gsl_rng_uniform_pos(gen)*2.0*PI;
 			break;
 		case REFL_BACK: //back scattering
 			outTheta = PI - inTheta;
@@ -696,9 +1028,9 @@ void PerformBounce_new(SubprocessFacet& collidedFacet,  const int &reflType, con
 		double incidentAngle = abs(inTheta);
 		if (incidentAngle > PI / 2) incidentAngle = PI - incidentAngle; //coming from the normal side
 		double y = cos(incidentAngle);
-		double wavelength = 3E8*6.626E-34 / (sHandle->currentParticle.energy*1.6E-19); //energy[eV] to wavelength[m]
+		double wavelength = 3E8*6.626E-34 / (currentParticle.energy*1.6E-19); //energy[eV] to wavelength[m]
 		double specularReflProbability = exp(-Sqr(4 * PI*collidedFacet.sh.rmsRoughness*y / wavelength)); //Debye-Wallers factor, See "Measurements of x-ray scattering..." by Dugan, Sonnad, Cimino, Ishibashi, Scafers, eq.2
-		bool specularReflection = rnd() < specularReflProbability;
+		bool specularReflection = gsl_rng_uniform_pos(gen) < specularReflProbability;
 		if (!specularReflection) {
 			//Smooth surface reflection performed, now let's perturbate the angles
 			//Using Gaussian approximated distributions of eq.14. of the above article
@@ -722,43 +1054,47 @@ void PerformBounce_new(SubprocessFacet& collidedFacet,  const int &reflType, con
 				lowerBound += PI / 2;
 				upperBound += PI / 2;
 			}
-			double outThetaPerturbated = TruncatedGaussian(sHandle->gen, outTheta, 2.9264*onePerTau, lowerBound, upperBound);
+			double outThetaPerturbated = TruncatedGaussian(gen, outTheta, 2.9264*onePerTau, lowerBound, upperBound);
 
-			double dPhi = Gaussian((2.80657*pow(incidentAngle, -1.00238) - 1.00293*pow(incidentAngle, 1.22425))*onePerTau); //Out-of-plane angle perturbation, depends on roughness and incident angle
+			double dPhi = gsl_ran_gaussian(gen, (2.80657*pow(incidentAngle, -1.00238) - 1.00293*pow(incidentAngle, 1.22425))*onePerTau); //Out-of-plane angle perturbation, depends on roughness and incident angle
 			outTheta = outThetaPerturbated;
 			outPhi += dPhi;
 		}
 	}
 
-    sHandle->currentParticle.direction = PolarToCartesian(&collidedFacet, outTheta, outPhi, false);
+    currentParticle.direction = PolarToCartesian(&collidedFacet, outTheta, outPhi, false);
+	if (timed) phaseTimers[PHASE_SCATTERING].Stop();
 
-	RecordHit(HIT_REF, sHandle->currentParticle.dF, sHandle->currentParticle.dP);
-	sHandle->currentParticle.lastHitFacet = &collidedFacet;
-	if (/*collidedFacet.texture &&*/ collidedFacet.sh.countRefl) RecordHitOnTexture(collidedFacet, sHandle->currentParticle.dF, sHandle->currentParticle.dP);
+	RecordHit(HIT_REF, currentParticle.dF, currentParticle.dP);
+	currentParticle.lastHitFacet = &collidedFacet;
+	if (/*collidedFacet.texture &&*/ collidedFacet.sh.countRefl) RecordHitOnTexture(collidedFacet, currentParticle.dF, currentParticle.dP);
+	currentParticle.nbBounces++; //After recording: the reflection hit belongs to the photons arriving with the previous count
 }
 
-bool PerformBounce_old(SubprocessFacet& collidedFacet, const int& reflType, const double& inTheta, const double& inPhi,
+bool SimulationThread::PerformBounce_old(SubprocessFacet& collidedFacet, const int& reflType, const double& inTheta, const double& inPhi,
 	const Vector3d& N_rotated, const Vector3d& nU_rotated, const Vector3d& nV_rotated) {
-	RecordHit(HIT_REF, sHandle->currentParticle.dF, sHandle->currentParticle.dP);
+	RecordHit(HIT_REF, currentParticle.dF, currentParticle.dP);
+	PhaseScope scope(phaseTimers[PHASE_SCATTERING]);
 	// Relaunch particle, regular monte-carlo
 	if (collidedFacet.sh.reflectType == REFLECTION_DIFFUSE) {
 		//See docs/theta_gen.png for further details on angular distribution generation
-        sHandle->currentParticle.direction = PolarToCartesian(&collidedFacet, acos(sqrt(rnd())), rnd()*2.0*PI, false);
+        currentParticle.direction = PolarToCartesian(&collidedFacet, acos(sqrt(gsl_rng_uniform_pos(gen))), gsl_rng_uniform_pos(gen)*2.0*PI, false);
 	} else { //Fwd/diff/back reflection, optionally with surface perturbation
 		if (!VerifiedSpecularReflection(collidedFacet, (collidedFacet.sh.reflectType == REFLECTION_SPECULAR)?REFL_FORWARD:reflType, inTheta, inPhi,
 			nU_rotated, nV_rotated, N_rotated)) {
 			return false;
 		}
 	}
-	sHandle->currentParticle.lastHitFacet = &collidedFacet;
+	currentParticle.lastHitFacet = &collidedFacet;
+	currentParticle.nbBounces++;
 	return true;
 }
 
-bool VerifiedSpecularReflection(const SubprocessFacet& collidedFacet, const int& reflType, const double& inTheta, const double& inPhi,
+bool SimulationThread::VerifiedSpecularReflection(const SubprocessFacet& collidedFacet, const int& reflType, const double& inTheta, const double& inPhi,
 	const Vector3d& nU_rotated, const Vector3d& nV_rotated,const Vector3d& N_rotated) {
 	
 	//Specular reflection that returns false if going against surface
-	//Changes sHandle->pDir
+	//Changes currentParticle.direction
 
 	double outTheta, outPhi;
 
@@ -774,8 +1110,8 @@ bool VerifiedSpecularReflection(const SubprocessFacet& collidedFacet, const int&
 		outPhi = inPhi;
 		break;
 	case REFL_DIFFUSE: //diffuse scattering
-		outTheta = acos(sqrt(rnd()));
-		outPhi = rnd()*2.0*PI;
+		outTheta = acos(sqrt(gsl_rng_uniform_pos(gen)));
+		outPhi = gsl_rng_uniform_pos(gen)*2.0*PI;
 		break;
 	case REFL_BACK: //back scattering
 
@@ -789,30 +1125,26 @@ bool VerifiedSpecularReflection(const SubprocessFacet& collidedFacet, const int&
 		
 		double factor = 1.0 / (1.0 + c);
 
-		std::vector<std::vector<double>> nullMatrix = { {0.0,0.0,0.0} , {0.0,0.0,0.0} , {0.0,0.0,0.0} };
-		std::vector<std::vector<double>> identityMatrix = { {1.0,0.0,0.0} , {0.0,1.0,0.0} , {0.0,0.0,1.0} }; //rows
-		std::vector<std::vector<double>> v_skew = { {0.0,-v.z,v.y} , {v.z,0.0,-v.x} , {-v.y,v.x,0.0} };
+		Matrix3x3 v_skew = { { {0.0,-v.z,v.y} , {v.z,0.0,-v.x} , {-v.y,v.x,0.0} } }; //rows
 		
-		std::vector<std::vector<double>> v_skew_square = nullMatrix;
+		Matrix3x3 v_skew_square = { { {0.0,0.0,0.0} , {0.0,0.0,0.0} , {0.0,0.0,0.0} } };
 		//3x3 matrix multiplication
 		for (size_t row = 0; row < 3; row++) {
 			for (size_t col = 0; col < 3; col++) {
 				for (size_t comp = 0; comp < 3; comp++) {
-					v_skew_square[row][col] += v_skew[row][comp] * v_skew[comp][col];
+					v_skew_square.m[row][col] += v_skew.m[row][comp] * v_skew.m[comp][col];
 				}
 			}
 		}
 
-		std::vector<std::vector<double>> rotationMatrix = nullMatrix;
+		Matrix3x3 rotationMatrix;
 		for (size_t row = 0; row < 3; row++) {
 			for (size_t col = 0; col < 3; col++) {
-				rotationMatrix[row][col] = identityMatrix[row][col] + v_skew[row][col] + factor*v_skew_square[row][col];
+				rotationMatrix.m[row][col] = ((row == col) ? 1.0 : 0.0) + v_skew.m[row][col] + factor*v_skew_square.m[row][col]; //identity + v_skew + factor*v_skew^2
 			}
 		}
 
-		newDir = Vector3d(-sHandle->currentParticle.direction.x * rotationMatrix[0][0] + -sHandle->currentParticle.direction.y * rotationMatrix[0][1] + -sHandle->currentParticle.direction.z * rotationMatrix[0][2],
-			-sHandle->currentParticle.direction.x * rotationMatrix[1][0] + -sHandle->currentParticle.direction.y * rotationMatrix[1][1] + -sHandle->currentParticle.direction.z * rotationMatrix[1][2],
-			-sHandle->currentParticle.direction.x * rotationMatrix[2][0] + -sHandle->currentParticle.direction.y * rotationMatrix[2][1] + -sHandle->currentParticle.direction.z * rotationMatrix[2][2]);
+		newDir = rotationMatrix * (-1.0 * currentParticle.direction);
 
 		calcNewDir = false;
 		break;
@@ -834,72 +1166,95 @@ bool VerifiedSpecularReflection(const SubprocessFacet& collidedFacet, const int&
 		return false; //if reflection would go against the surface, generate new angles
 	}
 
-	sHandle->currentParticle.direction = newDir;
+	currentParticle.direction = newDir;
 	return true;
 }
 
-void RecordHitOnTexture(SubprocessFacet& f, double dF, double dP) {
-	size_t tu = (size_t)(f.colU * f.sh.texWidthD);
-	size_t tv = (size_t)(f.colV * f.sh.texHeightD);
-	size_t index = tu + tv*f.sh.texWidth;
-	f.texture[index].count++;
-	f.texture[index].flux += dF*f.textureCellIncrements[index]; //normalized by area
-	f.texture[index].power += dP*f.textureCellIncrements[index]; //normalized by area
+void SimulationThread::RecordHitOnTexture(const SubprocessFacet& f, double dF, double dP) {
+	PhaseScope scope(phaseTimers[PHASE_RECORDING]);
+	size_t tu = (size_t)(currentParticle.colU * f.sh.texWidthD);
+	size_t tv = (size_t)(currentParticle.colV * f.sh.texHeightD);
+	double increment = f.GetCellIncrement(tu, tv);
+	FacetHitState& state = facetStates[f.globalId];
+	TextureCell& cell = state.textureTiles[state.GetCellSlot(tu, tv)];
+	cell.count++;
+	cell.flux += dF*increment; //normalized by area
+	cell.power += dP*increment; //normalized by area
+	if (!state.tagSlots.empty()) { //Tallied facet: also in the photon's tag
+		FacetHitState& tagCells = state.GetTaggedTally(GetTallyTag(currentParticle.sourceRegionId, currentParticle.nbBounces)).cells;
+		TextureCell& tagCell = tagCells.textureTiles[tagCells.GetCellSlot(tu, tv)];
+		tagCell.count++;
+		tagCell.flux += dF*increment;
+		tagCell.power += dP*increment;
+	}
+	if (!state.bands.empty() && state.bands[0].cells.hasTexture) {
+		FacetHitState& bandCells = state.bands[model->energyBands[f.globalId].GetBand(currentParticle.energy)].cells;
+		TextureCell& bandCell = bandCells.textureTiles[bandCells.GetCellSlot(tu, tv)];
+		bandCell.count++;
+		bandCell.flux += dF*increment;
+		bandCell.power += dP*increment;
+	}
 }
 
-void RecordDirectionVector(SubprocessFacet& f) {
-	size_t tu = (size_t)(f.colU * f.sh.texWidthD);
-	size_t tv = (size_t)(f.colV * f.sh.texHeightD);
-	size_t add = tu + tv*(f.sh.texWidth);
-
-	f.direction[add].dir.x += sHandle->currentParticle.direction.x;
-	f.direction[add].dir.y += sHandle->currentParticle.direction.y;
-	f.direction[add].dir.z += sHandle->currentParticle.direction.z;
-	f.direction[add].count++;
+void SimulationThread::RecordDirectionVector(const SubprocessFacet& f) {
+	PhaseScope scope(phaseTimers[PHASE_RECORDING]);
+	size_t tu = (size_t)(currentParticle.colU * f.sh.texWidthD);
+	size_t tv = (size_t)(currentParticle.colV * f.sh.texHeightD);
+
+	FacetHitState& state = facetStates[f.globalId];
+	DirectionCell& cell = state.directionTiles[state.GetCellSlot(tu, tv)];
+	cell.dir.x += currentParticle.direction.x;
+	cell.dir.y += currentParticle.direction.y;
+	cell.dir.z += currentParticle.direction.z;
+	cell.count++;
 }
 
-void Stick(SubprocessFacet& collidedFacet) {
-	collidedFacet.tmpCounter.hit.nbAbsEquiv+=1.0;
-	collidedFacet.tmpCounter.hit.fluxAbs += sHandle->currentParticle.dF;
-	collidedFacet.tmpCounter.hit.powerAbs += sHandle->currentParticle.dP;
-	sHandle->tmpGlobalResult.globalHits.hit.nbAbsEquiv+=1.0;
+void SimulationThread::Stick(SubprocessFacet& collidedFacet) {
+	facetStates[collidedFacet.globalId].tmpCounter.hit.nbAbsEquiv += currentParticle.splitWeight; //1 unless split
+	facetStates[collidedFacet.globalId].tmpCounter.hit.fluxAbs += currentParticle.dF;
+	facetStates[collidedFacet.globalId].tmpCounter.hit.powerAbs += currentParticle.dP;
+	tmpGlobalResult.globalHits.hit.nbAbsEquiv += currentParticle.splitWeight;
 	//sHandle->distTraveledSinceUpdate+=sHandle->distTraveledCurrentParticle;
 	//sHandle->counter.nbAbsorbed++;
 	//sHandle->counter.fluxAbs+=sHandle->dF;
 	//sHandle->counter.powerAbs+=sHandle->dP;
-	RecordHit(HIT_ABS, sHandle->currentParticle.dF, sHandle->currentParticle.dP); //for hits and lines display
+	RecordHit(HIT_ABS, currentParticle.dF, currentParticle.dP); //for hits and lines display
 	ProfileSlice increment;
 	increment.count_absorbed = 1;
 	increment.count_incident = 1;
-	increment.flux_absorbed = sHandle->currentParticle.dF;
-	increment.flux_incident = sHandle->currentParticle.dF;
-	increment.power_absorbed = sHandle->currentParticle.dP;
-	increment.power_incident = sHandle->currentParticle.dP;
-	ProfileFacet(collidedFacet, sHandle->currentParticle.energy, increment);
-	if (/*collidedFacet.texture &&*/ collidedFacet.sh.countAbs) RecordHitOnTexture(collidedFacet, sHandle->currentParticle.dF, sHandle->currentParticle.dP);
+	increment.flux_absorbed = currentParticle.dF;
+	increment.flux_incident = currentParticle.dF;
+	increment.power_absorbed = currentParticle.dP;
+	increment.power_incident = currentParticle.dP;
+	ProfileFacet(collidedFacet, currentParticle.energy, increment);
+	if (/*collidedFacet.texture &&*/ collidedFacet.sh.countAbs) RecordHitOnTexture(collidedFacet, currentParticle.dF, currentParticle.dP);
 }
 
-void UpdateLog(Dataport * dpLog, DWORD timeout)
+void UpdateLog(Simulation* sim, Dataport * dpLog, DWORD timeout)
 {
-	if (sHandle->tmpParticleLog.size()) {
+	size_t nbLogged = 0;
+	for (auto& t : sim->threads) nbLogged += t->tmpParticleLog.size();
+	if (nbLogged) {
 		double t0, t1;
 		t0 = GetTick();
 		SetState(NULL, "Waiting for 'dpLog' dataport access...", false, true);
-		sHandle->lastLogUpdateOK = AccessDataportTimed(dpLog, timeout);
+		sim->lastLogUpdateOK = AccessDataportTimed(dpLog, timeout);
 		SetState(NULL, "Updating Log...", false, true);
-		if (!sHandle->lastLogUpdateOK) return;
+		if (!sim->lastLogUpdateOK) return;
 
 		size_t* logBuff = (size_t*)dpLog->buff;
-		size_t recordedLogSize = *logBuff;
 		ParticleLoggerItem* logBuff2 = (ParticleLoggerItem*)(logBuff + 1);
 
-		size_t writeNb;
-		if (recordedLogSize > sHandle->ontheflyParams.logLimit) writeNb = 0;
-		else writeNb = Min(sHandle->tmpParticleLog.size(), sHandle->ontheflyParams.logLimit - recordedLogSize);
-		memcpy(&logBuff2[recordedLogSize], &sHandle->tmpParticleLog[0], writeNb * sizeof(ParticleLoggerItem)); //Knowing that vector memories are contigious
-		(*logBuff) += writeNb;
+		for (auto& t : sim->threads) {
+			size_t recordedLogSize = *logBuff;
+			size_t writeNb;
+			if (recordedLogSize > sim->ontheflyParams.logLimit) writeNb = 0;
+			else writeNb = Min(t->tmpParticleLog.size(), sim->ontheflyParams.logLimit - recordedLogSize);
+			if (writeNb) memcpy(&logBuff2[recordedLogSize], &t->tmpParticleLog[0], writeNb * sizeof(ParticleLoggerItem)); //Knowing that vector memories are contigious
+			(*logBuff) += writeNb;
+			t->tmpParticleLog.clear();
+		}
 		ReleaseDataport(dpLog);
-		sHandle->tmpParticleLog.clear();
 		extern char* GetSimuStatus();
 		SetState(NULL, GetSimuStatus(), false, true);
 
@@ -910,78 +1265,154 @@ void UpdateLog(Dataport * dpLog, DWORD timeout)
 	}
 }
 
-void LogHit(SubprocessFacet * f)
+void SimulationThread::LogHit(const SubprocessFacet& f)
 {
-	if (sHandle->ontheflyParams.enableLogging &&
-		sHandle->ontheflyParams.logFacetId == f->globalId &&
-		sHandle->tmpParticleLog.size() < (sHandle->ontheflyParams.logLimit / sHandle->ontheflyParams.nbProcess)) {
+	if (model->ontheflyParams.enableLogging &&
+		model->ontheflyParams.logFacetId == f.globalId &&
+		tmpParticleLog.size() < (model->ontheflyParams.logLimit / model->ontheflyParams.nbProcess / model->nbThreads)) {
 		ParticleLoggerItem log;
-		log.facetHitPosition = Vector2d(f->colU, f->colV);
-		std::tie(log.hitTheta, log.hitPhi) = CartesianToPolar(sHandle->currentParticle.direction, f->sh.nU, f->sh.nV, f->sh.N);
-		log.oriRatio = sHandle->currentParticle.oriRatio;
-		log.energy = sHandle->currentParticle.energy;
-		log.dF = sHandle->currentParticle.dF;
-		log.dP = sHandle->currentParticle.dP;
-		sHandle->tmpParticleLog.push_back(log);
+		log.facetHitPosition = Vector2d(currentParticle.colU, currentParticle.colV);
+		std::tie(log.hitTheta, log.hitPhi) = CartesianToPolar(currentParticle.direction, f.sh.nU, f.sh.nV, f.sh.N);
+		log.oriRatio = currentParticle.oriRatio;
+		log.energy = currentParticle.energy;
+		log.dF = currentParticle.dF;
+		log.dP = currentParticle.dP;
+		tmpParticleLog.push_back(log);
 	}
 }
 
-void SubprocessFacet::RegisterTransparentPass()
+void SimulationThread::RegisterTransparentPass(SubprocessFacet& f)
 {
     //Low flux mode not supported (ray properties can't change on transparent pass since it's inside the Intersect() routine)
-    this->hitted = true;
-    this->tmpCounter.hit.nbMCHit++; //count MC hits
-    this->tmpCounter.hit.nbHitEquiv += sHandle->currentParticle.oriRatio;
-    this->tmpCounter.hit.fluxAbs += sHandle->currentParticle.dF;
-    this->tmpCounter.hit.powerAbs += sHandle->currentParticle.dP;
+    FacetHitState& state = facetStates[f.globalId];
+    state.hitted = true;
+    state.tmpCounter.hit.nbMCHit++; //count MC hits
+    state.tmpCounter.hit.nbHitEquiv += currentParticle.oriRatio;
+    state.tmpCounter.hit.fluxAbs += currentParticle.dF;
+    state.tmpCounter.hit.powerAbs += currentParticle.dP;
     ProfileSlice increment;
     increment.count_absorbed = 0;
     increment.count_incident = 1;
     increment.flux_absorbed = 0.0;
-    increment.flux_incident = sHandle->currentParticle.dF;
+    increment.flux_incident = currentParticle.dF;
     increment.power_absorbed = 0.0;
-    increment.power_incident = sHandle->currentParticle.dP;
-    ProfileFacet(*this, sHandle->currentParticle.energy, increment); //count profile
-    LogHit(this);
-    if (/*this->texture &&*/ this->sh.countTrans) RecordHitOnTexture(*this, sHandle->currentParticle.dF, sHandle->currentParticle.dP); //count texture
-    if (/*this->direction &&*/ this->sh.countDirection) RecordDirectionVector(*this);
+    increment.power_incident = currentParticle.dP;
+    ProfileFacet(f, currentParticle.energy, increment); //count profile
+    LogHit(f);
+    if (/*f.texture &&*/ f.sh.countTrans) RecordHitOnTexture(f, currentParticle.dF, currentParticle.dP); //count texture
+    if (/*f.direction &&*/ f.sh.countDirection) RecordDirectionVector(f);
 }
 
-void ProfileFacet(SubprocessFacet &f, const double &energy, const ProfileSlice& increment) {
+void SimulationThread::ProfileFacet(const SubprocessFacet &f, const double &energy, const ProfileSlice& increment) {
 
-    size_t pos;
+    PhaseScope scope(phaseTimers[PHASE_RECORDING]);
+    size_t pos = PROFILE_SIZE; //Not profiled
+    FacetHitState& state = facetStates[f.globalId];
 
     switch (f.sh.profileType) {
 
         case PROFILE_ANGULAR: {
-            double dot = abs(Dot(f.sh.N, sHandle->currentParticle.direction));
+            double dot = abs(Dot(f.sh.N, currentParticle.direction));
             double theta = acos(dot);              // Angle to normal (0 to PI/2)
-            size_t grad = (size_t)(((double)PROFILE_SIZE)*(theta) / (PI / 2)); // To Grad
-            Saturate(grad, 0, PROFILE_SIZE - 1);
-            f.profile[grad] += increment;
-
+            pos = (size_t)(((double)PROFILE_SIZE)*(theta) / (PI / 2)); // To Grad
+            Saturate(pos, 0, PROFILE_SIZE - 1);
         } break;
 
         case PROFILE_U:
-            pos = (size_t)((f.colU)*(double)PROFILE_SIZE);
+            pos = (size_t)((currentParticle.colU)*(double)PROFILE_SIZE);
             Saturate(pos, 0, PROFILE_SIZE - 1);
-            f.profile[pos]+= increment;
             break;
 
         case PROFILE_V:
-            pos = (size_t)((f.colV)*(double)PROFILE_SIZE);
+            pos = (size_t)((currentParticle.colV)*(double)PROFILE_SIZE);
             Saturate(pos, 0, PROFILE_SIZE - 1);
-            f.profile[pos] += increment;
             break;
 
     }
+    if (pos < PROFILE_SIZE) state.profile[pos] += increment;
 
     if (f.sh.recordSpectrum) {
-        f.spectrum.Add(energy, increment);
+        state.spectrum.Add(energy, increment);
+    }
+
+    //Every facet hit passes here once with its incident and absorbed part: the totals of the tagged tallies
+    if (!state.tagSlots.empty()) {
+        TaggedTally& tally = state.GetTaggedTally(GetTallyTag(currentParticle.sourceRegionId, currentParticle.nbBounces));
+        tally.total += increment;
+        if (pos < PROFILE_SIZE && !tally.cells.profile.empty()) tally.cells.profile[pos] += increment;
+    }
+    if (!state.bands.empty()) {
+        state.bands[model->energyBands[f.globalId].GetBand(energy)].total += increment;
     }
 }
 
-void SubprocessFacet::ResetCounter() {
+void FacetHitState::ResetCounter() {
     memset(&tmpCounter, 0, sizeof(tmpCounter));
     tmpCounter.ResetBuffer();
-}
\ No newline at end of file
+}
+
+void FacetHitState::Add(const FacetHitState& src) {
+	tmpCounter += src.tmpCounter;
+	for (size_t srcSlot = 0; srcSlot < src.usedTiles.size(); srcSlot++) {
+		size_t slot = GetTileSlot(src.usedTiles[srcSlot]);
+		for (size_t c = 0; c < TEXTURE_TILE_CELLS; c++) {
+			if (hasTexture) textureTiles[slot * TEXTURE_TILE_CELLS + c] += src.textureTiles[srcSlot * TEXTURE_TILE_CELLS + c];
+			if (hasDirection) {
+				directionTiles[slot * TEXTURE_TILE_CELLS + c].dir += src.directionTiles[srcSlot * TEXTURE_TILE_CELLS + c].dir;
+				directionTiles[slot * TEXTURE_TILE_CELLS + c].count += src.directionTiles[srcSlot * TEXTURE_TILE_CELLS + c].count;
+			}
+		}
+	}
+	for (size_t i = 0; i < profile.size(); i++) profile[i] += src.profile[i];
+	spectrum += src.spectrum;
+	AddTagged(src);
+	hitted = true;
+}
+
+void FacetHitState::AddTagged(const FacetHitState& src) {
+	for (const auto& srcTally : src.tagged) {
+		TaggedTally& tally = GetTaggedTally(srcTally.tag);
+		tally.total += srcTally.total;
+		tally.cells.Add(srcTally.cells);
+	}
+	for (size_t b = 0; b < bands.size() && b < src.bands.size(); b++) {
+		bands[b].total += src.bands[b].total;
+		bands[b].cells.Add(src.bands[b].cells);
+	}
+}
+
+TaggedTally& FacetHitState::GetTaggedTally(const size_t& tag) {
+	uint32_t slot = tagSlots[tag];
+	if (slot == NO_TAG) {
+		slot = (uint32_t)tagged.size();
+		tagged.emplace_back();
+		TaggedTally& tally = tagged.back();
+		tally.tag = tag;
+		tally.total = ProfileSlice();
+		tally.cells.InitializeTagCells(*this, true, true);
+		tagSlots[tag] = slot;
+	}
+	return tagged[slot];
+}
+
+void FacetHitState::Reset() {
+	//Releases the allocated tiles (the pools keep their capacity for the next period) and zeroes the rest in place
+    ResetCounter();
+    hitted = false;
+
+	for (const auto& tile : usedTiles) tileSlots[tile] = NO_TILE;
+	usedTiles.clear();
+	textureTiles.clear();
+	directionTiles.clear();
+	std::fill(profile.begin(), profile.end(), ProfileSlice());
+    //if (f.sh.recordSpectrum)
+        spectrum.ResetCounts();
+	for (auto& tally : tagged) {
+		tally.total = ProfileSlice();
+		tally.cells.Reset();
+	}
+	for (auto& band : bands) {
+		band.total = ProfileSlice();
+		band.cells.Reset();
+	}
+}
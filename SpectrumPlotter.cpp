@@ -203,11 +203,7 @@ void SpectrumPlotter::refreshViews() {
 			int mode=v->userData2;
 			v->Reset();
 
-			size_t profileSize=f->sh.isProfile?PROFILE_SIZE*sizeof(ProfileSlice):0;
-			size_t textureSize=f->sh.isTextured?f->sh.texWidth*f->sh.texHeight*sizeof(TextureCell):0;
-			size_t directionSize=f->sh.countDirection?f->sh.texWidth*f->sh.texHeight*sizeof(DirectionCell):0;
-
-			ProfileSlice* spectrum = (ProfileSlice*)(buffer + (f->sh.hitOffset + sizeof(FacetHitBuffer) + profileSize + textureSize + directionSize));
+			ProfileSlice* spectrum = (ProfileSlice*)(buffer + GetSpectrumOffset(f->sh)); //After the texture tile indices
 			
 			double max;			
 
@@ -30,6 +30,7 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #include "RecoveryDialog.h"
 #include "Facet_shared.h"
 #include "SynradGeometry.h"
+#include "SynradLibrary.h"
 #include "GLApp\MathTools.h"
 //for Remainder
 #include "direct.h"
@@ -122,6 +123,9 @@ SynRad *mApp;
 #define MENU_FILE_EXPORTTEXTURE_POWERPERAREA 156
 #define MENU_FILE_EXPORTTEXTURE_ANSYS_POWER 157
 
+#define MENU_FILE_EXPORTLOADER 160
+#define MENU_FILE_EXPORTTALLIES 162
+
 #define MENU_FILE_EXPORTTEXTURE_AREA_COORD 171
 #define MENU_FILE_EXPORTTEXTURE_MCHITS_COORD 172
 #define MENU_FILE_EXPORTTEXTURE_FLUX_COORD 173
@@ -210,6 +214,7 @@ SynRad::SynRad()
 	regionEditor = NULL;
 
 	materialPaths = std::vector<std::string>();
+	saveTextResults = false;
 }
 
 // Name: OneTimeSceneInit()
@@ -240,6 +245,9 @@ int SynRad::OneTimeSceneInit()
 	menu->GetSubMenu("File")->GetSubMenu("Export selected textures")->GetSubMenu("By X,Y,Z coordinates")->Add("Flux density (ph/sec/cm\262)", MENU_FILE_EXPORTTEXTURE_FLUXPERAREA_COORD);
 	menu->GetSubMenu("File")->GetSubMenu("Export selected textures")->GetSubMenu("By X,Y,Z coordinates")->Add("Power density (W/mm\262)", MENU_FILE_EXPORTTEXTURE_POWERPERAREA_COORD);
 
+	menu->GetSubMenu("File")->Add("Export simulation input (for synradCLI)...", MENU_FILE_EXPORTLOADER);
+	menu->GetSubMenu("File")->Add("Export tally results...", MENU_FILE_EXPORTTALLIES);
+
 	menu->GetSubMenu("File")->Add(NULL); // Separator
 	menu->GetSubMenu("File")->Add("E&xit", MENU_FILE_EXIT);  //Moved here from OnetimeSceneinit_shared to assert it's the last menu item
 
@@ -308,17 +316,7 @@ int SynRad::OneTimeSceneInit()
 
 	//Reflection materials
 	//Find material files in param directory
-	intptr_t file;
-	_finddata_t filedata;
-	file = _findfirst("param\\Materials\\*.csv", &filedata);
-	if (file != -1)
-	{
-		do
-		{
-			materialPaths.push_back(filedata.name);
-		} while (_findnext(file, &filedata) == 0);
-	}
-	_findclose(file);
+	materialPaths = FindMaterialFiles();
 
 	facetRLabel = new GLLabel("Refl:");
 	facetPanel->Add(facetRLabel);
@@ -400,53 +398,18 @@ int SynRad::OneTimeSceneInit()
 
 	UpdateRecentPARMenu();
 
-	int index;
 	try {
-		for (index = 0; index < (int)materialPaths.size(); index++) //load materials
-			worker.AddMaterial(&(materialPaths[index]));
+		LoadMaterials(&worker, materialPaths);
 	}
 	catch (Error &e) {
-		char errMsg[512];
-		sprintf(errMsg, "Failed to load material reflection file:\n%s\n%s", materialPaths[index].c_str(), e.GetMsg());
-		GLMessageBox::Display(errMsg, "Error", GLDLG_OK, GLDLG_ICONERROR);
+		GLMessageBox::Display(e.GetMsg(), "Error", GLDLG_OK, GLDLG_ICONERROR);
 	}
 
-	FileReader *f;
 	try {
-		worker.chi_distros.resize(3);
-
-		f = new FileReader("param\\Distributions\\sum_psi_distr_0to4perlambdar_0.35_delta5E-3_full_pol.csv");
-		//vertical (psi) distribution for different e_crit/e values
-		//each row is for a logarithm of lambda_ratio, starting from -10 to +2
-		//each column is for a psi angle, starting from 0 going to 1, with a delta of 0.005
-		//where 1 corresponds to 4/lambda_ratio^0.35
-		worker.psi_distro = worker.ImportCSV_double(f);
-		SAFE_DELETE(f);
-		f = new FileReader("param\\Distributions\\psi_chi_gamma10000_logsampled_-7to0_delta0.02_full_pol.csv");
-		//each column corresponds to a Log10[PSI*(gamma/10000)] value. First column: -99, second column: -7, delta: 0.02, max: 0
-		//each row corresponds to a    Log10[CHI*(gamma/10000)] value. First column: -7,                     delta: 0.02, max: 0
-		worker.chi_distros[0] = worker.ImportCSV_double(f);
-		SAFE_DELETE(f);
-
-		//Parallel polarization
-		f = new FileReader("param\\Distributions\\psi_chi_gamma10000_logsampled_-7to0_delta0.02_par_pol.csv");
-		worker.chi_distros[1] = worker.ImportCSV_double(f);
-		SAFE_DELETE(f);
-
-		//Orthogonal polarization
-		f = new FileReader("param\\Distributions\\psi_chi_gamma10000_logsampled_-7to0_delta0.02_ort_pol.csv");
-		worker.chi_distros[2] = worker.ImportCSV_double(f);
-		SAFE_DELETE(f);
-
-		f = new FileReader("param\\Distributions\\degree_of_parallel_polarization_0to4perlambdar_0.35_delta5E-3.csv");
-		worker.parallel_polarization = worker.ImportCSV_double(f);
-		SAFE_DELETE(f);
+		LoadDistributions(&worker);
 	}
 	catch (Error &e) {
-		SAFE_DELETE(f);
-		char errMsg[512];
-		sprintf(errMsg, "Failed to load angular distribution file.\nIt should be in the param\\Distributions directory.\n%s", e.GetMsg());
-		GLMessageBox::Display(errMsg, "Error", GLDLG_OK, GLDLG_ICONERROR);
+		GLMessageBox::Display(e.GetMsg(), "Error", GLDLG_OK, GLDLG_ICONERROR);
 	}
 
 	return GL_OK;
@@ -1698,6 +1661,13 @@ void SynRad::ProcessMessage(GLComponent *src, int message)
 			ExportTextures(1, 5);
 			break;
 
+		case MENU_FILE_EXPORTLOADER:
+			ExportLoaderFile();
+			break;
+		case MENU_FILE_EXPORTTALLIES:
+			ExportTallies();
+			break;
+
 		/*case MENU_FILE_EXPORT_DESORP:
 			if (!geom->IsLoaded()) {
 				GLMessageBox::Display("No geometry loaded.", "Error", GLDLG_OK, GLDLG_ICONERROR);
@@ -2357,6 +2327,20 @@ void SynRad::LoadConfig() {
 			viewer[i]->hideLot = f->ReadInt();
 		f->ReadKeyword("leftHandedView"); f->ReadKeyword(":");
 		leftHandedView = f->ReadInt();
+		f->ReadKeyword("saveTextResults"); f->ReadKeyword(":");
+		saveTextResults = f->ReadInt();
+		f->ReadKeyword("nbThreadsPerProcess"); f->ReadKeyword(":");
+		runSettings.nbThreads = (size_t)f->ReadInt();
+		f->ReadKeyword("fluxWeightedSources"); f->ReadKeyword(":");
+		runSettings.fluxWeightedSources = f->ReadInt();
+		f->ReadKeyword("wavefrontSize"); f->ReadKeyword(":");
+		runSettings.wavefrontSize = (size_t)Max(f->ReadInt(), 1);
+		f->ReadKeyword("rouletteSurvivalWeight"); f->ReadKeyword(":");
+		runSettings.rouletteSurvivalWeight = Max(f->ReadDouble(), 0.0);
+		f->ReadKeyword("splitFactor"); f->ReadKeyword(":");
+		runSettings.splitFactor = (size_t)Max(f->ReadInt(), 1);
+		f->ReadKeyword("texturePoolMB"); f->ReadKeyword(":");
+		runSettings.texturePoolMB = (size_t)Max(f->ReadInt(), 1);
 		/*f->ReadKeyword("installId"); f->ReadKeyword(":");
 		installId = f->ReadString();
 		f->ReadKeyword("appLaunchesWithoutAsking"); f->ReadKeyword(":");
@@ -2463,6 +2447,13 @@ void SynRad::SaveConfig() {
 		f->Write("newReflectionModel:"); f->Write(worker.wp.newReflectionModel, "\n");
 		WRITEI("hideLot", hideLot);
 		f->Write("leftHandedView:"); f->Write(leftHandedView, "\n");
+		f->Write("saveTextResults:"); f->Write(saveTextResults, "\n");
+		f->Write("nbThreadsPerProcess:"); f->Write((int)runSettings.nbThreads, "\n");
+		f->Write("fluxWeightedSources:"); f->Write(runSettings.fluxWeightedSources, "\n");
+		f->Write("wavefrontSize:"); f->Write((int)runSettings.wavefrontSize, "\n");
+		f->Write("rouletteSurvivalWeight:"); f->Write(runSettings.rouletteSurvivalWeight, "\n");
+		f->Write("splitFactor:"); f->Write((int)runSettings.splitFactor, "\n");
+		f->Write("texturePoolMB:"); f->Write((int)runSettings.texturePoolMB, "\n");
 		/*f->Write("installId:"); f->Write(installId + "\n");
 		if (increaseSessionCount && appLaunchesWithoutAsking >= 0) appLaunchesWithoutAsking++;
 		f->Write("appLaunchesWithoutAsking:"); f->Write(appLaunchesWithoutAsking, "\n");*/
@@ -2572,6 +2563,80 @@ void SynRad::RemoveRegion(int index) {
 
 }
 
+void SynRad::ExportLoaderFile() {
+	//Geometry, regions, materials and distributions as loaded by the subprocesses, to run without the interface (synradCLI)
+	if (!worker.GetGeometry()->IsLoaded()) {
+		GLMessageBox::Display("No geometry loaded.", "Export simulation input", GLDLG_OK, GLDLG_ICONERROR);
+		return;
+	}
+
+	std::string saveFile = NFD_SaveFile_Cpp("synload", "");
+	if (saveFile.empty()) {
+		return;
+	}
+	if (FileUtils::GetExtension(saveFile) != "synload") saveFile = saveFile + ".synload";
+
+	FILE *f = fopen(saveFile.c_str(), "wb");
+	if (!f) {
+		char errMsg[512];
+		sprintf(errMsg, "Cannot open file\nFile:%s", saveFile.c_str());
+		GLMessageBox::Display(errMsg, "Error", GLDLG_OK, GLDLG_ICONERROR);
+		return;
+	}
+	try {
+		worker.GetSynradGeometry()->SaveLoaderFile(f, &worker, runSettings);
+	}
+	catch (Error &e) {
+		char errMsg[512];
+		sprintf(errMsg, "%s\nFile:%s", e.GetMsg(), saveFile.c_str());
+		GLMessageBox::Display(errMsg, "Error", GLDLG_OK, GLDLG_ICONERROR);
+	}
+	fclose(f);
+}
+
+void SynRad::ExportTallies() {
+	//Tagged and energy band tallies of the facets listed in Global Settings, same format as synradCLI's results and texture files
+	SynradGeometry *geom = worker.GetSynradGeometry();
+	if (!geom->IsLoaded()) {
+		GLMessageBox::Display("No geometry loaded.", "Export tally results", GLDLG_OK, GLDLG_ICONERROR);
+		return;
+	}
+	if (runSettings.tallyFacets.empty() && runSettings.energyBands.empty()) {
+		GLMessageBox::Display("No tallied facet nor energy bands, set them in Global Settings.", "Export tally results", GLDLG_OK, GLDLG_ICONERROR);
+		return;
+	}
+
+	std::string saveFile = NFD_SaveFile_Cpp("txt", "");
+	if (saveFile.empty()) {
+		return;
+	}
+	if (FileUtils::GetExtension(saveFile) != "txt") saveFile = saveFile + ".txt";
+
+	FILE *f = fopen(saveFile.c_str(), "w");
+	if (!f) {
+		char errMsg[512];
+		sprintf(errMsg, "Cannot open file\nFile:%s", saveFile.c_str());
+		GLMessageBox::Display(errMsg, "Error", GLDLG_OK, GLDLG_ICONERROR);
+		return;
+	}
+	BYTE *buffer = worker.GetHits();
+	if (buffer) {
+		std::vector<TallyLayout> layouts = geom->GetTallyLayouts();
+		if (!runSettings.tallyFacets.empty()) {
+			WriteTallyTable(f, buffer, layouts);
+			fprintf(f, "\n");
+		}
+		if (!runSettings.energyBands.empty()) {
+			WriteBandTable(f, buffer, layouts, runSettings.energyBands);
+			fprintf(f, "\n");
+		}
+		WriteTallyTextures(f, buffer, layouts);
+		WriteBandTextures(f, buffer, layouts);
+		worker.ReleaseHits();
+	}
+	fclose(f);
+}
+
 void SynRad::NewRegion() {
 	if (!worker.GetGeometry()->IsLoaded()) {
 		GLMessageBox::Display("You have to load a geometry before adding regions.", "Add magnetic region", GLDLG_OK, GLDLG_ICONERROR);
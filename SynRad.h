@@ -33,6 +33,7 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #include "TexturePlotter.h"
 #include "RegionInfo.h"
 #include "RegionEditor.h"
+#include "RunSettings.h"
 
 class Worker;
 
@@ -67,6 +68,8 @@ public:
 	void ClearRegions();
 	void RemoveRegion(int index);
 	void NewRegion();
+	void ExportLoaderFile(); //Simulation input for the command-line runner
+	void ExportTallies(); //Tagged and energy band tallies of the hit buffer
 
     // Recent files   	
 	char *recentPARs[MAX_RECENT];
@@ -112,6 +115,9 @@ public:
 	//Materials (photon reflection)
 	vector<string> materialPaths;
 
+	bool saveTextResults; //.syn results as text (readable by older versions, larger and slower to save) instead of binary chunks
+	RunSettings runSettings; //Sent to the subprocesses with the geometry, applied on reload
+
 	void RebuildPARMenus();
 
     //Dialog
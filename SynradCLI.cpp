@@ -0,0 +1,964 @@
+/*
+Program:     MolFlow+ / Synrad+
+Description: Monte Carlo simulator for ultra-high vacuum and synchrotron radiation
+Authors:     Jean-Luc PONS / Roberto KERSEVAN / Marton ADY
+Copyright:   E.S.R.F / CERN
+Website:     https://cern.ch/molflow
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
+*/
+
+//Command-line runner: simulates a geometry in this process, with no window, dialog or subprocess,
+//until a desorption limit or a time budget, then writes the results
+//The input is a .syn or .xml geometry with its PAR files, read as the interface does (SynradGeometry::LoadSYN()),
+//or a simulation input exported by the interface (File / Export simulation input): the flat loader buffer also sent to synradSub (LoaderFormat.h)
+//--benchmark-suite writes the inputs of the throughput benchmark, see WriteBenchmarkSuite()
+
+#ifdef WIN
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h> // For GetProcessMemoryInfo()
+#include <Process.h> // For _getpid()
+#else
+#include <sys/resource.h> // For getrusage()
+#include <unistd.h> // For getpid()
+#define _getpid getpid
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <csignal>
+#include <string>
+#include <vector>
+#include <functional>
+#include "Buffer_shared.h"
+#include "Simulation.h"
+#include "LoaderFormat.h"
+#include "RunSettings.h"
+#include "Worker.h"
+#include "SynradGeometry.h"
+#include "Facet_shared.h"
+#include "SynradDistributions.h" //Material
+#include "SynradLibrary.h"
+#include "Region_full.h"
+#include "SynradTypes.h" //Reflection types
+#include "File.h"
+#include "GLApp/MathTools.h"
+
+static size_t cliState = PROCESS_READY;
+static bool verbose = false;
+static volatile sig_atomic_t interrupted = 0;
+
+class HitUpdateStats { //Time spent in UpdateHits(): reducing the thread results and copying them to the hit buffer
+public:
+	size_t nbUpdates = 0;
+	double totalSeconds = 0.0, maxSeconds = 0.0;
+};
+
+// Called by the simulation core (implemented by synradSub for the interface)
+
+void SetState(size_t state, const char *status, bool changeState, bool changeStatus) {
+	if (changeState) cliState = state;
+	if (changeStatus && verbose && status) printf("  %s\n", status);
+}
+
+void SetErrorSub(const char *message) {
+	printf("Error: %s\n", message);
+	SetState(PROCESS_ERROR, message);
+}
+
+static void OnInterrupt(int) {
+	interrupted = 1; //Stop after the current step and write what was simulated
+}
+
+static bool ReadLoaderFile(const char *fileName, std::vector<uint64_t>& buffer, size_t& size) {
+	FILE *f = fopen(fileName, "rb");
+	if (!f) {
+		printf("Error: cannot open %s\n", fileName);
+		return false;
+	}
+	fseek(f, 0, SEEK_END);
+	long length = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	if (length <= 0) {
+		fclose(f);
+		printf("Error: %s is empty\n", fileName);
+		return false;
+	}
+	size = (size_t)length;
+	buffer.resize((size + sizeof(uint64_t) - 1) / sizeof(uint64_t)); //8-byte aligned for the loader sections
+	bool ok = fread(buffer.data(), 1, size, f) == size;
+	fclose(f);
+	if (!ok) printf("Error: cannot read %s\n", fileName);
+	return ok;
+}
+
+static bool LoadGeometryFile(const char *fileName, const std::vector<std::string>& parFiles, std::vector<uint64_t>& buffer, size_t& size) {
+	//.syn or .xml geometry and the PAR files of its regions, built into the same loader buffer as the interface sends.
+	//The material and distribution libraries are read from the param directory. Run settings are the defaults
+	Worker worker;
+	SynradGeometry *geom = worker.GetSynradGeometry();
+	GeometryLoadListener listener; //No progress, views, selections or formulas here
+	FileReader *f = NULL;
+	try {
+		LoadMaterials(&worker, FindMaterialFiles()); //Material facets refer to the library
+		LoadDistributions(&worker);
+
+		std::string ext = FileUtils::GetExtension(fileName);
+		std::vector<std::string> regionFiles;
+		if (ext == "syn") {
+			int version;
+			f = new FileReader(fileName);
+			regionFiles = geom->LoadSYN(f, &listener, &version, &worker);
+			SAFE_DELETE(f);
+			worker.ontheflyParams.desorptionLimit = geom->loaded_desorptionLimit;
+		}
+		else if (ext == "xml") { //Regions only given with -P
+			pugi::xml_document loadXML;
+			pugi::xml_parse_result parseResult = loadXML.load_file(fileName);
+			if (!parseResult) throw Error((std::string("XML parsed with errors: ") + parseResult.description()).c_str());
+			geom->LoadXML_geom(loadXML, &worker, &listener);
+		}
+		else throw Error("Unknown input type, expected .syn, .xml or .synload");
+
+		std::vector<std::string> regionPaths = parFiles;
+		if (parFiles.empty()) { //PAR files in the same directory as the SYN file
+			for (auto& regionFile : regionFiles)
+				regionPaths.push_back(FileUtils::GetPath(fileName) + regionFile);
+		}
+		std::vector<Region_full> loadedRegions;
+		std::vector<std::string> regionErrors;
+		LoadRegionFiles(regionPaths, loadedRegions, regionErrors);
+		for (size_t i = 0; i < loadedRegions.size(); i++) {
+			if (!regionErrors[i].empty()) throw Error((regionErrors[i] + "\nFile:" + regionPaths[i]).c_str());
+			worker.wp.nbTrajPoints += (int)loadedRegions[i].Points.size();
+			worker.regions.push_back(loadedRegions[i]);
+		}
+		if (worker.regions.empty()) throw Error("No region to generate photons, give the PAR files with -P");
+
+		RunSettings settings;
+		LoaderHeader header;
+		size = geom->GetLoaderLayout(header, &worker, settings);
+		buffer.assign((size + sizeof(uint64_t) - 1) / sizeof(uint64_t), 0); //8-byte aligned for the loader sections
+		geom->CopyLoaderBuffer(buffer.data(), header, &worker, settings);
+	}
+	catch (Error &e) {
+		SAFE_DELETE(f);
+		printf("Error: %s: %s\n", fileName, e.GetMsg());
+		return false;
+	}
+	return true;
+}
+
+static std::vector<const SubprocessFacet*> GetFacetsByGlobalId(Simulation* sim) {
+	std::vector<const SubprocessFacet*> facets(sim->sh.nbFacet, NULL);
+	for (auto& f : sim->facets) {
+		if (f.globalId < facets.size()) facets[f.globalId] = &f;
+	}
+	return facets;
+}
+
+static bool WriteResults(Simulation* sim, const BYTE *buffer, const char *fileName, const double& duration) {
+	FILE *f = fopen(fileName, "w");
+	if (!f) {
+		printf("Error: cannot write %s\n", fileName);
+		return false;
+	}
+	const GlobalHitBuffer *gHits = (const GlobalHitBuffer *)buffer;
+	fprintf(f, "Geometry\t%s\n", sim->sh.name.c_str());
+	fprintf(f, "Seed\t%llu\n", (unsigned long long)sim->randomSeed);
+	fprintf(f, "Duration_s\t%g\n", duration);
+	fprintf(f, "Desorbed\t%zd\n", (size_t)gHits->globalHits.hit.nbDesorbed);
+	fprintf(f, "MC_hits\t%zd\n", (size_t)gHits->globalHits.hit.nbMCHit);
+	fprintf(f, "Leaks\t%zd\n", (size_t)gHits->nbLeakTotal);
+	fprintf(f, "Flux_abs(ph/s)\t%g\n", gHits->globalHits.hit.fluxAbs);
+	fprintf(f, "Power_abs(W)\t%g\n", gHits->globalHits.hit.powerAbs);
+	size_t lostHits = (size_t)sim->texturePool.GetHeader(buffer)->nbLostHits;
+	if (lostHits > 0) fprintf(f, "Texture_hits_lost\t%zd\n", lostHits); //Texture tile pool full, see -m
+	fprintf(f, "\n");
+
+	fprintf(f, "Facet\tMC_hits\tHit_equiv\tAbs_equiv\tFlux_abs(ph/s)\tPower_abs(W)\n");
+	std::vector<const SubprocessFacet*> facets = GetFacetsByGlobalId(sim);
+	for (size_t i = 0; i < facets.size(); i++) {
+		if (!facets[i]) continue;
+		const FacetHitBuffer *fHits = (const FacetHitBuffer *)(buffer + facets[i]->sh.hitOffset);
+		fprintf(f, "%zd\t%zd\t%g\t%g\t%g\t%g\n", i + 1, (size_t)fHits->hit.nbMCHit, (double)fHits->hit.nbHitEquiv, (double)fHits->hit.nbAbsEquiv,
+			fHits->hit.fluxAbs, fHits->hit.powerAbs);
+	}
+
+	//By source region and bounce bucket, then by energy band, from the hit buffer as the interface exports them
+	bool hasTagged = false, hasBands = false;
+	for (auto& layout : sim->tallyLayouts) {
+		hasTagged = hasTagged || layout.nbTags > 0;
+		hasBands = hasBands || layout.nbBands > 0;
+	}
+	if (hasTagged) {
+		fprintf(f, "\n");
+		WriteTallyTable(f, buffer, sim->tallyLayouts);
+	}
+	if (hasBands) {
+		fprintf(f, "\n");
+		WriteBandTable(f, buffer, sim->tallyLayouts, sim->energyBands);
+	}
+
+	if (!sim->precision.targets.empty()) { //-1: not enough batches yet
+		fprintf(f, "\nPrecision target\tRequested_rel_error\tAchieved_rel_error\n");
+		for (auto& target : sim->precision.targets) {
+			fprintf(f, "%s\t%g\t%g\n", target.GetDescription().c_str(), target.relativeError, target.lastError);
+		}
+	}
+	fclose(f);
+	return true;
+}
+
+static bool WriteUncertaintyTextures(Simulation* sim, const std::string& prefix) {
+	//Relative error of the power density of every cell, same layout as WriteTextures(). 0: never hit, -1: not enough batches
+	std::string fileName = prefix + "_powerrelerror.txt";
+	FILE *f = fopen(fileName.c_str(), "w");
+	if (!f) {
+		printf("Error: cannot write %s\n", fileName.c_str());
+		return false;
+	}
+	for (auto& facet : sim->facets) {
+		const CellBatchStats* stats = sim->precision.GetCellStats(facet.globalId);
+		if (!stats) continue;
+		fprintf(f, "FACET%zd\n", facet.globalId + 1);
+		for (size_t x = 0; x < stats->width; x++) {
+			for (size_t y = 0; y < stats->height; y++) {
+				const BatchSums& cell = stats->cells[x + y*stats->width];
+				fprintf(f, "%g", (cell.sumY == 0.0) ? 0.0 : sim->precision.GetRelativeError(cell));
+				if (y < stats->height - 1) fprintf(f, "\t");
+			}
+			fprintf(f, "\n");
+		}
+		fprintf(f, "\n");
+	}
+	fclose(f);
+	return true;
+}
+
+static bool WriteTaggedTextures(Simulation* sim, const BYTE *buffer, const std::string& prefix) {
+	//Tallied textured facets, one block per tag that hit the facet. Energy bands recorded with a texture go to their own file
+	bool hasTagged = false, hasBands = false;
+	for (auto& layout : sim->tallyLayouts) {
+		hasTagged = hasTagged || (layout.nbTags > 0 && layout.texWidth > 0);
+		hasBands = hasBands || (layout.nbBands > 0 && layout.bandTexture);
+	}
+	if (hasTagged) {
+		std::string fileName = prefix + "_taggedpowerperarea.txt";
+		FILE *f = fopen(fileName.c_str(), "w");
+		if (!f) {
+			printf("Error: cannot write %s\n", fileName.c_str());
+			return false;
+		}
+		WriteTallyTextures(f, buffer, sim->tallyLayouts);
+		fclose(f);
+	}
+	if (hasBands) {
+		std::string fileName = prefix + "_bandpowerperarea.txt";
+		FILE *f = fopen(fileName.c_str(), "w");
+		if (!f) {
+			printf("Error: cannot write %s\n", fileName.c_str());
+			return false;
+		}
+		WriteBandTextures(f, buffer, sim->tallyLayouts);
+		fclose(f);
+	}
+	return true;
+}
+
+static bool WriteTextures(Simulation* sim, const BYTE *buffer, const std::string& prefix) {
+	//Facet by facet, as the interface's texture export: MC hits, flux density (ph/s/cm2) and power density (W/mm2)
+	const char *suffixes[3] = { "_mchits.txt", "_fluxperarea.txt", "_powerperarea.txt" };
+	std::vector<const SubprocessFacet*> facets = GetFacetsByGlobalId(sim);
+	for (int mode = 0; mode < 3; mode++) {
+		std::string fileName = prefix + suffixes[mode];
+		FILE *f = fopen(fileName.c_str(), "w");
+		if (!f) {
+			printf("Error: cannot write %s\n", fileName.c_str());
+			return false;
+		}
+		for (size_t i = 0; i < facets.size(); i++) {
+			if (!facets[i] || !facets[i]->sh.isTextured) continue;
+			const SubprocessFacet& facet = *facets[i];
+			size_t w = facet.sh.texWidth;
+			size_t h = facet.sh.texHeight;
+			TileView<TextureCell> texture = GetTextureView(buffer, facet.sh, sim->texturePool);
+			fprintf(f, "FACET%zd\n", i + 1);
+			for (size_t x = 0; x < w; x++) {
+				for (size_t y = 0; y < h; y++) {
+					const TextureCell& cell = texture.GetCell(x, y);
+					if (mode == 0) fprintf(f, "%zd", cell.count);
+					else if (mode == 1) fprintf(f, "%g", cell.flux);
+					else fprintf(f, "%g", cell.power * 0.01);
+					if (y < h - 1) fprintf(f, "\t");
+				}
+				fprintf(f, "\n");
+			}
+			fprintf(f, "\n");
+		}
+		fclose(f);
+	}
+	return WriteTaggedTextures(sim, buffer, prefix);
+}
+
+static std::string JsonEscape(const std::string& str) {
+	std::string result;
+	for (auto& c : str) {
+		if (c == '"' || c == '\\') result += '\\';
+		if ((unsigned char)c >= 0x20) result += c;
+	}
+	return result;
+}
+
+static size_t GetPeakMemoryUsage() { //Peak working set (resident set on Linux) of this process, in bytes
+#ifdef WIN
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+	return counters.PeakWorkingSetSize;
+#else
+	rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+	return (size_t)usage.ru_maxrss * 1024; //kilobytes
+#endif
+}
+
+static bool WriteBenchmark(Simulation* sim, const BYTE *buffer, const char *fileName, const char *inputFile, const double& duration, const HitUpdateStats& updates) {
+	//Machine-readable throughput of this run, one object per file
+	FILE *f = fopen(fileName, "w");
+	if (!f) {
+		printf("Error: cannot write %s\n", fileName);
+		return false;
+	}
+	const GlobalHitBuffer *gHits = (const GlobalHitBuffer *)buffer;
+	size_t nbDesorbed = (size_t)gHits->globalHits.hit.nbDesorbed;
+	size_t nbMCHit = (size_t)gHits->globalHits.hit.nbMCHit;
+	PhaseProfile profile;
+	sim->GetPhaseProfile(profile);
+	fprintf(f, "{\n");
+	fprintf(f, "  \"input\": \"%s\",\n", JsonEscape(inputFile).c_str());
+	fprintf(f, "  \"geometry\": \"%s\",\n", JsonEscape(sim->sh.name).c_str());
+	fprintf(f, "  \"threads\": %zd,\n", sim->nbThreads);
+	fprintf(f, "  \"wavefront_size\": %zd,\n", sim->wavefrontSize);
+	fprintf(f, "  \"flux_weighted_sources\": %s,\n", sim->fluxWeightedSources ? "true" : "false");
+	fprintf(f, "  \"low_flux_mode\": %s,\n", sim->ontheflyParams.lowFluxMode ? "true" : "false");
+	fprintf(f, "  \"seed\": %llu,\n", (unsigned long long)sim->randomSeed);
+	fprintf(f, "  \"duration_s\": %.6g,\n", duration);
+	fprintf(f, "  \"desorptions\": %zd,\n", nbDesorbed);
+	fprintf(f, "  \"mc_hits\": %zd,\n", nbMCHit);
+	fprintf(f, "  \"desorptions_per_s\": %.6g,\n", (duration > 0.0) ? (double)nbDesorbed / duration : 0.0);
+	fprintf(f, "  \"bounces_per_s\": %.6g,\n", (duration > 0.0) ? (double)nbMCHit / duration : 0.0);
+	fprintf(f, "  \"ns_per_intersect\": %.6g,\n", GetPhaseNanosecondsPerCall(profile, PHASE_INTERSECT));
+	fprintf(f, "  \"ns_per_generate_photon\": %.6g,\n", GetPhaseNanosecondsPerCall(profile, PHASE_GENERATION));
+	fprintf(f, "  \"peak_rss_bytes\": %zd,\n", GetPeakMemoryUsage());
+	fprintf(f, "  \"hit_buffer_bytes\": %zd,\n", GetHitsSize(sim));
+	fprintf(f, "  \"texture_tiles_used\": %llu,\n", (unsigned long long)sim->texturePool.GetHeader(buffer)->nbTextureTiles);
+	fprintf(f, "  \"hit_updates\": %zd,\n", updates.nbUpdates);
+	fprintf(f, "  \"hit_update_ms_mean\": %.6g,\n", (updates.nbUpdates > 0) ? updates.totalSeconds * 1000.0 / (double)updates.nbUpdates : 0.0);
+	fprintf(f, "  \"hit_update_ms_max\": %.6g,\n", updates.maxSeconds * 1000.0);
+	fprintf(f, "  \"thread_seconds\": %.6g,\n", profile.threadSeconds);
+	fprintf(f, "  \"roulette_survival_weight\": %.6g,\n", sim->rouletteSurvivalWeight);
+	fprintf(f, "  \"split_factor\": %zd,\n", sim->splitFactor);
+	fprintf(f, "  \"roulette_kills\": %llu,\n", (unsigned long long)profile.nbRouletteKills);
+	fprintf(f, "  \"roulette_survivals\": %llu,\n", (unsigned long long)profile.nbRouletteSurvivals);
+	fprintf(f, "  \"split_copies\": %llu,\n", (unsigned long long)profile.nbSplitCopies);
+	fprintf(f, "  \"effective_samples_per_cpu_s\": %.6g,\n", GetEffectiveSamplesPerSecond(profile)); //MC hits weighed by oriRatio, per thread second
+	fprintf(f, "  \"precision_batches\": %zd,\n", sim->precision.nbBatches);
+	fprintf(f, "  \"precision_targets\": [");
+	for (size_t i = 0; i < sim->precision.targets.size(); i++) {
+		const PrecisionTarget& target = sim->precision.targets[i];
+		fprintf(f, "%s\n    { \"target\": \"%s\", \"requested\": %.6g, \"achieved\": %.6g }", (i > 0) ? "," : "",
+			JsonEscape(target.GetDescription()).c_str(), target.relativeError, target.lastError);
+	}
+	fprintf(f, "%s],\n", sim->precision.targets.empty() ? "" : "\n  ");
+	fprintf(f, "  \"phases\": {\n"); //Sampled time scaled to all calls
+	for (size_t phase = 0; phase < NB_PROFILE_PHASES; phase++) {
+		fprintf(f, "    \"%s\": { \"calls\": %llu, \"seconds\": %.6g, \"ns_per_call\": %.6g }%s\n", GetPhaseShortName(phase),
+			(unsigned long long)profile.nbCalls[phase], GetPhaseSeconds(profile, phase), GetPhaseNanosecondsPerCall(profile, phase),
+			(phase + 1 < NB_PROFILE_PHASES) ? "," : "");
+	}
+	fprintf(f, "  }\n");
+	fprintf(f, "}\n");
+	fclose(f);
+	return true;
+}
+
+static bool ParseListOption(const char* list, std::vector<bool>& flags) {
+	if (ParseIdList(list, flags)) return true;
+	printf("Invalid list %s, expected numbers from 1 separated by commas\n", list);
+	return false;
+}
+
+static bool RunToLimit(const std::vector<uint64_t>& loaderBuffer, const size_t& loaderSize, const RunSettings& settings, const std::function<void(Simulation*)>& configure,
+	uint64_t& seed, std::vector<FacetHitBuffer>& facetHits, std::vector<bool>& randomPasses) {
+	//Runs the loaded geometry until its desorption limit, returns the facet counters by globalId
+	//seed: used if nonzero, else set to the run's seed. randomPasses: facets whose hit or pass is drawn (opacity or material)
+	Simulation *sim = new Simulation();
+	configure(sim);
+	if (!LoadSimulation(sim, loaderBuffer.data(), loaderSize, &settings)) {
+		SAFE_DELETE(sim);
+		return false;
+	}
+	if (seed != 0) sim->randomSeed = seed;
+	seed = sim->randomSeed;
+
+	static size_t nbRuns = 0;
+	char hitsDpName[40];
+	sprintf(hitsDpName, "SNRDCLICHECK%d_%zd", _getpid(), nbRuns++);
+	Dataport *dpHit = CreateDataport(hitsDpName, GetHitsSize(sim));
+	if (!dpHit || !StartSimulation(sim)) {
+		if (dpHit) CLOSEDP(dpHit);
+		ClearSimulation(sim);
+		SAFE_DELETE(sim);
+		return false;
+	}
+	bool eos = false;
+	while (!eos && !interrupted && cliState != PROCESS_ERROR) {
+		eos = SimulationRun(sim);
+		UpdateHits(sim, dpHit, NULL, 0, 60000);
+	}
+	bool ok = eos && AccessDataportTimed(dpHit, 60000);
+	if (ok) {
+		std::vector<const SubprocessFacet*> facets = GetFacetsByGlobalId(sim);
+		facetHits.assign(facets.size(), FacetHitBuffer());
+		randomPasses.assign(facets.size(), false);
+		for (size_t i = 0; i < facets.size(); i++) {
+			if (!facets[i]) continue;
+			facetHits[i] = *(const FacetHitBuffer *)((const BYTE *)dpHit->buff + facets[i]->sh.hitOffset);
+			randomPasses[i] = (facets[i]->sh.opacity > 0.0 && facets[i]->sh.opacity < 1.0) || facets[i]->sh.reflectType >= 10;
+		}
+		ReleaseDataport(dpHit);
+	}
+	CLOSEDP(dpHit);
+	ClearSimulation(sim);
+	SAFE_DELETE(sim);
+	return ok;
+}
+
+static int CheckWavefront(const std::vector<uint64_t>& loaderBuffer, const size_t& loaderSize, const RunSettings& settings, const std::function<void(Simulation*)>& configure,
+	const size_t& wavefrontSize) {
+	//Per-photon replay: with one thread and the same seed, tracing one particle at a time and wavefront tracing
+	//must give the same counters on every facet, including those where a pass is drawn
+	uint64_t seed = 0;
+	std::vector<FacetHitBuffer> scalarHits, wavefrontHits;
+	std::vector<bool> randomPasses;
+	RunSettings scalar = settings;
+	scalar.nbThreads = 1;
+	scalar.wavefrontSize = 1;
+	scalar.precisionTargets.clear(); //Both runs go to the desorption limit
+	RunSettings wavefront = scalar;
+	wavefront.wavefrontSize = wavefrontSize;
+	printf("Checking wavefront tracing (%zd particles) against scalar tracing\n", wavefrontSize);
+	if (!RunToLimit(loaderBuffer, loaderSize, scalar, configure, seed, scalarHits, randomPasses)
+		|| !RunToLimit(loaderBuffer, loaderSize, wavefront, configure, seed, wavefrontHits, randomPasses)) {
+		printf("Error: check run failed\n");
+		return 1;
+	}
+	size_t nbMismatches = 0, nbRandomFacetsHit = 0;
+	for (size_t i = 0; i < scalarHits.size(); i++) {
+		const FacetHitBuffer& a = scalarHits[i];
+		const FacetHitBuffer& b = wavefrontHits[i];
+		if (randomPasses[i] && a.hit.nbMCHit > 0) nbRandomFacetsHit++;
+		if (a.hit.nbMCHit != b.hit.nbMCHit || a.hit.nbHitEquiv != b.hit.nbHitEquiv || a.hit.nbAbsEquiv != b.hit.nbAbsEquiv
+			|| a.hit.fluxAbs != b.hit.fluxAbs || a.hit.powerAbs != b.hit.powerAbs) {
+			printf("  Facet %zd: %zd MC hits (scalar), %zd (wavefront), flux %g / %g, power %g / %g\n", i + 1,
+				(size_t)a.hit.nbMCHit, (size_t)b.hit.nbMCHit, a.hit.fluxAbs, b.hit.fluxAbs, a.hit.powerAbs, b.hit.powerAbs);
+			nbMismatches++;
+		}
+	}
+	if (nbMismatches > 0) {
+		printf("Failed: %zd facet(s) differ (seed %llu)\n", nbMismatches, (unsigned long long)seed);
+		return 1;
+	}
+	if (nbRandomFacetsHit == 0) {
+		printf("Failed: no semi-transparent or material facet was hit, the check needs one\n");
+		return 1;
+	}
+	printf("Passed: identical counters on all %zd facets, %zd of them semi-transparent or material facets that were hit (seed %llu)\n",
+		scalarHits.size(), nbRandomFacetsHit, (unsigned long long)seed);
+	return 0;
+}
+
+#define ALLOCATION_WARMUP_STEPS 3 //Steps sizing the thread buffers, photon batches, hit cache, texture tiles and tags
+
+static int CheckAllocations(const std::vector<uint64_t>& loaderBuffer, const size_t& loaderSize, const RunSettings& settings, const std::function<void(Simulation*)>& configure,
+	const size_t& nbSteps) {
+	//Once warmed up, the bounce loop must not touch the heap: every thread's allocationsLastStep stays 0 for nbSteps steps
+#ifndef SYNRAD_COUNT_ALLOCATIONS
+	printf("Error: the allocation check needs a build with SYNRAD_COUNT_ALLOCATIONS defined\n");
+	return 1;
+#else
+	RunSettings run = settings;
+	run.precisionTargets.clear(); //Runs a fixed number of steps
+	Simulation *sim = new Simulation();
+	configure(sim);
+	if (!LoadSimulation(sim, loaderBuffer.data(), loaderSize, &run)) {
+		SAFE_DELETE(sim);
+		return 1;
+	}
+	char hitsDpName[40];
+	sprintf(hitsDpName, "SNRDCLIALLOC%d", _getpid());
+	Dataport *dpHit = CreateDataport(hitsDpName, GetHitsSize(sim));
+	if (!dpHit || !StartSimulation(sim)) {
+		if (dpHit) CLOSEDP(dpHit);
+		ClearSimulation(sim);
+		SAFE_DELETE(sim);
+		return 1;
+	}
+	printf("Checking heap allocations: %d warm-up steps, then %zd steps on %zd thread(s)\n", ALLOCATION_WARMUP_STEPS, nbSteps, sim->nbThreads);
+	size_t nbAllocatingSteps = 0, step = 0;
+	bool eos = false;
+	for (; step < ALLOCATION_WARMUP_STEPS + nbSteps && !eos && !interrupted && cliState != PROCESS_ERROR; step++) {
+		eos = SimulationRun(sim);
+		if (step >= ALLOCATION_WARMUP_STEPS) {
+			for (auto& t : sim->threads) {
+				if (t->allocationsLastStep == 0) continue;
+				printf("  Step %zd, thread %zd: %zd heap allocation(s)\n", step - ALLOCATION_WARMUP_STEPS + 1, t->threadId, t->allocationsLastStep);
+				nbAllocatingSteps++;
+			}
+		}
+		UpdateHits(sim, dpHit, NULL, 0, 60000);
+	}
+	size_t nbPhotons = sim->GetTotalDesorbed();
+	bool completed = (step == ALLOCATION_WARMUP_STEPS + nbSteps) && cliState != PROCESS_ERROR && !interrupted;
+	CLOSEDP(dpHit);
+	ClearSimulation(sim);
+	SAFE_DELETE(sim);
+	if (!completed) {
+		printf("Failed: the run stopped after %zd step(s), raise the desorption limit with -d\n", step);
+		return 1;
+	}
+	if (nbAllocatingSteps > 0) {
+		printf("Failed: %zd thread step(s) allocated after the warm-up\n", nbAllocatingSteps);
+		return 1;
+	}
+	printf("Passed: no heap allocation after the warm-up (%zd photons)\n", nbPhotons);
+	return 0;
+#endif
+}
+
+//Benchmark suite: synthetic beamlines built here from fixed parameters, so that every build writes the same inputs
+#define BENCHMARK_PHOTONS 1000000 //Desorption limit of every scenario
+
+//Beam of the benchmark suite scenarios
+#define BENCHMARK_REGION_DIPOLE     0
+#define BENCHMARK_REGION_UNDULATOR  1
+#define BENCHMARK_REGION_QUADRUPOLE 2
+
+static Region_full BuildBenchmarkRegion(const int& preset) {
+	//3 GeV, 100 mA electron beam entering the benchmark pipe on its axis, trajectory calculated for the first 50 cm
+	Region_full reg;
+	reg.params.E_GeV = 3.0;
+	reg.params.current_mA = 100.0;
+	reg.params.startPoint = Vector3d(0, 0, 0);
+	reg.params.startDir = Vector3d(0, 0, 1);
+	reg.params.limits = Vector3d(1000, 1000, 50);
+	reg.params.dL_cm = 0.1;
+	reg.params.B_const = Vector3d(0, 0, 0);
+	reg.params.Bx_mode = reg.params.By_mode = reg.params.Bz_mode = B_MODE_CONSTANT;
+	switch (preset) {
+	case BENCHMARK_REGION_DIPOLE:
+		reg.params.B_const.y = 0.2; //50 m bending radius
+		reg.fileName = "benchmark_dipole.param";
+		break;
+	case BENCHMARK_REGION_UNDULATOR:
+		reg.params.By_mode = B_MODE_SINCOS;
+		reg.params.By_period = 5.0;
+		reg.params.By_dir = Vector3d(0, 0, 1);
+		reg.By_distr.AddPair(1.0, 0.0); //1 T sine, first order only
+		reg.params.dL_cm = 0.01; //50 steps per period
+		reg.fileName = "benchmark_undulator.param";
+		break;
+	case BENCHMARK_REGION_QUADRUPOLE:
+		reg.params.startPoint = Vector3d(0.2, 0, 0); //off axis to radiate
+		reg.params.Bx_mode = B_MODE_QUADRUPOLE;
+		reg.params.quad_params.center = Vector3d(0, 0, 25);
+		reg.params.quad_params.alfa_q = reg.params.quad_params.beta_q = reg.params.quad_params.rot_q = 0.0;
+		reg.params.quad_params.K_q = 20.0 / 100.0; //20 T/m, in T/cm
+		reg.params.quad_params.L_q = 50.0;
+		reg.params.quad_params.cosalfa_q = reg.params.quad_params.cosbeta_q = reg.params.quad_params.cosrot_q = 1.0;
+		reg.params.quad_params.sinalfa_q = reg.params.quad_params.sinbeta_q = reg.params.quad_params.sinrot_q = 0.0;
+		reg.params.quad_params.direction = Vector3d(0, 0, 1);
+		reg.params.quad_params.isCombinedFunction = false;
+		reg.params.quad_params.offset_combined_function = Vector3d(0, 0, 0);
+		reg.params.emittance_cm = 1E-7; //Non-ideal beam: photons get beam offsets
+		reg.params.betax_const_cm = reg.params.betay_const_cm = 1000.0;
+		reg.params.coupling_percent = 1.0;
+		reg.fileName = "benchmark_quadrupole.param";
+		break;
+	}
+	reg.CalculateTrajectory(1000000);
+	return reg;
+}
+
+static Material BuildBenchmarkMaterial() {
+	//Reflectivity table bundled with the suite instead of one of param/Materials, which may differ between installations:
+	//forward reflection only, falling with the photon energy (10 eV..100 keV) and the grazing angle (1 mrad..pi/2)
+	Material mat;
+	mat.name = "benchmark";
+	mat.hasBackscattering = false;
+	const double energies[] = { 10.0, 100.0, 1000.0, 10000.0, 100000.0 };
+	const double angles[] = { 0.001, 0.01, 0.1, 1.0, 1.5708 };
+	mat.energyVals.assign(energies, energies + 5);
+	mat.angleVals.assign(angles, angles + 5);
+	for (auto& energy : mat.energyVals) {
+		std::vector<std::vector<double>> row;
+		for (auto& angle : mat.angleVals)
+			row.push_back(std::vector<double>(1, 0.9 / (1.0 + (energy / 1000.0) * (angle / 0.01))));
+		mat.reflVals.push_back(row);
+	}
+	return mat;
+}
+
+static int WriteBenchmarkSuite(const std::string& directory) {
+	//The same 2 m pipe in every file, each scenario loads a different part of the simulation. Fails rather than leaving one out
+	struct BenchmarkScenario {
+		const char *name;
+		int regionPreset;
+		int reflectType; //REFLECTION_MATERIAL: the bundled material
+		bool roughness, lowFlux, textured;
+	};
+	const BenchmarkScenario scenarios[] = {
+		{ "diffuse", BENCHMARK_REGION_DIPOLE, REFLECTION_DIFFUSE, false, false, false },
+		{ "specular", BENCHMARK_REGION_UNDULATOR, REFLECTION_SPECULAR, false, false, false },
+		{ "material_rough", BENCHMARK_REGION_DIPOLE, REFLECTION_MATERIAL, true, false, false },
+		{ "lowflux", BENCHMARK_REGION_QUADRUPOLE, REFLECTION_MATERIAL, false, true, false },
+		{ "textured", BENCHMARK_REGION_DIPOLE, REFLECTION_DIFFUSE, false, false, true }
+	};
+
+	Worker worker;
+	SynradGeometry *geom = worker.GetSynradGeometry();
+	RunSettings settings; //Defaults, the runs choose theirs with the options
+	try {
+		LoadDistributions(&worker); //Needed by every scenario
+		worker.materials.push_back(BuildBenchmarkMaterial());
+		geom->UpdateName("PIPE200");
+		geom->BuildPipe(200.0, 1.0, 0, 64); //2 m long, 1 cm radius. Facets 1,2: absorbing caps, then the walls
+		FileUtils::CreateDir(directory);
+
+		for (auto& scenario : scenarios) {
+			worker.regions.clear();
+			worker.regions.push_back(BuildBenchmarkRegion(scenario.regionPreset));
+			worker.wp.nbTrajPoints = (int)worker.regions.back().Points.size();
+
+			for (size_t i = 2; i < geom->GetNbFacet(); i++) {
+				Facet *f = geom->GetFacet(i);
+				f->sh.reflectType = scenario.reflectType;
+				f->sh.sticking = 0.1; //about 10 bounces per photon
+				f->sh.doScattering = scenario.roughness;
+				f->sh.autoCorrLength = 1E-5; //10000 nm
+				f->sh.rmsRoughness = scenario.roughness ? 0.01 * f->sh.autoCorrLength : 0.0;
+				f->sh.countAbs = f->sh.countRefl = scenario.textured;
+				geom->SetFacetTexture(i, scenario.textured ? 10.0 : 0.0, false); //10 cells/cm
+			}
+
+			worker.ontheflyParams.desorptionLimit = BENCHMARK_PHOTONS;
+			worker.ontheflyParams.lowFluxMode = scenario.lowFlux;
+			worker.ontheflyParams.lowFluxCutoff = 1E-7;
+
+			std::string fileName = directory + "/benchmark_" + scenario.name + ".synload";
+			FILE *f = fopen(fileName.c_str(), "wb");
+			if (!f) throw Error(("Cannot open file\nFile:" + fileName).c_str());
+			try {
+				geom->SaveLoaderFile(f, &worker, settings);
+			}
+			catch (Error &) {
+				fclose(f);
+				throw;
+			}
+			fclose(f);
+			printf("Written %s\n", fileName.c_str());
+		}
+	}
+	catch (Error &e) {
+		printf("Error: benchmark suite: %s\n", e.GetMsg());
+		return 1;
+	}
+	printf("Run each with: synradCLI FILE -j FILE.json\n");
+	return 0;
+}
+
+static void PrintUsage() {
+	printf("Usage: synradCLI input.syn|input.xml|input.synload [options]\n");
+	printf("       synradCLI --benchmark-suite DIR\n");
+	printf("  --benchmark-suite DIR  write the benchmark scenarios, DIR/benchmark_*.synload, built from fixed parameters\n");
+	printf("            and a bundled material (%d photons each). Run each with -j to measure the throughput\n", BENCHMARK_PHOTONS);
+	printf("  -P FILE   PAR file of a region, repeat for several regions. Replaces the regions of a .syn file (by default\n");
+	printf("            its PAR files, in its directory), needed for an .xml file. Materials and distributions come from param/\n");
+	printf("  -d N      stop after N photons (overrides the desorption limit of the file)\n");
+	printf("  -s SEC    stop after SEC seconds of simulation\n");
+	printf("  -t N      simulation threads, 0: all cores (overrides the file, whose default is all cores)\n");
+	printf("  -w N      particles traced together per thread, wavefront mode (overrides the file)\n");
+	printf("  -f        sample source points by their flux (also set if the file asks for it)\n");
+	printf("  -l CUTOFF low flux mode, Russian roulette below CUTOFF (overrides the file)\n");
+	printf("  -r WEIGHT weight of the photons surviving the roulette (overrides the file, 0: 10x the cutoff)\n");
+	printf("  -n N      low flux mode: split photons in N copies when they leave a splitting facet or enter a splitting structure (overrides the file)\n");
+	printf("  -F LIST   splitting facets, comma separated numbers (from 1), instead of those of the file\n");
+	printf("  -T LIST   splitting structures, comma separated numbers (from 1), instead of those of the file\n");
+	printf("  -m MB     space for the texture cells hit so far, in 8x8 tiles (overrides the file, default %d).\n", DEFAULT_TEXTURE_POOL_MB);
+	printf("            Once full, new tiles aren't recorded: see Texture_hits_lost in the results\n");
+	printf("  -o FILE   global and facet results (default: input name + .results.txt)\n");
+	printf("  -x PREFIX texture files PREFIX_mchits.txt, PREFIX_fluxperarea.txt, PREFIX_powerperarea.txt\n");
+	printf("            and PREFIX_taggedpowerperarea.txt for the tallied facets\n");
+	printf("  -g LIST   tallied facets, comma separated numbers (from 1), instead of those of the file: flux, power, profile\n");
+	printf("            and texture split by source region and reflections (0, 1, 2+), in the results and the texture files\n");
+	printf("  -e SPEC   energy bands of a facet, SPEC = FACET:E1,E2,...[:texture] with up to %d increasing edges in eV:\n", MAX_BAND_EDGES);
+	printf("            flux and power below E1, from E1 to E2, ..., above the last edge. ':texture' adds PREFIX_bandpowerperarea.txt\n");
+	printf("            Repeat for several facets, replaces the bands of the file\n");
+	printf("  -p SPEC   stop once a result reaches a relative error, SPEC = FACET:QUANTITY:ERROR, QUANTITY power, flux, hits,\n");
+	printf("            peak (hottest texture cell) or cells=U0,V0,U1,V1 (power on a texture rectangle). Repeat for several targets,\n");
+	printf("            they replace those of the file\n");
+	printf("  -u PREFIX per-cell relative error of the power density, PREFIX_powerrelerror.txt\n");
+	printf("  -j FILE   benchmark: throughput, hot-path timings, peak memory and hit update latency as JSON\n");
+	printf("  -c N      check: run to the desorption limit on one thread, one particle at a time then N together (wavefront),\n");
+	printf("            with the same seed. Fails unless all facet counters match and a semi-transparent or material facet was hit\n");
+	printf("  -a N      check: after %d warm-up steps, run N steps of about 1 s and fail if a thread allocated on the heap.\n", ALLOCATION_WARMUP_STEPS);
+	printf("            Needs a build with SYNRAD_COUNT_ALLOCATIONS defined\n");
+	printf("  -v        print the simulation status messages\n");
+	printf("Set GSL_RNG_SEED to fix the random seed (photon streams are reproducible for a given seed).\n");
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc == 3 && strcmp(argv[1], "--benchmark-suite") == 0) return WriteBenchmarkSuite(argv[2]);
+	if (argc < 2 || argv[1][0] == '-') {
+		PrintUsage();
+		return 1;
+	}
+
+	const char *inputFile = argv[1];
+	size_t desorptionLimit = 0;
+	bool overrideLimit = false;
+	double timeBudget = 0.0;
+	int nbThreads = -1; //Negative: the file's setting
+	bool fluxWeightedSources = false;
+	int wavefrontSize = -1;
+	double lowFluxCutoff = 0.0;
+	double rouletteSurvivalWeight = -1.0;
+	int splitFactor = 0;
+	int texturePoolMB = 0;
+	std::vector<bool> splitFacets, splitStructures;
+	bool overrideSplitFacets = false, overrideSplitStructures = false;
+	std::vector<bool> tallyFacets;
+	bool overrideTallyFacets = false;
+	std::vector<EnergyBandEdges> energyBands;
+	bool overrideEnergyBands = false;
+	std::vector<std::string> parFiles;
+	std::string resultFile = std::string(inputFile) + ".results.txt";
+	std::string texturePrefix;
+	std::string benchmarkFile;
+	std::vector<PrecisionTarget> precisionTargets;
+	std::string uncertaintyPrefix;
+	size_t checkWavefrontSize = 0;
+	size_t checkAllocationSteps = 0;
+
+	for (int i = 2; i < argc; i++) {
+		bool hasValue = (i + 1 < argc);
+		if (strcmp(argv[i], "-d") == 0 && hasValue) { desorptionLimit = (size_t)strtoull(argv[++i], NULL, 10); overrideLimit = true; }
+		else if (strcmp(argv[i], "-s") == 0 && hasValue) timeBudget = atof(argv[++i]);
+		else if (strcmp(argv[i], "-t") == 0 && hasValue) nbThreads = Max(atoi(argv[++i]), 0);
+		else if (strcmp(argv[i], "-w") == 0 && hasValue) wavefrontSize = Max(atoi(argv[++i]), 1);
+		else if (strcmp(argv[i], "-f") == 0) fluxWeightedSources = true;
+		else if (strcmp(argv[i], "-l") == 0 && hasValue) lowFluxCutoff = atof(argv[++i]);
+		else if (strcmp(argv[i], "-r") == 0 && hasValue) rouletteSurvivalWeight = Max(atof(argv[++i]), 0.0);
+		else if (strcmp(argv[i], "-n") == 0 && hasValue) splitFactor = Max(atoi(argv[++i]), 1);
+		else if (strcmp(argv[i], "-m") == 0 && hasValue) texturePoolMB = Max(atoi(argv[++i]), 1);
+		else if (strcmp(argv[i], "-F") == 0 && hasValue) {
+			if (!ParseListOption(argv[++i], splitFacets)) return 1;
+			overrideSplitFacets = true;
+		}
+		else if (strcmp(argv[i], "-T") == 0 && hasValue) {
+			if (!ParseListOption(argv[++i], splitStructures)) return 1;
+			overrideSplitStructures = true;
+		}
+		else if (strcmp(argv[i], "-g") == 0 && hasValue) {
+			if (!ParseListOption(argv[++i], tallyFacets)) return 1;
+			overrideTallyFacets = true;
+		}
+		else if (strcmp(argv[i], "-e") == 0 && hasValue) {
+			overrideEnergyBands = true;
+			if (!AddEnergyBands(argv[++i], energyBands)) {
+				printf("Invalid energy bands %s\n", argv[i]);
+				PrintUsage();
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "-P") == 0 && hasValue) parFiles.push_back(argv[++i]);
+		else if (strcmp(argv[i], "-o") == 0 && hasValue) resultFile = argv[++i];
+		else if (strcmp(argv[i], "-x") == 0 && hasValue) texturePrefix = argv[++i];
+		else if (strcmp(argv[i], "-j") == 0 && hasValue) benchmarkFile = argv[++i];
+		else if (strcmp(argv[i], "-p") == 0 && hasValue) {
+			PrecisionTarget target;
+			if (!target.Parse(argv[++i])) {
+				printf("Invalid precision target %s\n", argv[i]);
+				PrintUsage();
+				return 1;
+			}
+			precisionTargets.push_back(target);
+		}
+		else if (strcmp(argv[i], "-u") == 0 && hasValue) uncertaintyPrefix = argv[++i];
+		else if (strcmp(argv[i], "-c") == 0 && hasValue) checkWavefrontSize = (size_t)Max(atoi(argv[++i]), 2);
+		else if (strcmp(argv[i], "-a") == 0 && hasValue) checkAllocationSteps = (size_t)Max(atoi(argv[++i]), 1);
+		else if (strcmp(argv[i], "-v") == 0) verbose = true;
+		else {
+			printf("Unknown option %s\n", argv[i]);
+			PrintUsage();
+			return 1;
+		}
+	}
+
+	std::vector<uint64_t> loaderBuffer;
+	size_t loaderSize;
+	if (FileUtils::GetExtension(inputFile) == "synload") {
+		if (!parFiles.empty()) {
+			printf("Error: -P needs a .syn or .xml input, the regions of %s are already built\n", inputFile);
+			return 1;
+		}
+		if (!ReadLoaderFile(inputFile, loaderBuffer, loaderSize)) return 1;
+	}
+	else if (!LoadGeometryFile(inputFile, parFiles, loaderBuffer, loaderSize)) return 1;
+	const char *loaderError = CheckLoaderBuffer(loaderBuffer.data(), loaderSize);
+	if (loaderError) {
+		printf("Error: %s: %s\n", inputFile, loaderError);
+		return 1;
+	}
+
+	//This process runs the whole simulation, the interface's process count and logging don't apply
+	const LoaderHeader& header = *(const LoaderHeader*)loaderBuffer.data();
+	if (header.sections[LOADER_ONTHEFLY_PARAMS].count != 1) {
+		printf("Error: %s has no simulation parameters\n", inputFile);
+		return 1;
+	}
+	OntheflySimulationParams *params = LoaderSectionData<OntheflySimulationParams>(loaderBuffer.data(), header, LOADER_ONTHEFLY_PARAMS);
+	params->nbProcess = 1;
+	params->enableLogging = false;
+	if (overrideLimit) params->desorptionLimit = desorptionLimit;
+	if (lowFluxCutoff > 0.0) {
+		params->lowFluxMode = true;
+		params->lowFluxCutoff = lowFluxCutoff;
+	}
+	//Run settings chosen in the interface (defaults for a geometry file), the options above override them
+	RunSettings settings;
+	if (!settings.ReadFromLoader(loaderBuffer.data())) {
+		printf("Error: %s has no run settings\n", inputFile);
+		return 1;
+	}
+	if (nbThreads >= 0) settings.nbThreads = (size_t)nbThreads;
+	if (fluxWeightedSources) settings.fluxWeightedSources = true;
+	if (wavefrontSize > 0) settings.wavefrontSize = (size_t)wavefrontSize;
+	if (rouletteSurvivalWeight >= 0.0) settings.rouletteSurvivalWeight = rouletteSurvivalWeight;
+	if (splitFactor > 0) settings.splitFactor = (size_t)splitFactor;
+	if (texturePoolMB > 0) settings.texturePoolMB = (size_t)texturePoolMB;
+	if (overrideSplitFacets) settings.splitFacets = splitFacets;
+	if (overrideSplitStructures) settings.splitStructures = splitStructures;
+	if (overrideTallyFacets) settings.tallyFacets = tallyFacets;
+	if (overrideEnergyBands) settings.energyBands = energyBands;
+	if (!precisionTargets.empty()) settings.precisionTargets = precisionTargets;
+
+	auto configure = [&](Simulation* sim) {
+		sim->precision.uncertaintyTextures = !uncertaintyPrefix.empty();
+	};
+
+	InitSimulation();
+	if (checkAllocationSteps > 0) return CheckAllocations(loaderBuffer, loaderSize, settings, configure, checkAllocationSteps);
+
+	if (params->desorptionLimit == 0 && timeBudget <= 0.0 && settings.precisionTargets.empty()) {
+		printf("Error: no desorption limit in the file, give one with -d, a time budget with -s or precision targets with -p\n");
+		return 1;
+	}
+	if (checkWavefrontSize > 0) {
+		if (params->desorptionLimit == 0) {
+			printf("Error: the check runs to a desorption limit, give one with -d\n");
+			return 1;
+		}
+		return CheckWavefront(loaderBuffer, loaderSize, settings, configure, checkWavefrontSize);
+	}
+
+	Simulation *sim = new Simulation();
+	configure(sim);
+	if (!LoadSimulation(sim, loaderBuffer.data(), loaderSize, &settings)) {
+		SAFE_DELETE(sim);
+		return 1;
+	}
+	printf("Using %zd simulation thread(s)\n", sim->nbThreads);
+	loaderBuffer.clear();
+	loaderBuffer.shrink_to_fit();
+
+	//Results are reduced into a local hit buffer with the same layout as the interface's
+	char hitsDpName[32];
+	sprintf(hitsDpName, "SNRDCLIHITS%d", _getpid());
+	Dataport *dpHit = CreateDataport(hitsDpName, GetHitsSize(sim));
+	if (!dpHit) {
+		printf("Error: failed to create the hit buffer (%zd bytes)\n", GetHitsSize(sim));
+		SAFE_DELETE(sim);
+		return 1;
+	}
+
+	if (!StartSimulation(sim)) {
+		CLOSEDP(dpHit);
+		SAFE_DELETE(sim);
+		return 1;
+	}
+	std::signal(SIGINT, OnInterrupt);
+	std::signal(SIGTERM, OnInterrupt);
+
+	double t0 = GetTick();
+	double lastReport = t0;
+	bool eos = false;
+	HitUpdateStats updates;
+	while (!eos && !interrupted && cliState != PROCESS_ERROR) {
+		eos = SimulationRun(sim); //1s step on every thread
+		double tUpdate = GetTick();
+		UpdateHits(sim, dpHit, NULL, 0, 60000);
+		double t = GetTick();
+		updates.nbUpdates++;
+		updates.totalSeconds += t - tUpdate;
+		updates.maxSeconds = Max(updates.maxSeconds, t - tUpdate);
+		bool precisionReached = sim->precision.TargetsReached(1);
+		if (t - lastReport >= 10.0 || eos || precisionReached) {
+			double worst = sim->precision.GetWorstRatio();
+			if (worst >= 0.0) printf("  %.0f s: %zd photons, worst target at %.2fx its error\n", t - t0, sim->GetTotalDesorbed(), worst);
+			else printf("  %.0f s: %zd photons\n", t - t0, sim->GetTotalDesorbed());
+			lastReport = t;
+		}
+		if (precisionReached) {
+			printf("Precision targets reached\n");
+			break;
+		}
+		if (timeBudget > 0.0 && t - t0 >= timeBudget) break;
+	}
+	double duration = GetTick() - t0;
+	if (interrupted) printf("Interrupted, writing the results so far\n");
+
+	int returnCode = (cliState == PROCESS_ERROR) ? 1 : 0;
+	if (AccessDataportTimed(dpHit, 60000)) {
+		const BYTE *buffer = (const BYTE *)dpHit->buff;
+		if (!WriteResults(sim, buffer, resultFile.c_str(), duration)) returnCode = 1;
+		else printf("Results written to %s\n", resultFile.c_str());
+		if (!texturePrefix.empty() && !WriteTextures(sim, buffer, texturePrefix)) returnCode = 1;
+		if (!uncertaintyPrefix.empty() && !WriteUncertaintyTextures(sim, uncertaintyPrefix)) returnCode = 1;
+		if (!benchmarkFile.empty() && !WriteBenchmark(sim, buffer, benchmarkFile.c_str(), inputFile, duration, updates)) returnCode = 1;
+		ReleaseDataport(dpHit);
+	}
+	else {
+		printf("Error: hit buffer not accessible\n");
+		returnCode = 1;
+	}
+
+	CLOSEDP(dpHit);
+	ClearSimulation(sim);
+	SAFE_DELETE(sim);
+	return returnCode;
+}
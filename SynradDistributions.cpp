@@ -31,6 +31,7 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 //DistributionND SR_spectrum_CDF = Generate_SR_spectrum(LOWER_LIMIT, UPPER_LIMIT);
 Distribution2D integral_N_photons = Generate_SR_spectrum(LOWER_LIMIT, UPPER_LIMIT, INTEGRAL_MODE_N_PHOTONS);
 Distribution2D integral_SR_power = Generate_SR_spectrum(LOWER_LIMIT, UPPER_LIMIT, INTEGRAL_MODE_SR_POWER);
+SpectrumTable SR_spectrum_table = BuildSpectrumTable(integral_N_photons, integral_SR_power); //after the two integrals (same translation unit, initialized in order)
 //Distribution2D polarization_distribution=Generate_Polarization_Distribution(true,true);
 //Distribution2D g1h2_distribution=Generate_G1_H2_Distribution();
 
@@ -276,67 +277,45 @@ seed=rnd()*factor_psi*local_polarization_integral.valuesY[NUMBER_OF_DISTRO_VALUE
 return local_polarization_integral.InterpolateX(seed);
 }*/
 
-std::tuple<double,double> find_psi_and_polarization(const double& lambda_ratios, const std::vector<std::vector<double>> &psi_distro,
-	const std::vector<std::vector<double>> &parallel_polarization, const size_t& polarizationComponent) {
+std::tuple<double,double> find_psi_and_polarization(const double& lambda_ratios, const double& lookup, const AngularTable& psiTable,
+	const AngularTable& polarizationTable, const size_t& polarizationComponent, const double& maxPsi) {
 	
 	//returns gamma*psi
+	if (psiTable.GetNbKnots() < 2) return std::make_tuple(0.0, 0.5);
 	double lambda_relative = log10(lambda_ratios);
 	double lambda_index = (lambda_relative + 10) / 0.1; //digitized for -10..+2 with delta=0.01
-	int lambda_lower_index = (int)(lambda_index);
-	double lambda_overshoot = lambda_index - (double)lambda_lower_index;
-
-	double lookup = rnd();
-	int foundAngle = 0;
-	/*double interpolated_CDF;
-	do { //to replace by binary search
-	foundAngle++;
-	interpolated_CDF = psi_distro[lambda_lower_index][foundAngle] + lambda_overshoot*(psi_distro[lambda_lower_index + 1][foundAngle] - psi_distro[lambda_lower_index][foundAngle]);
-
-	} while (interpolated_CDF < lookup);*/
-
-	//Binary search
-	int imin = 0;
-	int size = (int)psi_distro[0].size();
-	int imax = size;
-	double interpolated_CDF_lower, interpolated_CDF_higher;
-	// continue searching while [imin,imax] is not empty
-	while (imin <= imax)
-	{
-		// calculate the midpoint for roughly equal partition
-		int imid = (imin + imax) / 2;
-		interpolated_CDF_lower = Weigh(psi_distro[lambda_lower_index][imid], psi_distro[lambda_lower_index + 1][imid], lambda_overshoot);
-		interpolated_CDF_higher = Weigh(psi_distro[lambda_lower_index][imid + 1], psi_distro[lambda_lower_index + 1][imid + 1], lambda_overshoot);
-		if (imid == size - 1 || (interpolated_CDF_lower < lookup && lookup < interpolated_CDF_higher)) {
-			// key found at index imid
-			foundAngle = imid + 1; //will be lowered by 1
-			break;
-		}
-		// determine which subarray to search
-		else if (interpolated_CDF_lower < lookup)
-			// change min index to search upper subarray
-			imin = imid + 1;
-		else
-			// change max index to search lower subarray
-			imax = imid - 1;
-	}
-	//TO DO: Treat not found errors
-	int psi_lower_index = foundAngle - 1;
-	//double previous_interpolated_CDF = psi_distro[lambda_lower_index][psi_lower_index] + lambda_overshoot*(psi_distro[lambda_lower_index + 1][psi_lower_index] - psi_distro[lambda_lower_index][psi_lower_index]);
-	double psi_overshoot = (lookup - interpolated_CDF_lower) / (interpolated_CDF_higher - interpolated_CDF_lower);
-	double psi = (((double)psi_lower_index + psi_overshoot)*0.005) * (4.0 / pow(lambda_ratios, 0.35)); //psi_relative=1 corresponds to psi=4/lambda_ratios^0.35
+	size_t lambda_lower_index;
+	double lambda_overshoot;
+	psiTable.ClampRow(lambda_index, lambda_lower_index, lambda_overshoot);
+
+	double psi_step = 0.005 * (4.0 / pow(lambda_ratios, 0.35)); //psi_relative=1 corresponds to psi=4/lambda_ratios^0.35
+	double max_psi_index = maxPsi / psi_step;
+	double truncated_lookup = lookup;
+	if (max_psi_index < (double)(psiTable.GetNbKnots() - 1)) {
+		//Sample the CDF truncated at maxPsi instead of rejecting larger angles
+		truncated_lookup *= psiTable.InterpolateAt(lambda_lower_index, lambda_overshoot, max_psi_index);
+	}
+
+	size_t psi_lower_index = psiTable.FindKnot(lambda_lower_index, lambda_overshoot, truncated_lookup);
+	double interpolated_CDF_lower = psiTable.Interpolate(lambda_lower_index, lambda_overshoot, psi_lower_index);
+	double interpolated_CDF_higher = psiTable.Interpolate(lambda_lower_index, lambda_overshoot, psi_lower_index + 1);
+	double psi_overshoot = (interpolated_CDF_higher > interpolated_CDF_lower) ? (truncated_lookup - interpolated_CDF_lower) / (interpolated_CDF_higher - interpolated_CDF_lower) : 0.0;
+	Saturate(psi_overshoot, 0.0, 1.0);
+	double psi_index = Min((double)psi_lower_index + psi_overshoot, max_psi_index);
+	double psi = psi_index * psi_step;
 	
 	double polarization;
 	if (polarizationComponent == 0) {
 		polarization = 1.0;
 	}
 	else {
-		double polarization_pdf_lower = Weigh(parallel_polarization[lambda_lower_index][psi_lower_index], parallel_polarization[lambda_lower_index + 1][psi_lower_index], lambda_overshoot);
-		double polarization_pdf_higher = Weigh(parallel_polarization[lambda_lower_index][psi_lower_index + 1], parallel_polarization[lambda_lower_index + 1][psi_lower_index + 1], lambda_overshoot);
-		polarization = Weigh(polarization_pdf_lower, polarization_pdf_higher, psi_overshoot);
+		size_t polarization_row;
+		double polarization_row_weight;
+		polarizationTable.ClampRow(lambda_index, polarization_row, polarization_row_weight);
+		polarization = polarizationTable.InterpolateAt(polarization_row, polarization_row_weight, psi_index);
 		if (polarizationComponent == 2) polarization = 1.0 - polarization; //orthogonal component
 	}
-	return std::tie(psi,polarization);
-	//return 0.15;
+	return std::make_tuple(psi,polarization);
 }
 
 /*double find_chi(double psi,double gamma_square,double f_times_g1h2,bool calculate_parallel_polarization, bool calculate_orthogonal_polarization) {
@@ -465,90 +444,229 @@ double seed = rnd()*local_polarization_integral.valuesY[NUMBER_OF_DISTRO_VALUES
 return local_polarization_integral.InterpolateX(seed);
 }
 */
-double find_chi(const double& psi, const double& gamma, const std::vector<std::vector<double>> &chi_distro) {
+double find_chi(const double& psi, const double& gamma, const AngularTable& chiTable, const double& lookup, const double& lowAngleRnd, const double& maxChi) {
 
-	double psi_index, chi_lower, chi_higher, chi;
-	double psi_relative = log10(abs(psi)*(gamma / 10000.0)); //distributions are digitized for gamma=10000, and sampled logarithmically
+	size_t nbKnots = chiTable.GetNbKnots();
+	if (nbKnots < 2) return 0.0;
+	double gamma_ratio = gamma / 10000.0; //distributions are digitized for gamma=10000, and sampled logarithmically
+	double psi_index;
+	double psi_relative = log10(abs(psi)*gamma_ratio);
 	if (psi_relative < -7.0) {
 		psi_index = 0; //use lowest angle
 	}
 	else {
 		psi_index = (psi_relative + 7.0) / 0.02; //sampled from -7 to 0 with delta=0.02
 	}
+	size_t psi_lower_index;
+	double psi_overshoot;
+	chiTable.ClampRow(psi_index, psi_lower_index, psi_overshoot);
+
+	//CDF of chi (knot k at 10^(-7+k*0.02)/gamma_ratio, knot 0 covering the lowest angles) in the psi row pair
+	const double low_angle_limit = 1.0964782E-7;
+	auto CDF = [&](const size_t& knot) {
+		return (knot < nbKnots) ? chiTable.Interpolate(psi_lower_index, psi_overshoot, knot) : 1.0;
+	};
+
+	double truncated_lookup = lookup;
+	double max_chi_index = (log10(maxChi * gamma_ratio) + 7.0) / 0.02;
+	if (max_chi_index < (double)(nbKnots - 1)) {
+		//Sample the CDF truncated at maxChi instead of rejecting larger angles
+		double CDF_at_max;
+		if (maxChi * gamma_ratio <= low_angle_limit || !(max_chi_index >= 1.0)) {
+			CDF_at_max = Weigh(CDF(0), CDF(1), Min(maxChi * gamma_ratio / low_angle_limit, 1.0));
+		}
+		else {
+			size_t k = (size_t)max_chi_index;
+			double a = pow(10, -7.0 + (double)k*0.02) / gamma_ratio;
+			double b = a*1.04712854805; //1.047=10^0.02
+			double c = b*1.04712854805;
+			CDF_at_max = QuadraticInterpolateY(maxChi, a, b, c, CDF(k), CDF(k + 1), CDF(k + 2));
+			Saturate(CDF_at_max, CDF(k), CDF(k + 1));
+		}
+		truncated_lookup *= CDF_at_max;
+	}
 
-	int psi_lower_index = (int)(psi_index); //digitized for -2PI/10 .. +2PI/10 with delta=0.0025
-	double psi_overshoot = psi_index - (double)psi_lower_index;
-
-	double lookup = rnd();
+	size_t chi_lower_index = chiTable.FindKnot(psi_lower_index, psi_overshoot, truncated_lookup);
+	double chi;
+	if (chi_lower_index == 0) {
+		chi = Weigh(0.0, low_angle_limit, lowAngleRnd) / gamma_ratio;
+	}
+	else {
+		double a = pow(10, -7.0 + (double)chi_lower_index*0.02) / gamma_ratio;
+		double b = a*1.04712854805; /* pow(10, -7.0 + ((double)chi_lower_index + 1.0)*0.02) / (gamma / 10000.0);*/ //1.047=10^0.02
+		double c = b*1.04712854805; /*pow(10, -7.0 + ((double)chi_lower_index + 2.0)*0.02) / (gamma / 10000.0);*/
+		double FA = CDF(chi_lower_index);
+		double FB = CDF(chi_lower_index + 1);
+		double FC = CDF(chi_lower_index + 2);
+		
+		chi = QuadraticInterpolateX(truncated_lookup, a, b, c, FA, FB, FC, lowAngleRnd);
+	}
+	return Min(chi, maxChi); //Rounding, or the uniform low angle interval, can overshoot the truncated CDF slightly
+}
 
-	int foundAngle = 0;
-	/*interpolated_CDF = 0.0;
-	do { //to replace by binary search
-	previous_interpolated_CDF = interpolated_CDF;
-	foundAngle++;
-	interpolated_CDF = Weigh(chi_distro[foundAngle][psi_lower_index], chi_distro[foundAngle][psi_lower_index + 1], psi_overshoot);
-	} while (interpolated_CDF < lookup);*/
+void AngularTable::Build(const std::vector<std::vector<double>>& source, const bool& transpose, const bool& isCDF) {
+	pairs.clear();
+	guide.clear();
+	nbRows = nbKnots = 0;
+	if (source.empty()) return;
+	size_t minSize = source[0].size(); //Rows read from CSV files may be ragged, use the common part
+	for (auto& line : source) minSize = Min(minSize, line.size());
+	if (minSize == 0) return;
+	nbRows = transpose ? minSize : source.size();
+	nbKnots = transpose ? source.size() : minSize;
+	auto SourceValue = [&](const size_t& row, const size_t& knot) {
+		return transpose ? source[knot][row] : source[row][knot];
+	};
+
+	size_t nbPairs = Max(nbRows, (size_t)2) - 1;
+	pairs.resize(nbPairs * nbKnots * 2);
+	for (size_t r = 0; r < nbPairs; r++) {
+		size_t upperRow = Min(r + 1, nbRows - 1);
+		for (size_t k = 0; k < nbKnots; k++) {
+			pairs[(r * nbKnots + k) * 2] = SourceValue(r, k);
+			pairs[(r * nbKnots + k) * 2 + 1] = SourceValue(upperRow, k);
+		}
+	}
 
-	//Binary search
-	int imin = 0;
-	int size = (int)chi_distro.size();
-	int imax = size;
-	double interpolated_CDF_lower, interpolated_CDF_higher;
-	// continue searching while [imin,imax] is not empty
-	while (imin <= imax)
-	{
-		// calculate the midpoint for roughly equal partition
-		int imid = (imin + imax) / 2;
-		interpolated_CDF_lower = Weigh(chi_distro[imid][psi_lower_index], chi_distro[imid][psi_lower_index + 1], psi_overshoot);
-		interpolated_CDF_higher = Weigh(chi_distro[imid + 1][psi_lower_index], chi_distro[imid + 1][psi_lower_index + 1], psi_overshoot);
-		if (imid == size - 1 || (interpolated_CDF_lower < lookup && lookup < interpolated_CDF_higher)) {
-			// key found at index imid
-			foundAngle = imid + 1; //will be lowered by 1
-			break;
+	if (!isCDF) return;
+	guide.resize(nbRows * (ANGULAR_GUIDE_SIZE + 1));
+	for (size_t r = 0; r < nbRows; r++) {
+		uint32_t* rowGuide = &guide[r * (ANGULAR_GUIDE_SIZE + 1)];
+		size_t k = 0;
+		for (size_t b = 0; b < ANGULAR_GUIDE_SIZE; b++) {
+			double bucketMin = (double)b / (double)ANGULAR_GUIDE_SIZE;
+			while (k < nbKnots && SourceValue(r, k) < bucketMin) k++;
+			rowGuide[b] = (uint32_t)k;
 		}
-		// determine which subarray to search
-		else if (interpolated_CDF_lower < lookup)
-			// change min index to search upper subarray
-			imin = imid + 1;
-		else
-			// change max index to search lower subarray
-			imax = imid - 1;
+		rowGuide[ANGULAR_GUIDE_SIZE] = (uint32_t)nbKnots; //Values beyond 1 end up on the last knot
 	}
-	//TO DO: Treat not found errors
+}
 
-	int chi_lower_index = foundAngle - 1;
+void AngularTable::ClampRow(const double& rowIndex, size_t& row, double& weight) const {
+	if (nbRows < 2 || !(rowIndex > 0.0)) { //Also catches NaN
+		row = 0;
+		weight = 0.0;
+		return;
+	}
+	row = Min((size_t)rowIndex, nbRows - 2);
+	weight = Min(rowIndex - (double)row, 1.0);
+}
 
-	double next_interpolated_CDF;
-	if (foundAngle == chi_distro.size() - 1) next_interpolated_CDF = 1.0;
-	else next_interpolated_CDF = Weigh(chi_distro[chi_lower_index + 2][psi_lower_index], chi_distro[chi_lower_index + 2][psi_lower_index + 1], psi_overshoot);
-	//double chi_overshoot = (log10(lookup)-log10(previous_interpolated_CDF))/ (log10(interpolated_CDF) - log10(previous_interpolated_CDF));
-	//double chi_overshoot = (lookup - previous_interpolated_CDF) / (interpolated_CDF - previous_interpolated_CDF); //linear scale
+double AngularTable::InterpolateAt(const size_t& row, const double& weight, const double& knotIndex) const {
+	double x = knotIndex;
+	Saturate(x, 0.0, (double)(nbKnots - 1));
+	size_t k = Min((size_t)x, nbKnots - 2);
+	return Weigh(Interpolate(row, weight, k), Interpolate(row, weight, k + 1), x - (double)k);
+}
 
-	if (chi_lower_index == 0) {
-		chi_lower = 0;
-		chi_higher = 1.0964782E-7;
-		chi = Weigh(chi_lower, chi_higher, rnd()) / (gamma / 10000.0);
-		//chi = 0;
+size_t AngularTable::FindKnot(const size_t& row, const double& weight, const double& value) const {
+	//Where both rows of the pair are <= value, so is their interpolation (and > value likewise):
+	//the answer lies between the guided answers of the two rows, usually a few knots apart
+	size_t bucket = (value > 0.0) ? Min((size_t)(value * (double)ANGULAR_GUIDE_SIZE), (size_t)ANGULAR_GUIDE_SIZE - 1) : 0;
+	const uint32_t* lowerGuide = &guide[row * (ANGULAR_GUIDE_SIZE + 1)];
+	const uint32_t* upperGuide = (nbRows > 1) ? lowerGuide + ANGULAR_GUIDE_SIZE + 1 : lowerGuide;
+	size_t imin = Min(lowerGuide[bucket], upperGuide[bucket]);
+	size_t imax = Max(lowerGuide[bucket + 1], upperGuide[bucket + 1]);
+	//Number of knots <= value, in [imin, imax]
+	while (imin < imax) {
+		size_t imid = (imin + imax) / 2;
+		if (Interpolate(row, weight, imid) <= value) imin = imid + 1;
+		else imax = imid;
 	}
-	else {
+	return (imin == 0) ? 0 : Min(imin - 1, nbKnots - 2);
+}
 
-		double a = pow(10, -7.0 + ((double)chi_lower_index + 0.0)*0.02) / (gamma / 10000.0);
-		double b = a*1.04712854805; /* pow(10, -7.0 + ((double)chi_lower_index + 1.0)*0.02) / (gamma / 10000.0);*/ //1.047=10^0.02
-		double c = b*1.04712854805; /*pow(10, -7.0 + ((double)chi_lower_index + 2.0)*0.02) / (gamma / 10000.0);*/
-		double FA = interpolated_CDF_lower;
-		double FB = interpolated_CDF_higher;
-		double FC = next_interpolated_CDF;
-		
-		chi = QuadraticInterpolateX(lookup, a, b, c, FA, FB, FC);
-		//chi = Weigh(a, b,rnd()); //inverse linear interpolation
+SpectrumTable BuildSpectrumTable(const Distribution2D& fluxIntegral, const Distribution2D& powerIntegral) {
+	SpectrumTable table;
+	table.Build(fluxIntegral, powerIntegral);
+	return table;
+}
+
+void SpectrumTable::Build(const Distribution2D& fluxIntegral, const Distribution2D& powerIntegral) {
+	//Both integrals are generated on the same energy axis, see Generate_SR_spectrum()
+	size_t nbKnots = (size_t)fluxIntegral.GetSize();
+	knots.resize(nbKnots);
+	seriesExpansion = true;
+	for (size_t i = 0; i < nbKnots; i++) {
+		knots[i].log10x = fluxIntegral.GetX(i);
+		knots[i].energy = Pow10(knots[i].log10x);
+		knots[i].flux = fluxIntegral.GetY(i);
+		knots[i].power = powerIntegral.GetY(i);
+		if (i > 0 && (knots[i].log10x - knots[i - 1].log10x) * log(10.0) > 0.02) seriesExpansion = false; //4th order term above 1E-8
+	}
+	BuildGuide(guideX, &SpectrumKnot::log10x);
+	BuildGuide(guideFlux, &SpectrumKnot::flux);
+	BuildGuide(guidePower, &SpectrumKnot::power);
+}
 
+void SpectrumTable::BuildGuide(SpectrumGuide& guide, double SpectrumKnot::* column) {
+	guide.firstKnot.assign(SPECTRUM_GUIDE_SIZE + 1, 0);
+	if (knots.size() < 2) return;
+	guide.minValue = knots.front().*column;
+	guide.maxValue = knots.back().*column;
+	guide.bucketsPerUnit = (guide.maxValue > guide.minValue) ? (double)SPECTRUM_GUIDE_SIZE / (guide.maxValue - guide.minValue) : 0.0;
+	size_t knot = 0;
+	for (size_t bucket = 0; bucket <= SPECTRUM_GUIDE_SIZE; bucket++) {
+		double bucketStart = guide.minValue + (double)bucket / guide.bucketsPerUnit;
+		while (knot + 2 < knots.size() && knots[knot + 1].*column <= bucketStart) knot++;
+		guide.firstKnot[bucket] = (uint32_t)knot;
 	}
-	return chi;
+}
+
+size_t SpectrumTable::FindKnot(const SpectrumGuide& guide, double SpectrumKnot::* column, const double& value) const {
+	size_t bucket = Min((size_t)((value - guide.minValue) * guide.bucketsPerUnit), (size_t)SPECTRUM_GUIDE_SIZE - 1);
+	size_t lo = guide.firstKnot[bucket];
+	size_t hi = guide.firstKnot[bucket + 1] + 1; //One knot of margin for the rounding of the bucket index
+	while (lo > 0 && knots[lo].*column > value) lo--; //Same, on the lower side
+	if (hi > knots.size() - 2) hi = knots.size() - 2;
+	//Usually zero or one step, binary search for the dense low-energy tail
+	while (lo < hi) {
+		size_t mid = (lo + hi + 1) / 2;
+		if (knots[mid].*column <= value) lo = mid;
+		else hi = mid - 1;
+	}
+	return lo;
+}
+
+double SpectrumTable::SampleEnergy(const double& integralValue, const int& generation_mode) const {
+	bool powerwise = (generation_mode == SYNGEN_MODE_POWERWISE);
+	double SpectrumKnot::* column = powerwise ? &SpectrumKnot::power : &SpectrumKnot::flux;
+	if (knots.size() < 2 || integralValue <= knots.front().*column) return knots.front().energy; //no extrapolation
+	if (integralValue >= knots.back().*column) return knots.back().energy;
+
+	size_t i = FindKnot(powerwise ? guidePower : guideFlux, column, integralValue);
+	const SpectrumKnot& lower = knots[i];
+	const SpectrumKnot& upper = knots[i + 1];
+	double delta = upper.*column - lower.*column;
+	double overshoot = (delta > 0.0) ? (integralValue - lower.*column) / delta : 0.0;
+	//Linear interpolation of log10(E/E_crit), as Distribution2D::InterpolateX()
+	if (!seriesExpansion) return Pow10(Weigh(lower.log10x, upper.log10x, overshoot));
+	double a = overshoot * (upper.log10x - lower.log10x) * 2.302585092994046; //ln(10)
+	return lower.energy * (1.0 + a * (1.0 + a * (0.5 + a / 6.0))); //10^(overshoot*dx) = exp(a)
+}
+
+void SpectrumTable::InterpolateIntegrals(const double& log10x, double& flux, double& power) const {
+	if (knots.size() < 2 || !(log10x > knots.front().log10x)) { //no extrapolation, also catches NaN
+		flux = knots.empty() ? 0.0 : knots.front().flux;
+		power = knots.empty() ? 0.0 : knots.front().power;
+		return;
+	}
+	if (log10x >= knots.back().log10x) {
+		flux = knots.back().flux;
+		power = knots.back().power;
+		return;
+	}
+	size_t i = FindKnot(guideX, &SpectrumKnot::log10x, log10x);
+	const SpectrumKnot& lower = knots[i];
+	const SpectrumKnot& upper = knots[i + 1];
+	double overshoot = (log10x - lower.log10x) / (upper.log10x - lower.log10x);
+	flux = Weigh(lower.flux, upper.flux, overshoot);
+	power = Weigh(lower.power, upper.power, overshoot);
 }
 
 double SYNGEN1(const double& log10LoEnergyRatio, const double& log10HiEnergyRatio,
 	double& interpFluxLo, double& interpFluxHi, double& interpPowerLo, double& interpPowerHi, const bool& calcInterpolates,
-	const int& generation_mode) {
+	const int& generation_mode, const double& uniformRnd) {
 	/*
 	Originally called SYNGEN1.
 	- Determines the CDF values belonging to log10_x_min and log10_x_max (they are expressed in E/E_crit)
@@ -573,20 +691,19 @@ double SYNGEN1(const double& log10LoEnergyRatio, const double& log10HiEnergyRati
 	Indexes indexes=find_indexes(x_min,x_max,true); //subst. i1
 	*/
 	if (calcInterpolates) {
-		interpFluxLo = integral_N_photons.InterpolateY(log10LoEnergyRatio, false);
-		interpFluxHi = integral_N_photons.InterpolateY(log10HiEnergyRatio, false);
-		interpPowerLo = integral_SR_power.InterpolateY(log10LoEnergyRatio, false);
-		interpPowerHi = integral_SR_power.InterpolateY(log10HiEnergyRatio, false);
+		SR_spectrum_table.InterpolateIntegrals(log10LoEnergyRatio, interpFluxLo, interpPowerLo);
+		SR_spectrum_table.InterpolateIntegrals(log10HiEnergyRatio, interpFluxHi, interpPowerHi);
 	}
 
+	//Guide table inversion of the integrated spectrum, see SpectrumTable
 	double generated_energy;
 	if (generation_mode == SYNGEN_MODE_FLUXWISE) {
-		double generated_flux = Weigh(interpFluxLo, interpFluxHi, rnd()); //uniform distribution between flux_min and flux_max
-		generated_energy = Pow10(integral_N_photons.InterpolateX(generated_flux,false));
+		double generated_flux = Weigh(interpFluxLo, interpFluxHi, uniformRnd); //uniform distribution between flux_min and flux_max
+		generated_energy = SR_spectrum_table.SampleEnergy(generated_flux, generation_mode);
 	}
 	else { //Powerwise
-		double generated_power = Weigh(interpPowerLo, interpPowerHi, rnd()); //uniform distribution between flux_min and flux_max
-		generated_energy = Pow10(integral_SR_power.InterpolateX(generated_power,false));
+		double generated_power = Weigh(interpPowerLo, interpPowerHi, uniformRnd); //uniform distribution between flux_min and flux_max
+		generated_energy = SR_spectrum_table.SampleEnergy(generated_power, generation_mode);
 	}
 	return generated_energy;
 }
@@ -766,6 +883,98 @@ std::vector<double> Material::BilinearInterpolate(const double &energy, const do
 	return interpRefl;
 }
 
+void LogAxisGuide::Build(const std::vector<double>& knots) {
+	this->knots = knots;
+	log10Knots.resize(knots.size());
+	for (size_t i = 0; i < knots.size(); i++) log10Knots[i] = log10(knots[i]);
+	nbCells = (knots.size() > 1 && log10Knots.back() > log10Knots.front()) ? Min((knots.size() - 1) * REFL_GUIDE_CELLS_PER_KNOT, (size_t)REFL_GUIDE_MAX_CELLS) : 0;
+	firstKnot.assign(nbCells + 1, 0);
+	if (nbCells == 0) return;
+	log10Min = log10Knots.front();
+	cellsPerDecade = (double)nbCells / (log10Knots.back() - log10Min);
+	size_t knot = 0;
+	for (size_t cell = 0; cell <= nbCells; cell++) {
+		double cellStart = log10Min + (double)cell / cellsPerDecade;
+		while (knot + 2 < knots.size() && log10Knots[knot + 1] <= cellStart) knot++;
+		firstKnot[cell] = (uint32_t)((knot > 0) ? knot - 1 : 0); //One knot of margin for the rounding of cellStart
+	}
+}
+
+void LogAxisGuide::Find(const double& value, size_t& knot, double& weight) const {
+	//Out of the axis, like my_lower_bound() in BilinearInterpolate(): the end knot, not interpolated
+	weight = 0.0;
+	if (nbCells == 0 || !(value > knots.front())) { //Also catches NaN for zero energy or angle
+		knot = 0;
+		return;
+	}
+	if (value > knots.back()) {
+		knot = knots.size() - 1;
+		return;
+	}
+	double log10Value = log10(value);
+	size_t cell = (log10Value > log10Min) ? Min((size_t)((log10Value - log10Min) * cellsPerDecade), nbCells - 1) : 0;
+	//Last knot strictly below value, between the guided knots of the cell. Usually zero or one step
+	size_t lo = firstKnot[cell];
+	size_t hi = Min((size_t)firstKnot[cell + 1] + 1, knots.size() - 2);
+	while (lo < hi) {
+		size_t mid = (lo + hi + 1) / 2;
+		if (knots[mid] < value) lo = mid;
+		else hi = mid - 1;
+	}
+	knot = lo;
+	weight = (log10Value - log10Knots[knot]) / (log10Knots[knot + 1] - log10Knots[knot]);
+}
+
+void Material::BuildLookupTable() {
+	//The lookup interpolates the measured values themselves, only the search of both intervals is guided
+	lookupTable.clear();
+	energyGuide.Build(std::vector<double>());
+	angleGuide.Build(std::vector<double>());
+	if (energyVals.empty() || angleVals.empty() || reflVals.size() != energyVals.size()) return;
+	for (auto& row : reflVals) {
+		if (row.size() != angleVals.size()) return;
+	}
+
+	energyGuide.Build(energyVals);
+	angleGuide.Build(angleVals);
+	lookupTable.resize(energyVals.size() * angleVals.size() * 4, 0.0);
+	for (size_t e = 0; e < energyVals.size(); e++) {
+		for (size_t a = 0; a < angleVals.size(); a++) {
+			double* cell = &lookupTable[(e * angleVals.size() + a) * 4];
+			for (size_t comp = 0; comp < Min(reflVals[e][a].size(), (size_t)4); comp++) {
+				cell[comp] = reflVals[e][a][comp];
+			}
+		}
+	}
+}
+
+ReflectionProbabilities Material::Lookup(const double &energy, const double &angle) const {
+	ReflectionProbabilities result = {};
+	if (lookupTable.empty()) return result;
+
+	size_t e, a;
+	double we, wa;
+	energyGuide.Find(energy, e, we);
+	angleGuide.Find(angle, a, wa);
+	size_t nbAngles = angleGuide.GetNbKnots();
+	size_t energyStride = (we > 0.0) ? nbAngles * 4 : 0; //Not interpolated: both knots of the pair are the same
+	size_t angleStride = (wa > 0.0) ? 4 : 0;
+
+	//Same operations in the same order as BilinearInterpolate(): energy first, then angle
+	const double* c00 = &lookupTable[(e * nbAngles + a) * 4];
+	const double* c10 = c00 + energyStride;
+	const double* c01 = c00 + angleStride;
+	const double* c11 = c10 + angleStride;
+	for (size_t comp = 0; comp < 4; comp++) {
+		double lowerAngle = Weigh(c00[comp], c10[comp], we);
+		double higherAngle = Weigh(c01[comp], c11[comp], we);
+		double value = Weigh(lowerAngle, higherAngle, wa);
+		Saturate(value, 0.0, 1.0);
+		result[comp] = value;
+	}
+	return result;
+}
+
 int Material::GetReflectionType(const double &energy, const double &angle, double const &rnd) {
 	std::vector<double> components = BilinearInterpolate(energy, angle);
 	if (rnd < components[0]) return REFL_FORWARD; //forward reflection
@@ -777,9 +986,18 @@ int Material::GetReflectionType(const double &energy, const double &angle, doubl
 	return REFL_ABSORB; //absorption
 }
 
-double QuadraticInterpolateX(const double& y,
+double QuadraticInterpolateY(const double& x,
                              const double& a, const double& b, const double& c,
                              const double& FA, const double& FB, const double& FC) {
+    //Lagrange polynomial through {a,FA},{b,FB},{c,FC}, inverse of QuadraticInterpolateX()
+    return FA * (x - b)*(x - c) / ((a - b)*(a - c))
+        + FB * (x - a)*(x - c) / ((b - a)*(b - c))
+        + FC * (x - a)*(x - b) / ((c - a)*(c - b));
+}
+
+double QuadraticInterpolateX(const double& y,
+                             const double& a, const double& b, const double& c,
+                             const double& FA, const double& FB, const double& FC, const double& degenerateRnd) {
     double amb = a - b;
     double amc = a - c;
     double bmc = b - c;
@@ -791,7 +1009,7 @@ double QuadraticInterpolateX(const double& y,
         //Divisor is 0 when the slope is 1st order (a straight line) i.e. (FC-FB)/(c-b) == (FB-FA)/(b-a)
         if ((FB - FA) < 1e-30) {
             //FA==FB, shouldn't happen
-            return a + rnd()*(b - a);
+            return a + degenerateRnd*(b - a);
         }
         else {
             //Inverse linear interpolation
@@ -21,6 +21,7 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 //Synrad stuff, distributions and interpolation
 
 #include <string>
+#include <cstdint>
 #include "Distributions.h"
 #include <cereal/types/vector.hpp>
 #include <cereal/types/string.hpp>
@@ -38,11 +39,83 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #define SYNGEN_MODE_FLUXWISE  0
 #define SYNGEN_MODE_POWERWISE 1
 
+#define SPECTRUM_GUIDE_SIZE 8192 //Guide table buckets, about 1.6 per integrated spectrum value
+
+class SpectrumKnot { //One value of the integrated SR spectrum
+public:
+	double log10x; //log10(E/E_crit)
+	double energy; //E/E_crit
+	double flux, power; //Integrated photon number and power from LOWER_LIMIT to log10x
+};
+
+class SpectrumGuide { //Guide table: knot lying below the start of each equal-width bucket of a monotonic column
+public:
+	std::vector<uint32_t> firstKnot; //SPECTRUM_GUIDE_SIZE+1 entries
+	double minValue, maxValue, bucketsPerUnit;
+};
+
+class SpectrumTable { //integral_N_photons and integral_SR_power on their common energy axis, inverted in O(1) expected time
+public:
+	void Build(const Distribution2D& fluxIntegral, const Distribution2D& powerIntegral);
+	double SampleEnergy(const double& integralValue, const int& generation_mode) const; //E/E_crit where the flux (fluxwise) or power (powerwise) integral reaches integralValue
+	void InterpolateIntegrals(const double& log10x, double& flux, double& power) const; //Both integrals at log10(E/E_crit), one lookup
+private:
+	std::vector<SpectrumKnot> knots;
+	SpectrumGuide guideX, guideFlux, guidePower;
+	bool seriesExpansion; //Knots close enough to interpolate 10^x with a cubic expansion instead of Pow10()
+	void BuildGuide(SpectrumGuide& guide, double SpectrumKnot::* column);
+	size_t FindKnot(const SpectrumGuide& guide, double SpectrumKnot::* column, const double& value) const; //Last knot whose column is <= value, value inside the table
+};
+
+#define ANGULAR_GUIDE_SIZE 128 //Guide table buckets per row of a CDF table, over CDF values 0..1
+
+class AngularTable { //psi, chi or polarization table flattened for sampling: photons interpolate between two neighbouring rows, knot by knot
+public:
+	void Build(const std::vector<std::vector<double>>& source, const bool& transpose, const bool& isCDF); //transpose: source indexed [knot][row]. isCDF: rows are monotonic, build the guide for FindKnot()
+	size_t GetNbRows() const { return nbRows; }
+	size_t GetNbKnots() const { return nbKnots; }
+	void ClampRow(const double& rowIndex, size_t& row, double& weight) const; //Splits a fractional row index into the lower row of a pair and the weight of the upper one
+	double Interpolate(const size_t& row, const double& weight, const size_t& knot) const {
+		const double* pair = &pairs[(row * nbKnots + knot) * 2];
+		return pair[0] + weight * (pair[1] - pair[0]);
+	}
+	double InterpolateAt(const size_t& row, const double& weight, const double& knotIndex) const; //Linear between knots as well, knotIndex clamped to the table
+	size_t FindKnot(const size_t& row, const double& weight, const double& value) const; //Last knot k < nbKnots-1 whose interpolated value is <= value
+private:
+	std::vector<double> pairs; //[row][knot][2]: value of row and row+1, nbRows-1 row pairs (one if the source has a single row)
+	std::vector<uint32_t> guide; //[row][bucket]: number of knots of the source row below the bucket's lower bound, ANGULAR_GUIDE_SIZE+1 per row
+	size_t nbRows = 0, nbKnots = 0;
+};
+
+#define REFL_GUIDE_CELLS_PER_KNOT 8 //Guide cells per measured interval of an energy or angle axis
+#define REFL_GUIDE_MAX_CELLS 512 //Guide size limit on each axis
+
+class LogAxisGuide { //Finds the measured interval of an energy or angle on a log10 axis, without a binary search
+public:
+	void Build(const std::vector<double>& knots);
+	void Find(const double& value, size_t& knot, double& weight) const; //Lower knot and log10 weight of the next one, as BilinearInterpolate() computes them. Weight 0 outside the axis
+	size_t GetNbKnots() const { return knots.size(); }
+private:
+	std::vector<double> knots, log10Knots;
+	std::vector<uint32_t> firstKnot; //[cell]: knot at or below the start of each equal-width log10 cell, nbCells+1 entries
+	double log10Min, cellsPerDecade;
+	size_t nbCells;
+};
+
+class ReflectionProbabilities { //Result of a reflectivity lookup, by value
+public:
+	double values[4]; //forward/diffuse/back reflection and transparent pass probabilities, 0 if the material has no such component
+	const double& operator[](const size_t& i) const { return values[i]; }
+	double& operator[](const size_t& i) { return values[i]; }
+};
+
 class Material { //2-variable interpolation
 public:
 	//ReflectivityTable(const ReflectivityTable &copy_src); //copy constructor
 	//ReflectivityTable& operator= (const ReflectivityTable & other); //assignment op
 	std::vector<double> BilinearInterpolate(const double &energy, const double &angle);
+	void BuildLookupTable(); //Flattens reflVals and guides both axes, call after loading
+	ReflectionProbabilities Lookup(const double &energy, const double &angle) const; //Same result as BilinearInterpolate(), guided search and no allocation
 	std::vector<double> energyVals, angleVals; //energy and angle values (table headers)
 	std::vector<std::vector<std::vector<double>>> reflVals; //actual table values, 3 components for forward/diffuse/back reflection
 	void LoadMaterialCSV(FileReader *file);
@@ -51,6 +124,10 @@ public:
 	int hasBackscattering; //has forward/diffuse/backscattering/transparent pass probabilities
 	void InitAngles(std::vector<std::string> data);
 
+	//Lookup data, not serialized: reflVals as [energy][angle][4] (absent components are 0) and the guides of both axes
+	std::vector<double> lookupTable;
+	LogAxisGuide energyGuide, angleGuide;
+
     template<class Archive>
     void serialize(Archive & archive)
     {
@@ -81,19 +158,22 @@ double SYNRAD_FAST(const double &x);
 //double calc_polarization_percentage(double energy,bool calculate_parallel_polarization, bool calculate_orthogonal_polarization);
 //double find_psi_and_polarization(double x,bool calculate_parallel_polarization, bool calculate_orthogonal_polarization);
 //double find_chi(double psi,double gamma,bool calculate_parallel_polarization, bool calculate_orthogonal_polarization);
-std::tuple<double,double> find_psi_and_polarization(const double& lambda_ratios,
-	const std::vector<std::vector<double>> &psi_distr, const std::vector<std::vector<double>> &parallel_polarization, const size_t& polarizationComponent); //returns psi and parallel polarization ratio
-double find_chi(const double& psi, const double& gamma, const std::vector<std::vector<double>> &chi_distr);
+//Samplers take their uniform random numbers as arguments, so that each simulation thread can use its own generator
+std::tuple<double,double> find_psi_and_polarization(const double& lambda_ratios, const double& lookup,
+	const AngularTable& psiTable, const AngularTable& polarizationTable, const size_t& polarizationComponent, const double& maxPsi); //returns gamma*psi and parallel polarization ratio, gamma*psi sampled up to maxPsi
+double find_chi(const double& psi, const double& gamma, const AngularTable& chiTable, const double& lookup, const double& lowAngleRnd, const double& maxChi); //chi sampled up to maxChi
 double SYNGEN1(const double& log10LoEnergyRatio, const double& log10HiEnergyRatio,
 	double& interpFluxLo,double& interpFluxHi,double& interpPowerLo,double& interpPowerHi, const bool& calcInterpolates,
-	const int& generation_mode);
+	const int& generation_mode, const double& uniformRnd);
 
-double QuadraticInterpolateX(const double & y, const double & a, const double & b, const double & c, const double & FA, const double & FB, const double & FC);
+double QuadraticInterpolateY(const double & x, const double & a, const double & b, const double & c, const double & FA, const double & FB, const double & FC);
+double QuadraticInterpolateX(const double & y, const double & a, const double & b, const double & c, const double & FA, const double & FB, const double & FC, const double& degenerateRnd);
 
 //Distribution2D Generate_K_Distribution(double order);
 //Distribution2D Generate_G1_H2_Distribution();
 //Distribution2D Generate_Polarization_Distribution(bool calculate_parallel_polarization, bool calculate_orthogonal_polarization);
 Distribution2D Generate_SR_spectrum(double log10_min, double log10_max, int mode);
+SpectrumTable BuildSpectrumTable(const Distribution2D& fluxIntegral, const Distribution2D& powerIntegral);
 /*
 Distribution2D K_1_3_distribution=Generate_K_Distribution(1.0/3.0);
 Distribution2D K_2_3_distribution=Generate_K_Distribution(2.0/3.0);
@@ -19,6 +19,7 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 */
 #include "Facet_shared.h"
 #include "SynradTypes.h"
+#include "TextureTiles.h" //GetTileIndexSize()
 #include "GlApp/MathTools.h" //IS_ZERO
 #include "SynradDistributions.h" //Material
 #include <cereal/types/vector.hpp>
@@ -351,11 +352,12 @@ size_t Facet::GetGeometrySize() {
 }
 
 size_t Facet::GetHitsSize() {
+	//Texture and direction field as tile indices, their cells are in the texture pool (TextureTiles.h)
 
 	return   sizeof(FacetHitBuffer)
 		+ (sh.isProfile ? PROFILE_SIZE*sizeof(ProfileSlice) : 0)
-		+ sh.texWidth*sh.texHeight*sizeof(TextureCell)
-		+ (sh.countDirection ? sh.texWidth*sh.texHeight*sizeof(DirectionCell) : 0)
+		+ (sh.isTextured ? GetTileIndexSize(sh.texWidth, sh.texHeight) : 0)
+		+ (sh.countDirection ? GetTileIndexSize(sh.texWidth, sh.texHeight) : 0)
 		+ (sh.recordSpectrum ? SPECTRUM_SIZE * sizeof(ProfileSlice) : 0);
 
 }
@@ -32,6 +32,11 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #include "GLApp\GLWindowManager.h"
 #include "Region_full.h"
 #include "Facet_shared.h"
+#include "LoaderFormat.h"
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
 #include <cereal/types/vector.hpp>
 
 using namespace pugi;
@@ -277,16 +282,230 @@ void SynradGeometry::CopyGeometryBuffer(BYTE *buffer, std::vector<Region_full> &
 	}
 }
 
+size_t SynradGeometry::GetLoaderLayout(LoaderHeader& header, Worker *work, const RunSettings& settings) {
+
+	memset(&header, 0, sizeof(LoaderHeader));
+	work->wp.nbRegion = work->regions.size();
+
+	size_t nbPoints = 0, nbPairs = 0;
+	for (auto& reg : work->regions) {
+		reg.params.nbDistr_MAG = Vector3d((int)reg.Bx_distr.GetSize(), (int)reg.By_distr.GetSize(), (int)reg.Bz_distr.GetSize());
+		reg.params.nbPointsToCopy = reg.Points.size();
+		nbPoints += reg.Points.size();
+		nbPairs += reg.Bx_distr.GetSize() + reg.By_distr.GetSize() + reg.Bz_distr.GetSize();
+	}
+	size_t nbMaterialValues = 0;
+	for (auto& mat : work->materials) {
+		size_t nbComponents = mat.hasBackscattering ? 4 : 1;
+		nbMaterialValues += mat.angleVals.size() + mat.energyVals.size() + mat.angleVals.size()*mat.energyVals.size()*nbComponents;
+	}
+	size_t nbRows = work->psi_distro.size() + work->parallel_polarization.size(), nbTableValues = 0;
+	for (auto& row : work->psi_distro) nbTableValues += row.size();
+	for (auto& row : work->parallel_polarization) nbTableValues += row.size();
+	for (auto& table : work->chi_distros) {
+		nbRows += table.size();
+		for (auto& row : table) nbTableValues += row.size();
+	}
+	size_t nbIndices = 0, nbIncrements = 0;
+	size_t fOffset = sizeof(GlobalHitBuffer); //calculating offsets for all facets for the hits dataport during the simulation
+	for (size_t i = 0; i < sh.nbFacet; i++) {
+		Facet *f = facets[i];
+		f->sh.hitOffset = fOffset;
+		fOffset += f->GetHitsSize();
+		nbIndices += f->sh.nbIndex;
+		if (f->sh.isTextured) nbIncrements += f->sh.texWidth*f->sh.texHeight;
+	}
+
+	SetLoaderSection(header, LOADER_WORKER_PARAMS, 1, sizeof(WorkerParams));
+	SetLoaderSection(header, LOADER_ONTHEFLY_PARAMS, 1, sizeof(OntheflySimulationParams));
+	SetLoaderSection(header, LOADER_GEOM_COUNTS, 1, sizeof(LoaderGeomCounts));
+	SetLoaderSection(header, LOADER_GEOM_NAME, sh.name.size(), sizeof(char));
+	SetLoaderSection(header, LOADER_VERTICES, sh.nbVertex, sizeof(Vector3d));
+	SetLoaderSection(header, LOADER_FACETS, sh.nbFacet, sizeof(FacetProperties));
+	SetLoaderSection(header, LOADER_FACET_RANGES, sh.nbFacet, sizeof(LoaderFacetRanges));
+	SetLoaderSection(header, LOADER_INDICES, nbIndices, sizeof(size_t));
+	SetLoaderSection(header, LOADER_VERTICES2, nbIndices, sizeof(Vector2d));
+	SetLoaderSection(header, LOADER_TEXTURE_INCREMENTS, nbIncrements, sizeof(double));
+	SetLoaderSection(header, LOADER_REGIONS, work->regions.size(), sizeof(RegionParams));
+	SetLoaderSection(header, LOADER_REGION_RANGES, work->regions.size(), sizeof(LoaderRegionRanges));
+	SetLoaderSection(header, LOADER_TRAJECTORY_POINTS, nbPoints, sizeof(Trajectory_Point));
+	SetLoaderSection(header, LOADER_DISTRIBUTION_PAIRS, nbPairs, sizeof(LoaderPair));
+	SetLoaderSection(header, LOADER_MATERIALS, work->materials.size(), sizeof(LoaderMaterial));
+	SetLoaderSection(header, LOADER_MATERIAL_VALUES, nbMaterialValues, sizeof(double));
+	SetLoaderSection(header, LOADER_TABLES, work->chi_distros.size() + 2, sizeof(LoaderRange));
+	SetLoaderSection(header, LOADER_TABLE_ROWS, nbRows, sizeof(LoaderRange));
+	SetLoaderSection(header, LOADER_TABLE_VALUES, nbTableValues, sizeof(double));
+	settings.SetLoaderSections(header);
+
+	return LayoutLoader(header);
+}
+
+void SynradGeometry::CopyLoaderBuffer(void *buffer, const LoaderHeader& header, Worker *work, const RunSettings& settings) {
+
+	memcpy(buffer, &header, sizeof(LoaderHeader));
+
+	*LoaderSectionData<WorkerParams>(buffer, header, LOADER_WORKER_PARAMS) = work->wp;
+	*LoaderSectionData<OntheflySimulationParams>(buffer, header, LOADER_ONTHEFLY_PARAMS) = work->ontheflyParams;
+	settings.CopyToLoader(buffer, header);
+	LoaderGeomCounts* counts = LoaderSectionData<LoaderGeomCounts>(buffer, header, LOADER_GEOM_COUNTS);
+	counts->nbFacet = sh.nbFacet;
+	counts->nbVertex = sh.nbVertex;
+	counts->nbSuper = sh.nbSuper;
+	counts->nbChiDistros = work->chi_distros.size();
+	memcpy(LoaderSectionData<char>(buffer, header, LOADER_GEOM_NAME), sh.name.data(), sh.name.size());
+	memcpy(LoaderSectionData<Vector3d>(buffer, header, LOADER_VERTICES), vertices3.data(), sizeof(Vector3d)*sh.nbVertex);
+
+	//Regions
+	RegionParams* regionParams = LoaderSectionData<RegionParams>(buffer, header, LOADER_REGIONS);
+	LoaderRegionRanges* regionRanges = LoaderSectionData<LoaderRegionRanges>(buffer, header, LOADER_REGION_RANGES);
+	Trajectory_Point* points = LoaderSectionData<Trajectory_Point>(buffer, header, LOADER_TRAJECTORY_POINTS);
+	LoaderPair* pairs = LoaderSectionData<LoaderPair>(buffer, header, LOADER_DISTRIBUTION_PAIRS);
+	size_t nbPoints = 0, nbPairs = 0;
+	for (size_t r = 0; r < work->regions.size(); r++) {
+		Region_full& reg = work->regions[r];
+		regionParams[r] = reg.params;
+		regionRanges[r].points = { nbPoints, reg.Points.size() };
+		if (!reg.Points.empty()) memcpy(points + nbPoints, reg.Points.data(), sizeof(Trajectory_Point)*reg.Points.size());
+		nbPoints += reg.Points.size();
+		Distribution2D* distributions[3] = { &reg.Bx_distr, &reg.By_distr, &reg.Bz_distr };
+		LoaderRange* distrRanges[3] = { &regionRanges[r].Bx_distr, &regionRanges[r].By_distr, &regionRanges[r].Bz_distr };
+		for (size_t d = 0; d < 3; d++) {
+			size_t size = distributions[d]->GetSize();
+			*distrRanges[d] = { nbPairs, size };
+			for (size_t j = 0; j < size; j++) {
+				pairs[nbPairs].x = distributions[d]->GetX(j);
+				pairs[nbPairs].y = distributions[d]->GetY(j);
+				nbPairs++;
+			}
+		}
+	}
+
+	//Material library
+	LoaderMaterial* materials = LoaderSectionData<LoaderMaterial>(buffer, header, LOADER_MATERIALS);
+	double* materialValues = LoaderSectionData<double>(buffer, header, LOADER_MATERIAL_VALUES);
+	size_t nbMaterialValues = 0;
+	for (size_t i = 0; i < work->materials.size(); i++) {
+		const Material& mat = work->materials[i];
+		LoaderMaterial& m = materials[i];
+		m.hasBackscattering = mat.hasBackscattering ? 1 : 0;
+		m.nbAngles = mat.angleVals.size();
+		m.nbEnergies = mat.energyVals.size();
+		m.nbComponents = mat.hasBackscattering ? 4 : 1;
+		m.firstValue = nbMaterialValues;
+		for (auto& angleVal : mat.angleVals) materialValues[nbMaterialValues++] = angleVal; //header
+		for (auto& energyVal : mat.energyVals) materialValues[nbMaterialValues++] = energyVal; //column1
+		for (size_t j = 0; j < mat.energyVals.size(); j++) {
+			for (size_t k = 0; k < mat.angleVals.size(); k++) {
+				for (size_t comp = 0; comp < m.nbComponents; comp++) {
+					materialValues[nbMaterialValues++] = mat.reflVals[j][k][comp]; //forward/diffuse/back/transparent
+				}
+			}
+		}
+	}
+
+	//Distributions: psi, chi for each polarization component, parallel polarization
+	LoaderRange* tables = LoaderSectionData<LoaderRange>(buffer, header, LOADER_TABLES);
+	LoaderRange* rows = LoaderSectionData<LoaderRange>(buffer, header, LOADER_TABLE_ROWS);
+	double* tableValues = LoaderSectionData<double>(buffer, header, LOADER_TABLE_VALUES);
+	std::vector<const std::vector<std::vector<double>>*> sourceTables;
+	sourceTables.push_back(&work->psi_distro);
+	for (auto& table : work->chi_distros) sourceTables.push_back(&table);
+	sourceTables.push_back(&work->parallel_polarization);
+	size_t nbRows = 0, nbTableValues = 0;
+	for (size_t t = 0; t < sourceTables.size(); t++) {
+		tables[t] = { nbRows, sourceTables[t]->size() };
+		for (auto& row : *sourceTables[t]) {
+			rows[nbRows++] = { nbTableValues, row.size() };
+			if (!row.empty()) memcpy(tableValues + nbTableValues, row.data(), sizeof(double)*row.size());
+			nbTableValues += row.size();
+		}
+	}
+
+	//Facets
+	FacetProperties* facetProperties = LoaderSectionData<FacetProperties>(buffer, header, LOADER_FACETS);
+	LoaderFacetRanges* facetRanges = LoaderSectionData<LoaderFacetRanges>(buffer, header, LOADER_FACET_RANGES);
+	size_t* indices = LoaderSectionData<size_t>(buffer, header, LOADER_INDICES);
+	Vector2d* vertices2 = LoaderSectionData<Vector2d>(buffer, header, LOADER_VERTICES2);
+	double* increments = LoaderSectionData<double>(buffer, header, LOADER_TEXTURE_INCREMENTS);
+	size_t nbIndices = 0, nbIncrements = 0;
+	for (size_t k = 0; k < sh.nbFacet; k++) {
+		Facet *f = facets[k];
+		facetProperties[k] = f->sh; //hitOffset set by GetLoaderLayout()
+		facetRanges[k].indices = { nbIndices, f->sh.nbIndex };
+		memcpy(indices + nbIndices, f->indices.data(), sizeof(size_t)*f->sh.nbIndex);
+		memcpy(vertices2 + nbIndices, f->vertices2.data(), sizeof(Vector2d)*f->sh.nbIndex);
+		nbIndices += f->sh.nbIndex;
+
+		// Add surface elements area (reciprocal)
+		size_t nbCells = f->sh.isTextured ? f->sh.texWidth*f->sh.texHeight : 0;
+		facetRanges[k].textureIncrements = { nbIncrements, nbCells };
+		if (nbCells == 0) continue;
+		double* inc = increments + nbIncrements;
+		nbIncrements += nbCells;
+		if (f->cellPropertiesIds) {
+			for (size_t add = 0; add < nbCells; add++) {
+				double area = f->GetMeshArea(add, true);
+				inc[add] = (area > 0.0) ? 1.0 / area : 0.0;
+			}
+		}
+		else {
+			double rw = f->sh.U.Norme() / (double)(f->sh.texWidthD);
+			double rh = f->sh.V.Norme() / (double)(f->sh.texHeightD);
+			double area = rw * rh;
+			for (size_t add = 0; add < nbCells; add++) {
+				inc[add] = (area > 0.0) ? 1.0 / area : 0.0;
+			}
+		}
+	}
+}
+
+void SynradGeometry::SaveLoaderFile(FILE *file, Worker *work, const RunSettings& settings) {
+	//Same buffer as the one sent to the subprocesses, read back by synradCLI
+	LoaderHeader header;
+	size_t loadSize = GetLoaderLayout(header, work, settings);
+	std::vector<BYTE> buffer(loadSize, 0);
+	CopyLoaderBuffer(buffer.data(), header, work, settings);
+	if (fwrite(buffer.data(), 1, loadSize, file) != loadSize) throw Error("Error writing simulation input file");
+}
+
 size_t SynradGeometry::GetHitsSize() {
 
 	// Compute number of bytes allocated
-	size_t memoryUsage = 0;
-	memoryUsage += sizeof(GlobalHitBuffer);
+	return GetTexturePoolLayout().GetEndOffset();
+}
+
+TexturePoolLayout SynradGeometry::GetTexturePoolLayout() {
+	//Same layout as the subprocesses' (LoadSimulation()), after the tallies
+	size_t offset = sizeof(GlobalHitBuffer);
+	size_t nbTextureTiles = 0, nbDirectionTiles = 0;
 	for (size_t i = 0; i < sh.nbFacet; i++) {
-		memoryUsage += facets[i]->GetHitsSize();
-	}
+		Facet *f = facets[i];
+		offset += f->GetHitsSize();
+		if (f->sh.isTextured) nbTextureTiles += GetNbTiles(f->sh.texWidth, f->sh.texHeight);
+		if (f->sh.countDirection) nbDirectionTiles += GetNbTiles(f->sh.texWidth, f->sh.texHeight);
+	}
+	std::vector<TallyLayout> tallyLayouts = GetTallyLayouts();
+	if (!tallyLayouts.empty()) offset = tallyLayouts.back().GetEndOffset();
+	TexturePoolLayout pool;
+	pool.Set(offset, nbTextureTiles, nbDirectionTiles, mApp->runSettings.texturePoolMB);
+	return pool;
+}
 
-	return memoryUsage;
+std::vector<TallyLayout> SynradGeometry::GetTallyLayouts() {
+	//Same layout as the subprocesses' (LoadSimulation()), after the last facet
+	std::vector<TallyLayout> layouts(sh.nbFacet);
+	size_t offset = sizeof(GlobalHitBuffer);
+	for (size_t i = 0; i < sh.nbFacet; i++)
+		offset += facets[i]->GetHitsSize();
+	size_t nbTags = mApp->worker.regions.size() * NB_BOUNCE_BUCKETS;
+	for (size_t i = 0; i < sh.nbFacet; i++) {
+		Facet *f = facets[i];
+		size_t nbBands = mApp->runSettings.GetNbEnergyBands(i);
+		offset = layouts[i].Set(offset, mApp->runSettings.IsTallied(i) ? nbTags : 0,
+			f->sh.isProfile, f->sh.isTextured ? f->sh.texWidth : 0, f->sh.isTextured ? f->sh.texHeight : 0,
+			nbBands, nbBands > 0 && mApp->runSettings.energyBands[i].recordTexture);
+	}
+	return layouts;
 }
 
 void  SynradGeometry::BuildPipe(double L, double R, double s, int step) {
@@ -467,6 +686,10 @@ std::vector<std::string> SynradGeometry::InsertSYNGeom(FileReader *file, size_t
 	}
 	file->ReadKeyword("maxDes"); file->ReadKeyword(":");
 	file->ReadSizeT();
+	if (version2 >= 11) {
+		file->ReadKeyword("resultFormat"); file->ReadKeyword(":");
+		file->ReadInt(); //Results aren't inserted
+	}
 	file->ReadKeyword("nbVertex"); file->ReadKeyword(":");
 	size_t nbNewVertex = file->ReadSizeT();
 	file->ReadKeyword("nbFacet"); file->ReadKeyword(":");
@@ -952,6 +1175,7 @@ bool SynradGeometry::LoadTextures(FileReader *file, GLProgress *prg, Dataport *d
 		// Globals
 		BYTE *buffer = (BYTE *)dpHit->buff;
 		GlobalHitBuffer *gHits = (GlobalHitBuffer *)buffer;
+		TexturePoolLayout texturePool = GetTexturePoolLayout();
 
 		gHits->globalHits.hit.nbMCHit = loaded_nbMCHit;
 		gHits->globalHits.hit.nbHitEquiv = loaded_nbHitEquiv;
@@ -994,9 +1218,6 @@ bool SynradGeometry::LoadTextures(FileReader *file, GLProgress *prg, Dataport *d
 
 				size_t ix, iy;
 
-				size_t profSize = (f->sh.isProfile) ? PROFILE_SIZE*sizeof(ProfileSlice) : 0;
-				TextureCell *texture = (TextureCell *)((BYTE *)gHits + (f->sh.hitOffset + sizeof(FacetHitBuffer) + profSize));
-
 				size_t texWidth_file, texHeight_file;
 				//In case of rounding errors, the file might contain different texture dimensions than expected.
 				if (version >= 8) {
@@ -1011,16 +1232,21 @@ bool SynradGeometry::LoadTextures(FileReader *file, GLProgress *prg, Dataport *d
 				for (iy = 0; iy < (Min(f->sh.texHeight, texHeight_file)); iy++) { //MIN: If stored texture is larger, don't read extra cells
 					for (ix = 0; ix<(Min(f->sh.texWidth, texWidth_file)); ix++) { //MIN: If stored texture is larger, don't read extra cells
 						size_t index = iy*(f->sh.texWidth) + ix;
-						texture[index].count = file->ReadSizeT();
+						TextureCell cell;
+						cell.count = file->ReadSizeT();
 						if (version >= 7) file->ReadDouble(); //cell area
-						texture[index].flux = file->ReadDouble();
-						texture[index].power = file->ReadDouble();
+						cell.flux = file->ReadDouble();
+						cell.power = file->ReadDouble();
+						if (cell.count == 0 && cell.flux == 0.0 && cell.power == 0.0) continue; //Its tile may stay unallocated
 
 						//Normalize by area
 						if (f->GetMeshArea(index)>0.0) {
-							texture[index].flux /= f->GetMeshArea(index);
-							texture[index].power /= f->GetMeshArea(index);
+							cell.flux /= f->GetMeshArea(index);
+							cell.power /= f->GetMeshArea(index);
 						}
+						TextureCell *shCell = GetTextureCellForWrite(buffer, f->sh, texturePool, ix, iy);
+						if (shCell) *shCell = cell;
+						else texturePool.GetHeader(buffer)->nbLostHits += cell.count; //Pool full
 					}
 					for (size_t ie = 0; ie < texWidth_file - f->sh.texWidth; ie++) {//Executed if file texture is bigger than expected texture
 						//Read extra cells from file without doing anything
@@ -1138,6 +1364,7 @@ void SynradGeometry::ExportTextures(FILE *file, int grouping, int mode, double n
 	//GlobalHitBuffer *gHits = (GlobalHitBuffer *)buffer;
 
 	if (grouping == 1) fprintf(file, "X_coord_cm\tY_coord_cm\tZ_coord_cm\tValue\t\n"); //mode 10: special ANSYS export
+	TexturePoolLayout texturePool = GetTexturePoolLayout();
 
 	// Facets
 	for (int i = 0; i < sh.nbFacet; i++) {
@@ -1155,9 +1382,8 @@ void SynradGeometry::ExportTextures(FILE *file, int grouping, int mode, double n
 				size_t w = f->sh.texWidth;
 				size_t h = f->sh.texHeight;
 				size_t nbE = w*h;
-				size_t profSize = (f->sh.isProfile) ? PROFILE_SIZE*sizeof(ProfileSlice) : 0;
 
-				TextureCell *texture = (TextureCell *)((BYTE *)buffer + (f->sh.hitOffset + sizeof(FacetHitBuffer) + profSize));
+				TileView<TextureCell> texture = GetTextureView(buffer, f->sh, texturePool); //Indexed as a dense texture, tiles never hit read as zero
 				double norm = 1.0 / no_scans; //normalize values by number of scans (and don't normalize by area...)
 
 				for (size_t i = 0; i < w; i++) {
@@ -1232,6 +1458,7 @@ void SynradGeometry::SaveDesorption(FILE *file, Dataport *dpHit, bool selectedOn
 			buffer = (BYTE *)dpHit->buff;
 
 	Worker *worker = &(mApp->worker);
+	TexturePoolLayout texturePool = GetTexturePoolLayout();
 
 	// Globals
 	//BYTE *buffer = (BYTE *)dpHit->buff;
@@ -1253,8 +1480,7 @@ void SynradGeometry::SaveDesorption(FILE *file, Dataport *dpHit, bool selectedOn
 
 				size_t w = f->sh.texWidth;
 				size_t h = f->sh.texHeight;
-				size_t profSize = (f->sh.isProfile) ? PROFILE_SIZE * sizeof(ProfileSlice) : 0;
-				TextureCell *texture = (TextureCell *)((BYTE *)buffer + (f->sh.hitOffset + sizeof(FacetHitBuffer) + profSize));
+				TileView<TextureCell> texture = GetTextureView(buffer, f->sh, texturePool);
 
 				for (size_t i = 0; i < w; i++) {
 					for (size_t j = 0; j < h; j++) {
@@ -1293,13 +1519,14 @@ void SynradGeometry::SaveDesorption(FILE *file, Dataport *dpHit, bool selectedOn
 }
 
 void SynradGeometry::SaveSYN(FileWriter *file, GLProgress *prg, Dataport *dpHit, bool saveSelected, LEAK *leakCacheSave,
-	size_t *nbLeakSave, HIT *hitCacheSave, size_t *nbHitSave, bool crashSave) {
+	size_t *nbLeakSave, HIT *hitCacheSave, size_t *nbHitSave, bool crashSave, int resultFormat, bool hitsLocked) {
 
 	prg->SetMessage("Counting hits...");
 	if (!IsLoaded()) throw Error("Nothing to save !");
 
-	// Block dpHit during the whole disc writing
-	if (!crashSave && !saveSelected) AccessDataport(dpHit);
+	// Block dpHit during the whole disc writing (the caller does when the binary results follow)
+	bool lockHits = !crashSave && !saveSelected && !hitsLocked;
+	if (lockHits) AccessDataport(dpHit);
 
 	// Globals
 	BYTE *buffer;
@@ -1324,6 +1551,7 @@ void SynradGeometry::SaveSYN(FileWriter *file, GLProgress *prg, Dataport *dpHit,
 	file->Write("totalAbsEquiv:"); file->Write((!crashSave && !saveSelected) ? gHits->globalHits.hit.nbAbsEquiv : 0, "\n");
 	file->Write("totalDist:"); file->Write((!crashSave && !saveSelected) ? gHits->distTraveledTotal : 0, "\n");
 	file->Write("maxDes:"); file->Write((!crashSave && !saveSelected) ? loaded_desorptionLimit : 0, "\n");
+	file->Write("resultFormat:"); file->Write(resultFormat, "\n");
 	file->Write("nbVertex:"); file->Write(sh.nbVertex, "\n");
 	auto selectedFacets = GetSelectedFacets();
 	file->Write("nbFacet:"); file->Write(saveSelected ? selectedFacets.size() : sh.nbFacet, "\n");
@@ -1460,6 +1688,12 @@ void SynradGeometry::SaveSYN(FileWriter *file, GLProgress *prg, Dataport *dpHit,
 		if (!saveSelected || facets[i]->selected) { facets[i]->SaveSYN(file, worker->materials, k, crashSave); k++; }
 	}
 
+	if (resultFormat == RESULT_FORMAT_CHUNKS) { //Results follow in binary, see SaveResultChunks()
+		file->Write("{result_chunks}\n");
+		if (lockHits) ReleaseDataport(dpHit);
+		return;
+	}
+
 	prg->SetMessage("Writing profiles and spectrum...");
 	SaveProfileSYN(file, dpHit, -1, saveSelected, crashSave);
 	SaveSpectrumSYN(file, dpHit, -1, saveSelected, crashSave);
@@ -1479,14 +1713,14 @@ void SynradGeometry::SaveSYN(FileWriter *file, GLProgress *prg, Dataport *dpHit,
 	//SaveSelections();
 
 	prg->SetMessage("Writing textures...");
+	TexturePoolLayout texturePool = GetTexturePoolLayout();
 	for (int i = 0; i < sh.nbFacet; i++) {
 		prg->SetProgress(((double)i / (double)sh.nbFacet) *0.33 + 0.66);
 		Facet *f = facets[i];
 		if (f->hasMesh) {
-			size_t profSize = f->sh.isProfile ? PROFILE_SIZE*sizeof(ProfileSlice) : 0;
 			size_t nbE = f->sh.texHeight*f->sh.texWidth;
-			TextureCell *texture;
-			if (!crashSave && !saveSelected) texture = (TextureCell *)((BYTE *)gHits + (f->sh.hitOffset + sizeof(FacetHitBuffer) + profSize));
+			TileView<TextureCell> texture; //Every cell written, those of tiles never hit as zero
+			if (!crashSave && !saveSelected) texture = GetTextureView((BYTE *)gHits, f->sh, texturePool);
 
 			//char tmp[256];
 			sprintf(tmp, "texture_facet %d {\n", i + 1);
@@ -1506,20 +1740,260 @@ void SynradGeometry::SaveSYN(FileWriter *file, GLProgress *prg, Dataport *dpHit,
 		}
 	}
 
-	if (!crashSave && !saveSelected) ReleaseDataport(dpHit);
+	if (lockHits) ReleaseDataport(dpHit);
 
 }
 
-std::vector<std::string> SynradGeometry::LoadSYN(FileReader *file, GLProgress *prg, int *version, Worker *worker) {
+void SynradGeometry::SaveResultChunks(FILE *file, GLProgress *prg, const BYTE *hitBuffer) {
+
+	//Appended to a .syn file whose text part was written with RESULT_FORMAT_CHUNKS, under the same dpHit lock
+	prg->SetMessage("Writing results...");
+	_fseeki64(file, 0, SEEK_END);
+	std::vector<ResultChunkEntry> index;
+	std::vector<uint64_t> encoded;
+
+	auto writeChunk = [&](const uint32_t& type, const size_t& facetId, const void *data, const size_t& elementSize, const size_t& width, const size_t& height) {
+		ResultChunkEntry entry;
+		entry.type = type;
+		entry.encoding = RESULT_ENCODING_RAW;
+		entry.facetId = facetId;
+		entry.offset = (uint64_t)_ftelli64(file);
+		entry.rawSize = entry.storedSize = width * height * elementSize;
+		entry.elementSize = elementSize;
+		entry.width = width;
+		entry.height = height;
+		const void *stored = data;
+		if (entry.rawSize % sizeof(uint64_t) == 0) {
+			EncodeZeroRuns((const uint64_t*)data, entry.rawSize / sizeof(uint64_t), encoded);
+			if (encoded.size() * sizeof(uint64_t) < entry.rawSize - entry.rawSize / 8) { //Coded only if it saves at least 1/8
+				entry.encoding = RESULT_ENCODING_ZERORUN;
+				entry.storedSize = encoded.size() * sizeof(uint64_t);
+				stored = encoded.data();
+			}
+		}
+		if (entry.storedSize > 0 && fwrite(stored, 1, entry.storedSize, file) != entry.storedSize) throw Error("Error writing the results (disk full?)");
+		index.push_back(entry);
+	};
+
+	const GlobalHitBuffer *gHits = (const GlobalHitBuffer *)hitBuffer;
+	ResultTextureLimits limits;
+	limits.minCount = gHits->hitMin.count; limits.maxCount = gHits->hitMax.count;
+	limits.minFlux = gHits->hitMin.flux; limits.maxFlux = gHits->hitMax.flux;
+	limits.minPower = gHits->hitMin.power; limits.maxPower = gHits->hitMax.power;
+	writeChunk(RESULT_CHUNK_TEXTURE_LIMITS, 0, &limits, sizeof(ResultTextureLimits), 1, 1);
+
+	TexturePoolLayout texturePool = GetTexturePoolLayout();
+	std::vector<TextureCell> facetTexture; //Texture chunks stay dense, one facet at a time: the tiles never hit are zero runs
+	for (size_t i = 0; i < sh.nbFacet; i++) {
+		prg->SetProgress((double)i / (double)sh.nbFacet);
+		Facet *f = facets[i];
+		const BYTE *facetHits = hitBuffer + f->sh.hitOffset + sizeof(FacetHitBuffer);
+		if (f->sh.isProfile) writeChunk(RESULT_CHUNK_PROFILE, i, facetHits, sizeof(ProfileSlice), PROFILE_SIZE, 1);
+		if (f->hasMesh) {
+			facetTexture.resize(f->sh.texWidth*f->sh.texHeight);
+			GetTextureView(hitBuffer, f->sh, texturePool).CopyTo(facetTexture.data());
+			writeChunk(RESULT_CHUNK_TEXTURE, i, facetTexture.data(), sizeof(TextureCell), f->sh.texWidth, f->sh.texHeight);
+		}
+		if (f->sh.recordSpectrum) writeChunk(RESULT_CHUNK_SPECTRUM, i, hitBuffer + GetSpectrumOffset(f->sh), sizeof(ProfileSlice), SPECTRUM_SIZE, 1);
+	}
 
-	prg->SetMessage("Clearing current geometry...");
+	ResultChunkFooter footer;
+	footer.indexOffset = (uint64_t)_ftelli64(file);
+	footer.nbChunks = index.size();
+	footer.version = RESULT_CHUNK_VERSION;
+	footer.magic = RESULT_CHUNK_MAGIC;
+	if (fwrite(index.data(), sizeof(ResultChunkEntry), index.size(), file) != index.size()
+		|| fwrite(&footer, sizeof(ResultChunkFooter), 1, file) != 1) throw Error("Error writing the results (disk full?)");
+}
+
+void SynradGeometry::LoadResultChunks(const std::string& fileName, GLProgress *prg, Dataport *dpHit) {
+
+	prg->SetMessage("Reading result index...");
+	FILE *file = fopen(fileName.c_str(), "rb");
+	if (!file) throw Error(("Cannot open " + fileName + " to read the results").c_str());
+	_fseeki64(file, 0, SEEK_END);
+	uint64_t fileSize = (uint64_t)_ftelli64(file);
+	ResultChunkFooter footer;
+	std::vector<ResultChunkEntry> index;
+	const char *err = NULL;
+	if (fileSize < sizeof(ResultChunkFooter) || _fseeki64(file, fileSize - sizeof(ResultChunkFooter), SEEK_SET) != 0
+		|| fread(&footer, sizeof(ResultChunkFooter), 1, file) != 1 || footer.magic != RESULT_CHUNK_MAGIC) err = "No binary result section at the end of the file";
+	else if (footer.version != RESULT_CHUNK_VERSION) err = "Unsupported binary result version";
+	else if (footer.indexOffset > fileSize - sizeof(ResultChunkFooter)
+		|| footer.nbChunks > (fileSize - sizeof(ResultChunkFooter) - footer.indexOffset) / sizeof(ResultChunkEntry)) err = "Result index out of file";
+	else {
+		index.resize(footer.nbChunks);
+		if (_fseeki64(file, footer.indexOffset, SEEK_SET) != 0
+			|| fread(index.data(), sizeof(ResultChunkEntry), index.size(), file) != index.size()) err = "Cannot read the result index";
+	}
+	fclose(file);
+	if (err) throw Error(err);
+
+	//Destination of each chunk in the hits buffer, checked here so that the decoding threads only decode
+	struct ChunkTarget {
+		const ResultChunkEntry *entry;
+		size_t offset; //In the hits buffer
+		size_t width, height; //Destination dimensions, cells outside those of the chunk are left untouched
+		Facet *texturedFacet; //Texture chunks: decoded aside, then their nonzero cells written to the facet's tiles
+	};
+	std::vector<ChunkTarget> targets;
+	const ResultChunkEntry *limitsEntry = NULL;
+	for (const ResultChunkEntry& entry : index) {
+		if (entry.offset > footer.indexOffset || entry.storedSize > footer.indexOffset - entry.offset
+			|| entry.width == 0 || entry.height == 0 || entry.rawSize != entry.width * entry.height * entry.elementSize
+			|| (entry.encoding == RESULT_ENCODING_ZERORUN && (entry.rawSize % sizeof(uint64_t) != 0 || entry.storedSize % sizeof(uint64_t) != 0))
+			|| (entry.encoding == RESULT_ENCODING_RAW && entry.storedSize != entry.rawSize)
+			|| entry.encoding > RESULT_ENCODING_ZERORUN) throw Error("Corrupt result chunk");
+		if (entry.type == RESULT_CHUNK_TEXTURE_LIMITS) {
+			if (entry.elementSize != sizeof(ResultTextureLimits) || entry.width * entry.height != 1) throw Error("Corrupt result chunk");
+			limitsEntry = &entry;
+			continue;
+		}
+		if (entry.facetId >= sh.nbFacet) throw Error("Result chunk of a facet that doesn't exist");
+		Facet *f = facets[entry.facetId];
+		ChunkTarget target;
+		target.entry = &entry;
+		target.offset = f->sh.hitOffset + sizeof(FacetHitBuffer);
+		target.texturedFacet = NULL;
+		switch (entry.type) {
+		case RESULT_CHUNK_PROFILE:
+			if (!f->sh.isProfile) continue;
+			if (entry.elementSize != sizeof(ProfileSlice)) throw Error("Profile chunk saved by a different build");
+			target.width = PROFILE_SIZE; target.height = 1;
+			break;
+		case RESULT_CHUNK_TEXTURE: //Like the text format, a texture of other dimensions (rounding) is loaded where it overlaps
+			if (!f->hasMesh) continue;
+			if (entry.elementSize != sizeof(TextureCell)) throw Error("Texture chunk saved by a different build");
+			target.texturedFacet = f;
+			target.width = f->sh.texWidth; target.height = f->sh.texHeight;
+			break;
+		case RESULT_CHUNK_SPECTRUM:
+			if (!f->sh.recordSpectrum) continue;
+			if (entry.elementSize != sizeof(ProfileSlice)) throw Error("Spectrum chunk saved by a different build");
+			target.offset = GetSpectrumOffset(f->sh);
+			target.width = SPECTRUM_SIZE; target.height = 1;
+			break;
+		default:
+			continue; //Chunk type of a newer version
+		}
+		targets.push_back(target);
+	}
+
+	prg->SetMessage("Loading results...");
+	AccessDataport(dpHit);
+	BYTE *buffer = (BYTE *)dpHit->buff;
+	GlobalHitBuffer *gHits = (GlobalHitBuffer *)buffer;
+
+	gHits->globalHits.hit.nbMCHit = loaded_nbMCHit;
+	gHits->globalHits.hit.nbHitEquiv = loaded_nbHitEquiv;
+	gHits->globalHits.hit.nbDesorbed = loaded_nbDesorption;
+	gHits->globalHits.hit.nbAbsEquiv = loaded_nbAbsEquiv;
+	gHits->nbLeakTotal = loaded_nbLeak;
+	gHits->globalHits.hit.fluxAbs = loaded_totalFlux;
+	gHits->globalHits.hit.powerAbs = loaded_totalPower;
+	gHits->distTraveledTotal = loaded_distTraveledTotal;
+
+	//Chunks are independent: each thread claims the next one, reads it with its own file handle and decodes it in place
+	//Texture chunks take tiles from the pool, one thread at a time
+	TexturePoolLayout texturePool = GetTexturePoolLayout();
+	std::mutex tileMutex;
+	std::atomic<size_t> nextChunk(0), nbDone(0), nbRunning(0);
+	size_t nbThreads = Min(Max((size_t)mApp->numCPU, (size_t)1), Max(targets.size(), (size_t)1));
+	std::vector<std::string> errors(nbThreads);
+	auto decodeChunks = [&](const size_t& threadId) {
+		FILE *f = fopen(fileName.c_str(), "rb");
+		if (!f) errors[threadId] = "Cannot open " + fileName + " to read the results";
+		std::vector<uint64_t> stored, decoded;
+		for (size_t i = nextChunk++; f && errors[threadId].empty() && i < targets.size(); i = nextChunk++) {
+			const ChunkTarget& target = targets[i];
+			const ResultChunkEntry& entry = *target.entry;
+			BYTE *dest = buffer + target.offset;
+			bool inPlace = (entry.width == target.width && entry.height == target.height) && !target.texturedFacet;
+			BYTE *raw = dest;
+			if (!inPlace) {
+				decoded.resize((entry.rawSize + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+				raw = (BYTE*)decoded.data();
+			}
+			bool ok = (_fseeki64(f, entry.offset, SEEK_SET) == 0);
+			if (ok && entry.encoding == RESULT_ENCODING_RAW) {
+				ok = fread(raw, 1, entry.rawSize, f) == entry.rawSize;
+			}
+			else if (ok) {
+				stored.resize(entry.storedSize / sizeof(uint64_t));
+				ok = fread(stored.data(), sizeof(uint64_t), stored.size(), f) == stored.size()
+					&& DecodeZeroRuns(stored.data(), stored.size(), (uint64_t*)raw, entry.rawSize / sizeof(uint64_t));
+			}
+			if (!ok) {
+				char tmp[256];
+				sprintf(tmp, "Cannot read the results of facet %zd", (size_t)entry.facetId + 1);
+				errors[threadId] = tmp;
+				break;
+			}
+			if (target.texturedFacet) { //Overlapping cells, the empty ones leave their tile unallocated
+				const TextureCell *cells = (const TextureCell *)raw;
+				std::lock_guard<std::mutex> lock(tileMutex);
+				for (size_t v = 0; v < Min(entry.height, target.height); v++) {
+					for (size_t u = 0; u < Min(entry.width, target.width); u++) {
+						const TextureCell& cell = cells[u + v * entry.width];
+						if (cell.count == 0 && cell.flux == 0.0 && cell.power == 0.0) continue;
+						TextureCell *shCell = GetTextureCellForWrite(buffer, target.texturedFacet->sh, texturePool, u, v);
+						if (shCell) *shCell = cell;
+						else texturePool.GetHeader(buffer)->nbLostHits += cell.count; //Pool full
+					}
+				}
+			}
+			else if (!inPlace) { //Overlapping rows
+				size_t rowBytes = Min(entry.width, target.width) * entry.elementSize;
+				for (size_t row = 0; row < Min(entry.height, target.height); row++)
+					memcpy(dest + row * target.width * entry.elementSize, raw + row * entry.width * entry.elementSize, rowBytes);
+			}
+			nbDone++;
+		}
+		if (f) fclose(f);
+		nbRunning--;
+	};
+	std::vector<std::thread> threads;
+	nbRunning = nbThreads;
+	for (size_t i = 0; i < nbThreads; i++) threads.emplace_back(decodeChunks, i);
+	while (nbRunning > 0) {
+		prg->SetProgress(targets.empty() ? 1.0 : (double)nbDone / (double)targets.size());
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	}
+	for (auto& t : threads) t.join();
+
+	if (limitsEntry) { //Tiny, read here
+		ResultTextureLimits limits;
+		FILE *f = fopen(fileName.c_str(), "rb");
+		bool ok = f && _fseeki64(f, limitsEntry->offset, SEEK_SET) == 0;
+		if (ok && limitsEntry->encoding == RESULT_ENCODING_RAW) ok = fread(&limits, sizeof(ResultTextureLimits), 1, f) == 1;
+		else if (ok) {
+			std::vector<uint64_t> stored(limitsEntry->storedSize / sizeof(uint64_t));
+			ok = fread(stored.data(), sizeof(uint64_t), stored.size(), f) == stored.size()
+				&& DecodeZeroRuns(stored.data(), stored.size(), (uint64_t*)&limits, sizeof(ResultTextureLimits) / sizeof(uint64_t));
+		}
+		if (f) fclose(f);
+		if (ok) {
+			gHits->hitMin.count = limits.minCount; gHits->hitMax.count = limits.maxCount;
+			gHits->hitMin.flux = limits.minFlux; gHits->hitMax.flux = limits.maxFlux;
+			gHits->hitMin.power = limits.minPower; gHits->hitMax.power = limits.maxPower;
+		}
+	}
+	ReleaseDataport(dpHit);
+
+	for (auto& error : errors)
+		if (!error.empty()) throw Error(error.c_str());
+}
+
+std::vector<std::string> SynradGeometry::LoadSYN(FileReader *file, GeometryLoadListener *listener, int *version, Worker *worker) {
+
+	listener->SetMessage("Clearing current geometry...");
 	Clear();
 
 	std::vector<std::string> result;
 
 	// Globals
 	char tmp[512];
-	prg->SetMessage("Reading SYN file header...");
+	listener->SetMessage("Reading SYN file header...");
 	file->ReadKeyword("version"); file->ReadKeyword(":");
 	*version = file->ReadInt();
 	if (*version > SYNVERSION) {
@@ -1565,6 +2039,15 @@ std::vector<std::string> SynradGeometry::LoadSYN(FileReader *file, GLProgress *p
 	}
 	file->ReadKeyword("maxDes"); file->ReadKeyword(":");
 	loaded_desorptionLimit = file->ReadSizeT();
+	if (*version >= 11) {
+		file->ReadKeyword("resultFormat"); file->ReadKeyword(":");
+		loaded_resultFormat = file->ReadInt();
+		if (loaded_resultFormat != RESULT_FORMAT_TEXT && loaded_resultFormat != RESULT_FORMAT_CHUNKS) {
+			sprintf(tmp, "Unknown result format %d", loaded_resultFormat);
+			throw Error(file->MakeError(tmp));
+		}
+	}
+	else loaded_resultFormat = RESULT_FORMAT_TEXT;
 	file->ReadKeyword("nbVertex"); file->ReadKeyword(":");
 	sh.nbVertex = file->ReadInt();
 	file->ReadKeyword("nbFacet"); file->ReadKeyword(":");
@@ -1626,27 +2109,26 @@ std::vector<std::string> SynradGeometry::LoadSYN(FileReader *file, GLProgress *p
 		v.vRight = file->ReadDouble();
 		v.vTop = file->ReadDouble();
 		v.vBottom = file->ReadDouble();
-		mApp->AddView(tmpName, v);
+		listener->AddView(tmpName, v);
 	}
 	file->ReadKeyword("}");
 
 	file->ReadKeyword("selections"); file->ReadKeyword("{");
 	for (int i = 0; i < nbS; i++) {
-		SelectionGroup s;
+		std::vector<size_t> selection;
 		char tmpName[256];
 		strcpy(tmpName, file->ReadString());
-		s.name = _strdup(tmpName);
 		int nbSel = file->ReadInt();
 
 		for (int j = 0; j < nbSel; j++) {
-			s.selection.push_back(file->ReadInt());
+			selection.push_back(file->ReadInt());
 		}
-		mApp->AddSelection(s);
+		listener->AddSelection(tmpName, selection);
 	}
 	file->ReadKeyword("}");
 
 	for (int i = 0; i < nbF; i++) { //parse formulas now that selection groups are loaded
-		mApp->AddFormula(loadFormulas[i][0].c_str(), loadFormulas[i][1].c_str());
+		listener->AddFormula(loadFormulas[i][0].c_str(), loadFormulas[i][1].c_str());
 	}
 
 	file->ReadKeyword("structures"); file->ReadKeyword("{");
@@ -1664,7 +2146,7 @@ std::vector<std::string> SynradGeometry::LoadSYN(FileReader *file, GLProgress *p
     vertices3.resize(sh.nbVertex); vertices3.shrink_to_fit();
 
 	// Read vertices
-	prg->SetMessage("Reading vertices...");
+	listener->SetMessage("Reading vertices...");
 	file->ReadKeyword("vertices"); file->ReadKeyword("{");
 	for (int i = 0; i < sh.nbVertex; i++) {
 		// Check idx
@@ -1676,7 +2158,7 @@ std::vector<std::string> SynradGeometry::LoadSYN(FileReader *file, GLProgress *p
 		vertices3[i].selected = false;
 	}
 	file->ReadKeyword("}");
-	prg->SetMessage("Reading leaks and hits...");
+	listener->SetMessage("Reading leaks and hits...");
 	// Read leaks
 	file->ReadKeyword("leaks"); file->ReadKeyword("{");
 	file->ReadKeyword("nbLeak"); file->ReadKeyword(":");
@@ -1722,7 +2204,7 @@ std::vector<std::string> SynradGeometry::LoadSYN(FileReader *file, GLProgress *p
 	}
 	file->ReadKeyword("}");
 	// Read facets
-	prg->SetMessage("Reading facets...");
+	listener->SetMessage("Reading facets...");
 	for (int i = 0; i < sh.nbFacet; i++) {
 		file->ReadKeyword("facet");
 		// Check idx
@@ -1737,23 +2219,23 @@ std::vector<std::string> SynradGeometry::LoadSYN(FileReader *file, GLProgress *p
 			sprintf(errMsg, "Facet %d has only %d vertices. ", i, nbI);
 			throw Error(errMsg);
 		}
-		prg->SetProgress((float)i / sh.nbFacet);
+		listener->SetProgress((float)i / sh.nbFacet);
 		facets[i] = new Facet(nbI);
-		facets[i]->LoadSYN(file, mApp->worker.materials, *version, sh.nbVertex);
+		facets[i]->LoadSYN(file, worker->materials, *version, sh.nbVertex);
 		file->ReadKeyword("}");
 	}
 
-	prg->SetMessage("Initalizing geometry and building mesh...");
+	listener->SetMessage("Initalizing geometry and building mesh...");
 	InitializeGeometry();
 	//AdjustProfile();
 	//isLoaded = true; //InitializeGeometry() already sets it to true
 	UpdateName(file);
 
 	// Update mesh
-	prg->SetMessage("Building mesh...");
+	listener->SetMessage("Building mesh...");
 	for (size_t i = 0; i < sh.nbFacet; i++) {
 		double p = (double)i / (double)sh.nbFacet;
-		prg->SetProgress(p);
+		listener->SetProgress(p);
 		Facet *f = facets[i];
 		if (!f->SetTexture(f->sh.texWidthD, f->sh.texHeightD, f->hasMesh)) {
 			char errMsg[512];
@@ -1809,11 +2291,7 @@ void SynradGeometry::LoadSpectrumSYN(FileReader *file, Dataport *dpHit, const in
 	for (size_t j = 0; j < PROFILE_SIZE; j++) {
 		for (size_t i = 0; i < nbSpectrum; i++) {
 			Facet *f = GetFacet(facetsWithSpectrum[i]);
-			size_t profileSize = f->sh.isProfile ? PROFILE_SIZE*sizeof(ProfileSlice) : 0;
-			size_t textureSize = f->sh.texWidth*f->sh.texHeight*sizeof(TextureCell);
-			size_t directionSize = f->sh.countDirection ? f->sh.texWidth*f->sh.texHeight*sizeof(DirectionCell) : 0;
-			ProfileSlice *shSpectrum = (ProfileSlice *)(buffer + (f->sh.hitOffset + sizeof(FacetHitBuffer) + profileSize
-				+ textureSize + directionSize));
+			ProfileSlice *shSpectrum = (ProfileSlice *)(buffer + GetSpectrumOffset(f->sh));
 			
 			if (version >= 10) shSpectrum[j].count_absorbed = file->ReadSizeT();
 			if (version >= 10) shSpectrum[j].count_incident = file->ReadSizeT();
@@ -1882,12 +2360,8 @@ void SynradGeometry::SaveSpectrumSYN(FileWriter *file, Dataport *dpHit, int supe
 	for (size_t sliceId = 0; sliceId < SPECTRUM_SIZE; sliceId++) {
 		for (auto facetId : spectrumFacetIds) {  //doesn't execute when crashSave or saveSelected...
 			Facet *f = GetFacet(facetId);
-			size_t profileSize = (f->sh.isProfile) ? PROFILE_SIZE*sizeof(ProfileSlice) : 0;
-			size_t textureSize = f->sh.texWidth*f->sh.texHeight*sizeof(TextureCell);
-			size_t directionSize = f->sh.countDirection*f->sh.texWidth*f->sh.texHeight*sizeof(DirectionCell);
 			ProfileSlice *shSpectrum;
-			if (!crashSave) shSpectrum = (ProfileSlice *)(buffer + (f->sh.hitOffset + sizeof(FacetHitBuffer) + profileSize
-				+ textureSize + directionSize));
+			if (!crashSave) shSpectrum = (ProfileSlice *)(buffer + GetSpectrumOffset(f->sh));
 
 			file->Write((!crashSave) ? shSpectrum[sliceId].count_absorbed : 0); file->Write("\t");
 			file->Write((!crashSave) ? shSpectrum[sliceId].count_incident : 0); file->Write("\t");
@@ -1907,7 +2381,7 @@ bool SynradGeometry::SaveXML_simustate(pugi::xml_node saveDoc, Worker *work, BYT
 	LEAK *leakCache, HIT *hitCache, GLProgress *prg, bool saveSelected){
 	return false;
 }
-void SynradGeometry::LoadXML_geom(pugi::xml_node loadXML, Worker *work, GLProgress *progressDlg){
+void SynradGeometry::LoadXML_geom(pugi::xml_node loadXML, Worker *work, GeometryLoadListener *listener){
 	//mApp->ClearAllSelections();
 	//mApp->ClearAllViews();
 	//mApp->ClearFormula();
@@ -1976,12 +2450,11 @@ void SynradGeometry::LoadXML_geom(pugi::xml_node loadXML, Worker *work, GLProgre
 	//int nbS = selNode.select_nodes("Selection").size();
 
 	for (xml_node sNode : selNode.children("Selection")) {
-		SelectionGroup s;
-		s.name = _strdup(sNode.attribute("name").as_string());
-		s.selection.reserve(sNode.select_nodes("selItem").size());
+		std::vector<size_t> selection;
+		selection.reserve(sNode.select_nodes("selItem").size());
 		for (xml_node iNode : sNode.children("selItem"))
-			s.selection.push_back(iNode.attribute("facet").as_llong());
-		mApp->AddSelection(s);
+			selection.push_back(iNode.attribute("facet").as_llong());
+		listener->AddSelection(sNode.attribute("name").as_string(), selection);
 	}
 
 	xml_node viewNode = interfNode.child("Views");
@@ -2007,13 +2480,13 @@ void SynradGeometry::LoadXML_geom(pugi::xml_node loadXML, Worker *work, GLProgre
 		v.vRight = newView.attribute("vRight").as_double();
 		v.vTop = newView.attribute("vTop").as_double();
 		v.vBottom = newView.attribute("vBottom").as_double();
-		mApp->AddView(v.name, v);
+		listener->AddView(v.name, v);
 	}
 
 	if (isSynradFile) {
 		xml_node formulaNode = interfNode.child("Formulas");
 		for (xml_node newFormula : formulaNode.children("Formula")) {
-			mApp->AddFormula(newFormula.attribute("name").as_string(),
+			listener->AddFormula(newFormula.attribute("name").as_string(),
 				newFormula.attribute("expression").as_string());
 		}
 	}
@@ -2023,11 +2496,11 @@ void SynradGeometry::LoadXML_geom(pugi::xml_node loadXML, Worker *work, GLProgre
 	//isLoaded = true; //InitializeGeometry() already sets it to true
 
 	// Update mesh
-	progressDlg->SetMessage("Building mesh...");
+	listener->SetMessage("Building mesh...");
 	for (int i = 0; i < sh.nbFacet; i++) {
 		double p = (double)i / (double)sh.nbFacet;
 
-		progressDlg->SetProgress(p);
+		listener->SetProgress(p);
 		Facet *f = facets[i];
 		if (!f->SetTexture(f->sh.texWidthD, f->sh.texHeightD, f->hasMesh)) {
 			char errMsg[512];
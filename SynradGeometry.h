@@ -21,13 +21,27 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 
 #include "Geometry_shared.h"
 #include "Region_full.h"
+#include "ResultChunks.h"
+#include "RunSettings.h"
+#include "GeometryViewer.h" //AVIEW
 #include <cereal/archives/json.hpp>
 
-#define SYNVERSION   10
+#define SYNVERSION   11
 
 #define PARAMVERSION 4
 class Worker;
 class Material;
+struct LoaderHeader;
+
+class GeometryLoadListener { //What a geometry file hands to its reader besides the geometry: progress, views, selections and formulas. Ignored by default (synradCLI)
+public:
+	virtual ~GeometryLoadListener() {}
+	virtual void SetMessage(const char *message) {}
+	virtual void SetProgress(const double& progress) {}
+	virtual void AddView(const char *name, const AVIEW& view) {}
+	virtual void AddSelection(const char *name, const std::vector<size_t>& facetIds) {}
+	virtual void AddFormula(const char *name, const char *expression) {}
+};
 
 class SynradGeometry: public Geometry {
 
@@ -41,7 +55,7 @@ private:
 public:
 	SynradGeometry();
 	void LoadGEO(FileReader *file, GLProgress *prg, int *version, Worker *worker);
-	std::vector<std::string> LoadSYN(FileReader *file, GLProgress *prg, int *version, Worker *worker);
+	std::vector<std::string> LoadSYN(FileReader *file, GeometryLoadListener *listener, int *version, Worker *worker); //Returns the PAR files of the regions, doesn't load them
 	bool LoadTextures(FileReader *file, GLProgress *prg, Dataport *dpHit, int version);
 	std::vector<std::string> InsertSYN(FileReader *file, GLProgress *prg, bool newStr);
 	void SaveTXT(FileWriter *file, Dataport *dhHit, bool saveSelected);
@@ -49,11 +63,14 @@ public:
 	void SaveDesorption(FILE *file, Dataport *dhHit, bool selectedOnly, int mode, double eta0, double alpha, const Distribution2D &distr); //Deprecated, not used anymore
 
 	//void SaveGEO(FileWriter *file,GLProgress *prg,Dataport *dpHit,bool saveSelected,LEAK *pleak,int *nbleakSave,HIT *hitCache,int *nbHHitSave,bool crashSave=false);
-	void SaveSYN(FileWriter *file, GLProgress *prg, Dataport *dpHit, bool saveSelected, LEAK *leakCache, size_t *nbLeakTotal, HIT *hitCache, size_t *nbHitSave, bool crashSave = false);
+	void SaveSYN(FileWriter *file, GLProgress *prg, Dataport *dpHit, bool saveSelected, LEAK *leakCache, size_t *nbLeakTotal, HIT *hitCache, size_t *nbHitSave, bool crashSave = false,
+		int resultFormat = RESULT_FORMAT_TEXT, bool hitsLocked = false); //RESULT_FORMAT_CHUNKS: no results in the text part, call SaveResultChunks() once the text is written. hitsLocked: dpHit held by the caller
+	void SaveResultChunks(FILE *file, GLProgress *prg, const BYTE *hitBuffer); //Appends the binary result section (see ResultChunks.h), hitBuffer: contents of dpHit, locked by the caller
+	void LoadResultChunks(const std::string& fileName, GLProgress *prg, Dataport *dpHit); //Decodes the binary result section in parallel, straight into the hits buffer
 	void SaveXML_geometry(pugi::xml_node saveDoc, Worker *work, GLProgress *prg, bool saveSelected);
 	bool SaveXML_simustate(pugi::xml_node saveDoc, Worker *work, BYTE *buffer, GlobalHitBuffer *gHits, int nbLeakSave, int nbHHitSave,
 		LEAK *leakCache, HIT *hitCache, GLProgress *prg, bool saveSelected);
-	void LoadXML_geom(pugi::xml_node loadXML, Worker *work, GLProgress *progressDlg);
+	void LoadXML_geom(pugi::xml_node loadXML, Worker *work, GeometryLoadListener *listener);
 	void InsertXML(pugi::xml_node loadXML, Worker *work, GLProgress *progressDlg, bool newStr);
 	bool LoadXML_simustate(pugi::xml_node loadXML, Dataport *dpHit, Worker *work, GLProgress *progressDlg);
 	void BuildPipe(double L, double R, double s, int step);
@@ -62,10 +79,15 @@ public:
 	size_t GetGeometrySize(std::vector<Region_full> &regions, std::vector<Material> &materials, 
 		std::vector<std::vector<double>> &psi_distro, std::vector<std::vector<std::vector<double>>> &chi_distros,
 		const std::vector<std::vector<double>>& parallel_polarization);
-	size_t GetHitsSize();
+	size_t GetHitsSize(); //Facets, then the tagged and energy band tallies, then the texture pool
+	std::vector<TallyLayout> GetTallyLayouts(); //By facet index, from the run settings
+	TexturePoolLayout GetTexturePoolLayout(); //After the tallies, from the run settings
 	void CopyGeometryBuffer(BYTE *buffer, std::vector<Region_full> &regions, std::vector<Material> &materials,
 		std::vector<std::vector<double>> &psi_distro, const std::vector<std::vector<std::vector<double>>> &chi_distros,
 		const std::vector<std::vector<double>> &parallel_polarization, const bool& newReflectionModel, const OntheflySimulationParams& ontheflyParams);
+	size_t GetLoaderLayout(LoaderHeader& header, Worker *work, const RunSettings& settings); //Sizes the sections of the flat loader buffer (see LoaderFormat.h), returns the total size
+	void CopyLoaderBuffer(void *buffer, const LoaderHeader& header, Worker *work, const RunSettings& settings); //Fills a buffer laid out by GetLoaderLayout()
+	void SaveLoaderFile(FILE *file, Worker *work, const RunSettings& settings); //Writes the loader buffer as a simulation input file for synradCLI
 #pragma endregion
 
 #pragma region GeometryRender.cpp
@@ -78,6 +100,7 @@ public:
 	double loaded_totalFlux;
 	double loaded_totalPower;
 	double loaded_no_scans;
+	int loaded_resultFormat;
 
 };
 
@@ -0,0 +1,110 @@
+/*
+Program:     MolFlow+ / Synrad+
+Description: Monte Carlo simulator for ultra-high vacuum and synchrotron radiation
+Authors:     Jean-Luc PONS / Roberto KERSEVAN / Marton ADY
+Copyright:   E.S.R.F / CERN
+Website:     https://cern.ch/molflow
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
+*/
+#include "SynradLibrary.h"
+#include "Worker.h"
+#include "File.h"
+#include <algorithm> //std::sort
+#ifdef WIN
+#include <io.h> //_findfirst
+#else
+#include <dirent.h>
+#endif
+
+std::vector<std::string> FindMaterialFiles() {
+	std::vector<std::string> fileNames;
+#ifdef WIN
+	intptr_t file;
+	_finddata_t filedata;
+	file = _findfirst(MATERIALS_DIR "*.csv", &filedata);
+	if (file != -1)
+	{
+		do
+		{
+			fileNames.push_back(filedata.name);
+		} while (_findnext(file, &filedata) == 0);
+	}
+	_findclose(file);
+#else
+	DIR *dir = opendir(MATERIALS_DIR);
+	if (dir) {
+		while (dirent *entry = readdir(dir)) {
+			std::string name = entry->d_name;
+			if (FileUtils::GetExtension(name) == "csv") fileNames.push_back(name);
+		}
+		closedir(dir);
+	}
+	std::sort(fileNames.begin(), fileNames.end()); //_findfirst() lists NTFS directories alphabetically, material indexes must match
+#endif
+	return fileNames;
+}
+
+void LoadMaterials(Worker *worker, const std::vector<std::string>& fileNames) {
+	for (auto& fileName : fileNames) {
+		try {
+			std::string name = fileName;
+			worker->AddMaterial(&name);
+		}
+		catch (Error &e) {
+			char errMsg[512];
+			sprintf(errMsg, "Failed to load material reflection file:\n%s\n%s", fileName.c_str(), e.GetMsg());
+			throw Error(errMsg);
+		}
+	}
+}
+
+void LoadDistributions(Worker *worker) {
+	FileReader *f = NULL;
+	try {
+		worker->chi_distros.resize(3);
+
+		f = new FileReader(DISTRIBUTIONS_DIR "sum_psi_distr_0to4perlambdar_0.35_delta5E-3_full_pol.csv");
+		//vertical (psi) distribution for different e_crit/e values
+		//each row is for a logarithm of lambda_ratio, starting from -10 to +2
+		//each column is for a psi angle, starting from 0 going to 1, with a delta of 0.005
+		//where 1 corresponds to 4/lambda_ratio^0.35
+		worker->psi_distro = worker->ImportCSV_double(f);
+		SAFE_DELETE(f);
+		f = new FileReader(DISTRIBUTIONS_DIR "psi_chi_gamma10000_logsampled_-7to0_delta0.02_full_pol.csv");
+		//each column corresponds to a Log10[PSI*(gamma/10000)] value. First column: -99, second column: -7, delta: 0.02, max: 0
+		//each row corresponds to a    Log10[CHI*(gamma/10000)] value. First column: -7,                     delta: 0.02, max: 0
+		worker->chi_distros[0] = worker->ImportCSV_double(f);
+		SAFE_DELETE(f);
+
+		//Parallel polarization
+		f = new FileReader(DISTRIBUTIONS_DIR "psi_chi_gamma10000_logsampled_-7to0_delta0.02_par_pol.csv");
+		worker->chi_distros[1] = worker->ImportCSV_double(f);
+		SAFE_DELETE(f);
+
+		//Orthogonal polarization
+		f = new FileReader(DISTRIBUTIONS_DIR "psi_chi_gamma10000_logsampled_-7to0_delta0.02_ort_pol.csv");
+		worker->chi_distros[2] = worker->ImportCSV_double(f);
+		SAFE_DELETE(f);
+
+		f = new FileReader(DISTRIBUTIONS_DIR "degree_of_parallel_polarization_0to4perlambdar_0.35_delta5E-3.csv");
+		worker->parallel_polarization = worker->ImportCSV_double(f);
+		SAFE_DELETE(f);
+	}
+	catch (Error &e) {
+		SAFE_DELETE(f);
+		char errMsg[512];
+		sprintf(errMsg, "Failed to load angular distribution file.\nIt should be in the " DISTRIBUTIONS_DIR " directory.\n%s", e.GetMsg());
+		throw Error(errMsg);
+	}
+}
@@ -0,0 +1,35 @@
+/*
+Program:     MolFlow+ / Synrad+
+Description: Monte Carlo simulator for ultra-high vacuum and synchrotron radiation
+Authors:     Jean-Luc PONS / Roberto KERSEVAN / Marton ADY
+Copyright:   E.S.R.F / CERN
+Website:     https://cern.ch/molflow
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
+*/
+#pragma once
+
+//Material reflectivity tables and synchrotron radiation angular distributions shipped in the param directory,
+//loaded by the interface at startup and by synradCLI. No dialogs: failures are thrown as Error
+
+#include <string>
+#include <vector>
+
+class Worker;
+
+#define MATERIALS_DIR     "param/Materials/"
+#define DISTRIBUTIONS_DIR "param/Distributions/"
+
+std::vector<std::string> FindMaterialFiles(); //Names (without path) of the *.csv tables in MATERIALS_DIR, in alphabetical order
+void LoadMaterials(Worker *worker, const std::vector<std::string>& fileNames); //Appends them to worker->materials, the error names the file that failed
+void LoadDistributions(Worker *worker); //psi, chi and parallel polarization tables of the photon generation
@@ -34,14 +34,15 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #include <Process.h> // For _getpid()
 #endif
 
-// Global process variables
-Simulation* sHandle; //Global handle to simulation, one per subprocess
+// Process variables
+static Simulation* sHandle; //Geometry and simulation threads of this subprocess, only accessed from the main loop
 
 #define WAITTIME    100  // Answer in STOP mode
 
 static Dataport *dpControl=NULL;
 static Dataport *dpHit=NULL;
 static Dataport *dpLog = NULL;
+static Dataport *dpProfile = NULL; //Phase profile of this subprocess, read by Global Settings
 static int       prIdx;
 static size_t    prState;
 static size_t    prParam;
@@ -51,6 +52,7 @@ static char      ctrlDpName[32];
 static char      loadDpName[32];
 static char      hitsDpName[32];
 static char		 logDpName[32];
+static char      profDpName[32];
 
 bool end = false;
 bool IsProcessRunning(DWORD pid);
@@ -121,7 +123,7 @@ void SetErrorSub(const char *message) {
 char *GetSimuStatus() {
 
   static char ret[128];
-  size_t count = sHandle->totalDesorbed;
+  size_t count = sHandle->GetTotalDesorbed();
   size_t max   = sHandle->ontheflyParams.desorptionLimit / sHandle->ontheflyParams.nbProcess;
 
       if( max!=0 ) {
@@ -130,6 +132,8 @@ char *GetSimuStatus() {
       } else {
         sprintf(ret,"(%s) MC %I64d",sHandle->sh.name.c_str(),count);
       }
+      double worst = sHandle->precision.GetWorstRatio(); //Worst target: achieved/requested error
+      if (worst >= 0.0) sprintf(ret + strlen(ret), " err %.2fx", worst);
 
   return ret;
 
@@ -160,7 +164,7 @@ void Load() {
   
   printf("Connected to %s\n",loadDpName);
 
-  if( !LoadSimulation(loader) ) {
+  if( !LoadSimulation(sHandle,loader) ) {
     CLOSEDP(loader);
     return;
   }
@@ -181,7 +185,7 @@ void Load() {
 
 
   // Connect to hit dataport
-  hSize = GetHitsSize();
+  hSize = GetHitsSize(sHandle);
   dpHit = OpenDataport(hitsDpName,hSize);
   if( !dpHit ) {
     SetErrorSub("Failed to connect to 'hits' dataport");
@@ -207,7 +211,7 @@ bool UpdateParams() {
 
 	printf("Connected to %s\n", loadDpName);
 
-	bool result = UpdateOntheflySimuParams(loader);
+	bool result = UpdateOntheflySimuParams(sHandle, loader);
 	CLOSEDP(loader);
 
 	if (sHandle->ontheflyParams.enableLogging) {
@@ -220,13 +224,25 @@ bool UpdateParams() {
 		}
 		//*((size_t*)dpLog->buff) = 0; //Autofill with 0, besides we would need access first
 	}
-	sHandle->tmpParticleLog.clear();
-	sHandle->tmpParticleLog.shrink_to_fit();
-	if (sHandle->ontheflyParams.enableLogging) sHandle->tmpParticleLog.reserve(sHandle->ontheflyParams.logLimit / sHandle->ontheflyParams.nbProcess);
+	for (auto& t : sHandle->threads) {
+		t->tmpParticleLog.clear();
+		t->tmpParticleLog.shrink_to_fit();
+		if (sHandle->ontheflyParams.enableLogging) t->tmpParticleLog.reserve(sHandle->ontheflyParams.logLimit / sHandle->ontheflyParams.nbProcess / sHandle->nbThreads);
+	}
 
 	return result;
 }
 
+void PublishProfile() {
+	if (!dpProfile) return;
+	PhaseProfile profile;
+	sHandle->GetPhaseProfile(profile);
+	if (AccessDataport(dpProfile)) {
+		memcpy(dpProfile->buff, &profile, sizeof(PhaseProfile));
+		ReleaseDataport(dpProfile);
+	}
+}
+
 int main(int argc,char* argv[])
 {
   bool eos = false;
@@ -243,6 +259,7 @@ int main(int argc,char* argv[])
   sprintf(loadDpName,"SNRDLOAD%s",argv[1]);
   sprintf(hitsDpName,"SNRDHITS%s",argv[1]);
   sprintf(logDpName, "SNRDLOG%s", argv[1]);
+  sprintf(profDpName, "SNRDPROF%s_%d", argv[1], prIdx);
 
   dpControl = OpenDataport(ctrlDpName,sizeof(SHCONTROL));
   if( !dpControl ) {
@@ -252,7 +269,12 @@ int main(int argc,char* argv[])
 
   printf("Connected to %s (%zd bytes), synradSub.exe #%d\n",ctrlDpName,sizeof(SHCONTROL),prIdx);
 
+  dpProfile = CreateDataport(profDpName, sizeof(PhaseProfile)); //Optional, the simulation runs without it
+  if (!dpProfile) printf("Cannot create profile dataport %s, profiling disabled\n", profDpName);
+
   InitSimulation();
+  sHandle = new Simulation();
+  sHandle->processIndex = (size_t)prIdx;
 
   // Sub process ready
   SetReady();
@@ -289,7 +311,7 @@ int main(int argc,char* argv[])
       case COMMAND_START:
         printf("COMMAND: START (%zd,%I64d)\n",prParam,prParam2);
         if( sHandle->loadOK ) {
-          if( StartSimulation() )
+          if( StartSimulation(sHandle) )
             SetState(PROCESS_RUN,GetSimuStatus());
           else {
             if( GetLocalState()!=PROCESS_ERROR )
@@ -303,14 +325,15 @@ int main(int argc,char* argv[])
         printf("COMMAND: PAUSE (%zd,%I64d)\n",prParam,prParam2);
         if( !sHandle->lastHitUpdateOK ) {
           // Last update not successful, retry with a longer tomeout
-			if (dpHit && (GetLocalState() != PROCESS_ERROR)) UpdateHits(dpHit,dpLog,prIdx,60000);
+			if (dpHit && (GetLocalState() != PROCESS_ERROR)) UpdateHits(sHandle,dpHit,dpLog,prIdx,60000);
         }
         SetReady();
         break;
 
       case COMMAND_RESET:
           printf("COMMAND: RESET (%zd,%I64d)\n",prParam,prParam2);
-        ResetSimulation();
+        ResetSimulation(sHandle);
+        PublishProfile();
         SetReady();
         break;
 
@@ -321,7 +344,7 @@ int main(int argc,char* argv[])
 
       case COMMAND_CLOSE:
         printf("COMMAND: CLOSE (%zd,%I64d)\n",prParam,prParam2);
-        ClearSimulation();
+        ClearSimulation(sHandle);
         CLOSEDP(dpHit);
 		CLOSEDP(dpLog);
         SetReady();
@@ -329,9 +352,17 @@ int main(int argc,char* argv[])
 
       case PROCESS_RUN:
         SetStatus(GetSimuStatus()); //update hits only
-        eos = SimulationRun();      // Run during 1 sec
-        if(dpHit && (GetLocalState()!=PROCESS_ERROR)) UpdateHits(dpHit,dpLog,prIdx,20); // Update hit with 20ms timeout. If fails, probably an other subprocess is updating, so we'll keep calculating and try it later (latest when the simulation is stopped).
-        if(eos) {
+        eos = SimulationRun(sHandle);      // Run during 1 sec on every thread
+        if(dpHit && (GetLocalState()!=PROCESS_ERROR)) UpdateHits(sHandle,dpHit,dpLog,prIdx,20); // Update hit with 20ms timeout. If fails, probably an other subprocess is updating, so we'll keep calculating and try it later (latest when the simulation is stopped).
+        PublishProfile();
+        if (!eos && sHandle->lastHitUpdateOK && sHandle->precision.TargetsReached(sHandle->ontheflyParams.nbProcess)) {
+          //Every error target reached, the rest of this process's share isn't needed
+          if (GetLocalState() != PROCESS_ERROR) {
+            SetState(PROCESS_DONE, GetSimuStatus());
+            printf("COMMAND: PROCESS_DONE (Precision reached)\n");
+          }
+        }
+        else if(eos) {
           if( GetLocalState()!=PROCESS_ERROR ) {
             // Max desorption reached
             SetState(PROCESS_DONE,GetSimuStatus());
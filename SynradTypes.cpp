@@ -18,6 +18,7 @@ GNU General Public License for more details.
 Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 */
 #include <math.h>
+#include <algorithm> //std::fill
 #include "SynradTypes.h"
 #include "GLApp/MathTools.h"
 #include "File.h" //Error
@@ -76,6 +77,12 @@ void Histogram::Add(const double &x,const ProfileSlice &increment) {
 	}
 }
 
+Histogram& Histogram::operator+=(const Histogram& rhs) {
+	for (size_t i = 0; i < counts.size() && i < rhs.counts.size(); i++)
+		counts[i] += rhs.counts[i];
+	return *this;
+}
+
 ProfileSlice Histogram::GetCounts(size_t index){
 	return counts[index];
 }
@@ -93,7 +100,7 @@ double Histogram::GetX(size_t index){
 }
 
 void Histogram::ResetCounts(){
-    std::vector<ProfileSlice>(counts.size()).swap(counts);
+    std::fill(counts.begin(), counts.end(), ProfileSlice()); //in place, no reallocation
 }
 
 ProfileSlice & ProfileSlice::operator+=(const ProfileSlice & rhs)
@@ -140,6 +140,7 @@ public:
 	//double GetNormalized(int index);
 	double GetX(size_t index);
 	void Add(const double &x,const ProfileSlice &increment);
+	Histogram& operator+=(const Histogram& rhs); //Bin by bin, rhs must have the same binning
 	bool logarithmic;
 	void ResetCounts();
 };
\ No newline at end of file
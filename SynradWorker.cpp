@@ -20,7 +20,9 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #include "Worker.h"
 #include "Facet_shared.h"
 #include "SynradGeometry.h"
+#include "LoaderFormat.h"
 #include "SynradDistributions.h"
+#include "SynradLibrary.h"
 #include "SynradFacet.h"
 #include "GLApp/GLApp.h"
 #include "GLApp/GLMessageBox.h"
@@ -205,7 +207,31 @@ void Worker::SaveGeometry(std::string fileName,GLProgress *prg,bool askConfirm,b
 						SaveRegion((char*)regions[i].fileName.c_str(),i,true); //save with forced overwrite
 					}
 
-					geom->SaveSYN(f,prg,dpHit,saveSelected,globalHitCache.leakCache,(&globalHitCache.leakCacheSize),globalHitCache.hitCache,&(globalHitCache.hitCacheSize),crashSave);
+					//Results in binary chunks after the text part, unless text results are chosen (Global Settings) or there are none to save
+					int resultFormat = (!crashSave && !saveSelected && !mApp->saveTextResults) ? RESULT_FORMAT_CHUNKS : RESULT_FORMAT_TEXT;
+					if (resultFormat == RESULT_FORMAT_CHUNKS) {
+						AccessDataport(dpHit); //One lock for the totals of the text part and the binary results: both of the same moment
+						try {
+							geom->SaveSYN(f,prg,dpHit,saveSelected,globalHitCache.leakCache,(&globalHitCache.leakCacheSize),globalHitCache.hitCache,&(globalHitCache.hitCacheSize),crashSave,resultFormat,true);
+							SAFE_DELETE(f); //Flushes the text part
+							FILE *binFile = fopen(isSYN7Z ? fileNameWithSyn.c_str() : fileName.c_str(), "ab");
+							if (!binFile) throw Error("Cannot reopen the file to append the results");
+							try {
+								geom->SaveResultChunks(binFile, prg, (const BYTE *)dpHit->buff);
+							}
+							catch (Error &e) {
+								fclose(binFile);
+								throw e;
+							}
+							fclose(binFile);
+						}
+						catch (Error &e) {
+							ReleaseDataport(dpHit);
+							throw e;
+						}
+						ReleaseDataport(dpHit);
+					}
+					else geom->SaveSYN(f,prg,dpHit,saveSelected,globalHitCache.leakCache,(&globalHitCache.leakCacheSize),globalHitCache.hitCache,&(globalHitCache.hitCacheSize),crashSave,resultFormat);
 				}
 			}
 			if (!autoSave && !saveSelected) {
@@ -349,6 +375,23 @@ void Worker::ExportDesorption(char *fileName,bool selectedOnly,int mode,double e
 }
 */
 
+class InterfaceLoadListener : public GeometryLoadListener { //Progress in the load dialog, views, selections and formulas to the interface
+public:
+	InterfaceLoadListener(GLProgress *prg) : prg(prg) {}
+	void SetMessage(const char *message) { prg->SetMessage(message); }
+	void SetProgress(const double& progress) { prg->SetProgress(progress); }
+	void AddView(const char *name, const AVIEW& view) { mApp->AddView(name, view); }
+	void AddSelection(const char *name, const std::vector<size_t>& facetIds) {
+		SelectionGroup s;
+		s.name = _strdup(name);
+		s.selection = facetIds;
+		mApp->AddSelection(s);
+	}
+	void AddFormula(const char *name, const char *expression) { mApp->AddFormula(name, expression); }
+private:
+	GLProgress *prg;
+};
+
 void Worker::LoadGeometry(const std::string& fileName, bool insert, bool newStr) {
 	if (!insert) {
 		needsReload=true;
@@ -367,6 +410,7 @@ void Worker::LoadGeometry(const std::string& fileName, bool insert, bool newStr)
 	// Read a file
 	FileReader *f = NULL;
 	GLProgress *progressDlg = new GLProgress("Reading file...","Please wait");
+	InterfaceLoadListener listener(progressDlg);
 	progressDlg->SetVisible(true);
 	progressDlg->SetProgress(0.0);
 
@@ -494,7 +538,7 @@ void Worker::LoadGeometry(const std::string& fileName, bool insert, bool newStr)
 				progressDlg->SetMessage("Resetting worker...");
 				ResetWorkerStats();
 				
-				regionsToLoad = geom->LoadSYN(f, progressDlg, &version, this);
+				regionsToLoad = geom->LoadSYN(f, &listener, &version, this);
 				//copy temp values from geom to worker. They will be sent to shared memory in LoadTextures() which connects to dpHit
 				globalHitCache.nbLeakTotal = geom->loaded_nbLeak;
                 globalHitCache.globalHits.hit.nbMCHit = geom->loaded_nbMCHit;
@@ -518,7 +562,7 @@ void Worker::LoadGeometry(const std::string& fileName, bool insert, bool newStr)
 				bool loadThem = ( GLMessageBox::Display(tmp,"File load",GLDLG_OK|GLDLG_CANCEL,GLDLG_ICONINFO)==GLDLG_OK );
 				if (loadThem) {
 					progressDlg->SetMessage("Loading regions");
-					int i = 0;
+					std::vector<std::string> regionPaths;
 					for (auto&& regionFileName:regionsToLoad) {
 						std::string toLoad;
 						if (ext=="syn7z") { //PAR file to load in tmp dir (just extracted)
@@ -535,21 +579,44 @@ void Worker::LoadGeometry(const std::string& fileName, bool insert, bool newStr)
 							toLoad = FileUtils::GetPath(fileName);
 							toLoad+=regionFileName;
 						}
-						progressDlg->SetMessage("Adding "+regionFileName+"...");
-						progressDlg->SetProgress((double)i++ / (double)regionsToLoad.size());
-						AddRegion(toLoad.c_str(), -1);
+						regionPaths.push_back(toLoad);
+					}
+					//Regions are independent: read and integrated on all cores, then added in file order
+					std::vector<Region_full> loadedRegions;
+					std::vector<std::string> regionErrors;
+					LoadRegionFiles(regionPaths, loadedRegions, regionErrors);
+					for (size_t i = 0; i < loadedRegions.size(); i++) {
+						if (!regionErrors[i].empty()) throw Error((regionErrors[i] + "\nFile:" + regionPaths[i]).c_str());
+						needsReload = true;
+						wp.nbTrajPoints += (int)loadedRegions[i].Points.size();
+						regions.push_back(loadedRegions[i]);
 					}
+					geom->RecalcBoundingBox(); //recalculate bounding box
+					if (mApp->regionInfo) mApp->regionInfo->Update();
 				}
 			}
 			if (!insert) {
 				progressDlg->SetMessage("Reloading worker with new geometry...");
 				RealReload(); //for the loading of textures
-				geom->LoadProfileSYN(f, dpHit, version);
-				geom->LoadSpectrumSYN(f, dpHit, version);
-				//SetLeakCache(loaded_leakCache, &loaded_nbLeak, dpHit);
-				//SetHitCache(hitCache, &(globalHitCache.hitCacheSize), dpHit);
-				progressDlg->SetMessage("Loading texture values...");
-				LoadTexturesSYN(f, version);
+				if (geom->loaded_resultFormat == RESULT_FORMAT_CHUNKS) {
+					try {
+						geom->LoadResultChunks(f->GetName(), progressDlg, dpHit);
+						RebuildTextures();
+					}
+					catch (Error &e) {
+						char tmp[256];
+						sprintf(tmp, "Couldn't load some results. To avoid continuing a partially loaded state, it is recommended to reset the simulation.\n%s", e.GetMsg());
+						GLMessageBox::Display(tmp, "Error while loading results.", GLDLG_OK, GLDLG_ICONWARNING);
+					}
+				}
+				else {
+					geom->LoadProfileSYN(f, dpHit, version);
+					geom->LoadSpectrumSYN(f, dpHit, version);
+					//SetLeakCache(loaded_leakCache, &loaded_nbLeak, dpHit);
+					//SetHitCache(hitCache, &(globalHitCache.hitCacheSize), dpHit);
+					progressDlg->SetMessage("Loading texture values...");
+					LoadTexturesSYN(f, version);
+				}
 				strcpy(fullFileName, fileName.c_str());
 			}
 			SAFE_DELETE(f);
@@ -656,7 +723,7 @@ void Worker::LoadGeometry(const std::string& fileName, bool insert, bool newStr)
 
 			progressDlg->SetMessage("Building geometry...");
 			if (!insert) {
-				geom->LoadXML_geom(loadXML, this, progressDlg);
+				geom->LoadXML_geom(loadXML, this, &listener);
 				ontheflyParams.desorptionLimit = 0;
 				progressDlg->SetMessage("Reloading worker with new geometry...");
 				RealReload();
@@ -809,12 +876,8 @@ void Worker::RealReload(bool sendOnly) { //Sharing geometry with workers
 		//*((size_t*)dpLog->buff) = 0; //Automatic 0-filling
 	}
 
-    std::string loaderString = SerializeForLoader().str();
-
-    //size_t loadSize = geom->GetGeometrySize();
-    //Dataport *loader = CreateDataport(loadDpName, loadSize);
-
-    size_t loadSize = loaderString.size();
+    LoaderHeader loaderHeader;
+    size_t loadSize = geom->GetLoaderLayout(loaderHeader, this, mApp->runSettings); //Flat layout, written in place below
 
 	Dataport *loader = CreateDataport(loadDpName,loadSize);
 	if (!loader) {
@@ -830,9 +893,7 @@ void Worker::RealReload(bool sendOnly) { //Sharing geometry with workers
 		parallel_polarization,wp.newReflectionModel,ontheflyParams);
 	*/
 
-    BYTE* buffer = (BYTE*)loader->buff;
-    //memcpy(loader->buff, loaderString.c_str(), loadSize);
-    std::copy(loaderString.begin(), loaderString.end(), buffer);
+    geom->CopyLoaderBuffer(loader->buff, loaderHeader, this, mApp->runSettings);
 	 progressDlg->SetMessage("Releasing dataport...");
 	ReleaseDataport(loader);
 
@@ -936,31 +997,17 @@ void Worker::AddRegion(const char *fileName,int position) {
 	//if (!geom->IsLoaded()) throw Error("Load geometry first!");
 	needsReload=true;
 
-	std::string ext = FileUtils::GetExtension(fileName);
-	if(ext=="par" || ext=="PAR" || ext=="param") {
-        Region_full newtraj;
-
-        FileReader* fr = new FileReader(fileName);
-
-        if (ext == "par" || ext == "PAR")
-            newtraj.LoadPAR(fr);
-        else {
-            newtraj.LoadParam(fr);
-        }
-        SAFE_DELETE(fr);
-
-        newtraj.fileName=fileName;
-			if (position==-1) regions.push_back(newtraj);
-			else {
-				wp.nbTrajPoints-=(int)regions[position].Points.size();
-				regions[position]=newtraj;
-				//regions[position].Points=newtraj.Points; //need to force because of operator=
-			}
-			geom->RecalcBoundingBox(); //recalculate bounding box
-			wp.nbTrajPoints+=(int)newtraj.Points.size();
-	}  else {
-		throw Error("LoadParam(): Invalid file extension [Only par or param]");
+	Region_full newtraj;
+	newtraj.LoadFile(fileName); //Throws on invalid extension
+	if (position==-1) regions.push_back(newtraj);
+	else {
+		wp.nbTrajPoints-=(int)regions[position].Points.size();
+		regions[position]=newtraj;
+		//regions[position].Points=newtraj.Points; //need to force because of operator=
 	}
+	geom->RecalcBoundingBox(); //recalculate bounding box
+	wp.nbTrajPoints+=(int)newtraj.Points.size();
+	if (mApp->regionInfo) mApp->regionInfo->Update();
 }
 
 void Worker::RecalcRegion(int regionId) {
@@ -1005,7 +1052,7 @@ void Worker::RemoveRegion(int index) {
 void Worker::AddMaterial(std::string *fileName){
 	Material result;
 	char tmp[512];
-	sprintf(tmp,"param\\Materials\\%s",fileName->c_str());
+	sprintf(tmp,MATERIALS_DIR "%s",fileName->c_str());
 	FileReader *f=new FileReader(tmp);
 	result.LoadMaterialCSV(f);
 	delete f;
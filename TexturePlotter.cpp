@@ -165,8 +165,7 @@ void TexturePlotter::UpdateTable() {
 		char tmp[256];
 		size_t w = selFacet->sh.texWidth;
 		size_t h = selFacet->sh.texHeight;
-		size_t textureSize=w*h*sizeof(TextureCell);
-		size_t profile_memory=PROFILE_SIZE*sizeof(ProfileSlice);
+		TexturePoolLayout texturePool = worker->GetSynradGeometry()->GetTexturePoolLayout();
 		mapList->SetSize(w,h);
 		mapList->SetAllColumnAlign(ALIGN_CENTER);
 
@@ -195,13 +194,11 @@ void TexturePlotter::UpdateTable() {
 
 			try {
 				if(buffer) {
-					GlobalHitBuffer *shGHit = (GlobalHitBuffer *)buffer;
-					size_t profSize = (selFacet->sh.isProfile)?profile_memory:0;
-					TextureCell *texture = (TextureCell *)((BYTE *)buffer + (selFacet->sh.hitOffset + sizeof(FacetHitBuffer) + profSize));
+					TileView<TextureCell> texture = GetTextureView(buffer, selFacet->sh, texturePool);
 
 					for(size_t i=0;i<w;i++) {
 						for(size_t j=0;j<h;j++) {
-							double val=texture[i+j*w].flux/worker->no_scans; //already divided by area
+							double val=texture.GetCell(i,j).flux/worker->no_scans; //already divided by area
 							if (val>maxValue) {
 								maxValue=(float)val;
 								maxX=i;maxY=j;
@@ -224,13 +221,11 @@ void TexturePlotter::UpdateTable() {
 			try{
 				if(buffer) {
 
-					GlobalHitBuffer *shGHit = (GlobalHitBuffer *)buffer;
-					size_t profSize = (selFacet->sh.isProfile)?profile_memory:0;
-					TextureCell *texture = (TextureCell *)((BYTE *)buffer + (selFacet->sh.hitOffset + sizeof(FacetHitBuffer) + profSize));
+					TileView<TextureCell> texture = GetTextureView(buffer, selFacet->sh, texturePool);
 
 					for(size_t i=0;i<w;i++) {
 						for(size_t j=0;j<h;j++) {
-							double val=texture[i+j*w].power/worker->no_scans;
+							double val=texture.GetCell(i,j).power/worker->no_scans;
 
 							if (val>maxValue) {
 								maxValue=(float)val;
@@ -255,16 +250,14 @@ void TexturePlotter::UpdateTable() {
 			BYTE *buffer = worker->GetHits();
 			try{
 				if(buffer) {
-					GlobalHitBuffer *shGHit = (GlobalHitBuffer *)buffer;
-					size_t profSize = (selFacet->sh.isProfile)?profile_memory:0;
-					TextureCell *texture = (TextureCell *)((BYTE *)buffer + (selFacet->sh.hitOffset + sizeof(FacetHitBuffer) + profSize));
+					TileView<TextureCell> texture = GetTextureView(buffer, selFacet->sh, texturePool);
 					float dCoef = 1.0f;
 					//if( shGHit->mode == MC_MODE ) dCoef=1.0;//dCoef = (float)totalOutgassing / (float)shGHit->globalHits.hit.nbDesorbed;
 
 					for(size_t i=0;i<w;i++) {
 						for(size_t j=0;j<h;j++) {
 
-							size_t val=texture[i+j*w].count;
+							size_t val=texture.GetCell(i,j).count;
 							if (val>maxValue) {
 								maxValue=(float)val;
 								maxX=i;maxY=j;
@@ -274,6 +267,11 @@ void TexturePlotter::UpdateTable() {
 							mapList->SetValueAt(i,j,tmp);
 						}
 					}
+					size_t lostHits = (size_t)texturePool.GetHeader(buffer)->nbLostHits;
+					if (lostHits) { //Texture tile space full: those hits only count in the facet totals
+						sprintf(tmp,"Texture plotter (%zd hits not on textures, raise the texture tile space)",lostHits);
+						SetTitle(tmp);
+					}
 					worker->ReleaseHits();
 				}
 			} catch (...) {
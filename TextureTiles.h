@@ -0,0 +1,154 @@
+/*
+Program:     MolFlow+ / Synrad+
+Description: Monte Carlo simulator for ultra-high vacuum and synchrotron radiation
+Authors:     Jean-Luc PONS / Roberto KERSEVAN / Marton ADY
+Copyright:   E.S.R.F / CERN
+Website:     https://cern.ch/molflow
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
+*/
+#pragma once
+
+//Textures and direction fields in the 'hits' dataport, by tiles of TEXTURE_TILE_SIZE x TEXTURE_TILE_SIZE cells:
+//the block of a textured facet holds a tile index (one uint32_t per tile, after the profile), the cells live in a pool at the end
+//of the dataport (TexturePoolLayout). A tile is taken from the pool the first time a subprocess or a loaded file writes one of its cells,
+//so a finely meshed chamber costs memory only where photons landed. Index entries are the slot + 1: a zeroed dataport has no tile
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring> //memset
+#include "SynradTypes.h" //TextureCell, BYTE
+#include "Buffer_shared.h" //DirectionCell
+
+#define TEXTURE_TILE_SIZE 8 //Textures, direction fields and cell increments are stored in tiles of 8x8 cells
+#define TEXTURE_TILE_CELLS (TEXTURE_TILE_SIZE*TEXTURE_TILE_SIZE)
+#define NO_TILE UINT32_MAX //Thread counters: tile never hit since the last reset, not allocated
+#define DEFAULT_TEXTURE_POOL_MB 1024 //Dataport space for the tiles, unless all tiles of all textures take less
+
+inline size_t GetNbTilesX(const size_t& width) { return (width + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE; }
+inline size_t GetNbTiles(const size_t& width, const size_t& height) { return GetNbTilesX(width) * GetNbTilesX(height); }
+inline size_t GetTileIndexSize(const size_t& width, const size_t& height) { //Bytes of a tile index in a facet block, 8-byte aligned
+	return (GetNbTiles(width, height) * sizeof(uint32_t) + 7) / 8 * 8;
+}
+inline size_t GetTile(const size_t& u, const size_t& v, const size_t& nbTilesX) { return (v / TEXTURE_TILE_SIZE) * nbTilesX + u / TEXTURE_TILE_SIZE; }
+inline size_t GetCellInTile(const size_t& u, const size_t& v) { return (v % TEXTURE_TILE_SIZE) * TEXTURE_TILE_SIZE + u % TEXTURE_TILE_SIZE; }
+
+struct TexturePoolHeader { //First bytes of the pool, zeroed with the dataport
+	uint64_t nbTextureTiles, nbDirectionTiles; //Slots taken since the last reset
+	uint64_t nbLostHits; //MC hits of texture cells not recorded because the pool was full
+};
+
+class TexturePoolLayout {
+public:
+	size_t offset = 0; //TexturePoolHeader, then textureCapacity tiles of TextureCell, then directionCapacity tiles of DirectionCell
+	size_t textureCapacity = 0, directionCapacity = 0;
+
+	//All the tiles if they fit in budgetMB, else the same share of the texture and the direction tiles. Returns the end offset
+	size_t Set(const size_t& startOffset, const size_t& nbTextureTiles, const size_t& nbDirectionTiles, const size_t& budgetMB) {
+		offset = startOffset;
+		const size_t textureTileSize = TEXTURE_TILE_CELLS * sizeof(TextureCell), directionTileSize = TEXTURE_TILE_CELLS * sizeof(DirectionCell);
+		double allTiles = (double)nbTextureTiles * textureTileSize + (double)nbDirectionTiles * directionTileSize;
+		double budget = (double)budgetMB * 1024.0 * 1024.0;
+		double share = (allTiles > budget) ? budget / allTiles : 1.0;
+		textureCapacity = (size_t)(nbTextureTiles * share);
+		directionCapacity = (size_t)(nbDirectionTiles * share);
+		return GetEndOffset();
+	}
+	size_t GetEndOffset() const {
+		return offset + sizeof(TexturePoolHeader) + TEXTURE_TILE_CELLS * (textureCapacity * sizeof(TextureCell) + directionCapacity * sizeof(DirectionCell));
+	}
+	TexturePoolHeader* GetHeader(BYTE* buffer) const { return (TexturePoolHeader*)(buffer + offset); }
+	TextureCell* GetTextureTiles(BYTE* buffer) const { return (TextureCell*)(GetHeader(buffer) + 1); }
+	DirectionCell* GetDirectionTiles(BYTE* buffer) const { return (DirectionCell*)(GetTextureTiles(buffer) + textureCapacity * TEXTURE_TILE_CELLS); }
+	const TexturePoolHeader* GetHeader(const BYTE* buffer) const { return GetHeader((BYTE*)buffer); }
+	const TextureCell* GetTextureTiles(const BYTE* buffer) const { return GetTextureTiles((BYTE*)buffer); }
+	const DirectionCell* GetDirectionTiles(const BYTE* buffer) const { return GetDirectionTiles((BYTE*)buffer); }
+
+	//Cells of a tile of a facet's index, taken from the pool if the tile has none yet. NULL once the pool is full
+	TextureCell* AllocateTextureTile(BYTE* buffer, uint32_t* index, const size_t& tile) const {
+		return AllocateTile(index, tile, GetHeader(buffer)->nbTextureTiles, textureCapacity, GetTextureTiles(buffer));
+	}
+	DirectionCell* AllocateDirectionTile(BYTE* buffer, uint32_t* index, const size_t& tile) const {
+		return AllocateTile(index, tile, GetHeader(buffer)->nbDirectionTiles, directionCapacity, GetDirectionTiles(buffer));
+	}
+
+private:
+	template <class Cell> static Cell* AllocateTile(uint32_t* index, const size_t& tile, uint64_t& nbTaken, const size_t& capacity, Cell* tiles) {
+		if (index[tile] == 0) {
+			if (nbTaken >= capacity) return NULL;
+			index[tile] = (uint32_t)(++nbTaken); //Slot + 1
+			memset((void*)(tiles + (nbTaken - 1) * TEXTURE_TILE_CELLS), 0, TEXTURE_TILE_CELLS * sizeof(Cell));
+		}
+		return tiles + (size_t)(index[tile] - 1) * TEXTURE_TILE_CELLS;
+	}
+};
+
+//Read access to the texture or direction field of one facet: cells of tiles never allocated read as zero
+template <class Cell> class TileView {
+public:
+	TileView() {}
+	TileView(const uint32_t* index, const Cell* tiles, const size_t& width, const size_t& height)
+		: index(index), tiles(tiles), width(width), height(height), nbTilesX(GetNbTilesX(width)) {}
+
+	const Cell& GetCell(const size_t& u, const size_t& v) const {
+		static const Cell emptyCell = Cell();
+		uint32_t entry = index[GetTile(u, v, nbTilesX)];
+		if (entry == 0) return emptyCell;
+		return tiles[(size_t)(entry - 1) * TEXTURE_TILE_CELLS + GetCellInTile(u, v)];
+	}
+	const Cell& operator[](const size_t& cellId) const { return GetCell(cellId % width, cellId / width); } //u + v*width, as the dense layout
+
+	template <typename CellFunction> void ForEachAllocatedCell(CellFunction cellFunction) const {
+		//Calls cellFunction(u, v, cell) for the cells of the allocated tiles, tile after tile
+		size_t nbTiles = GetNbTiles(width, height);
+		for (size_t tile = 0; tile < nbTiles; tile++) {
+			if (index[tile] == 0) continue;
+			const Cell* tileCells = tiles + (size_t)(index[tile] - 1) * TEXTURE_TILE_CELLS;
+			size_t u0 = (tile % nbTilesX) * TEXTURE_TILE_SIZE, v0 = (tile / nbTilesX) * TEXTURE_TILE_SIZE;
+			for (size_t v = v0; v < v0 + TEXTURE_TILE_SIZE && v < height; v++)
+				for (size_t u = u0; u < u0 + TEXTURE_TILE_SIZE && u < width; u++)
+					cellFunction(u, v, tileCells[GetCellInTile(u, v)]);
+		}
+	}
+
+	void CopyTo(Cell* dense) const { //width*height cells, u + v*width
+		memset((void*)dense, 0, width * height * sizeof(Cell));
+		ForEachAllocatedCell([&](const size_t& u, const size_t& v, const Cell& cell) { dense[u + v * width] = cell; });
+	}
+
+	const uint32_t* index = NULL;
+	const Cell* tiles = NULL;
+	size_t width = 0, height = 0, nbTilesX = 0;
+};
+
+//Tile indices in the block of a facet (sh: its FacetProperties, in the interface or a subprocess): after the profile, texture then direction field
+template <class Properties> size_t GetTextureIndexOffset(const Properties& sh) {
+	return sh.hitOffset + sizeof(FacetHitBuffer) + (sh.isProfile ? PROFILE_SIZE * sizeof(ProfileSlice) : 0);
+}
+template <class Properties> size_t GetDirectionIndexOffset(const Properties& sh) {
+	return GetTextureIndexOffset(sh) + (sh.isTextured ? GetTileIndexSize(sh.texWidth, sh.texHeight) : 0);
+}
+template <class Properties> TileView<TextureCell> GetTextureView(const BYTE* buffer, const Properties& sh, const TexturePoolLayout& pool) {
+	return TileView<TextureCell>((const uint32_t*)(buffer + GetTextureIndexOffset(sh)), pool.GetTextureTiles(buffer), sh.texWidth, sh.texHeight);
+}
+template <class Properties> TileView<DirectionCell> GetDirectionView(const BYTE* buffer, const Properties& sh, const TexturePoolLayout& pool) {
+	return TileView<DirectionCell>((const uint32_t*)(buffer + GetDirectionIndexOffset(sh)), pool.GetDirectionTiles(buffer), sh.texWidth, sh.texHeight);
+}
+template <class Properties> size_t GetSpectrumOffset(const Properties& sh) { //After the tile indices
+	return GetDirectionIndexOffset(sh) + (sh.countDirection ? GetTileIndexSize(sh.texWidth, sh.texHeight) : 0);
+}
+template <class Properties> TextureCell* GetTextureCellForWrite(BYTE* buffer, const Properties& sh, const TexturePoolLayout& pool, const size_t& u, const size_t& v) {
+	//Cell (u,v) of a facet's texture, its tile taken from the pool if needed (loaded results). NULL once the pool is full
+	TextureCell* tile = pool.AllocateTextureTile(buffer, (uint32_t*)(buffer + GetTextureIndexOffset(sh)), GetTile(u, v, GetNbTilesX(sh.texWidth)));
+	return tile ? tile + GetCellInTile(u, v) : NULL;
+}
@@ -446,10 +446,14 @@ void TrajectoryDetails::UpdateTable() {
 	else
 		componentIndex = 2; //Orthogonal polarization
 
+	AngularTable psiTable, chiTable, polarizationTable;
+	psiTable.Build(worker->psi_distro, false, true);
+	chiTable.Build(worker->chi_distros[componentIndex], true, true);
+	polarizationTable.Build(worker->parallel_polarization, false, false);
+
 	for (int pointId = 0; pointId < nbPoints; pointId += freq) {
  		GenPhoton photon = GeneratePhoton(pointId, &worker->regions[displayedRegion], worker->ontheflyParams.generation_mode,
-			worker->psi_distro, worker->chi_distros[componentIndex], 
-			worker->parallel_polarization, pointId == 0);
+			psiTable, chiTable, polarizationTable, NULL);
 		updatePrg->SetProgress((double)pointId / (double)nbPoints);
 		for (int j = 0; j < nbCol; j++)
 			pointList->SetValueAt(j, (int)((double)pointId / (double)freq), FormatCell(pointId, shown[j], &photon));
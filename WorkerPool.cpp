@@ -0,0 +1,74 @@
+/*
+Program:     MolFlow+ / Synrad+
+Description: Monte Carlo simulator for ultra-high vacuum and synchrotron radiation
+Authors:     Jean-Luc PONS / Roberto KERSEVAN / Marton ADY
+Copyright:   E.S.R.F / CERN
+Website:     https://cern.ch/molflow
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
+*/
+#include "WorkerPool.h"
+#include <algorithm> //std::max
+
+WorkerPool::WorkerPool(const size_t& nbThreads) {
+	this->nbThreads = std::max(nbThreads, (size_t)1);
+	task = NULL;
+	generation = 0;
+	nbPending = 0;
+	stopping = false;
+	for (size_t i = 1; i < this->nbThreads; i++) workers.emplace_back(&WorkerPool::WorkerLoop, this, i);
+}
+
+WorkerPool::~WorkerPool() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	startCondition.notify_all();
+	for (auto& w : workers) w.join();
+}
+
+void WorkerPool::Run(const std::function<void(const size_t&)>& task) {
+	std::lock_guard<std::mutex> runLock(runMutex);
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		this->task = &task;
+		nbPending = workers.size();
+		generation++;
+	}
+	startCondition.notify_all();
+	task(0);
+	std::unique_lock<std::mutex> lock(mutex);
+	doneCondition.wait(lock, [this]() { return nbPending == 0; });
+	this->task = NULL;
+}
+
+void WorkerPool::WorkerLoop(const size_t& index) {
+	uint64_t lastGeneration = 0;
+	while (true) {
+		const std::function<void(const size_t&)>* current;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			startCondition.wait(lock, [&]() { return stopping || generation != lastGeneration; });
+			if (stopping) return;
+			lastGeneration = generation;
+			current = task;
+		}
+		(*current)(index);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			nbPending--;
+		}
+		doneCondition.notify_one();
+	}
+}
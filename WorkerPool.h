@@ -0,0 +1,49 @@
+/*
+Program:     MolFlow+ / Synrad+
+Description: Monte Carlo simulator for ultra-high vacuum and synchrotron radiation
+Authors:     Jean-Luc PONS / Roberto KERSEVAN / Marton ADY
+Copyright:   E.S.R.F / CERN
+Website:     https://cern.ch/molflow
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
+*/
+#pragma once
+
+//Threads kept for the life of a pool, running one task at a time on all of them
+//Worker i runs task(i) of every Run(), the calling thread runs task(0)
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <cstdint>
+
+class WorkerPool {
+public:
+	WorkerPool(const size_t& nbThreads); //Starts nbThreads-1 workers, the thread calling Run() is the first one
+	~WorkerPool(); //Stops and joins the workers
+	size_t GetNbThreads() const { return nbThreads; }
+	void Run(const std::function<void(const size_t&)>& task); //task(0..nbThreads-1) in parallel, returns once all are done. Calls from other threads wait their turn
+private:
+	void WorkerLoop(const size_t& index);
+	size_t nbThreads;
+	std::vector<std::thread> workers;
+	std::mutex runMutex; //One Run() at a time
+	std::mutex mutex; //Guards the fields below
+	std::condition_variable startCondition, doneCondition;
+	const std::function<void(const size_t&)>* task;
+	uint64_t generation; //Incremented by each Run(), the workers wait for a new one
+	size_t nbPending; //Workers still running the current task
+	bool stopping;
+};